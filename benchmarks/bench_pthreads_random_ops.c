@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 
 #ifdef WORKLOAD_TIME
@@ -23,23 +24,52 @@
 #include "../maps/key/key.h"
 
 pthread_barrier_t start_barrier;
+//> Workers wait at it when they are done, and again until the master has
+//> printed the statistics in their map data, which they then free.
+pthread_barrier_t end_barrier;
 
 __thread int seed;
-int nextNatural(int n) {                                                                                                                                                                  
+static inline void nextSeed() {
 	seed ^= seed << 6;
 	seed ^= seed >> 21;
 	seed ^= seed << 7;
-	int retval = (int) (seed % n);
-	return (retval < 0 ? -retval : retval);
+}
+
+//> Ranges beyond INT_MAX take two draws. The smaller ones take one, as they
+//> always did, so their sequence of numbers does not change.
+long long nextNatural(long long n) {
+	unsigned long long high;
+	nextSeed();
+	if (n <= INT_MAX) {
+		int retval = (int) (seed % (int)n);
+		return (retval < 0 ? -retval : retval);
+	}
+	high = (unsigned int)seed;
+	nextSeed();
+	return ((high << 32) | (unsigned int)seed) % n;
+}
+
+//> Range query visitor that only counts the keys in the range.
+static int rquery_count_keys(map_key_t key, void *value, void *arg)
+{
+	(*(unsigned long long *)arg)++;
+	return 0;
 }
 
 void *thread_fn(void *arg)
 {
 	thread_data_t *data = arg;
-	int ret, tid = data->tid, cpu = data->cpu;
+	int i, ret, tid = data->tid, cpu = data->cpu;
 	void *map = data->map;
-	int choice, randint;
+	int choice;
+	long long randint;
 	map_key_t key;
+	//> Scanning threads only perform range queries, concurrently with the
+	//> updates of the others.
+	int scanner = (tid < clargs.scan_threads);
+	//> Keys and results of the batched lookups (-B).
+	map_key_t *batch_keys = NULL;
+	int *batch_results = NULL;
 #	if defined(WORKLOAD_FIXED)
 	int ops_performed = 0;
 #	endif
@@ -53,6 +83,11 @@ void *thread_fn(void *arg)
 	//> Initialize random number generator
 	seed = (tid + 1) * clargs.thread_seed;
 
+	if (clargs.lookup_batch > 1) {
+		XMALLOC(batch_keys, clargs.lookup_batch);
+		XMALLOC(batch_results, clargs.lookup_batch);
+	}
+
 	//> Wait for the master to give the starting signal.
 	pthread_barrier_wait(&start_barrier);
 
@@ -75,18 +110,31 @@ void *thread_fn(void *arg)
 		data->operations_performed[OPS_TOTAL]++;
 
 		//> Perform operation on the RBT based on choice.
-		if (choice < clargs.lookup_frac) {
+		if (!scanner && choice < clargs.lookup_frac) {
 			//> Lookup
-			data->operations_performed[OPS_LOOKUP]++;
-			ret = map_lookup(map, data->map_tdata, key);
+			if (clargs.lookup_batch > 1) {
+				//> A batch counts as `lookup_batch` lookups; `ret` is the
+				//> number of keys found.
+				KEY_COPY(batch_keys[0], key);
+				for (i=1; i < clargs.lookup_batch; i++)
+					KEY_GET(batch_keys[i], nextNatural(clargs.max_key));
+				data->operations_performed[OPS_TOTAL] += clargs.lookup_batch - 1;
+				data->operations_performed[OPS_LOOKUP] += clargs.lookup_batch;
+				ret = map_lookup_batch(map, data->map_tdata, batch_keys,
+				                       clargs.lookup_batch, batch_results);
+			} else {
+				data->operations_performed[OPS_LOOKUP]++;
+				ret = map_lookup(map, data->map_tdata, key);
+			}
 			data->operations_succeeded[OPS_LOOKUP] += ret;
-		} else if (choice < clargs.lookup_frac + clargs.rquery_frac) {
+		} else if (scanner || choice < clargs.lookup_frac + clargs.rquery_frac) {
 			//> Range-Query
 			data->operations_performed[OPS_RQUERY]++;
 			map_key_t key2;
-			KEY_GET(key2, 100);
+			KEY_GET(key2, clargs.rquery_size);
 			KEY_ADD(key2, key, key2);
-			ret = map_rquery(map, data->map_tdata, key, key2);
+			ret = map_rquery(map, data->map_tdata, key, key2,
+			                 rquery_count_keys, &data->rquery_keys);
 			data->operations_succeeded[OPS_RQUERY] += ret;
 		} else {
 			//> Update
@@ -118,12 +166,20 @@ void *thread_fn(void *arg)
 		data->operations_succeeded[OPS_TOTAL] += ret;
 	}
 
+	free(batch_keys);
+	free(batch_results);
+	pthread_barrier_wait(&end_barrier);
+	pthread_barrier_wait(&end_barrier);
+	map_tdata_free(data->map_tdata);
+	data->map_tdata = NULL;
+	nalloc_thread_exit();
 	return NULL;
 }
 
-bench_res_t bench_execute(int argc, char **argv)
+//> Runs the benchmark on a new map, warmed up on `warmup_core`.
+static void bench_run(int warmup_core)
 {
-	int i, validation, nthreads;
+	int i, validation, nthreads = clargs.num_threads;
 	pthread_t *threads;
 	thread_data_t **threads_data;
 	unsigned int ncpus;
@@ -132,16 +188,6 @@ bench_res_t bench_execute(int argc, char **argv)
 	timer_tt *warmup_timer;
 	void *map;
 
-	//> Read command line arguments
-	clargs_init(argc, argv);
-	clargs_print();
-	nthreads = clargs.num_threads;
-
-	//> Initialize memory allocator.
-	int warmup_core = 0;
-	setaffinity_oncpu(warmup_core);
-	log_info("\n");
-
 	//> Initialize Red-Black tree.
 	map = map_new();
 	log_info("Benchmark\n");
@@ -157,8 +203,9 @@ bench_res_t bench_execute(int argc, char **argv)
 	timer_stop(warmup_timer);
 	log_info("Initialization finished in %.2lf sec\n", timer_report_sec(warmup_timer));
 
-	//> Initialize the starting barrier.
+	//> Initialize the starting and ending barriers.
 	pthread_barrier_init(&start_barrier, NULL, nthreads+1);
+	pthread_barrier_init(&end_barrier, NULL, nthreads+1);
 	
 	//> Initialize the arrays that hold the thread references and data.
 	XMALLOC(threads, nthreads);
@@ -194,9 +241,8 @@ bench_res_t bench_execute(int argc, char **argv)
 	time_to_leave = 1;
 #	endif
 
-	//> Join threads.
-	for (i=0; i < nthreads; i++)
-		pthread_join(threads[i], NULL);
+	//> Wait until all threads are done.
+	pthread_barrier_wait(&end_barrier);
 
 	//> Stop wall_timer.
 	timer_stop(wall_timer);
@@ -225,6 +271,15 @@ bench_res_t bench_execute(int argc, char **argv)
 	thread_data_print_map_data(total_data);
 	log_info("\n");
 
+	//> Let the threads free their map data and join them.
+	pthread_barrier_wait(&end_barrier);
+	for (i=0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	//> Print memory reclamation statistics.
+	nalloc_print_stats();
+	log_info("\n");
+
 	//> Validate the final RBT.
 	validation = map_validate(map);
 
@@ -234,11 +289,57 @@ bench_res_t bench_execute(int argc, char **argv)
 	                         time_elapsed / 1000000.0;
 	log_info("Time elapsed: %6.2lf\n", time_elapsed);
 	log_info("Throughput(Ops/usec): %7.3lf\n", throughput_usec);
+	if (total_data->operations_performed[OPS_RQUERY])
+		log_info("Range query keys: %llu (%.2lf per range query)\n",
+		         total_data->rquery_keys, (double)total_data->rquery_keys /
+		         total_data->operations_performed[OPS_RQUERY]);
 
 	log_info("Expected size of RBT: %llu\n",
 	        (long long unsigned)clargs.init_tree_size +
 	        total_data->operations_succeeded[OPS_INSERT] - 
 	        total_data->operations_succeeded[OPS_DELETE]);
+	log_info("Size of map: %lld\n", map_size(map, total_data->map_tdata, 1));
+	pthread_barrier_destroy(&start_barrier);
+	pthread_barrier_destroy(&end_barrier);
+
+	//> Free the map, so the next one of a registry run starts afresh.
+	map_destroy(map, nthreads);
+}
+
+bench_res_t bench_execute(int argc, char **argv)
+{
+	//> Read command line arguments
+	clargs_init(argc, argv);
+	clargs_print();
+#	if defined(MAP_KEY_TYPE_INT) || defined(MAP_KEY_TYPE_BIG_INT)
+	//> The keys are ints; wider key spaces need MAP_KEY_TYPE_INT64.
+	if (clargs.max_key > INT_MAX) {
+		log_error("max_key %lld does not fit in the key type\n", clargs.max_key);
+		return BENCH_FAILURE;
+	}
+#	endif
+
+	//> Initialize memory allocator.
+	int warmup_core = 0;
+	setaffinity_oncpu(warmup_core);
+	nalloc_set_huge_pages(clargs.huge_pages);
+	log_info("\n");
+
+#	ifdef MAP_REGISTRY
+	//> The maps run one after the other in the same process.
+	char *id, *ids_left;
+	for (id = strtok_r(clargs.maps, ",", &ids_left); id != NULL;
+	     id = strtok_r(NULL, ",", &ids_left)) {
+		if (!map_registry_select(id)) {
+			log_error("Unknown map: %s\n", id);
+			return BENCH_FAILURE;
+		}
+		bench_run(warmup_core);
+		log_info("\n");
+	}
+#	else
+	bench_run(warmup_core);
+#	endif
 
 //	return validation;
 	return BENCH_SUCCESS;
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "benchmarks.h"
+#include "../maps/map.h"
+#include "../lib/alloc.h"
+#include "../lib/log.h"
+#include "../maps/key/key.h"
+
+/**
+ * Concurrent stress test of a map.
+ * The threads insert, delete and range query the keys of a small key space,
+ * so that they keep replacing and freeing the same nodes. The value of every
+ * key is the integer the key was made of. It fails if a range query visits a
+ * key outside of its range or with the value of another key, if the keys left
+ * in the map are not those the successful inserts and deletes account for,
+ * or if the map does not validate.
+ **/
+
+#define STRESS_RQUERY_SIZE 20
+
+static void *map;
+static long long nr_operations, max_key;
+static pthread_barrier_t start_barrier;
+
+typedef struct {
+	int tid;
+	long long net_inserts; //> Successful inserts minus successful deletes.
+	long long errors;
+} stress_data_t;
+
+typedef struct {
+	map_key_t key1, key2;
+	long long nr_keys, errors;
+} stress_rquery_t;
+
+static int stress_visit(map_key_t key, void *value, void *arg)
+{
+	stress_rquery_t *rq = arg;
+	map_key_t expected = MIN_KEY;
+
+	KEY_GET(expected, (long long)(uintptr_t)value);
+	if (KEY_CMP(key, rq->key1) < 0 || KEY_CMP(key, rq->key2) > 0 ||
+	    KEY_CMP(key, expected) != 0)
+		rq->errors++;
+	rq->nr_keys++;
+	return 0;
+}
+
+static void stress_rquery(void *tdata, long long from, long long to,
+                          stress_rquery_t *rq)
+{
+	KEY_GET(rq->key1, from);
+	KEY_GET(rq->key2, to);
+	rq->nr_keys = rq->errors = 0;
+	map_rquery(map, tdata, rq->key1, rq->key2, stress_visit, rq);
+}
+
+static void *stress_thread(void *arg)
+{
+	stress_data_t *data = arg;
+	unsigned int seed = data->tid + 1;
+	long long i, k;
+	stress_rquery_t rq;
+	map_key_t key;
+	void *tdata;
+
+	tdata = map_tdata_new(data->tid);
+	pthread_barrier_wait(&start_barrier);
+
+	for (i=0; i < nr_operations; i++) {
+		k = rand_r(&seed) % max_key;
+		KEY_GET(key, k);
+		switch (rand_r(&seed) % 5) {
+		case 0:
+		case 1:
+			if (map_insert(map, tdata, key, (void *)(uintptr_t)k))
+				data->net_inserts++;
+			break;
+		case 2:
+		case 3:
+			if (map_delete(map, tdata, key))
+				data->net_inserts--;
+			break;
+		default:
+			stress_rquery(tdata, k, k + STRESS_RQUERY_SIZE, &rq);
+			data->errors += rq.errors;
+			break;
+		}
+	}
+
+	map_tdata_free(tdata);
+	return NULL;
+}
+
+bench_res_t bench_execute(int argc, char **argv)
+{
+	int nthreads, i;
+	long long k, nr_keys = 0, errors = 0;
+	pthread_t *threads;
+	stress_data_t *threads_data;
+	stress_rquery_t rq;
+	map_key_t key;
+	void *tdata;
+
+	if (argc < 3) {
+		log_error("Usage: %s <threads> <operations per thread> [max key]\n",
+		          argv[0]);
+		return BENCH_FAILURE;
+	}
+	nthreads = atoi(argv[1]);
+	nr_operations = atoll(argv[2]);
+	max_key = (argc > 3) ? atoll(argv[3]) : 1000;
+
+	map = map_new();
+	tdata = map_tdata_new(nthreads);
+	log_info("Map: %s, %d threads, %lld operations each, keys in [0, %lld)\n",
+	         map_name(), nthreads, nr_operations, max_key);
+
+	//> Start with every other key.
+	for (k=0; k < max_key; k += 2) {
+		KEY_GET(key, k);
+		nr_keys += map_insert(map, tdata, key, (void *)(uintptr_t)k);
+	}
+
+	XMALLOC(threads, nthreads);
+	XMALLOC(threads_data, nthreads);
+	pthread_barrier_init(&start_barrier, NULL, nthreads);
+	for (i=0; i < nthreads; i++) {
+		threads_data[i].tid = i;
+		threads_data[i].net_inserts = threads_data[i].errors = 0;
+		pthread_create(&threads[i], NULL, stress_thread, &threads_data[i]);
+	}
+	for (i=0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+		nr_keys += threads_data[i].net_inserts;
+		errors += threads_data[i].errors;
+	}
+	pthread_barrier_destroy(&start_barrier);
+
+	stress_rquery(tdata, 0, max_key, &rq);
+	log_info("Range query errors: %lld\n", errors + rq.errors);
+	log_info("Expected keys: %lld, keys in the map: %lld, size of map: %lld\n",
+	         nr_keys, rq.nr_keys, map_size(map, tdata, 1));
+	if (rq.nr_keys != nr_keys || map_size(map, tdata, 1) != nr_keys)
+		errors++;
+	if (!map_validate(map))
+		errors++;
+
+	map_destroy(map, 1);
+	free(threads);
+	free(threads_data);
+	log_info("Stress test: %s\n", errors + rq.errors ? "FAILED" : "OK");
+	return (errors + rq.errors) ? BENCH_FAILURE : BENCH_SUCCESS;
+}
+
+char *bench_name()
+{
+	return "pthreads-stress";
+}
@@ -8,6 +8,9 @@
 #include <getopt.h>
 
 #include "../lib/log.h"
+#ifdef MAP_REGISTRY
+#	include "../maps/registry/registry.h"
+#endif
 
 /**
  * The interface provided
@@ -16,20 +19,31 @@ static void clargs_init(int argc, char **argv);
 static void clargs_print();
 
 typedef struct {
-	int num_threads,
-	    init_tree_size,
-	    max_key,
-	    lookup_frac,
+	int num_threads;
+	//> 64-bit, so that trees and key ranges can grow beyond 2^31 keys (with
+	//> MAP_KEY_TYPE_INT64 or MAP_KEY_TYPE_VAR_STR keys).
+	long long init_tree_size,
+	          max_key;
+	int lookup_frac,
 		rquery_frac,
 		insert_frac,
 	    init_seed,
-	    thread_seed;
+	    thread_seed,
+	    huge_pages,
+	    rquery_size,
+	    scan_threads,
+	    lookup_batch;
 
 #	ifdef WORKLOAD_TIME
 	int run_time_sec;
 #	elif defined(WORKLOAD_FIXED)
 	int nr_operations;
 #	endif
+
+#	ifdef MAP_REGISTRY
+	//> Comma-separated ids of the maps to run (see maps/registry/registry.h).
+	char *maps;
+#	endif
 } clargs_t;
 
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
@@ -43,13 +57,17 @@ typedef struct {
 #define ARGUMENT_DEFAULT_INSERT_FRAC 50
 #define ARGUMENT_DEFAULT_INIT_SEED 1024
 #define ARGUMENT_DEFAULT_THREAD_SEED 128
+#define ARGUMENT_DEFAULT_HUGE_PAGES 0
+#define ARGUMENT_DEFAULT_RQUERY_SIZE 100
+#define ARGUMENT_DEFAULT_SCAN_THREADS 0
+#define ARGUMENT_DEFAULT_LOOKUP_BATCH 1
 #ifdef WORKLOAD_TIME
 #define ARGUMENT_DEFAULT_RUN_TIME_SEC 5
 #elif defined WORKLOAD_FIXED
 #define ARGUMENT_DEFAULT_NR_OPERATIONS 1000000
 #endif
 
-static char *opt_string = "ht:s:m:i:l:q:r:e:j:o:";
+static char *opt_string = "ht:s:m:i:l:q:r:e:j:o:HR:S:B:M:";
 static struct option long_options[] = {
 	{ "help",            no_argument,       NULL, 'h' },
 	{ "num-threads",     required_argument, NULL, 't' },
@@ -60,6 +78,10 @@ static struct option long_options[] = {
 	{ "insert-frac",     required_argument, NULL, 'i' },
 	{ "init-seed",       required_argument, NULL, 'e' },
 	{ "thread-seed",     required_argument, NULL, 'j' },
+	{ "huge-pages",      no_argument,       NULL, 'H' },
+	{ "rquery-size",     required_argument, NULL, 'R' },
+	{ "scan-threads",    required_argument, NULL, 'S' },
+	{ "lookup-batch",    required_argument, NULL, 'B' },
 
 #	if defined(WORKLOAD_FIXED)
 	{ "nr-operations",   required_argument, NULL, 'o' },
@@ -67,6 +89,10 @@ static struct option long_options[] = {
 	{ "run-time-sec",    required_argument, NULL, 'r' },
 #	endif
 
+#	ifdef MAP_REGISTRY
+	{ "map",             required_argument, NULL, 'M' },
+#	endif
+
 	{ NULL, 0, NULL, 0 }
 };
 
@@ -79,10 +105,17 @@ static clargs_t clargs = {
 	ARGUMENT_DEFAULT_INSERT_FRAC,
 	ARGUMENT_DEFAULT_INIT_SEED,
 	ARGUMENT_DEFAULT_THREAD_SEED,
+	ARGUMENT_DEFAULT_HUGE_PAGES,
+	ARGUMENT_DEFAULT_RQUERY_SIZE,
+	ARGUMENT_DEFAULT_SCAN_THREADS,
+	ARGUMENT_DEFAULT_LOOKUP_BATCH,
 #	ifdef WORKLOAD_TIME
-	ARGUMENT_DEFAULT_RUN_TIME_SEC
+	ARGUMENT_DEFAULT_RUN_TIME_SEC,
 #	elif defined(WORKLOAD_FIXED)
-	ARGUMENT_DEFAULT_NR_OPERATIONS
+	ARGUMENT_DEFAULT_NR_OPERATIONS,
+#	endif
+#	ifdef MAP_REGISTRY
+	NULL
 #	endif
 };
 
@@ -107,6 +140,15 @@ static void clargs_print_usage(char *progname)
 	         ARGUMENT_DEFAULT_INIT_SEED);
 	log_info("    -j,--thread-seed  the seed that is used for the thread operations [%d]\n",
 	         ARGUMENT_DEFAULT_THREAD_SEED);
+	log_info("    -H,--huge-pages   back the node allocator with 2MB huge pages\n");
+	log_info("    -R,--rquery-size  range queries are on [key, key + rquery-size] [%d]\n",
+	         ARGUMENT_DEFAULT_RQUERY_SIZE);
+	log_info("    -S,--scan-threads number of threads that only perform range queries;\n"
+	         "                      the rest run the lookup/rquery/update mix [%d]\n",
+	         ARGUMENT_DEFAULT_SCAN_THREADS);
+	log_info("    -B,--lookup-batch every lookup looks up this many random keys with\n"
+	         "                      map_lookup_batch() [%d]\n",
+	         ARGUMENT_DEFAULT_LOOKUP_BATCH);
 
 #	ifdef WORKLOAD_TIME
 	log_info("    -r,--run-time-sec execution time [%d sec]\n",
@@ -115,6 +157,12 @@ static void clargs_print_usage(char *progname)
 	log_info("    -o,--nr-operations number of operations to execute [%d]\n",
 	        ARGUMENT_DEFAULT_NR_OPERATIONS);
 #	endif
+
+#	ifdef MAP_REGISTRY
+	log_info("    -M,--map          comma-separated maps to run one after the other,\n"
+	         "                      each on a fresh map with the same warmup. One of:\n");
+	map_registry_print();
+#	endif
 }
 
 static void clargs_init(int argc, char **argv)
@@ -136,10 +184,10 @@ static void clargs_init(int argc, char **argv)
 			clargs.num_threads = atoi(optarg);
 			break;
 		case 's':
-			clargs.init_tree_size = atoi(optarg);
+			clargs.init_tree_size = atoll(optarg);
 			break;
 		case 'm':
-			clargs.max_key = atoi(optarg);
+			clargs.max_key = atoll(optarg);
 			break;
 		case 'l':
 			clargs.lookup_frac = atoi(optarg);
@@ -156,6 +204,18 @@ static void clargs_init(int argc, char **argv)
 		case 'j':
 			clargs.thread_seed = atoi(optarg);
 			break;
+		case 'H':
+			clargs.huge_pages = 1;
+			break;
+		case 'R':
+			clargs.rquery_size = atoi(optarg);
+			break;
+		case 'S':
+			clargs.scan_threads = atoi(optarg);
+			break;
+		case 'B':
+			clargs.lookup_batch = atoi(optarg);
+			break;
 #		ifdef WORKLOAD_TIME
 		case 'r':
 			clargs.run_time_sec = atoi(optarg);
@@ -164,6 +224,11 @@ static void clargs_init(int argc, char **argv)
 		case 'o':
 			clargs.nr_operations = atoi(optarg);
 			break;
+#		endif
+#		ifdef MAP_REGISTRY
+		case 'M':
+			clargs.maps = optarg;
+			break;
 #		endif
 		default:
 			clargs_print_usage(argv[0]);
@@ -173,6 +238,14 @@ static void clargs_init(int argc, char **argv)
 
 	/* Sanity checks. */
 	assert(clargs.lookup_frac + clargs.rquery_frac + clargs.insert_frac <= 100);
+	assert(clargs.scan_threads <= clargs.num_threads);
+	assert(clargs.lookup_batch >= 1);
+#	ifdef MAP_REGISTRY
+	if (clargs.maps == NULL) {
+		clargs_print_usage(argv[0]);
+		exit(1);
+	}
+#	endif
 }
 
 static void clargs_print()
@@ -180,19 +253,26 @@ static void clargs_print()
 	log_info("Inputs:\n");
 	log_info("====================\n");
 	log_info("  num_threads: %d\n", clargs.num_threads);
-	log_info("  init_tree_size: %d\n", clargs.init_tree_size);
-	log_info("  max_key: %d\n", clargs.max_key);
+	log_info("  init_tree_size: %lld\n", clargs.init_tree_size);
+	log_info("  max_key: %lld\n", clargs.max_key);
 	log_info("  lookup_frac: %d\n", clargs.lookup_frac);
 	log_info("  rqery_frac: %d\n", clargs.rquery_frac);
 	log_info("  insert_frac: %d\n", clargs.insert_frac);
 	log_info("  init_seed: %d\n", clargs.init_seed);
 	log_info("  thread_seed: %d\n", clargs.thread_seed);
+	log_info("  huge_pages: %d\n", clargs.huge_pages);
+	log_info("  rquery_size: %d\n", clargs.rquery_size);
+	log_info("  scan_threads: %d\n", clargs.scan_threads);
+	log_info("  lookup_batch: %d\n", clargs.lookup_batch);
 
 #	ifdef WORKLOAD_TIME
 	log_info("  run_time_sec: %d\n", clargs.run_time_sec);
 #	elif defined(WORKLOAD_FIXED)
 	log_info("  nr_operations: %d\n", clargs.nr_operations);
 #	endif
+#	ifdef MAP_REGISTRY
+	log_info("  maps: %s\n", clargs.maps);
+#	endif
 
 	log_info("\n");
 }
@@ -29,11 +29,13 @@ typedef struct {
 
 	unsigned long long operations_performed[OPS_END],
 	                   operations_succeeded[OPS_END];
+	//> Keys visited by the range queries.
+	unsigned long long rquery_keys;
 
 	void *map_tdata;
 
 	char padding[2*CACHE_LINE_SIZE - 3*sizeof(int) - 2*sizeof(void *) -
-	                               2*OPS_END*sizeof(unsigned long long)];
+	                               (2*OPS_END+1)*sizeof(unsigned long long)];
 } __attribute__((aligned(CACHE_LINE_SIZE))) thread_data_t;
 
 static inline thread_data_t *thread_data_new(int tid, int cpu, void *map)
@@ -79,6 +81,7 @@ static inline void thread_data_add(thread_data_t *d1, thread_data_t *d2,
 	dest->nr_operations = d1->nr_operations + d2->nr_operations;
 #	endif
 
+	dest->rquery_keys = d1->rquery_keys + d2->rquery_keys;
 	for (i=0; i < OPS_END; i++) {
 		dest->operations_performed[i] = d1->operations_performed[i] + 
 		                                d2->operations_performed[i];
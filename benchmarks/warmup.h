@@ -3,24 +3,92 @@
 
 #include <stdlib.h>
 #include "../maps/map.h"
+#include "../lib/alloc.h"
 
-static inline int map_warmup(void *map, int nr_nodes, int max_key,
-                             unsigned int seed)
+//> Inserts keys[lo..hi] median first, so that even the unbalanced trees
+//> end up balanced.
+static void map_warmup_insert(void *map, void *tdata, map_key_t *keys,
+                              long long lo, long long hi)
+{
+	long long mid;
+
+	if (lo > hi) return;
+	mid = lo + (hi - lo) / 2;
+	map_insert(map, tdata, keys[mid], NULL);
+	map_warmup_insert(map, tdata, keys, lo, mid - 1);
+	map_warmup_insert(map, tdata, keys, mid + 1, hi);
+}
+
+static int map_warmup_cmp(const void *a, const void *b)
+{
+	long long x = *(const long long *)a, y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
+
+//> rand() % max_key; two calls to rand() when max_key is larger than
+//> RAND_MAX.
+static inline long long map_warmup_rand(long long max_key)
+{
+	long long r = rand();
+	if (max_key > RAND_MAX)
+		r = r * ((long long)RAND_MAX + 1) + rand();
+	return r % max_key;
+}
+
+/**
+ * Fills the map with `nr_nodes` random keys in [0, max_key).
+ * The keys are the ones the map would get by inserting rand() % max_key
+ * until it contains `nr_nodes` keys, but they are sorted and handed to
+ * map_bulk_load() at once. Maps that cannot be bulk loaded get them
+ * inserted one by one.
+ * The keys are drawn in rounds: each round draws as many keys as are still
+ * missing, sorts them and merges them into the unique keys of the previous
+ * rounds, dropping the duplicates. All rounds together consume a prefix of
+ * the rand() sequence, so the keys are the same as drawing them one at a
+ * time, at O(nr_nodes) memory and O(nr_nodes log nr_nodes) time, however
+ * large max_key is.
+ **/
+static inline long long map_warmup(void *map, long long nr_nodes,
+                                   long long max_key, unsigned int seed)
 {
 	void *tdata = map_tdata_new(-1);
-	int nodes_inserted = 0, ret = 0, randint;
-	map_key_t key;
-	
-	srand(seed);
-	while (nodes_inserted < nr_nodes) {
-		randint = rand() % max_key;
-		KEY_GET(key, randint);
+	long long *unique, *drawn, *merged, *tmp, nr_unique = 0, nr_drawn, next,
+	          i, j, k;
+	map_key_t *keys;
+
+	XMALLOC(unique, nr_nodes);
+	XMALLOC(drawn, nr_nodes);
+	XMALLOC(merged, nr_nodes);
 
-		ret = map_insert(map, tdata, key, NULL);
-		nodes_inserted += ret;
+	srand(seed);
+	while (nr_unique < nr_nodes) {
+		nr_drawn = nr_nodes - nr_unique;
+		for (i=0; i < nr_drawn; i++)
+			drawn[i] = map_warmup_rand(max_key);
+		qsort(drawn, nr_drawn, sizeof(*drawn), map_warmup_cmp);
+		for (i=0, j=0, k=0; i < nr_unique || j < nr_drawn; ) {
+			if (j == nr_drawn || (i < nr_unique && unique[i] <= drawn[j]))
+				next = unique[i++];
+			else
+				next = drawn[j++];
+			if (k == 0 || merged[k-1] != next) merged[k++] = next;
+		}
+		tmp = unique; unique = merged; merged = tmp;
+		nr_unique = k;
 	}
+	free(drawn);
+	free(merged);
+
+	XMALLOC(keys, nr_nodes);
+	for (i=0; i < nr_nodes; i++)
+		KEY_GET(keys[i], unique[i]);
+	free(unique);
+
+	if (map_bulk_load(map, tdata, keys, NULL, nr_nodes) == 0)
+		map_warmup_insert(map, tdata, keys, 0, nr_nodes - 1);
 
-	return nodes_inserted;
+	free(keys);
+	return nr_unique;
 }
 
 
@@ -15,4 +15,12 @@
 #	define CACHE_LINE_SIZE 64
 #endif
 
+//> Prefetches, for reading, all the cache lines of the `size` bytes at `addr`.
+static inline void prefetch_range(const void *addr, unsigned long size)
+{
+	const char *p = addr, *end = (const char *)addr + size;
+	for (; p < end; p += CACHE_LINE_SIZE)
+		__builtin_prefetch(p, 0, 3);
+}
+
 #endif /* _ARCH_H_ */
@@ -58,6 +58,11 @@ static inline void *tx_thread_data_new(int tid)
 	return ret;
 }
 
+static inline void tx_thread_data_free(void *thread_data)
+{
+	free(thread_data);
+}
+
 static inline void tx_thread_data_print(void *thread_data)
 {
 	int i;
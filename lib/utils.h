@@ -1,11 +1,13 @@
 #ifndef _UTILS_H_
 #define _UTILS_H_
 
+#ifndef MIN
 #define MIN(a, b) ({ \
 	__typeof__ (a) _a = (a); \
 	__typeof__ (b) _b = (b); \
 	_a < _b ? _a : _b; \
 })
+#endif
 
 #define MAX(a, b) ({ \
 	__typeof__ (a) _a = (a); \
@@ -4,8 +4,9 @@
 #include "ca-locks.h"
 #include "tdata.h"
 #include "../key/key.h"
+#include "../size.h"
 
-static int ca_lookup(ca_t *ca, map_key_t key, ca_tdata_t *tdata)
+static int ca_lookup(ca_t *ca, map_key_t key, void **value, ca_tdata_t *tdata)
 {
 	int ret = 0;
 	base_node_t *bnode;
@@ -18,7 +19,7 @@ static int ca_lookup(ca_t *ca, map_key_t key, ca_tdata_t *tdata)
 			ca_node_base_unlock(bnode);
 			continue;
 		}
-		ret = seq_ds_lookup(bnode->root, key);
+		ret = seq_ds_lookup(bnode->root, key, value);
 		ca_adapt_if_needed(ca, bnode, parent, gparent, tdata);
 		ca_node_base_unlock(bnode);
 		return ret;
@@ -45,6 +46,27 @@ static int ca_insert(ca_t *ca, map_key_t key, void *value, ca_tdata_t *tdata)
 	}
 }
 
+static int ca_compute(ca_t *ca, map_key_t key, map_compute_t fn, void *arg,
+                      ca_tdata_t *tdata)
+{
+	int ret = 0;
+	base_node_t *bnode;
+	route_node_t *parent, *gparent;
+
+	while (1) {
+		bnode = _get_base_node(ca, &parent, &gparent, key);
+		ca_node_base_lock(bnode);
+		if (!bnode->valid) {
+			ca_node_base_unlock(bnode);
+			continue;
+		}
+		ret = seq_ds_compute(bnode->root, key, fn, arg);
+		ca_adapt_if_needed(ca, bnode, parent, gparent, tdata);
+		ca_node_base_unlock(bnode);
+		return ret;
+	}
+}
+
 static int ca_update(ca_t *ca, map_key_t key, void *value, ca_tdata_t *tdata)
 {
 	int ret = 0;
@@ -86,7 +108,20 @@ static int ca_delete(ca_t *ca, map_key_t key, ca_tdata_t *tdata)
 }
 
 static __thread stack_t access_path;
-static __thread base_node_t *rquery_bnodes[100];
+//> Grows on demand, a range query may span any number of base nodes.
+static __thread base_node_t **rquery_bnodes;
+static __thread int rquery_bnodes_sz;
+
+static void _rquery_bnodes_grow()
+{
+	rquery_bnodes_sz = rquery_bnodes_sz ? 2 * rquery_bnodes_sz : 100;
+	rquery_bnodes = realloc(rquery_bnodes,
+	                        rquery_bnodes_sz * sizeof(*rquery_bnodes));
+	if (!rquery_bnodes) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+}
 
 /**
  * For a range query of [key1, key2] returns (locked) all the base nodes involved.
@@ -123,10 +158,12 @@ static int _rquery_get_base_nodes(ca_t *ca, map_key_t key1, map_key_t key2)
 			}
 		} else {
 			bnode = curr;
+			if (nbase_nodes == rquery_bnodes_sz) _rquery_bnodes_grow();
 			if (pthread_spin_trylock(&bnode->lock)) goto out_with_valid_error;
 			rquery_bnodes[nbase_nodes++] = bnode;
 			if (!bnode->valid) goto out_with_valid_error;
-			if (bnode->root->root != NULL && seq_ds_max_key(bnode->root) >= key2) break;
+			if (bnode->root->root != NULL &&
+			    KEY_CMP(seq_ds_max_key(bnode->root), key2) >= 0) break;
 			prev = curr;
 			curr = stack_pop(&access_path);
 		}
@@ -139,8 +176,10 @@ out_with_valid_error:
 	return -1;
 }
 
-static int ca_rquery(ca_t *ca, map_key_t key1, map_key_t key2, int *nkeys,
-                     ca_tdata_t *tdata)
+//> All the base nodes of the range are locked while they are visited, so the
+//> range query is atomic.
+static int ca_rquery(ca_t *ca, map_key_t key1, map_key_t key2,
+                     map_visit_t visit, void *arg, ca_tdata_t *tdata)
 {
 	int nbase_nodes, i;
 
@@ -148,12 +187,112 @@ static int ca_rquery(ca_t *ca, map_key_t key1, map_key_t key2, int *nkeys,
 		nbase_nodes = _rquery_get_base_nodes(ca, key1, key2);
 	} while (nbase_nodes == -1);
 
+	for (i=0; i < nbase_nodes; i++)
+		if (!seq_ds_query(rquery_bnodes[i]->root, key1, key2, visit, arg))
+			break;
+
 	for (i=0; i < nbase_nodes; i++)
 		ca_node_base_unlock(rquery_bnodes[i]);
 
 	return (nbase_nodes > 0);
 }
 
+/**
+ * Like range queries, locks all the base nodes of the range, so the deletion is
+ * atomic. The base nodes that are left empty get the lock statistics of a
+ * base node without contention, so the next operation that locks them joins
+ * them with a neighbour (see ca_adapt_if_needed()).
+ **/
+static int ca_delete_range(ca_t *ca, map_key_t key1, map_key_t key2,
+                           ca_tdata_t *tdata)
+{
+	int nbase_nodes, i, deleted = 0;
+	base_node_t *bnode;
+
+	do {
+		nbase_nodes = _rquery_get_base_nodes(ca, key1, key2);
+	} while (nbase_nodes == -1);
+
+	for (i=0; i < nbase_nodes; i++) {
+		bnode = rquery_bnodes[i];
+		deleted += seq_ds_delete_range(bnode->root, key1, key2);
+		if (bnode->root->root == NULL)
+			bnode->lock_statistics = STAT_LOCK_LOW_CONTENTION_LIMIT;
+	}
+
+	for (i=0; i < nbase_nodes; i++)
+		ca_node_base_unlock(rquery_bnodes[i]);
+
+	return deleted;
+}
+
+/**
+ * Ordered navigation (see nav.h). The base nodes are visited in the direction
+ * of `op`, starting from the one `key` is routed to (the leftmost or the
+ * rightmost one for map_min() and map_max()), until one of them has the
+ * answer. Like in range queries, the visited base nodes stay locked until the
+ * end, so the answer is atomic, and we start over if one of them is invalid
+ * or cannot be locked right away.
+ **/
+static int ca_nav(ca_t *ca, map_key_t key, map_nav_t op,
+                  map_key_t *key_out, void **value_out)
+{
+	base_node_t *bnode;
+	route_node_t *rnode;
+	void *curr, *prev;
+	int forward = MAP_NAV_IS_FORWARD(op);
+	int nbase_nodes, i, ret;
+
+restart:
+	nbase_nodes = ret = 0;
+	stack_reset(&access_path);
+	curr = ca->root;
+	while (ca_node_is_route(curr)) {
+		stack_push(&access_path, curr);
+		rnode = curr;
+		if (op == MAP_NAV_MIN)      curr = rnode->left;
+		else if (op == MAP_NAV_MAX) curr = rnode->right;
+		else curr = (KEY_CMP(key, rnode->key) <= 0) ? rnode->left : rnode->right;
+	}
+
+	while (1) {
+		bnode = curr;
+		if (nbase_nodes == rquery_bnodes_sz) _rquery_bnodes_grow();
+		if (pthread_spin_trylock(&bnode->lock)) goto out_restart;
+		rquery_bnodes[nbase_nodes++] = bnode;
+		if (!bnode->valid) goto out_restart;
+		if (seq_ds_nav(bnode->root, key, op, key_out, value_out)) {
+			ret = 1;
+			break;
+		}
+
+		//> Go up while we come from the child in the direction of `op`
+		//> and then down to the first base node of the other child.
+		do {
+			prev = curr;
+			curr = stack_pop(&access_path);
+			rnode = curr;
+		} while (curr != NULL && prev == (forward ? rnode->right : rnode->left));
+		if (curr == NULL) break;
+		stack_push(&access_path, rnode);
+		curr = forward ? rnode->right : rnode->left;
+		while (ca_node_is_route(curr)) {
+			stack_push(&access_path, curr);
+			rnode = curr;
+			curr = forward ? rnode->left : rnode->right;
+		}
+	}
+
+	for (i=0; i < nbase_nodes; i++)
+		ca_node_base_unlock(rquery_bnodes[i]);
+	return ret;
+
+out_restart:
+	for (i=0; i < nbase_nodes; i++)
+		ca_node_base_unlock(rquery_bnodes[i]);
+	goto restart;
+}
+
 static int bst_violations;
 static int total_nodes, route_nodes, base_nodes, invalid_nodes;
 static int total_keys, base_keys;
@@ -181,8 +320,10 @@ static void ca_validate_rec(void *root, map_key_t min, map_key_t max,
 		base_nodes++;
 		invalid_nodes += (bnode->valid == 0);
 		//> FIXME don't access bnode->root->root directly below
-		if (bnode->root->root != NULL && seq_ds_max_key(bnode->root) > max) bst_violations++;
-		if (bnode->root->root != NULL && seq_ds_min_key(bnode->root) < min) bst_violations++;
+		if (bnode->root->root != NULL &&
+		    KEY_CMP(seq_ds_max_key(bnode->root), max) > 0) bst_violations++;
+		if (bnode->root->root != NULL &&
+		    KEY_CMP(seq_ds_min_key(bnode->root), min) < 0) bst_violations++;
 		if (depth < min_depth) min_depth = depth;
 		if (depth > max_depth) max_depth = depth;
 		sz = seq_ds_size(bnode->root);
@@ -225,14 +366,51 @@ int ca_validate_helper(ca_t *ca)
 	return check_bst;
 }
 
+/**
+ * map_destroy() callbacks (see destroy.h). The subtree of a base node is its
+ * sequential data structure, whose nodes are told apart from the route and
+ * base nodes by their magic number.
+ **/
+static void ca_destroy_children(void *node, destroy_stack_t *stack)
+{
+	if (*(char *)node != CA_NODE_MAGIC_NUMBER) {
+		seq_ds_destroy_children(node, stack);
+	} else if (ca_node_is_route(node)) {
+		destroy_push(stack, ((route_node_t *)node)->left);
+		destroy_push(stack, ((route_node_t *)node)->right);
+	} else {
+		destroy_push(stack, ((base_node_t *)node)->root->root);
+	}
+}
+
+static void ca_destroy_node(void *node)
+{
+	if (*(char *)node != CA_NODE_MAGIC_NUMBER) {
+		seq_ds_destroy_node(node);
+	} else if (ca_node_is_route(node)) {
+		nalloc_free_node_now(nalloc_route, node);
+	} else {
+		free(((base_node_t *)node)->root);
+		nalloc_free_node_now(nalloc_base, node);
+	}
+}
+
 /******************************************************************************/
 /*     Map interface implementation                                           */
 /******************************************************************************/
 void *map_new()
 {
+	ca_t *ca;
+
 	printf("Size of CA node is %lu (route) and %lu (base)\n",
 	        sizeof(route_node_t), sizeof(base_node_t));
-	return ca_new();
+	nalloc_internal = nalloc_thread_init(-1, sizeof(treap_node_internal_t));
+	nalloc_external = nalloc_thread_init(-1, sizeof(treap_node_external_t));
+	nalloc_route = nalloc_thread_init(-1, sizeof(route_node_t));
+	nalloc_base = nalloc_thread_init(-1, sizeof(base_node_t));
+	ca = ca_new();
+	ca->size = map_size_new();
+	return ca;
 }
 
 void *map_tdata_new(int tid)
@@ -254,41 +432,162 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	ca_tdata_add(d1, d2, dst);
 }
 
+void map_tdata_free(void *thread_data)
+{
+	free(rquery_bnodes);
+	rquery_bnodes = NULL;
+	rquery_bnodes_sz = 0;
+	ca_tdata_free(thread_data);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((ca_t *)map)->root, nthreads, ca_destroy_children,
+	             ca_destroy_node);
+	map_size_free(((ca_t *)map)->size);
+	free(map);
+}
+
+//> Not supported; map_warmup() inserts the keys instead.
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	return 0;
+}
+
 int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
-	ret = ca_lookup(map, key, thread_data);
+	nalloc_op_begin();
+	ret = ca_lookup(map, key, value_out, thread_data);
+	nalloc_op_end();
 	return ret; 
 }
 
-int map_rquery(void *map, void *thread_data, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
+{
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(map, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *thread_data, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
 {
-	int ret = 0, nkeys;
-	ret = ca_rquery(map, key1, key2, &nkeys, thread_data);
+	int ret = 0;
+	nalloc_op_begin();
+	ret = ca_rquery(map, key1, key2, visit, arg, thread_data);
+	nalloc_op_end();
 	return ret; 
 }
 
+static int map_nav(void *map, void *thread_data, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	int ret;
+	nalloc_op_begin();
+	ret = ca_nav(map, key, op, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *map, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *thread_data, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *thread_data, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, key, MAP_NAV_PRED, key_out, value_out);
+}
+
 int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = ca_insert(map, key, value, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((ca_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = ca_compute(map, key, fn, arg, thread_data);
+	nalloc_op_end();
+	if (!ret) map_size_add(((ca_t *)map)->size, 1);
 	return ret;
 }
 
 int map_delete(void *map, void *thread_data, map_key_t key)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = ca_delete(map, key, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((ca_t *)map)->size, -1);
+	return ret;
+}
+
+int map_delete_range(void *map, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	int ret = 0;
+	if (KEY_CMP(key1, key2) > 0) return 0;
+	nalloc_op_begin();
+	ret = ca_delete_range(map, key1, key2, thread_data);
+	nalloc_op_end();
+	map_size_add(((ca_t *)map)->size, -ret);
 	return ret;
 }
 
 int map_update(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = ca_update(map, key, value, thread_data);
+	nalloc_op_end();
+	map_size_updated(((ca_t *)map)->size, ret);
 	return ret;
 }
 
+long long map_size(void *map, void *thread_data, int exact)
+{
+	return map_size_sum(((ca_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	int ret = 0;
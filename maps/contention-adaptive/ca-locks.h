@@ -7,6 +7,7 @@
 #include "stack.h"
 #include "tdata.h"
 #include "../key/key.h"
+#include "../size.h"
 #include "seq_ds.h"
 
 #define CA_NODE_MAGIC_NUMBER 18
@@ -39,6 +40,7 @@ typedef struct {
 	pthread_spinlock_t lock;
 	//> Root is either a route or a base node
 	void *root;
+	map_size_t *size; //> See size.h.
 } ca_t;
 
 //> Allocators for route and base nodes
@@ -187,8 +189,8 @@ static void ca_split(ca_t *ca, base_node_t *bnode,
 
 	if (seq_ds_size(bnode->root) < 10) return;
 
-	left_bnode = ca_node_new(-1, 0);
-	right_bnode = ca_node_new(-1, 0);
+	left_bnode = ca_node_new(MIN_KEY, 0);
+	right_bnode = ca_node_new(MIN_KEY, 0);
 	left_bnode->root = seq_ds_split(bnode->root, &right_bnode->root);
 
 	assert(left_bnode->root != NULL);
@@ -204,6 +206,7 @@ static void ca_split(ca_t *ca, base_node_t *bnode,
 	} else {
 		ca->root = new_rnode;
 	}
+	nalloc_free_node(nalloc_base, bnode);
 }
 
 //> Called with bnode locked
@@ -218,7 +221,7 @@ static void ca_join(ca_t *ca, base_node_t *bnode,
 
 	if (parent == NULL) return;
 
-	new_bnode = ca_node_new(-1, 0);
+	new_bnode = ca_node_new(MIN_KEY, 0);
 
 	if (parent->left == bnode) {
 		sibling = parent->right;
@@ -230,9 +233,11 @@ static void ca_join(ca_t *ca, base_node_t *bnode,
 
 		//> Try to lock lmost_base and check if valid
 		if (pthread_spin_trylock(&lmost_base->lock) != 0) {
+			nalloc_free_node(nalloc_base, new_bnode);
 			return;
 		} else if (lmost_base->valid == 0) {
 			pthread_spin_unlock(&lmost_base->lock);
+			nalloc_free_node(nalloc_base, new_bnode);
 			return;
 		}
 
@@ -250,6 +255,9 @@ static void ca_join(ca_t *ca, base_node_t *bnode,
 		else                                   lmparent->right = new_bnode;
 		lmost_base->valid = 0;
 		pthread_spin_unlock(&lmost_base->lock);
+		nalloc_free_node(nalloc_base, lmost_base);
+		nalloc_free_node(nalloc_base, bnode);
+		nalloc_free_node(nalloc_route, parent);
 	} else if (parent->right == bnode) {
 		sibling = parent->left;
 
@@ -260,9 +268,11 @@ static void ca_join(ca_t *ca, base_node_t *bnode,
 
 		//> Try to lock rmost_base and check if valid
 		if (pthread_spin_trylock(&rmost_base->lock) != 0) {
+			nalloc_free_node(nalloc_base, new_bnode);
 			return;
 		} else if (rmost_base->valid == 0) {
 			pthread_spin_unlock(&rmost_base->lock);
+			nalloc_free_node(nalloc_base, new_bnode);
 			return;
 		}
 
@@ -280,6 +290,9 @@ static void ca_join(ca_t *ca, base_node_t *bnode,
 		else                                   rmparent->right = new_bnode;
 		rmost_base->valid = 0;
 		pthread_spin_unlock(&rmost_base->lock);
+		nalloc_free_node(nalloc_base, rmost_base);
+		nalloc_free_node(nalloc_base, bnode);
+		nalloc_free_node(nalloc_route, parent);
 	}
 }
 
@@ -306,7 +319,7 @@ static ca_t *ca_new()
 	ca_t *ca;
 	XMALLOC(ca, 1);
 	pthread_spin_init(&ca->lock, PTHREAD_PROCESS_SHARED);
-	ca->root = ca_node_new(-1, 0);
+	ca->root = ca_node_new(MIN_KEY, 0);
 	return ca;
 }
 
@@ -326,10 +339,9 @@ static void _print_helper_rec(void *node, int depth)
 	} else {
 		bnode = node;
 		for (i=0; i < depth; i++) printf("-");
-		printf("-> [BASE] (size: %u min: %d max: %d)\n",
-		        seq_ds_size(bnode->root),
-		        seq_ds_min_key(bnode->root),
-		        seq_ds_max_key(bnode->root));
+		printf("-> [BASE] (size: %u", seq_ds_size(bnode->root));
+		KEY_PRINT(seq_ds_min_key(bnode->root), " min: ", "");
+		KEY_PRINT(seq_ds_max_key(bnode->root), " max: ", ")\n");
 	}
 }
 
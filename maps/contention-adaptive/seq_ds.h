@@ -10,14 +10,19 @@
 #define seq_ds_lookup    treap_seq_lookup
 #define seq_ds_insert    treap_seq_insert
 #define seq_ds_update    treap_seq_update
+#define seq_ds_compute   treap_seq_compute
 #define seq_ds_delete    treap_seq_delete
+#define seq_ds_delete_range treap_seq_delete_range
 #define seq_ds_query     treap_seq_rquery
+#define seq_ds_nav       treap_seq_nav
 #define seq_ds_print     treap_print
 #define seq_ds_split     treap_split
 #define seq_ds_join      treap_join
 #define seq_ds_max_key   treap_max_key
 #define seq_ds_min_key   treap_min_key
 #define seq_ds_size      treap_size
+#define seq_ds_destroy_children treap_destroy_children
+#define seq_ds_destroy_node     treap_destroy_node
 #endif
 
 
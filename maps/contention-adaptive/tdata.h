@@ -19,6 +19,11 @@ ca_tdata_t *ca_tdata_new(int tid)
 	return tdata;
 }
 
+void ca_tdata_free(ca_tdata_t *tdata)
+{
+	free(tdata);
+}
+
 void ca_tdata_print(ca_tdata_t *tdata)
 {
 	printf("%3d %5d %5d\n", tdata->tid, tdata->joins, tdata->splits);
@@ -0,0 +1,34 @@
+#ifndef _MAP_DELETE_RANGE_H_
+#define _MAP_DELETE_RANGE_H_
+
+/**
+ * map_delete_range() for the maps that cannot delete a range at once
+ * (see map.h). It deletes `key1` and then every successor of it up to `key2`,
+ * each with its own map_delete(), so it is as concurrent as the deletions of
+ * the map, but the range as a whole is not deleted atomically: keys inserted
+ * in the range during the call may survive it. It needs map_successor(); maps
+ * without navigation return -1 instead of calling it.
+ **/
+
+#include "key/key.h"
+#include "map.h"
+
+static int map_delete_range_each(void *map, void *tdata, map_key_t key1,
+                                 map_key_t key2)
+{
+	map_key_t key = MIN_KEY, next = MIN_KEY;
+	int ret = 0;
+
+	if (KEY_CMP(key1, key2) > 0) return 0;
+
+	KEY_COPY(key, key1);
+	ret += map_delete(map, tdata, key);
+	while (map_successor(map, tdata, key, &next, NULL) &&
+	       KEY_CMP(next, key2) <= 0) {
+		ret += map_delete(map, tdata, next);
+		KEY_COPY(key, next);
+	}
+	return ret;
+}
+
+#endif /* _MAP_DELETE_RANGE_H_ */
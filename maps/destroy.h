@@ -0,0 +1,156 @@
+#ifndef _MAP_DESTROY_H_
+#define _MAP_DESTROY_H_
+
+/**
+ * Helpers of map_destroy().
+ *
+ * The nodes of a map are split in disjoint parts, which are freed in parallel
+ * by `nthreads` threads: the calling one and nthreads-1 threads that are
+ * created for the call. Every thread takes the next part from a shared
+ * counter, so a large part does not hold back the rest of the threads.
+ * The threads that are created initialize the per-thread data of the map
+ * (map_tdata_new()), so the nodes are given back to the allocator through
+ * their own handles, and release it with map_tdata_free() and
+ * nalloc_thread_exit() when they are done; their heaps, with the freed nodes,
+ * are taken over by the threads created later.
+ *
+ * Trees describe their nodes with two callbacks: `children` pushes the
+ * children of a node to the stack (NULL ones are skipped) and `free_node`
+ * frees a single node. destroy_tree() frees the top of the tree breadth-first
+ * until there are enough subtrees for the threads and every subtree is then
+ * freed with an explicit stack, so unbalanced trees do not overflow the stack
+ * of the thread.
+ **/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "alloc.h"
+#include "map.h"
+
+#define DESTROY_PARTS_PER_THREAD 8
+
+typedef struct {
+	void **nodes;
+	int nr_nodes, capacity;
+} destroy_stack_t;
+
+static void destroy_push(destroy_stack_t *stack, void *node)
+{
+	if (!node) return;
+	if (stack->nr_nodes == stack->capacity) {
+		stack->capacity = stack->capacity ? 2 * stack->capacity : 64;
+		stack->nodes = realloc(stack->nodes,
+		                       stack->capacity * sizeof(*stack->nodes));
+		if (!stack->nodes) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+	}
+	stack->nodes[stack->nr_nodes++] = node;
+}
+
+//> Frees `part`; for lists, along with the nodes up to `next_part`, which is
+//> NULL for the last part.
+typedef void (*destroy_part_t)(void *part, void *next_part, void *arg);
+typedef void (*destroy_children_t)(void *node, destroy_stack_t *stack);
+typedef void (*destroy_free_t)(void *node);
+
+typedef struct {
+	void **parts;
+	int nr_parts;
+	volatile int next;
+	destroy_part_t fn;
+	void *arg;
+} destroy_job_t;
+
+static void destroy_job_run(destroy_job_t *job)
+{
+	int i;
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nr_parts)
+		job->fn(job->parts[i], (i + 1 < job->nr_parts) ? job->parts[i+1] : NULL,
+		        job->arg);
+}
+
+static void *destroy_thread(void *arg)
+{
+	void *tdata = map_tdata_new(-1);
+	destroy_job_run(arg);
+	map_tdata_free(tdata);
+	nalloc_thread_exit();
+	return NULL;
+}
+
+static void destroy_parts(void **parts, int nr_parts, int nthreads,
+                          destroy_part_t fn, void *arg)
+{
+	destroy_job_t job = { parts, nr_parts, 0, fn, arg };
+	pthread_t *threads;
+	int i, nr_created;
+
+	if (nthreads > nr_parts) nthreads = nr_parts;
+	if (nthreads <= 1) {
+		destroy_job_run(&job);
+		return;
+	}
+
+	//> If a thread cannot be created, the rest of them do its share.
+	XMALLOC(threads, nthreads);
+	for (nr_created=0; nr_created < nthreads - 1; nr_created++)
+		if (pthread_create(&threads[nr_created], NULL, destroy_thread, &job))
+			break;
+	destroy_job_run(&job);
+	for (i=0; i < nr_created; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+typedef struct {
+	destroy_children_t children;
+	destroy_free_t free_node;
+} destroy_tree_t;
+
+static void destroy_subtree(void *root, void *next_part, void *arg)
+{
+	destroy_tree_t *tree = arg;
+	destroy_stack_t stack = { NULL, 0, 0 };
+	void *node;
+
+	destroy_push(&stack, root);
+	while (stack.nr_nodes > 0) {
+		node = stack.nodes[--stack.nr_nodes];
+		tree->children(node, &stack);
+		tree->free_node(node);
+	}
+	free(stack.nodes);
+}
+
+static void destroy_tree(void *root, int nthreads, destroy_children_t children,
+                         destroy_free_t free_node)
+{
+	destroy_tree_t tree = { children, free_node };
+	destroy_stack_t level = { NULL, 0, 0 };
+	int first = 0;
+
+	destroy_push(&level, root);
+	//> `level` is used as a queue; nodes[first..nr_nodes-1] are the subtrees.
+	//> The consumed ones are dropped, so a degenerate tree does not fill it.
+	while (nthreads > 1 && first < level.nr_nodes &&
+	       level.nr_nodes - first < nthreads * DESTROY_PARTS_PER_THREAD) {
+		if (first == level.capacity / 2) {
+			level.nr_nodes -= first;
+			memmove(level.nodes, level.nodes + first,
+			        level.nr_nodes * sizeof(*level.nodes));
+			first = 0;
+		}
+		root = level.nodes[first++];
+		children(root, &level);
+		free_node(root);
+	}
+	destroy_parts(level.nodes + first, level.nr_nodes - first, nthreads,
+	              destroy_subtree, &tree);
+	free(level.nodes);
+}
+
+#endif /* _MAP_DESTROY_H_ */
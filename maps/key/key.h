@@ -3,6 +3,8 @@
 
 #if defined(MAP_KEY_TYPE_INT)
 #	include "key_int.h"
+#elif defined(MAP_KEY_TYPE_INT64)
+#	include "key_int64.h"
 #elif defined (MAP_KEY_TYPE_BIG_INT)
 #	ifndef BIG_INT_KEY_SZ
 #		define BIG_INT_KEY_SZ 50
@@ -13,6 +15,8 @@
 #		define STR_KEY_SZ 50
 #	endif
 #	include "key_str.h"
+#elif defined (MAP_KEY_TYPE_VAR_STR)
+#	include "key_var_str.h"
 #else
 #	error "No key type defined..."
 #endif
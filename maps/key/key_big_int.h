@@ -25,7 +25,7 @@ static int KEY_CMP(map_key_t k1, map_key_t k2) {
 	for (i=0; i < BIG_INT_KEY_SZ - sizeof(int); i++)
 		sum += k1.padding[i] + k2.padding[i];
 
-	return k1.value - k2.value;
+	return (k1.value > k2.value) - (k1.value < k2.value);
 }
 
 #endif /* _KEY_BIG_INT_H_ */
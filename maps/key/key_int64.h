@@ -0,0 +1,17 @@
+#ifndef _KEY_INT64_H_
+#define _KEY_INT64_H_
+
+#include <limits.h> //> For LLONG_MAX
+
+typedef long long map_key_t;
+#define MAX_KEY LLONG_MAX
+#define MIN_KEY -1LL
+#define KEY_PRINT(k, PREFIX, POSTFIX) printf("%s%lld%s", (PREFIX), (k), (POSTFIX))
+
+//> -1, 0 or 1: the difference of two 64-bit keys does not fit in an int.
+#define KEY_CMP(k1, k2) (((k1) > (k2)) - ((k1) < (k2)))
+#define KEY_COPY(dst, src) ((dst) = (src))
+#define KEY_GET(k, someint) ((k) = (someint))
+#define KEY_ADD(dst, k1, k2) ((dst) = (k1) + (k2))
+
+#endif /* _KEY_INT64_H_ */
@@ -0,0 +1,195 @@
+#ifndef _KEY_VAR_STR_H_
+#define _KEY_VAR_STR_H_
+
+/**
+ * Variable-length string keys.
+ *
+ * The bytes of a key are an immutable, NUL-terminated string that lives
+ * outside of the maps. A key slot holds a pointer to them along with their
+ * first 8 bytes, packed big-endian in an integer (`head`), so every slot is
+ * 16 bytes whatever the length of the key and KEY_CMP() only reads the bytes
+ * when the heads are equal and the keys are longer than 7 bytes.
+ * The strings are interned in an append-only, lock-free hash table, so equal
+ * keys share their bytes. Interned strings are never freed. Each translation
+ * unit has its own table, which only costs the shortcut for equal keys that
+ * come from different ones.
+ *
+ * KEY_GET() encodes a non-negative integer as VAR_STR_KEY_PREFIX followed by
+ * the number of its digits (as '0' + digits) and the digits, e.g., 42 becomes
+ * "242", so the order of the strings is the order of the integers.
+ * With a long VAR_STR_KEY_PREFIX (e.g., a URL) all the keys share a long
+ * prefix, which the B+trees skip when they search a node (see
+ * var_str_key_search()).
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef VAR_STR_KEY_PREFIX
+#define VAR_STR_KEY_PREFIX ""
+#endif
+#ifndef VAR_STR_KEY_BUCKETS
+#define VAR_STR_KEY_BUCKETS (1 << 20)
+#endif
+
+typedef struct {
+	unsigned long long head;
+	const char *bytes;
+} map_key_t;
+
+//> Keys that are zeroed, e.g., in new nodes, are empty strings.
+static map_key_t max_key_var = { ~0ULL, "\xff\xff\xff\xff\xff\xff\xff\xff\xff" };
+static map_key_t min_key_var = { 0, "" };
+#define MAX_KEY max_key_var
+#define MIN_KEY min_key_var
+#define KEY_PRINT(k, PREFIX, POSTFIX) \
+	printf("%s%s%s", (PREFIX), (k).bytes ? (k).bytes : "", (POSTFIX))
+
+typedef struct var_str_key_s {
+	struct var_str_key_s *next;
+	unsigned int hash;
+	char bytes[];
+} var_str_key_t;
+
+static var_str_key_t *var_str_keys[VAR_STR_KEY_BUCKETS];
+
+static unsigned int var_str_key_hash(const char *s)
+{
+	unsigned int h = 2166136261u; //> FNV-1a
+	while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+//> Returns the interned copy of `s`.
+static const char *var_str_key_intern(const char *s)
+{
+	unsigned int hash = var_str_key_hash(s);
+	var_str_key_t **bucket = &var_str_keys[hash % VAR_STR_KEY_BUCKETS];
+	var_str_key_t *head, *k, *new = NULL;
+	size_t len;
+
+	do {
+		head = *bucket;
+		for (k=head; k; k=k->next) {
+			if (k->hash == hash && !strcmp(k->bytes, s)) {
+				free(new);
+				return k->bytes;
+			}
+		}
+		if (!new) {
+			len = strlen(s);
+			new = malloc(sizeof(*new) + len + 1);
+			new->hash = hash;
+			memcpy(new->bytes, s, len + 1);
+		}
+		new->next = head;
+	} while (!__sync_bool_compare_and_swap(bucket, head, new));
+	return new->bytes;
+}
+
+//> Returns the key of the string `s`, which is interned.
+static map_key_t var_str_key_new(const char *s)
+{
+	map_key_t key = { 0, var_str_key_intern(s) };
+	int i;
+	for (i=0; i < 8 && key.bytes[i]; i++)
+		key.head |= (unsigned long long)(unsigned char)key.bytes[i] << (56 - 8 * i);
+	return key;
+}
+
+//> KEY_GET() is called for every operation of the benchmarks, so the keys of
+//> the values in [0, 2^32) are also kept in a two-level table, which is
+//> filled lazily and saves formatting and hashing the key every time.
+#define VAR_STR_KEY_CHUNK_BITS 16
+static map_key_t *var_str_key_chunks[1 << (32 - VAR_STR_KEY_CHUNK_BITS)];
+
+static map_key_t var_str_key_get(long long value)
+{
+	char digits[24], buf[sizeof(VAR_STR_KEY_PREFIX) + sizeof(digits) + 1];
+	unsigned long long chunk = (unsigned long long)value >> VAR_STR_KEY_CHUNK_BITS;
+	unsigned int index = value & ((1 << VAR_STR_KEY_CHUNK_BITS) - 1);
+	map_key_t *keys = NULL, key;
+	int ndigits;
+
+	if (value >= 0 && chunk < sizeof(var_str_key_chunks) / sizeof(keys)) {
+		keys = var_str_key_chunks[chunk];
+		if (!keys) {
+			keys = calloc(1 << VAR_STR_KEY_CHUNK_BITS, sizeof(*keys));
+			if (!__sync_bool_compare_and_swap(&var_str_key_chunks[chunk],
+			                                  NULL, keys)) {
+				free(keys);
+				keys = var_str_key_chunks[chunk];
+			}
+		}
+		//> `bytes` is published after `head`.
+		key.bytes = __atomic_load_n(&keys[index].bytes, __ATOMIC_ACQUIRE);
+		if (key.bytes) {
+			key.head = keys[index].head;
+			return key;
+		}
+	}
+
+	ndigits = snprintf(digits, sizeof(digits), "%lld", value);
+	snprintf(buf, sizeof(buf), "%s%c%s", VAR_STR_KEY_PREFIX, '0' + ndigits,
+	         digits);
+	key = var_str_key_new(buf);
+	//> Racing threads store the same interned key.
+	if (keys) {
+		keys[index].head = key.head;
+		__atomic_store_n(&keys[index].bytes, key.bytes, __ATOMIC_RELEASE);
+	}
+	return key;
+}
+
+//> The integer a key of KEY_GET() was made of.
+static long long var_str_key_value(map_key_t k)
+{
+	return atoll(k.bytes + sizeof(VAR_STR_KEY_PREFIX));
+}
+
+static inline int var_str_key_cmp(map_key_t k1, map_key_t k2)
+{
+	if (k1.head != k2.head) return (k1.head < k2.head) ? -1 : 1;
+	//> Keys shorter than 8 bytes end in their head.
+	if ((k1.head & 0xff) == 0 || k1.bytes == k2.bytes) return 0;
+	return strcmp(k1.bytes + 8, k2.bytes + 8);
+}
+
+/**
+ * Returns the index of the first of the sorted `keys[0..n-1]` that is not
+ * smaller than `key`. All the keys share the common prefix of the first and
+ * the last one. When it is longer than the heads, `key` is compared with it
+ * once and, if it shares it, only the rest of the bytes of the keys is
+ * compared.
+ **/
+static int var_str_key_search(map_key_t *keys, int n, map_key_t key)
+{
+	const char *first, *last;
+	int i = 0, skip = 8, cmp;
+
+	if (n > 1 && keys[0].head == keys[n-1].head && (keys[0].head & 0xff) &&
+	    key.head == keys[0].head && (key.head & 0xff)) {
+		first = keys[0].bytes;
+		last = keys[n-1].bytes;
+		while (first[skip] && first[skip] == last[skip]) skip++;
+		cmp = strncmp(key.bytes + 8, first + 8, skip - 8);
+		if (cmp < 0) return 0;
+		if (cmp > 0) return n;
+		while (i < n && key.bytes != keys[i].bytes &&
+		       strcmp(key.bytes + skip, keys[i].bytes + skip) > 0)
+			i++;
+		return i;
+	}
+
+	while (i < n && var_str_key_cmp(key, keys[i]) > 0) i++;
+	return i;
+}
+
+#define KEY_CMP(k1, k2) var_str_key_cmp((k1), (k2))
+#define KEY_COPY(dst, src) ((dst) = (src))
+#define KEY_GET(k, someint) ((k) = var_str_key_get(someint))
+#define KEY_ADD(dst, k1, k2) \
+	((dst) = var_str_key_get(var_str_key_value(k1) + var_str_key_value(k2)))
+
+#endif /* _KEY_VAR_STR_H_ */
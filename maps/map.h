@@ -9,11 +9,27 @@
 void *map_new();
 char *map_name();
 int   map_validate(void *map);
+//> map_bulk_load() fills the empty `map` with the `n` keys of `keys`, which
+//>  must be unique and sorted in ascending order, and their `values` (all
+//>  NULL if `values` is NULL). `tdata` is what map_tdata_new() returned to
+//>  the calling thread. It returns the number of keys loaded, or 0 if the map
+//>  does not support bulk loading and the keys have to be inserted.
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys,
+                        void **values, long long n);
+//> map_destroy() frees `map` and all its nodes. No thread may access the map,
+//>  or a snapshot of it, during or after the call. The nodes are freed by
+//>  `nthreads` threads, the calling one included, which must have called
+//>  map_tdata_new() (see destroy.h).
+void  map_destroy(void *map, int nthreads);
 
 //> Initialize per thread data and statistics.
 void *map_tdata_new(int tid);
 void  map_tdata_print(void *tdata);
 void  map_tdata_add(void *tdata1, void *tdata2, void *tdata_dst);
+//> map_tdata_free() frees the per-thread data of the calling thread, `tdata`
+//>  included, once the thread will not use maps of this implementation any
+//>  more.
+void  map_tdata_free(void *tdata);
 
 //> Thread-safe interface functions.
 //> Can handle multiple threads at the same time and produce correct results.
@@ -21,18 +37,125 @@ void  map_tdata_add(void *tdata1, void *tdata2, void *tdata_dst);
 //>  on whether the key is present or not in the map.
 //>  It returns 0 or 1 if insert was performed and 2 or 3 if delete was performed.
 int map_lookup(void *map, void *tdata, map_key_t key);
+//> map_get() is map_lookup() that also returns the value of `key` in
+//>  `*value_out`, which is left untouched if the key is not in the map.
+int map_get(void *map, void *tdata, map_key_t key, void **value_out);
+//> map_lookup_batch() looks up `keys[0..n-1]`, stores the result of each
+//>  lookup in `results[i]` and returns the number of keys found. Some maps
+//>  interleave the traversals of the keys to overlap their cache misses;
+//>  every single lookup is still linearizable, the batch as a whole is not.
+int map_lookup_batch(void *map, void *tdata, map_key_t *keys, int n,
+                     int *results);
 int map_insert(void *map, void *tdata, map_key_t key, void *value);
 int map_delete(void *map, void *tdata, map_key_t key);
+//> map_delete_range() deletes every key in [key1, key2] and returns the
+//>  number of deleted keys, or -1 if the map does not support it. The
+//>  sequential, coarse-grained and RCU-HTM B+trees, treaps and skip list and
+//>  the contention adapting tree delete the range at once and atomically, in
+//>  time proportional to the nodes they touch. The rest delete one key at a
+//>  time through map_successor() (see delete_range.h), so the range is not
+//>  deleted atomically; the lock-free BSTs with hazard pointers, which do not
+//>  support navigation, return -1.
+int map_delete_range(void *map, void *tdata, map_key_t key1, map_key_t key2);
 int map_update(void *map, void *tdata, map_key_t key, void *value);
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2);
+//> map_rquery() calls `visit(key, value, arg)` for every key in [key1, key2]
+//>  in ascending order and stops as soon as `visit` returns non-zero.
+//>  It returns 1, or 0 if the map does not support range queries.
+//>  Maps that synchronize with HTM may call `visit` inside a transaction;
+//>  if the transaction aborts, the keys it visited are visited again.
+typedef int (*map_visit_t)(map_key_t key, void *value, void *arg);
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg);
+
+//> map_compute() atomically replaces the value of `key` with
+//>  `fn(key, value, 1, arg)`, where `value` is its current value, or, if `key`
+//>  is not in the map, inserts it with the value `fn(key, NULL, 0, arg)`.
+//>  It returns 1 if `key` was in the map and 0 if it was inserted.
+//>  `fn` may be called more than once, e.g., when an attempt has to be
+//>  retried or a transaction aborts; only the value returned by the last
+//>  call is stored.
+typedef void *(*map_compute_t)(map_key_t key, void *value, int found, void *arg);
+int map_compute(void *map, void *tdata, map_key_t key, map_compute_t fn,
+                void *arg);
+
+//> Ordered navigation. map_min() and map_max() find the smallest and the
+//>  largest key of the map, map_successor() the smallest key that is larger
+//>  than `key` and map_predecessor() the largest key that is smaller than
+//>  `key`. They return 1 and store the key in `*key_out` and its value in
+//>  `*value_out` (unless `value_out` is NULL), or 0 if there is no such key.
+//>  Maps that serialize their operations answer atomically; in the rest,
+//>  like their lookups and range queries, the returned key was in the map
+//>  at some point during the call. The lock-free BSTs do not support them
+//>  with hazard pointers and always return 0.
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out);
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out);
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out);
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out);
+
+//> map_size() returns the number of keys in the map without traversing it.
+//>  It is approximate while updates are running: the updates that have not
+//>  returned yet may be missing. With `exact` set, it waits for a moment when
+//>  no update completes and is exact if no update is running (see size.h).
+long long map_size(void *map, void *tdata, int exact);
+
+//> map_snapshot() returns a read-only version of the map as it is at the
+//>  moment of the call, or NULL if the map does not support snapshots. It can
+//>  be given instead of the map to map_lookup(), map_get(), map_lookup_batch(),
+//>  map_rquery() and the navigation functions, which see the keys of that
+//>  moment while the map keeps being updated. Taking one costs O(1), but
+//>  updates copy more nodes while there are snapshots and the nodes they
+//>  replace are reclaimed after the snapshot is given to
+//>  map_snapshot_release(). Only the RCU-HTM B+tree supports them (not with
+//>  hazard pointers).
+void *map_snapshot(void *map, void *tdata);
+void  map_snapshot_release(void *snapshot, void *tdata);
 
 //> Debugging functions
 void map_print(void *map);
 
 //> Thread-safe node allocator functions
+//> Every thread has one allocator that serves nodes of all sizes.
+//> nalloc_thread_init() returns the handle of the calling thread's allocator
+//> for nodes of `sz` bytes; maps with several node types call it once per type
+//> and all the returned handles share the memory of the thread.
 void *nalloc_init();
 void *nalloc_thread_init(int tid, size_t sz);
 void *nalloc_alloc_node(void *nalloc);
 void  nalloc_free_node(void *nalloc, void *node);
+//> nalloc_free_node_now() reuses `node` right away, so it is only for nodes
+//> that no thread can reach any more, e.g., those of a destroyed map.
+void  nalloc_free_node_now(void *nalloc, void *node);
+//> Called by a thread after its last map operation. Its heap, with all its
+//> memory and free nodes, and its reclamation state are taken over by the
+//> next thread that calls nalloc_thread_init().
+void  nalloc_thread_exit();
+//> Back the arenas of the allocator with 2MB huge pages (falls back to
+//> transparent huge pages). Must be called before any nalloc_thread_init().
+void  nalloc_set_huge_pages(int enable);
+
+//> Epoch-based reclamation.
+//> nalloc_free_node() only retires the node; it is reused after every thread
+//> that might still reference it has finished its current operation.
+//> Thus, every thread-safe map operation must be enclosed in
+//> nalloc_op_begin() / nalloc_op_end().
+void  nalloc_op_begin();
+void  nalloc_op_end();
+//> nalloc_pin() keeps every node retired from now on until nalloc_unpin(),
+//> as if an operation lasted until then. Returns NULL with hazard pointers.
+void *nalloc_pin();
+void  nalloc_unpin(void *pin);
+
+//> Hazard pointers (compile with -DNALLOC_HAZARD_POINTERS).
+//> nalloc_free_node() reuses a node as soon as it is not in any thread's
+//> hazard slots. Maps that support this mode publish every node with
+//> nalloc_hp_protect() before dereferencing it and then validate that it is
+//> still reachable. nalloc_op_end() clears all the slots of the thread.
+#define NALLOC_HP_SLOTS 12
+void  nalloc_hp_protect(int slot, void *node);
+
+//> Prints the number of retired and reclaimed nodes of all threads.
+void  nalloc_print_stats();
 
 #endif /* _MAP_H_ */
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include "map.h"
 #include "../lib/log.h"
 
 #define MSG() log_debug("Hello!!!\n")
@@ -20,6 +21,11 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	MSG();
 }
 
+void map_tdata_free(void *tdata)
+{
+	MSG();
+}
+
 void *map_new()
 {
 	MSG();
@@ -38,31 +44,113 @@ int map_validate(void *rbt)
 	return 1;
 }
 
-int map_lookup(void *map, void *tdata, int key)
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys,
+                        void **values, long long n)
+{
+	MSG();
+	return 0;
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	MSG();
+}
+
+int map_lookup(void *map, void *tdata, map_key_t key)
+{
+	MSG();
+	return 1;
+}
+
+int map_get(void *map, void *tdata, map_key_t key, void **value_out)
 {
 	MSG();
 	return 1;
 }
 
-int map_insert(void *map, void *tdata, int key, void *value)
+int map_lookup_batch(void *map, void *tdata, map_key_t *keys, int n,
+                     int *results)
+{
+	MSG();
+	return n;
+}
+
+int map_insert(void *map, void *tdata, map_key_t key, void *value)
 {
 	MSG();
 	return 1;
 }
 
-int map_delete(void *map, void *tdata, int key)
+int map_compute(void *map, void *tdata, map_key_t key, map_compute_t fn,
+                void *arg)
 {
 	MSG();
 	return 1;
 }
 
-int map_update(void *map, void *tdata, int key, void *value)
+int map_delete(void *map, void *tdata, map_key_t key)
+{
+	MSG();
+	return 1;
+}
+
+int map_delete_range(void *map, void *tdata, map_key_t key1, map_key_t key2)
+{
+	MSG();
+	return -1;
+}
+
+int map_update(void *map, void *tdata, map_key_t key, void *value)
 {
 	MSG();
 	return 1;
 }
 
-int map_rquery(void *map, void *tdata, int key1, int key2)
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	MSG();
+	return 0;
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	MSG();
+	return 0;
+}
+
+int map_successor(void *map, void *tdata, map_key_t key, map_key_t *key_out,
+                  void **value_out)
+{
+	MSG();
+	return 0;
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key, map_key_t *key_out,
+                    void **value_out)
+{
+	MSG();
+	return 0;
+}
+
+long long map_size(void *map, void *tdata, int exact)
+{
+	MSG();
+	return 0;
+}
+
+void *map_snapshot(void *map, void *tdata)
+{
+	MSG();
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+	MSG();
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
 {
 	MSG();
 	return 1;
@@ -0,0 +1,250 @@
+#ifndef _EBR_H_
+#define _EBR_H_
+
+/**
+ * Epoch-based reclamation (DEBRA-style) for the node allocators.
+ *
+ * Every thread owns a record in a global list. At the beginning of each map
+ * operation the thread announces the global epoch it observed and at the end
+ * it announces that it is quiescent. Nodes given to nalloc_free_node() are
+ * placed in the limbo bag of the thread's current epoch and are handed back
+ * to the allocator (nalloc_recycle_node()) three epochs later, when no thread
+ * can still hold a reference to them.
+ * The global epoch is advanced incrementally: each operation checks the
+ * announcement of one other thread and the thread that finds everyone
+ * up-to-date increments the epoch.
+ * A pin (ebr_pin()) is a record that is not owned by any thread and keeps
+ * announcing the epoch in which it was taken until it is released, so no
+ * node retired meanwhile is reclaimed.
+ * The records of released pins are reused by the next pins and threads. The
+ * record of a thread that has exited (ebr_thread_exit()) is taken over, with
+ * the nodes left in its limbo bags, by the next owner of the heap of the
+ * thread (see heap.h).
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "alloc.h"
+#include "arch.h"
+
+#define EBR_NR_BAGS 3
+#define EBR_BLOCK_SZ 256
+#define EBR_QUIESCENT 1UL
+
+//> Provided by the allocator that includes this file.
+static void nalloc_recycle_node(void *nalloc, void *node);
+
+//> Limbo entries are kept outside of the retired nodes, because concurrent
+//> readers may still traverse them until the grace period has passed.
+typedef struct ebr_block_s {
+	int nr_entries;
+	struct {
+		void *nalloc, *node;
+	} entries[EBR_BLOCK_SZ];
+	struct ebr_block_s *next;
+} ebr_block_t;
+
+typedef struct ebr_thread_s {
+	//> (epoch << 1) | EBR_QUIESCENT, read by the other threads.
+	volatile unsigned long announce;
+	char pad[CACHE_LINE_SIZE - sizeof(unsigned long)];
+
+	int tid;
+	unsigned long epoch;
+	struct ebr_thread_s *check_next;
+	ebr_block_t *bags[EBR_NR_BAGS];
+	ebr_block_t *free_blocks;
+	unsigned long long nr_retired, nr_reclaimed;
+	//> Set when the record is a released pin.
+	volatile int unused;
+
+	struct ebr_thread_s *next;
+} ebr_thread_t;
+
+static volatile unsigned long ebr_epoch = EBR_NR_BAGS;
+static ebr_thread_t * volatile ebr_threads;
+static __thread ebr_thread_t *ebr_me;
+
+static ebr_thread_t *ebr_thread_register(int tid)
+{
+	ebr_thread_t *t;
+
+	XMALLOC(t, 1);
+	memset(t, 0, sizeof(*t));
+	t->tid = tid;
+	t->epoch = ebr_epoch;
+	t->announce = (t->epoch << 1) | EBR_QUIESCENT;
+	do {
+		t->next = ebr_threads;
+	} while (!__sync_bool_compare_and_swap(&ebr_threads, t->next, t));
+	//> Threads registered after us start after the current epoch, so
+	//> the first scan only needs to cover the ones already in the list.
+	t->check_next = t->next;
+	return t;
+}
+
+//> Takes over the record of a released pin or registers a new one.
+static ebr_thread_t *ebr_thread_claim(int tid)
+{
+	ebr_thread_t *t;
+
+	for (t = ebr_threads; t; t = t->next)
+		if (t->unused && __sync_bool_compare_and_swap(&t->unused, 1, 0)) {
+			t->tid = tid;
+			return t;
+		}
+	return ebr_thread_register(tid);
+}
+
+//> `t` is the record that the previous owner of the heap of the thread left,
+//> or NULL.
+static inline void ebr_thread_init(int tid, ebr_thread_t *t)
+{
+	if (ebr_me) return;
+	if (t) t->tid = tid;
+	else t = ebr_thread_claim(tid);
+	ebr_me = t;
+}
+
+static inline ebr_thread_t *ebr_thread_self()
+{
+	if (!ebr_me) ebr_me = ebr_thread_claim(-1);
+	return ebr_me;
+}
+
+//> Returns the record of the thread, for the next owner of its heap.
+static void *ebr_thread_exit()
+{
+	ebr_thread_t *me = ebr_me;
+	if (!me) return NULL;
+	__atomic_store_n(&me->announce, me->announce | EBR_QUIESCENT,
+	                 __ATOMIC_RELEASE);
+	ebr_me = NULL;
+	return me;
+}
+
+static void ebr_bag_reclaim(ebr_thread_t *me, int bag)
+{
+	ebr_block_t *b = me->bags[bag], *next;
+	int i;
+
+	while (b) {
+		for (i=0; i < b->nr_entries; i++)
+			nalloc_recycle_node(b->entries[i].nalloc, b->entries[i].node);
+		me->nr_reclaimed += b->nr_entries;
+		next = b->next;
+		b->nr_entries = 0;
+		b->next = me->free_blocks;
+		me->free_blocks = b;
+		b = next;
+	}
+	me->bags[bag] = NULL;
+}
+
+static inline void ebr_retire(void *nalloc, void *node)
+{
+	ebr_thread_t *me = ebr_thread_self();
+	int bag = me->epoch % EBR_NR_BAGS;
+	ebr_block_t *b = me->bags[bag];
+
+	if (!b || b->nr_entries == EBR_BLOCK_SZ) {
+		if (me->free_blocks) {
+			b = me->free_blocks;
+			me->free_blocks = b->next;
+		} else {
+			XMALLOC(b, 1);
+			b->nr_entries = 0;
+		}
+		b->next = me->bags[bag];
+		me->bags[bag] = b;
+	}
+	b->entries[b->nr_entries].nalloc = nalloc;
+	b->entries[b->nr_entries].node = node;
+	b->nr_entries++;
+	me->nr_retired++;
+}
+
+//> Announces an epoch that is still the global one after the announcement
+//> is visible, so the local epoch of `t` never lags by more than one.
+static inline unsigned long ebr_announce(ebr_thread_t *t)
+{
+	unsigned long e = ebr_epoch, e2;
+
+	while (1) {
+		t->announce = e << 1;
+		__sync_synchronize();
+		e2 = ebr_epoch;
+		if (e2 == e) return e;
+		e = e2;
+	}
+}
+
+static inline void ebr_op_begin()
+{
+	ebr_thread_t *me = ebr_thread_self(), *t;
+	unsigned long e;
+	int i;
+
+	e = ebr_announce(me);
+
+	if (e != me->epoch) {
+		//> The bag we are going to reuse holds nodes retired at most
+		//> at epoch e-3, so nobody can reference them any more.
+		if (e - me->epoch >= EBR_NR_BAGS)
+			for (i=0; i < EBR_NR_BAGS; i++) ebr_bag_reclaim(me, i);
+		else
+			ebr_bag_reclaim(me, e % EBR_NR_BAGS);
+		me->epoch = e;
+		me->check_next = ebr_threads;
+	}
+
+	//> Check one more thread and try to advance the epoch.
+	t = me->check_next;
+	if (t == me) t = t->next;
+	if (t) {
+		unsigned long a = t->announce;
+		if ((a & EBR_QUIESCENT) || (a >> 1) == e) t = t->next;
+	}
+	me->check_next = t;
+	if (!t) __sync_bool_compare_and_swap(&ebr_epoch, e, e + 1);
+}
+
+static inline void ebr_op_end()
+{
+	ebr_thread_t *me = ebr_me;
+	if (!me) return;
+	__atomic_store_n(&me->announce, me->announce | EBR_QUIESCENT,
+	                 __ATOMIC_RELEASE);
+}
+
+static void *ebr_pin()
+{
+	ebr_thread_t *t = ebr_thread_claim(-1);
+	ebr_announce(t);
+	return t;
+}
+
+static void ebr_unpin(void *pin)
+{
+	ebr_thread_t *t = pin;
+	__atomic_store_n(&t->announce, t->announce | EBR_QUIESCENT,
+	                 __ATOMIC_RELEASE);
+	t->unused = 1;
+}
+
+static void ebr_print_stats()
+{
+	ebr_thread_t *t;
+	unsigned long long retired = 0, reclaimed = 0;
+
+	for (t = ebr_threads; t; t = t->next) {
+		retired += t->nr_retired;
+		reclaimed += t->nr_reclaimed;
+	}
+	printf("Memory reclamation (epochs):\n");
+	printf("  Retired: %llu Reclaimed: %llu Pending: %llu Epoch: %lu\n",
+	       retired, reclaimed, retired - reclaimed, ebr_epoch);
+}
+
+#endif /* _EBR_H_ */
@@ -0,0 +1,332 @@
+#ifndef _HEAP_H_
+#define _HEAP_H_
+
+/**
+ * Per-thread heaps with size classes.
+ *
+ * Every thread has a single heap that serves all the node types of the maps.
+ * nalloc_thread_init(tid, sz) returns the size class of the calling thread's
+ * heap that serves nodes of `sz` bytes (rounded up to a multiple of the cache
+ * line); calling it again for the same size returns the same size class.
+ * All the classes of a heap carve their nodes out of the same memory, so a
+ * map with several node types (e.g., tree nodes and operation descriptors)
+ * does not multiply the memory and the startup cost of the allocator.
+ * Every class keeps its own LIFO free list of recycled nodes, threaded
+ * through the nodes themselves.
+ *
+ * The memory of a heap is mapped by the allocator that includes this file
+ * (heap_chunk_map()) and is split in segments of NALLOC_SEGMENT_SIZE bytes,
+ * aligned to their size. The first cache line of a segment holds its owner
+ * heap and NUMA node, so they can be found from any node by masking its
+ * address.
+ *
+ * Remote frees: a node that becomes free in a thread other than its owner
+ * is given back to the owner's heap. The freeing thread collects such nodes
+ * in per-owner batches and pushes a full batch with a single CAS to the
+ * owner's remote-free queue (a lock-free multi-producer single-consumer
+ * stack). The owner grabs the whole queue with one atomic exchange when a
+ * size class runs out of free nodes. Nodes of heaps with a negative tid
+ * (the initialization thread, which does not run operations afterwards) are
+ * kept by the thread that frees them.
+ *
+ * A thread that is done with the maps releases its heap (heap_release()) and
+ * the next thread that initializes its allocator adopts it, with all its
+ * memory and free nodes, instead of creating a new one. The record of the
+ * memory reclamation scheme of the thread is released and adopted along with
+ * the heap: the nodes it has not reclaimed yet are recycled through the size
+ * classes of the heap, so only the owner of the heap may reclaim them.
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include "alloc.h"
+#include "arch.h"
+
+#define NALLOC_SEGMENT_SIZE (2UL * 1024 * 1024)
+#define NALLOC_REMOTE_BATCH 64
+
+typedef struct nalloc_segment_s {
+	struct nalloc_heap_s *heap;
+	int numa_node;
+} nalloc_segment_t;
+
+typedef struct nalloc_class_s {
+	struct nalloc_heap_s *heap;
+	size_t sz;
+	void *free_nodes;
+
+	unsigned long long nr_allocs, nr_frees;
+	//> Nodes that live on a different NUMA node than the heap
+	//> (only counted by nalloc_numa.c).
+	unsigned long long nr_numa_remote_allocs, nr_numa_remote_frees;
+
+	struct nalloc_class_s *next;
+} nalloc_class_t;
+
+//> Overlays a node in a remote-free queue or batch.
+typedef struct nalloc_remote_s {
+	struct nalloc_remote_s *next;
+	size_t sz;
+} nalloc_remote_t;
+
+typedef struct {
+	nalloc_remote_t *head, *tail;
+	int nr_nodes;
+} nalloc_batch_t;
+
+typedef struct nalloc_heap_s {
+	//> Pushed to by the other threads.
+	nalloc_remote_t * volatile remote_frees;
+	char pad[CACHE_LINE_SIZE - sizeof(void *)];
+
+	int id, tid;
+	int numa_node;
+	//> Set while no thread owns the heap.
+	volatile int released;
+
+	char *reserve_cur; //> Mapped memory that is not yet split in segments.
+	char *reserve_end;
+	char *chunk_cur;   //> Next free byte of the current segment.
+	char *chunk_end;
+	size_t chunk_bytes; //> Size of the next mapping, if the allocator grows them.
+	unsigned long long nr_chunks, nr_segments;
+
+	nalloc_class_t *classes;
+	//> Reclamation record left by the last owner (see heap_release()).
+	void *reclaim;
+
+	//> Nodes of other heaps waiting to be sent back, indexed by heap id.
+	nalloc_batch_t *batches;
+	int nr_batches;
+	unsigned long long nr_remote_sent, nr_remote_received;
+
+	struct nalloc_heap_s *next;
+} nalloc_heap_t;
+
+//> Provided by the allocator that includes this file. Returns memory of at
+//> least `*bytes` bytes, aligned to NALLOC_SEGMENT_SIZE, and its size in
+//> `*bytes`.
+static void *heap_chunk_map(nalloc_heap_t *heap, size_t *bytes);
+
+static nalloc_heap_t * volatile heaps;
+static volatile int heaps_nr;
+static __thread nalloc_heap_t *heap_me;
+
+static nalloc_heap_t *heap_self(int tid)
+{
+	nalloc_heap_t *heap;
+
+	if (heap_me) return heap_me;
+
+	for (heap = heaps; heap; heap = heap->next)
+		if (heap->released &&
+		    __sync_bool_compare_and_swap(&heap->released, 1, 0)) {
+			heap->tid = tid;
+			heap_me = heap;
+			return heap;
+		}
+
+	if (posix_memalign((void **)&heap, CACHE_LINE_SIZE, sizeof(*heap)) != 0) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	memset(heap, 0, sizeof(*heap));
+	heap->id = __sync_fetch_and_add(&heaps_nr, 1);
+	heap->tid = tid;
+	do {
+		heap->next = heaps;
+	} while (!__sync_bool_compare_and_swap(&heaps, heap->next, heap));
+	heap_me = heap;
+	return heap;
+}
+
+static nalloc_class_t *heap_class(nalloc_heap_t *heap, size_t sz)
+{
+	nalloc_class_t *c;
+
+	sz = (sz + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1);
+	if (sz > NALLOC_SEGMENT_SIZE - CACHE_LINE_SIZE) {
+		fprintf(stderr, "Node size %lu too large for the node allocator\n", sz);
+		exit(1);
+	}
+	for (c = heap->classes; c; c = c->next)
+		if (c->sz == sz) return c;
+
+	XMALLOC(c, 1);
+	memset(c, 0, sizeof(*c));
+	c->heap = heap;
+	c->sz = sz;
+	c->next = heap->classes;
+	heap->classes = c;
+	return c;
+}
+
+static inline nalloc_segment_t *heap_segment_of(void *node)
+{
+	return (nalloc_segment_t *)((uintptr_t)node & ~(NALLOC_SEGMENT_SIZE - 1));
+}
+
+//> The tail of the current segment that does not fit the node is wasted.
+static void heap_chunk_new(nalloc_heap_t *heap)
+{
+	nalloc_segment_t *segment;
+	size_t bytes;
+
+	if (heap->reserve_cur == heap->reserve_end) {
+		bytes = NALLOC_SEGMENT_SIZE;
+		heap->reserve_cur = heap_chunk_map(heap, &bytes);
+		heap->reserve_end = heap->reserve_cur +
+		                    (bytes & ~(NALLOC_SEGMENT_SIZE - 1));
+		heap->nr_chunks++;
+	}
+	segment = (nalloc_segment_t *)heap->reserve_cur;
+	heap->reserve_cur += NALLOC_SEGMENT_SIZE;
+	segment->heap = heap;
+	segment->numa_node = heap->numa_node;
+	heap->chunk_cur = (char *)segment + CACHE_LINE_SIZE;
+	heap->chunk_end = (char *)segment + NALLOC_SEGMENT_SIZE;
+	heap->nr_segments++;
+}
+
+//> Moves the nodes that other threads gave back to the free lists.
+static void heap_drain_remote(nalloc_heap_t *heap)
+{
+	nalloc_remote_t *r, *next;
+	nalloc_class_t *c = NULL;
+
+	r = __sync_lock_test_and_set(&heap->remote_frees, NULL);
+	for (; r; r = next) {
+		next = r->next;
+		if (!c || c->sz != r->sz) c = heap_class(heap, r->sz);
+		*(void **)r = c->free_nodes;
+		c->free_nodes = r;
+		heap->nr_remote_received++;
+	}
+}
+
+static inline void *heap_alloc(nalloc_class_t *c)
+{
+	nalloc_heap_t *heap = c->heap;
+	void *ret;
+
+	if (!c->free_nodes && heap->remote_frees) heap_drain_remote(heap);
+	if (c->free_nodes) {
+		ret = c->free_nodes;
+		c->free_nodes = *(void **)ret;
+	} else {
+		if ((size_t)(heap->chunk_end - heap->chunk_cur) < c->sz)
+			heap_chunk_new(heap);
+		ret = heap->chunk_cur;
+		heap->chunk_cur += c->sz;
+	}
+	c->nr_allocs++;
+	//> Maps expect zeroed nodes.
+	memset(ret, 0, c->sz);
+	return ret;
+}
+
+static void heap_send_batch(nalloc_heap_t *owner, nalloc_batch_t *b)
+{
+	nalloc_remote_t *head;
+	do {
+		head = owner->remote_frees;
+		b->tail->next = head;
+	} while (!__sync_bool_compare_and_swap(&owner->remote_frees, head, b->head));
+	b->head = b->tail = NULL;
+	b->nr_nodes = 0;
+}
+
+//> `c` is a size class of the calling thread's heap.
+static inline void heap_recycle(nalloc_class_t *c, void *node)
+{
+	nalloc_heap_t *heap = c->heap, *owner = heap_segment_of(node)->heap;
+	nalloc_remote_t *r = node;
+	nalloc_batch_t *b;
+
+	if (owner == heap || owner->tid < 0) {
+		*(void **)node = c->free_nodes;
+		c->free_nodes = node;
+		return;
+	}
+
+	if (owner->id >= heap->nr_batches) {
+		int nr = heaps_nr;
+		heap->batches = realloc(heap->batches, nr * sizeof(*heap->batches));
+		if (!heap->batches) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+		memset(heap->batches + heap->nr_batches, 0,
+		       (nr - heap->nr_batches) * sizeof(*heap->batches));
+		heap->nr_batches = nr;
+	}
+	b = &heap->batches[owner->id];
+	r->sz = c->sz;
+	r->next = b->head;
+	b->head = r;
+	if (!b->tail) b->tail = r;
+	heap->nr_remote_sent++;
+	if (++b->nr_nodes == NALLOC_REMOTE_BATCH) heap_send_batch(owner, b);
+}
+
+//> Sends the pending batches back to their owners and gives up the heap of
+//> the calling thread, together with its reclamation record `reclaim`, which
+//> the next owner takes over.
+static void heap_release(void *reclaim)
+{
+	nalloc_heap_t *heap = heap_me, *owner;
+
+	if (!heap) return;
+	for (owner = heaps; owner; owner = owner->next)
+		if (owner->id < heap->nr_batches && heap->batches[owner->id].nr_nodes)
+			heap_send_batch(owner, &heap->batches[owner->id]);
+	heap->reclaim = reclaim;
+	heap_me = NULL;
+	__sync_synchronize();
+	heap->released = 1;
+}
+
+static void heap_print_stats()
+{
+	nalloc_heap_t *heap;
+	nalloc_class_t *c, *d;
+	unsigned long long nr_heaps = 0, nr_chunks = 0, nr_segments = 0,
+	                   sent = 0, received = 0;
+
+	for (heap = heaps; heap; heap = heap->next) {
+		nr_heaps++;
+		nr_chunks += heap->nr_chunks;
+		nr_segments += heap->nr_segments;
+		sent += heap->nr_remote_sent;
+		received += heap->nr_remote_received;
+	}
+	printf("Node allocator:\n");
+	printf("  Heaps: %llu Chunks: %llu Segments: %llu\n",
+	       nr_heaps, nr_chunks, nr_segments);
+	printf("  Remote frees: Sent: %llu Received: %llu\n", sent, received);
+
+	//> Sum each size class over all heaps, once per distinct size.
+	for (heap = heaps; heap; heap = heap->next) {
+		for (c = heap->classes; c; c = c->next) {
+			nalloc_heap_t *h;
+			unsigned long long allocs = 0, frees = 0;
+			int first = 1;
+			for (h = heaps; h != heap && first; h = h->next)
+				for (d = h->classes; d; d = d->next)
+					if (d->sz == c->sz) first = 0;
+			if (!first) continue;
+			for (h = heaps; h; h = h->next)
+				for (d = h->classes; d; d = d->next)
+					if (d->sz == c->sz) {
+						allocs += d->nr_allocs;
+						frees += d->nr_frees;
+					}
+			printf("  Size class %4lu: Allocs: %llu Frees: %llu\n",
+			       c->sz, allocs, frees);
+		}
+	}
+}
+
+#endif /* _HEAP_H_ */
@@ -0,0 +1,216 @@
+#ifndef _HP_H_
+#define _HP_H_
+
+/**
+ * Hazard pointers for the node allocators.
+ *
+ * Every thread owns NALLOC_HP_SLOTS hazard slots, published in a global list
+ * of thread records. A map publishes a node in one of its slots before it
+ * dereferences it and then validates that the node is still reachable.
+ * Nodes given to nalloc_free_node() are kept in a per-thread retired list;
+ * when the list grows beyond a threshold, the thread collects the hazard
+ * pointers of all threads and hands back to the allocator
+ * (nalloc_recycle_node()) all retired nodes that are not protected.
+ * Contrary to epochs, a descheduled thread can only hold back the few nodes
+ * in its slots.
+ * The record of a thread that has exited (hp_thread_exit()) is taken over,
+ * along with its retired list, by the next owner of the heap of the thread
+ * (see heap.h).
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "alloc.h"
+#include "arch.h"
+#include "../map.h" /* NALLOC_HP_SLOTS */
+
+#define HP_SCAN_MIN 128
+
+//> Provided by the allocator that includes this file.
+static void nalloc_recycle_node(void *nalloc, void *node);
+
+typedef struct {
+	void *nalloc, *node;
+} hp_retired_t;
+
+typedef struct hp_thread_s {
+	//> Read by the other threads.
+	void * volatile slots[NALLOC_HP_SLOTS];
+	char pad[CACHE_LINE_SIZE - (NALLOC_HP_SLOTS * sizeof(void *)) % CACHE_LINE_SIZE];
+
+	int tid;
+	hp_retired_t *retired;
+	int nr_retired_now, retired_capacity, scan_threshold;
+	//> The hazard pointers collected by hp_scan(), kept across scans.
+	void **hazards;
+	int hazards_capacity;
+	unsigned long long nr_retired, nr_reclaimed, nr_scans;
+
+	struct hp_thread_s *next;
+} hp_thread_t;
+
+static hp_thread_t * volatile hp_threads;
+static __thread hp_thread_t *hp_me;
+
+static hp_thread_t *hp_thread_register(int tid)
+{
+	hp_thread_t *t;
+
+	XMALLOC(t, 1);
+	memset(t, 0, sizeof(*t));
+	t->tid = tid;
+	t->retired_capacity = HP_SCAN_MIN;
+	XMALLOC(t->retired, t->retired_capacity);
+	t->scan_threshold = HP_SCAN_MIN;
+	do {
+		t->next = hp_threads;
+	} while (!__sync_bool_compare_and_swap(&hp_threads, t->next, t));
+	return t;
+}
+
+//> `t` is the record that the previous owner of the heap of the thread left,
+//> or NULL.
+static inline void hp_thread_init(int tid, hp_thread_t *t)
+{
+	if (hp_me) return;
+	if (t) t->tid = tid;
+	else t = hp_thread_register(tid);
+	hp_me = t;
+}
+
+static inline hp_thread_t *hp_thread_self()
+{
+	if (!hp_me) hp_me = hp_thread_register(-1);
+	return hp_me;
+}
+
+static int hp_ptr_cmp(const void *a, const void *b)
+{
+	void *pa = *(void **)a, *pb = *(void **)b;
+	return (pa > pb) - (pa < pb);
+}
+
+static void hp_scan(hp_thread_t *me)
+{
+	hp_thread_t *t;
+	void **hazards = me->hazards, *hp;
+	int nr_hazards = 0, nr_threads = 0, i, j, kept = 0;
+
+	//> Every record in the list is scanned, however many threads register
+	//> meanwhile; the buffer grows to fit them. Threads that register after
+	//> the list head is read cannot hold references to nodes that were
+	//> retired before they started.
+	__sync_synchronize();
+	for (t = hp_threads; t; t = t->next) {
+		if (nr_hazards + NALLOC_HP_SLOTS > me->hazards_capacity) {
+			me->hazards_capacity = 2 * me->hazards_capacity + NALLOC_HP_SLOTS;
+			hazards = realloc(hazards, me->hazards_capacity * sizeof(*hazards));
+			if (!hazards) {
+				fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+				exit(1);
+			}
+			me->hazards = hazards;
+		}
+		for (j=0; j < NALLOC_HP_SLOTS; j++)
+			if ((hp = t->slots[j]) != NULL) hazards[nr_hazards++] = hp;
+		nr_threads++;
+	}
+	qsort(hazards, nr_hazards, sizeof(void *), hp_ptr_cmp);
+
+	for (i=0; i < me->nr_retired_now; i++) {
+		void *node = me->retired[i].node;
+		if (bsearch(&node, hazards, nr_hazards, sizeof(void *), hp_ptr_cmp)) {
+			me->retired[kept++] = me->retired[i];
+		} else {
+			nalloc_recycle_node(me->retired[i].nalloc, node);
+			me->nr_reclaimed++;
+		}
+	}
+	me->nr_retired_now = kept;
+	me->nr_scans++;
+
+	//> Amortize the scan over a number of retirements proportional
+	//> to the number of hazard pointers.
+	me->scan_threshold = 2 * nr_threads * NALLOC_HP_SLOTS;
+	if (me->scan_threshold < HP_SCAN_MIN) me->scan_threshold = HP_SCAN_MIN;
+	if (me->scan_threshold < 2 * kept) me->scan_threshold = 2 * kept;
+}
+
+static inline void hp_retire(void *nalloc, void *node)
+{
+	hp_thread_t *me = hp_thread_self();
+
+	if (me->nr_retired_now == me->retired_capacity) {
+		me->retired_capacity *= 2;
+		me->retired = realloc(me->retired,
+		                      me->retired_capacity * sizeof(*me->retired));
+		if (!me->retired) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+	}
+	me->retired[me->nr_retired_now].nalloc = nalloc;
+	me->retired[me->nr_retired_now].node = node;
+	me->nr_retired_now++;
+	me->nr_retired++;
+	if (me->nr_retired_now >= me->scan_threshold) hp_scan(me);
+}
+
+//> The full barrier orders the publication of the hazard pointer before
+//> the loads that validate it.
+static inline void hp_protect(int slot, void *node)
+{
+	hp_thread_t *me = hp_thread_self();
+	me->slots[slot] = node;
+	__sync_synchronize();
+}
+
+static inline void hp_op_begin()
+{
+}
+
+static inline void hp_op_end()
+{
+	hp_thread_t *me = hp_me;
+	int i;
+	if (!me) return;
+	for (i=0; i < NALLOC_HP_SLOTS; i++) me->slots[i] = NULL;
+}
+
+//> Returns the record of the thread, for the next owner of its heap.
+static void *hp_thread_exit()
+{
+	hp_thread_t *me = hp_me;
+	if (!me) return NULL;
+	hp_op_end();
+	hp_me = NULL;
+	return me;
+}
+
+//> Hazard pointers only protect the nodes in the slots, so there are no pins.
+static void *hp_pin()
+{
+	return NULL;
+}
+
+static void hp_unpin(void *pin)
+{
+}
+
+static void hp_print_stats()
+{
+	hp_thread_t *t;
+	unsigned long long retired = 0, reclaimed = 0, scans = 0;
+
+	for (t = hp_threads; t; t = t->next) {
+		retired += t->nr_retired;
+		reclaimed += t->nr_reclaimed;
+		scans += t->nr_scans;
+	}
+	printf("Memory reclamation (hazard pointers):\n");
+	printf("  Retired: %llu Reclaimed: %llu Pending: %llu Scans: %llu\n",
+	       retired, reclaimed, retired - reclaimed, scans);
+}
+
+#endif /* _HP_H_ */
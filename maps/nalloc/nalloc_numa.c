@@ -0,0 +1,176 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include "alloc.h"
+#include "arch.h"
+#include "reclaim.h"
+#include "pages.h"
+#include "heap.h"
+
+/**
+ * NUMA-aware node allocator.
+ * Every thread allocates from its own heap (see heap.h) whose memory lives on
+ * the NUMA node of the CPU the thread is pinned to (see MT_CONF) when the
+ * heap is created. Memory is requested one segment at a time; every segment
+ * is bound to the heap's NUMA node with mbind() and first touched by the
+ * owning thread. The segment header keeps its NUMA node, which is used to
+ * count how many of the nodes a thread gets or frees live on a remote NUMA
+ * node.
+ * We do not depend on libnuma; mbind() and getcpu() are called directly.
+ **/
+
+#ifndef MPOL_PREFERRED
+#	define MPOL_PREFERRED 1
+#endif
+
+static int numa_node_self()
+{
+	unsigned int cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+	return node;
+}
+
+static inline int numa_node_of(void *node)
+{
+	return heap_segment_of(node)->numa_node;
+}
+
+void *nalloc_init()
+{
+	return NULL;
+}
+
+void nalloc_set_huge_pages(int enable)
+{
+	pages_set_huge(enable);
+}
+
+void *nalloc_thread_init(int tid, size_t sz)
+{
+	nalloc_heap_t *heap = heap_self(tid);
+	if (!heap->nr_chunks) heap->numa_node = numa_node_self();
+	reclaim_thread_init(tid, heap->reclaim);
+	return heap_class(heap, sz);
+}
+
+void nalloc_thread_exit()
+{
+	heap_release(reclaim_thread_exit());
+}
+
+//> The binding is only a preference; if the node runs out of memory
+//> the kernel falls back to the others.
+static void *heap_chunk_map(nalloc_heap_t *heap, size_t *bytes)
+{
+	char *chunk;
+	unsigned long nodemask;
+
+	*bytes = NALLOC_SEGMENT_SIZE;
+	chunk = pages_map(bytes, NALLOC_SEGMENT_SIZE);
+
+	if (heap->numa_node < (int)(8 * sizeof(nodemask))) {
+		nodemask = 1UL << heap->numa_node;
+		(void)syscall(SYS_mbind, chunk, NALLOC_SEGMENT_SIZE, MPOL_PREFERRED,
+		              &nodemask, 8 * sizeof(nodemask), 0);
+	}
+	//> First touch by the owning thread.
+	memset(chunk, 0, NALLOC_SEGMENT_SIZE);
+	return chunk;
+}
+
+void *nalloc_alloc_node(void *nalloc)
+{
+	nalloc_class_t *c = nalloc;
+	void *ret = heap_alloc(c);
+	if (numa_node_of(ret) != c->heap->numa_node) c->nr_numa_remote_allocs++;
+	return ret;
+}
+
+//> Called by the reclamation code once the grace period of `node` has passed.
+static void nalloc_recycle_node(void *nalloc, void *node)
+{
+	heap_recycle(nalloc, node);
+}
+
+void nalloc_free_node(void *nalloc, void *node)
+{
+	nalloc_class_t *c = nalloc;
+	c->nr_frees++;
+	if (numa_node_of(node) != c->heap->numa_node) c->nr_numa_remote_frees++;
+	reclaim_retire(nalloc, node);
+}
+
+//> `node` is not reachable by any thread, so it skips the grace period.
+void nalloc_free_node_now(void *nalloc, void *node)
+{
+	nalloc_class_t *c = nalloc;
+	c->nr_frees++;
+	if (numa_node_of(node) != c->heap->numa_node) c->nr_numa_remote_frees++;
+	nalloc_recycle_node(nalloc, node);
+}
+
+void nalloc_op_begin()
+{
+	reclaim_op_begin();
+}
+
+void nalloc_op_end()
+{
+	reclaim_op_end();
+}
+
+void nalloc_hp_protect(int slot, void *node)
+{
+	reclaim_protect(slot, node);
+}
+
+void *nalloc_pin()
+{
+	return reclaim_pin();
+}
+
+void nalloc_unpin(void *pin)
+{
+	reclaim_unpin(pin);
+}
+
+void nalloc_print_stats()
+{
+	nalloc_heap_t *h;
+	nalloc_class_t *c;
+	int node, max_node = -1;
+
+	for (h = heaps; h; h = h->next)
+		if (h->numa_node > max_node) max_node = h->numa_node;
+
+	printf("NUMA node allocator:\n");
+	for (node = 0; node <= max_node; node++) {
+		unsigned long long nr_heaps = 0, chunks = 0, allocs = 0, remote_allocs = 0,
+		                   frees = 0, remote_frees = 0;
+		for (h = heaps; h; h = h->next) {
+			if (h->numa_node != node) continue;
+			nr_heaps++;
+			chunks += h->nr_chunks;
+			for (c = h->classes; c; c = c->next) {
+				allocs += c->nr_allocs;
+				remote_allocs += c->nr_numa_remote_allocs;
+				frees += c->nr_frees;
+				remote_frees += c->nr_numa_remote_frees;
+			}
+		}
+		if (!nr_heaps) continue;
+		printf("  Node %d: Heaps: %llu Chunks: %llu Allocs: %llu (remote: %llu) "
+		       "Frees: %llu (remote: %llu)\n", node, nr_heaps, chunks,
+		       allocs, remote_allocs, frees, remote_frees);
+	}
+	heap_print_stats();
+	pages_print_stats();
+	reclaim_print_stats();
+}
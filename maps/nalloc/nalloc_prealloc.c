@@ -1,42 +1,135 @@
 #include <stdlib.h>
 #include <string.h>
-#include <assert.h>
 #include "alloc.h"
+#include "arch.h"
+#include "reclaim.h"
+#include "pages.h"
+#include "heap.h"
 
-#define NR_NODES 10000000
+/**
+ * Preallocating node allocator.
+ * The heap of every thread (see heap.h) is a single arena that is mapped and
+ * touched when the thread initializes its allocator, so that no memory is
+ * allocated or faulted in during the measurements.
+ * The arena holds NALLOC_PREALLOC_NODES nodes of the size the heap is first
+ * initialized for, i.e., of the first node type of the map (compile with
+ * -DNALLOC_PREALLOC_NODES=... to change it). All node types of the thread
+ * share the arena, so the further types of a map, and the maps of a registry
+ * run that adopt the heap with larger nodes, get fewer nodes than that.
+ **/
 
-typedef struct {
-	void *free_nodes[NR_NODES];
-	int index;
-	int tid;
-} tdata_t;
+#ifndef NALLOC_PREALLOC_NODES
+#	define NALLOC_PREALLOC_NODES 10000000
+#endif
+
+//> Node size the arena of the calling thread's heap is mapped for.
+static __thread size_t prealloc_sz;
+
+//> The first cache line of every segment and the tail that does not fit a
+//> node are not used for nodes (see heap_chunk_new()).
+static size_t prealloc_bytes(size_t sz)
+{
+	size_t nodes_per_segment = (NALLOC_SEGMENT_SIZE - CACHE_LINE_SIZE) / sz;
+	size_t nr_segments = (NALLOC_PREALLOC_NODES + nodes_per_segment - 1) /
+	                     nodes_per_segment;
+	return nr_segments * NALLOC_SEGMENT_SIZE;
+}
 
 void *nalloc_init()
 {
 	return NULL;
 }
 
+void nalloc_set_huge_pages(int enable)
+{
+	pages_set_huge(enable);
+}
+
 void *nalloc_thread_init(int tid, size_t sz)
 {
-	int i;
-	tdata_t *ret;
-	XMALLOC(ret, 1);
-	for (i=0; i < NR_NODES; i++) {
-		ret->free_nodes[i] = malloc(sz);
-		memset(ret->free_nodes[i], 0, sz);
+	nalloc_heap_t *heap = heap_self(tid);
+	nalloc_class_t *c = heap_class(heap, sz);
+	if (!heap->nr_chunks) {
+		prealloc_sz = c->sz;
+		heap_chunk_new(heap);
 	}
-	ret->index = 0;
-	ret->tid = tid;
-	return ret;
+	reclaim_thread_init(tid, heap->reclaim);
+	return c;
 }
 
-void *nalloc_alloc_node(void *_nalloc)
+void nalloc_thread_exit()
 {
-	tdata_t *nalloc = _nalloc;
-	assert(nalloc->index < NR_NODES);
-	return nalloc->free_nodes[nalloc->index++];
+	heap_release(reclaim_thread_exit());
+}
+
+static void *heap_chunk_map(nalloc_heap_t *heap, size_t *bytes)
+{
+	void *arena;
+	if (heap->nr_chunks) {
+		fprintf(stderr, "Preallocated nodes exhausted (see "
+		        "NALLOC_PREALLOC_NODES): %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	*bytes = prealloc_bytes(prealloc_sz);
+	arena = pages_map(bytes, NALLOC_SEGMENT_SIZE);
+	memset(arena, 0, *bytes);
+	return arena;
+}
+
+void *nalloc_alloc_node(void *nalloc)
+{
+	return heap_alloc(nalloc);
+}
+
+//> Called by the reclamation code once the grace period of `node` has passed.
+//> The free list is LIFO, so the node is the next one handed out while it is
+//> still hot in cache.
+static void nalloc_recycle_node(void *nalloc, void *node)
+{
+	heap_recycle(nalloc, node);
 }
 
 void nalloc_free_node(void *nalloc, void *node)
 {
+	((nalloc_class_t *)nalloc)->nr_frees++;
+	reclaim_retire(nalloc, node);
+}
+
+//> `node` is not reachable by any thread, so it skips the grace period.
+void nalloc_free_node_now(void *nalloc, void *node)
+{
+	((nalloc_class_t *)nalloc)->nr_frees++;
+	nalloc_recycle_node(nalloc, node);
+}
+
+void nalloc_op_begin()
+{
+	reclaim_op_begin();
+}
+
+void nalloc_op_end()
+{
+	reclaim_op_end();
+}
+
+void nalloc_hp_protect(int slot, void *node)
+{
+	reclaim_protect(slot, node);
+}
+
+void *nalloc_pin()
+{
+	return reclaim_pin();
+}
+
+void nalloc_unpin(void *pin)
+{
+	reclaim_unpin(pin);
+}
+
+void nalloc_print_stats()
+{
+	heap_print_stats();
+	pages_print_stats();
+	reclaim_print_stats();
 }
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "alloc.h"
+#include "arch.h"
+#include "reclaim.h"
+#include "pages.h"
+#include "heap.h"
+
+/**
+ * Slab node allocator.
+ * Nodes are carved on demand out of the segments of the thread's heap (see
+ * heap.h). The first chunk of segments the heap maps is SLAB_CHUNK_MIN_BYTES
+ * long and every next chunk doubles in size up to SLAB_CHUNK_MAX_BYTES, so
+ * there is no cap on the number of allocations and the footprint follows the
+ * size of the data structure.
+ * Chunks are mapped through pages.h, so they can be backed by huge pages.
+ **/
+
+#define SLAB_CHUNK_MIN_BYTES NALLOC_SEGMENT_SIZE
+#define SLAB_CHUNK_MAX_BYTES (32 * NALLOC_SEGMENT_SIZE)
+
+void *nalloc_init()
+{
+	return NULL;
+}
+
+void nalloc_set_huge_pages(int enable)
+{
+	pages_set_huge(enable);
+}
+
+void *nalloc_thread_init(int tid, size_t sz)
+{
+	nalloc_heap_t *heap = heap_self(tid);
+	if (!heap->chunk_bytes) heap->chunk_bytes = SLAB_CHUNK_MIN_BYTES;
+	reclaim_thread_init(tid, heap->reclaim);
+	return heap_class(heap, sz);
+}
+
+void nalloc_thread_exit()
+{
+	heap_release(reclaim_thread_exit());
+}
+
+//> The mapping may be rounded up; the heap uses all of it.
+static void *heap_chunk_map(nalloc_heap_t *heap, size_t *bytes)
+{
+	if (*bytes < heap->chunk_bytes) *bytes = heap->chunk_bytes;
+	if (heap->chunk_bytes < SLAB_CHUNK_MAX_BYTES) heap->chunk_bytes *= 2;
+	return pages_map(bytes, NALLOC_SEGMENT_SIZE);
+}
+
+void *nalloc_alloc_node(void *nalloc)
+{
+	return heap_alloc(nalloc);
+}
+
+//> Called by the reclamation code once the grace period of `node` has passed.
+static void nalloc_recycle_node(void *nalloc, void *node)
+{
+	heap_recycle(nalloc, node);
+}
+
+void nalloc_free_node(void *nalloc, void *node)
+{
+	((nalloc_class_t *)nalloc)->nr_frees++;
+	reclaim_retire(nalloc, node);
+}
+
+//> `node` is not reachable by any thread, so it skips the grace period.
+void nalloc_free_node_now(void *nalloc, void *node)
+{
+	((nalloc_class_t *)nalloc)->nr_frees++;
+	nalloc_recycle_node(nalloc, node);
+}
+
+void nalloc_op_begin()
+{
+	reclaim_op_begin();
+}
+
+void nalloc_op_end()
+{
+	reclaim_op_end();
+}
+
+void nalloc_hp_protect(int slot, void *node)
+{
+	reclaim_protect(slot, node);
+}
+
+void *nalloc_pin()
+{
+	return reclaim_pin();
+}
+
+void nalloc_unpin(void *pin)
+{
+	reclaim_unpin(pin);
+}
+
+void nalloc_print_stats()
+{
+	heap_print_stats();
+	pages_print_stats();
+	reclaim_print_stats();
+}
@@ -0,0 +1,90 @@
+#ifndef _PAGES_H_
+#define _PAGES_H_
+
+/**
+ * Backing memory for the arenas of the node allocators.
+ * By default arenas are mapped with regular pages. After
+ * nalloc_set_huge_pages(1) they are mapped with explicit 2MB huge pages
+ * (MAP_HUGETLB) and, when no huge pages are reserved in the system
+ * (/proc/sys/vm/nr_hugepages), with regular pages marked for transparent
+ * huge pages (MADV_HUGEPAGE). In both cases the arena is rounded up to a
+ * multiple of the huge page size and aligned to it.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#define SMALL_PAGE_SIZE 4096UL
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+#ifndef MAP_HUGETLB
+#	define MAP_HUGETLB 0x40000
+#endif
+
+static int pages_huge;
+static unsigned long long pages_nr_regular, pages_nr_hugetlb, pages_nr_thp;
+
+static void pages_set_huge(int enable)
+{
+	pages_huge = enable;
+}
+
+//> Maps `*bytes` bytes aligned to `align` (a power of two) and returns in
+//> `*bytes` the size that was actually mapped.
+static void *pages_map(size_t *bytes, size_t align)
+{
+	char *mem, *ret;
+	size_t head, len;
+
+	if (pages_huge) {
+		*bytes = (*bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		if (align < HUGE_PAGE_SIZE) align = HUGE_PAGE_SIZE;
+		//> Huge pages are naturally aligned to their size.
+		if (align == HUGE_PAGE_SIZE) {
+			mem = mmap(NULL, *bytes, PROT_READ | PROT_WRITE,
+			           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (mem != MAP_FAILED) {
+				__sync_fetch_and_add(&pages_nr_hugetlb, 1);
+				return mem;
+			}
+		}
+	}
+
+	*bytes = (*bytes + SMALL_PAGE_SIZE - 1) & ~(SMALL_PAGE_SIZE - 1);
+	if (align <= SMALL_PAGE_SIZE) {
+		align = SMALL_PAGE_SIZE;
+		len = *bytes;
+	} else {
+		//> mmap() only guarantees page alignment, so map more and trim.
+		len = *bytes + align;
+	}
+	mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+	           -1, 0);
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+	ret = (char *)(((uintptr_t)mem + align - 1) & ~(align - 1));
+	head = ret - mem;
+	if (head) munmap(mem, head);
+	if (len - head - *bytes) munmap(ret + *bytes, len - head - *bytes);
+
+	if (pages_huge) {
+		(void)madvise(ret, *bytes, MADV_HUGEPAGE);
+		__sync_fetch_and_add(&pages_nr_thp, 1);
+	} else {
+		__sync_fetch_and_add(&pages_nr_regular, 1);
+	}
+	return ret;
+}
+
+static void pages_print_stats()
+{
+	printf("Arena mappings:\n");
+	printf("  Regular pages: %llu Huge pages: %llu THP: %llu\n",
+	       pages_nr_regular, pages_nr_hugetlb, pages_nr_thp);
+}
+
+#endif /* _PAGES_H_ */
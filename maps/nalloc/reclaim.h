@@ -0,0 +1,37 @@
+#ifndef _RECLAIM_H_
+#define _RECLAIM_H_
+
+/**
+ * Selects the memory reclamation scheme of the node allocators.
+ * Epoch-based reclamation is the default; hazard pointers are used when
+ * compiling with -DNALLOC_HAZARD_POINTERS and require map support.
+ * reclaim_thread_exit() returns the record of the thread, which is kept with
+ * the heap of the thread and given to reclaim_thread_init() of its next owner
+ * (see heap.h).
+ **/
+
+#if defined(NALLOC_HAZARD_POINTERS)
+#	include "hp.h"
+#	define reclaim_thread_init(tid, t)  hp_thread_init(tid, t)
+#	define reclaim_thread_exit()        hp_thread_exit()
+#	define reclaim_retire(nalloc, node) hp_retire(nalloc, node)
+#	define reclaim_op_begin()           hp_op_begin()
+#	define reclaim_op_end()             hp_op_end()
+#	define reclaim_protect(slot, node)  hp_protect(slot, node)
+#	define reclaim_pin()                hp_pin()
+#	define reclaim_unpin(pin)           hp_unpin(pin)
+#	define reclaim_print_stats()        hp_print_stats()
+#else
+#	include "ebr.h"
+#	define reclaim_thread_init(tid, t)  ebr_thread_init(tid, t)
+#	define reclaim_thread_exit()        ebr_thread_exit()
+#	define reclaim_retire(nalloc, node) ebr_retire(nalloc, node)
+#	define reclaim_op_begin()           ebr_op_begin()
+#	define reclaim_op_end()             ebr_op_end()
+#	define reclaim_protect(slot, node)  do { } while (0)
+#	define reclaim_pin()                ebr_pin()
+#	define reclaim_unpin(pin)           ebr_unpin(pin)
+#	define reclaim_print_stats()        ebr_print_stats()
+#endif
+
+#endif /* _RECLAIM_H_ */
@@ -0,0 +1,36 @@
+#ifndef _MAP_NAV_H_
+#define _MAP_NAV_H_
+
+/**
+ * Ordered navigation (map_min(), map_max(), map_successor() and
+ * map_predecessor() in map.h). Every map answers the four queries with a
+ * single helper that gets one of the following operations: the forward ones
+ * look for the smallest key of the map (that is larger than `key`), the
+ * backward ones for the largest key (that is smaller than `key`).
+ **/
+
+#include "key/key.h"
+
+typedef enum {
+	MAP_NAV_MIN,
+	MAP_NAV_SUCC,
+	MAP_NAV_MAX,
+	MAP_NAV_PRED
+} map_nav_t;
+
+#define MAP_NAV_IS_FORWARD(op) ((op) == MAP_NAV_MIN || (op) == MAP_NAV_SUCC)
+
+//> Whether key `k` may be the answer of `op` for `key`.
+#define MAP_NAV_KEY_OK(op, k, key) \
+	((op) == MAP_NAV_SUCC ? KEY_CMP((k), (key)) > 0 : \
+	 (op) == MAP_NAV_PRED ? KEY_CMP((k), (key)) < 0 : 1)
+
+static inline int map_nav_found(map_key_t k, void *value,
+                                map_key_t *key_out, void **value_out)
+{
+	KEY_COPY(*key_out, k);
+	if (value_out) *value_out = value;
+	return 1;
+}
+
+#endif /* _MAP_NAV_H_ */
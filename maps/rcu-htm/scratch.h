@@ -0,0 +1,89 @@
+#ifndef _RCU_HTM_SCRATCH_H_
+#define _RCU_HTM_SCRATCH_H_
+
+/**
+ * Per-thread scratch pool for the node copies of RCU-HTM updates.
+ *
+ * An update copies the nodes it modifies and installs the copies in a
+ * transaction. When validation fails the update starts from scratch; the
+ * copies of the failed attempt were never visible to other threads, so they
+ * are handed to the next attempts of the same thread right away, instead of
+ * being leaked or going through memory reclamation.
+ *
+ * Copies are allocated with rcu_copy_alloc(). Every update calls
+ * rcu_copies_begin() once, to forget the copies of the previous update that
+ * are now part of the tree, and rcu_copies_discard() at the beginning of
+ * every attempt, to move the copies of the previous (failed) attempt to the
+ * pool. A single copy that is not needed any more is returned to the pool
+ * with rcu_copy_discard().
+ **/
+
+#include <string.h>
+#include "../map.h"
+
+#define RCU_SCRATCH_MAX_COPIES 128
+
+static __thread void *rcu_scratch_pool; //> Free list through the first word.
+static __thread void *rcu_attempt_copies[RCU_SCRATCH_MAX_COPIES];
+static __thread int rcu_attempt_nr_copies;
+//> Points to the statistics of the thread (see tdata_new()).
+static __thread long long unsigned *rcu_scratch_nr_reused;
+
+static inline void *rcu_copy_alloc(void *nalloc, size_t sz)
+{
+	void *ret;
+
+	if (rcu_scratch_pool) {
+		ret = rcu_scratch_pool;
+		rcu_scratch_pool = *(void **)ret;
+		memset(ret, 0, sz);
+		if (rcu_scratch_nr_reused) (*rcu_scratch_nr_reused)++;
+	} else {
+		ret = nalloc_alloc_node(nalloc);
+	}
+	//> Copies that do not fit are not reused.
+	if (rcu_attempt_nr_copies < RCU_SCRATCH_MAX_COPIES)
+		rcu_attempt_copies[rcu_attempt_nr_copies++] = ret;
+	return ret;
+}
+
+static inline void rcu_copy_discard(void *copy)
+{
+	int i;
+	for (i=rcu_attempt_nr_copies-1; i >= 0; i--) {
+		if (rcu_attempt_copies[i] != copy) continue;
+		rcu_attempt_copies[i] = rcu_attempt_copies[--rcu_attempt_nr_copies];
+		break;
+	}
+	*(void **)copy = rcu_scratch_pool;
+	rcu_scratch_pool = copy;
+}
+
+static inline void rcu_copies_discard()
+{
+	int i;
+	for (i=0; i < rcu_attempt_nr_copies; i++) {
+		*(void **)rcu_attempt_copies[i] = rcu_scratch_pool;
+		rcu_scratch_pool = rcu_attempt_copies[i];
+	}
+	rcu_attempt_nr_copies = 0;
+}
+
+static inline void rcu_copies_begin()
+{
+	rcu_attempt_nr_copies = 0;
+}
+
+//> Gives the nodes of the pool back to the allocator when the thread is done
+//> with the map (see map_tdata_free()); none of them is in the tree.
+static inline void rcu_scratch_free(void *nalloc)
+{
+	void *next;
+	for (; rcu_scratch_pool; rcu_scratch_pool = next) {
+		next = *(void **)rcu_scratch_pool;
+		nalloc_free_node_now(nalloc, rcu_scratch_pool);
+	}
+	rcu_attempt_nr_copies = 0;
+}
+
+#endif /* _RCU_HTM_SCRATCH_H_ */
@@ -1,10 +1,13 @@
 #ifndef _RCU_HTM_TDATA_H_
 #define _RCU_HTM_TDATA_H_
 
+#include "scratch.h"
+
 typedef struct {
 	int tid;
 	long long unsigned tx_starts, tx_aborts, 
 	                   tx_aborts_explicit_validation, lacqs;
+	long long unsigned copies_reused;
 	ht_t *ht;
 } tdata_t;
 
@@ -17,14 +20,26 @@ static inline tdata_t *tdata_new(int tid)
 	ret->tx_aborts = 0;
 	ret->tx_aborts_explicit_validation = 0;
 	ret->lacqs = 0;
+	ret->copies_reused = 0;
 	ret->ht = ht_new();
+	rcu_scratch_nr_reused = &ret->copies_reused;
 	return ret;
 }
 
+static inline void tdata_free(tdata_t *tdata)
+{
+	if (!tdata) return;
+	if (rcu_scratch_nr_reused == &tdata->copies_reused)
+		rcu_scratch_nr_reused = NULL;
+	free(tdata->ht);
+	free(tdata);
+}
+
 static inline void tdata_print(tdata_t *tdata)
 {
-	printf("TID %3d: %llu %llu %llu ( %llu )\n", tdata->tid, tdata->tx_starts,
-	      tdata->tx_aborts, tdata->tx_aborts_explicit_validation, tdata->lacqs);
+	printf("TID %3d: %llu %llu %llu ( %llu ) %llu\n", tdata->tid, tdata->tx_starts,
+	      tdata->tx_aborts, tdata->tx_aborts_explicit_validation, tdata->lacqs,
+	      tdata->copies_reused);
 }
 
 static inline void tdata_add(tdata_t *d1, tdata_t *d2, tdata_t *dst)
@@ -34,6 +49,7 @@ static inline void tdata_add(tdata_t *d1, tdata_t *d2, tdata_t *dst)
 	dst->tx_aborts_explicit_validation = d1->tx_aborts_explicit_validation +
 	                                     d2->tx_aborts_explicit_validation;
 	dst->lacqs = d1->lacqs + d2->lacqs;
+	dst->copies_reused = d1->copies_reused + d2->copies_reused;
 }
 
 #endif /* _RCU_HTM_TDATA_H_ */
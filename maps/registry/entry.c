@@ -0,0 +1,44 @@
+/**
+ * Registers the map of MAP_SOURCE with the id MAP_REGISTRY_ID
+ * (see registry.h). Compiled once per map with the flags of its x.* target.
+ **/
+
+#include MAP_SOURCE
+#include "registry.h"
+
+static const map_ops_t map_ops = {
+	MAP_REGISTRY_ID,
+
+	map_new,
+	map_name,
+	map_validate,
+	map_bulk_load,
+	map_destroy,
+
+	map_tdata_new,
+	map_tdata_print,
+	map_tdata_add,
+	map_tdata_free,
+
+	map_lookup,
+	map_get,
+	map_lookup_batch,
+	map_insert,
+	map_delete,
+	map_delete_range,
+	map_update,
+	map_rquery,
+	map_compute,
+
+	map_min,
+	map_max,
+	map_successor,
+	map_predecessor,
+
+	map_size,
+	map_snapshot,
+	map_snapshot_release
+};
+
+static const map_ops_t *map_ops_entry
+	__attribute__((section("map_registry"), used)) = &map_ops;
@@ -0,0 +1,168 @@
+#include <string.h>
+#include "../../lib/log.h"
+#include "registry.h"
+
+//> The linker collects the entries of all the maps in the section.
+extern const map_ops_t *__start_map_registry[];
+extern const map_ops_t *__stop_map_registry[];
+
+static const map_ops_t *map_ops;
+
+const map_ops_t *map_registry_find(char *id)
+{
+	const map_ops_t **ops;
+
+	for (ops = __start_map_registry; ops < __stop_map_registry; ops++)
+		if (!strcmp((*ops)->id, id)) return *ops;
+	return NULL;
+}
+
+void map_registry_print()
+{
+	const map_ops_t **ops;
+
+	for (ops = __start_map_registry; ops < __stop_map_registry; ops++)
+		log_info("    %s\n", (*ops)->id);
+}
+
+int map_registry_select(char *id)
+{
+	const map_ops_t *ops = map_registry_find(id);
+	if (ops == NULL) return 0;
+	map_ops = ops;
+	return 1;
+}
+
+/******************************************************************************/
+/* MAP interface on top of the selected implementation                        */
+/******************************************************************************/
+void *map_new()
+{
+	return map_ops->new();
+}
+
+char *map_name()
+{
+	return map_ops->name();
+}
+
+int map_validate(void *map)
+{
+	return map_ops->validate(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	return map_ops->bulk_load(map, tdata, keys, values, n);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	map_ops->destroy(map, nthreads);
+}
+
+void *map_tdata_new(int tid)
+{
+	return map_ops->tdata_new(tid);
+}
+
+void map_tdata_print(void *tdata)
+{
+	map_ops->tdata_print(tdata);
+}
+
+void map_tdata_add(void *d1, void *d2, void *dst)
+{
+	map_ops->tdata_add(d1, d2, dst);
+}
+
+void map_tdata_free(void *tdata)
+{
+	map_ops->tdata_free(tdata);
+}
+
+int map_lookup(void *map, void *tdata, map_key_t key)
+{
+	return map_ops->lookup(map, tdata, key);
+}
+
+int map_get(void *map, void *tdata, map_key_t key, void **value_out)
+{
+	return map_ops->get(map, tdata, key, value_out);
+}
+
+int map_lookup_batch(void *map, void *tdata, map_key_t *keys, int n,
+                     int *results)
+{
+	return map_ops->lookup_batch(map, tdata, keys, n, results);
+}
+
+int map_insert(void *map, void *tdata, map_key_t key, void *value)
+{
+	return map_ops->insert(map, tdata, key, value);
+}
+
+int map_delete(void *map, void *tdata, map_key_t key)
+{
+	return map_ops->delete(map, tdata, key);
+}
+
+int map_delete_range(void *map, void *tdata, map_key_t key1, map_key_t key2)
+{
+	return map_ops->delete_range(map, tdata, key1, key2);
+}
+
+int map_update(void *map, void *tdata, map_key_t key, void *value)
+{
+	return map_ops->update(map, tdata, key, value);
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	return map_ops->rquery(map, tdata, key1, key2, visit, arg);
+}
+
+int map_compute(void *map, void *tdata, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	return map_ops->compute(map, tdata, key, fn, arg);
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_ops->min(map, tdata, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_ops->max(map, tdata, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_ops->successor(map, tdata, key, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_ops->predecessor(map, tdata, key, key_out, value_out);
+}
+
+long long map_size(void *map, void *tdata, int exact)
+{
+	return map_ops->size(map, tdata, exact);
+}
+
+void *map_snapshot(void *map, void *tdata)
+{
+	return map_ops->snapshot(map, tdata);
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+	map_ops->snapshot_release(snapshot, tdata);
+}
@@ -0,0 +1,72 @@
+#ifndef _MAP_REGISTRY_H_
+#define _MAP_REGISTRY_H_
+
+/**
+ * Registry of map implementations, for binaries that host all of them.
+ *
+ * Every x.* target links a single map through the map_*() functions of
+ * map.h. The registry build (x.all in the Makefile) compiles every map on
+ * its own through entry.c, which adds a map_ops_t with the map's functions to
+ * the "map_registry" section, and then makes all the symbols of the object
+ * local, so the maps do not clash. Their per-thread state (e.g., `nalloc`) is
+ * static, so each map has its own and several maps, of different
+ * implementations, can be used at the same time through their map_ops_t.
+ *
+ * registry.c also implements the map_*() functions of map.h on top of the
+ * implementation chosen with map_registry_select(), so the benchmarks run
+ * unchanged. All the maps share the node allocator and its reclamation
+ * scheme; the hazard pointer variants are not in the registry.
+ **/
+
+#include "../map.h"
+
+typedef struct {
+	//> The suffix of the x.* target of the map, e.g., "btree.rcu_htm".
+	char *id;
+
+	void *(*new)();
+	char *(*name)();
+	int   (*validate)(void *map);
+	long long (*bulk_load)(void *map, void *tdata, map_key_t *keys,
+	                       void **values, long long n);
+	void  (*destroy)(void *map, int nthreads);
+
+	void *(*tdata_new)(int tid);
+	void  (*tdata_print)(void *tdata);
+	void  (*tdata_add)(void *tdata1, void *tdata2, void *tdata_dst);
+	void  (*tdata_free)(void *tdata);
+
+	int (*lookup)(void *map, void *tdata, map_key_t key);
+	int (*get)(void *map, void *tdata, map_key_t key, void **value_out);
+	int (*lookup_batch)(void *map, void *tdata, map_key_t *keys, int n,
+	                    int *results);
+	int (*insert)(void *map, void *tdata, map_key_t key, void *value);
+	int (*delete)(void *map, void *tdata, map_key_t key);
+	int (*delete_range)(void *map, void *tdata, map_key_t key1, map_key_t key2);
+	int (*update)(void *map, void *tdata, map_key_t key, void *value);
+	int (*rquery)(void *map, void *tdata, map_key_t key1, map_key_t key2,
+	              map_visit_t visit, void *arg);
+	int (*compute)(void *map, void *tdata, map_key_t key, map_compute_t fn,
+	               void *arg);
+
+	int (*min)(void *map, void *tdata, map_key_t *key_out, void **value_out);
+	int (*max)(void *map, void *tdata, map_key_t *key_out, void **value_out);
+	int (*successor)(void *map, void *tdata, map_key_t key,
+	                 map_key_t *key_out, void **value_out);
+	int (*predecessor)(void *map, void *tdata, map_key_t key,
+	                   map_key_t *key_out, void **value_out);
+
+	long long (*size)(void *map, void *tdata, int exact);
+	void *(*snapshot)(void *map, void *tdata);
+	void  (*snapshot_release)(void *snapshot, void *tdata);
+} map_ops_t;
+
+//> Returns the implementation with the given id, or NULL.
+const map_ops_t *map_registry_find(char *id);
+//> Prints the ids of all the implementations.
+void map_registry_print();
+//> Makes the map_*() functions call the implementation with the given id.
+//> Returns 0 if there is no such implementation.
+int map_registry_select(char *id);
+
+#endif /* _MAP_REGISTRY_H_ */
@@ -0,0 +1,140 @@
+#ifndef _MAP_SIZE_H_
+#define _MAP_SIZE_H_
+
+/**
+ * Number of keys in the map, kept in per-thread counters.
+ *
+ * Every thread counts its successful inserts and deletes in its own
+ * counters, which are padded to a cache line, so updates never write to a
+ * shared location. map_size() sums the counters of all the threads, which
+ * costs O(number of threads) instead of a traversal of the map.
+ *
+ * The counters of a thread are updated after its operation has taken effect,
+ * so the sum may miss the updates that are running. With `exact`, the sum is
+ * repeated until two consecutive ones read the same counters; both counters
+ * of a thread only grow, so no update finished in between and, when no update
+ * is running, the result is the exact size of the map.
+ *
+ * The counters belong to the map: map_new() creates them with
+ * map_size_new() and map_destroy() frees them with map_size_free(), so every
+ * map of the same implementation in the process has its own. A thread finds
+ * its counters of a map through a small per-thread cache, indexed by the id
+ * of the map, and otherwise by searching the list of the map.
+ **/
+
+#include <string.h>
+#include "alloc.h"
+#include "arch.h"
+
+#define MAP_SIZE_EXACT_RETRIES 64
+#define MAP_SIZE_CACHE_LEN 8
+
+typedef struct map_size_thread_s {
+	volatile unsigned long long inserted, deleted;
+	char pad[CACHE_LINE_SIZE - 2 * sizeof(unsigned long long)];
+
+	void *owner;
+	struct map_size_thread_s *next;
+} map_size_thread_t;
+
+typedef struct {
+	map_size_thread_t * volatile threads;
+	unsigned long long id; //> Unique in the process, never 0.
+} map_size_t;
+
+static unsigned long long map_size_last_id;
+//> Its address identifies the thread among the running ones; a thread that
+//> gets the address of an exited one takes over its counters.
+static __thread char map_size_owner;
+static __thread struct {
+	unsigned long long id;
+	map_size_thread_t *t;
+} map_size_cache[MAP_SIZE_CACHE_LEN];
+
+static map_size_t *map_size_new()
+{
+	map_size_t *s;
+
+	XMALLOC(s, 1);
+	s->threads = NULL;
+	s->id = __sync_add_and_fetch(&map_size_last_id, 1);
+	return s;
+}
+
+//> No thread may use the counters any more.
+static void map_size_free(map_size_t *s)
+{
+	map_size_thread_t *t, *next;
+
+	for (t = s->threads; t; t = next) {
+		next = t->next;
+		free(t);
+	}
+	free(s);
+}
+
+static map_size_thread_t *map_size_thread_self(map_size_t *s)
+{
+	map_size_thread_t *t;
+	int c = s->id % MAP_SIZE_CACHE_LEN;
+
+	if (map_size_cache[c].id == s->id) return map_size_cache[c].t;
+
+	for (t = s->threads; t; t = t->next)
+		if (t->owner == &map_size_owner) break;
+	if (!t) {
+		XMALLOC(t, 1);
+		memset(t, 0, sizeof(*t));
+		t->owner = &map_size_owner;
+		do {
+			t->next = s->threads;
+		} while (!__sync_bool_compare_and_swap(&s->threads, t->next, t));
+	}
+	map_size_cache[c].id = s->id;
+	map_size_cache[c].t = t;
+	return t;
+}
+
+//> Only the owner writes its counters.
+static inline void map_size_add(map_size_t *s, long long d)
+{
+	map_size_thread_t *me = map_size_thread_self(s);
+	if (d > 0) me->inserted += d;
+	else       me->deleted -= d;
+}
+
+//> map_update() returns 1 for a successful insert and 3 for a successful delete.
+static inline void map_size_updated(map_size_t *s, int ret)
+{
+	if (ret == 1)      map_size_add(s, 1);
+	else if (ret == 3) map_size_add(s, -1);
+}
+
+static void map_size_collect(map_size_t *s, unsigned long long *ins,
+                             unsigned long long *del)
+{
+	map_size_thread_t *t;
+
+	*ins = *del = 0;
+	for (t = s->threads; t; t = t->next) {
+		*ins += t->inserted;
+		*del += t->deleted;
+	}
+}
+
+static long long map_size_sum(map_size_t *s, int exact)
+{
+	unsigned long long ins, del, ins2, del2;
+	int retries = 0;
+
+	map_size_collect(s, &ins, &del);
+	while (exact && retries++ < MAP_SIZE_EXACT_RETRIES) {
+		map_size_collect(s, &ins2, &del2);
+		if (ins2 == ins && del2 == del) break;
+		ins = ins2;
+		del = del2;
+	}
+	return (long long)(ins - del);
+}
+
+#endif /* _MAP_SIZE_H_ */
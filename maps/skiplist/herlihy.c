@@ -6,12 +6,17 @@
  * The implementation is heavily based on the implementation provided by ASCYLIB:
  *   https://github.com/LPD-EPFL/ASCYLIB
  *
+ * Range queries walk level 0 and are not atomic, unless compiled with
+ * -DSL_RQUERY_SNAPSHOT, in which case they lock all the nodes of the range.
  **/
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #include "../key/key.h"
+#include "../size.h"
+#include "../delete_range.h"
 
 #define SL_HERLIHY
 #define LOCK_PER_NODE
@@ -20,6 +25,8 @@
 #include "sl_random.h"
 #include "sl_validate.h"
 #include "sl_thread_data.h"
+#include "sl_batch.h"
+#include "sl_nav.h"
 
 static inline int find_node(sl_t *sl, map_key_t key, sl_node_t *preds[],
                                                      sl_node_t *succs[])
@@ -67,10 +74,14 @@ static inline sl_node_t *find_node_left(sl_t *sl, map_key_t key)
 	return nd;
 }
 
-static int _sl_lookup(sl_t *sl, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+static int _sl_lookup(sl_t *sl, map_key_t key, void **value)
 {
 	sl_node_t *node = find_node_left(sl, key);
-	if (node && !node->marked && node->fully_linked) return 1;
+	if (node && !node->marked && node->fully_linked) {
+		if (value) *value = node->value;
+		return 1;
+	}
 	return 0;
 }
 
@@ -149,6 +160,41 @@ static int _sl_insert(sl_t *sl, map_key_t key, void *value, sl_node_t **new_node
 	return -1;
 }
 
+/**
+ * The value of a node is replaced while holding the lock of the node, which
+ * is also taken by the delete that marks it. When the key is not found, the
+ * new node is inserted as in _sl_insert(), which starts over if the key has
+ * been inserted in the meantime.
+ **/
+static int _sl_compute(sl_t *sl, map_key_t key, map_compute_t fn, void *arg,
+                       sl_node_t **new_node, sl_thread_data_t *tdata)
+{
+	sl_node_t *succs[MAX_LEVEL], *preds[MAX_LEVEL];
+	sl_node_t *node_found;
+	int found;
+
+	while (1) {
+		found = find_node(sl, key, preds, succs);
+		if (found != -1) {
+			node_found = succs[found];
+			while (!node_found->marked && !node_found->fully_linked)
+				;
+			LOCK_NODE(node_found);
+			if (node_found->marked) {
+				UNLOCK_NODE(node_found);
+				continue;
+			}
+			node_found->value = fn(key, node_found->value, 1, arg);
+			UNLOCK_NODE(node_found);
+			return 1;
+		}
+
+		new_node[0]->value = fn(key, NULL, 0, arg);
+		if (_sl_insert(sl, key, new_node[0]->value, new_node, tdata))
+			return 0;
+	}
+}
+
 static inline int ok_to_delete(sl_node_t *node, int found)
 {
 	return (node->fully_linked && (node->toplevel - 1 == found) && !node->marked);
@@ -217,16 +263,122 @@ static int _sl_delete(sl_t *sl, map_key_t key, sl_node_t **node_to_delete)
 	return -1;
 }
 
+//> Returns the last node of level 0 with key smaller than `key`.
+static sl_node_t *_sl_find_pred0(sl_t *sl, map_key_t key)
+{
+	int i;
+	sl_node_t *pred = sl->head, *curr;
+
+	for (i=MAX_LEVEL-1; i >= 0; i--) {
+		curr = pred->next[i];
+		while (KEY_CMP(curr->key, key) < 0) {
+			pred = curr;
+			curr = pred->next[i];
+		}
+	}
+	return pred;
+}
+
+#if defined(SL_RQUERY_SNAPSHOT)
+//> Grows on demand, a range query may lock any number of nodes.
+static __thread sl_node_t **rquery_nodes;
+static __thread int rquery_nodes_sz;
+
+static void _rquery_nodes_grow()
+{
+	rquery_nodes_sz = rquery_nodes_sz ? 2 * rquery_nodes_sz : 128;
+	rquery_nodes = realloc(rquery_nodes, rquery_nodes_sz * sizeof(*rquery_nodes));
+	if (!rquery_nodes) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+}
+
+/**
+ * Locks the level-0 predecessor of key1 and all the level-0 nodes up to key2.
+ * An insert in the range needs the lock of its level-0 predecessor and a
+ * delete the lock of the deleted node, so the keys of the range cannot
+ * change until the nodes are unlocked.
+ * Updates lock their nodes right to left, so we only trylock (left to right)
+ * and on failure unlock everything and return -1.
+ * Returns the number of locked nodes.
+ **/
+static int _rquery_lock_nodes(sl_t *sl, map_key_t key1, map_key_t key2)
+{
+	sl_node_t *curr = _sl_find_pred0(sl, key1);
+	int nnodes = 0, i;
+
+	while (1) {
+		if (nnodes == rquery_nodes_sz) _rquery_nodes_grow();
+		if (pthread_spin_trylock(&curr->lock)) goto out_with_error;
+		rquery_nodes[nnodes++] = curr;
+		//> Unlinked after we reached it.
+		if (curr->marked) goto out_with_error;
+		curr = curr->next[0];
+		if (curr->next[0] == NULL || KEY_CMP(curr->key, key2) > 0) break;
+	}
+	return nnodes;
+
+out_with_error:
+	for (i=0; i < nnodes; i++)
+		UNLOCK_NODE(rquery_nodes[i]);
+	return -1;
+}
+
+static void _sl_rquery(sl_t *sl, map_key_t key1, map_key_t key2,
+                       map_visit_t visit, void *arg)
+{
+	sl_node_t *n;
+	int nnodes, i;
+
+	do {
+		nnodes = _rquery_lock_nodes(sl, key1, key2);
+	} while (nnodes == -1);
+
+	for (i=0; i < nnodes; i++) {
+		n = rquery_nodes[i];
+		if (KEY_CMP(n->key, key1) < 0) continue;
+		if (visit(n->key, n->value, arg)) break;
+	}
+
+	for (i=0; i < nnodes; i++)
+		UNLOCK_NODE(rquery_nodes[i]);
+}
+#else
+/**
+ * Walks level 0 and visits the nodes that are fully linked and not marked.
+ * Every visited key is in the map at some point during the scan, but the
+ * scan is not atomic (see SL_RQUERY_SNAPSHOT).
+ **/
+static void _sl_rquery(sl_t *sl, map_key_t key1, map_key_t key2,
+                       map_visit_t visit, void *arg)
+{
+	sl_node_t *curr = _sl_find_pred0(sl, key1)->next[0];
+
+	while (curr->next[0] != NULL && KEY_CMP(curr->key, key2) <= 0) {
+		if (KEY_CMP(curr->key, key1) >= 0 && curr->fully_linked && !curr->marked)
+			if (visit(curr->key, curr->value, arg)) return;
+		curr = curr->next[0];
+	}
+}
+#endif
+
 /******************************************************************************/
 /*         Map interface implementation                                       */
 /******************************************************************************/
 void *map_new()
 {
-	return _sl_new();
+	sl_t *sl;
+
+	nalloc = nalloc_thread_init(-1, sizeof(sl_node_t));
+	sl = _sl_new();
+	sl->size = map_size_new();
+	return sl;
 }
 
 void *map_tdata_new(int tid)
 {
+	nalloc = nalloc_thread_init(tid, sizeof(sl_node_t));
 	return sl_thread_data_new(tid);
 }
 
@@ -240,33 +392,138 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	sl_thread_data_add(d1, d2, dst);
 }
 
+void map_tdata_free(void *thread_data)
+{
+#	if defined(SL_RQUERY_SNAPSHOT)
+	free(rquery_nodes);
+	rquery_nodes = NULL;
+	rquery_nodes_sz = 0;
+#	endif
+	sl_thread_data_free(thread_data);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	map_size_free(((sl_t *)map)->size);
+	_sl_destroy(map, nthreads);
+}
+
+long long map_bulk_load(void *sl, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	_sl_bulk_load(sl, keys, values, n);
+	map_size_add(((sl_t *)sl)->size, n);
+	return n;
+}
+
 int map_lookup(void *sl, void *thread_data, map_key_t key)
+{
+	return map_get(sl, thread_data, key, NULL);
+}
+
+int map_get(void *sl, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
 	sl_thread_data_t *tdata = thread_data;
 
-	ret = _sl_lookup(sl, key);
+	nalloc_op_begin();
+	ret = _sl_lookup(sl, key, value_out);
+	nalloc_op_end();
 
 	return ret;
 }
 
-int map_rquery(void *sl, void *thread_data, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *sl, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	return 0;
+	int i, group, found = 0;
+
+	for (i=0; i < n; i += SL_BATCH_WIDTH) {
+		group = (n - i < SL_BATCH_WIDTH) ? n - i : SL_BATCH_WIDTH;
+		nalloc_op_begin();
+		found += _sl_lookup_batch(sl, &keys[i], group, &results[i]);
+		nalloc_op_end();
+	}
+	return found;
+}
+
+int map_rquery(void *sl, void *thread_data, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	nalloc_op_begin();
+	_sl_rquery(sl, key1, key2, visit, arg);
+	nalloc_op_end();
+	return 1;
+}
+
+static int map_nav(void *sl, void *thread_data, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	int ret;
+	nalloc_op_begin();
+	ret = _sl_nav(sl, key, op, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *sl, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(sl, thread_data, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *sl, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(sl, thread_data, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *sl, void *thread_data, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(sl, thread_data, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *sl, void *thread_data, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(sl, thread_data, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *sl, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 	sl_node_t *new_node[1];
-	new_node[0] = _sl_node_new(key, value);
 	sl_thread_data_t *tdata = thread_data;
 
+	nalloc_op_begin();
+	new_node[0] = _sl_node_new(key, value);
+
 	ret = _sl_insert(sl, key, value, new_node, thread_data);
 
 	if (!ret)
 		_sl_node_free(new_node[0]);
+	nalloc_op_end();
 
+	if (ret) map_size_add(((sl_t *)sl)->size, 1);
+	return ret;
+}
+
+int map_compute(void *sl, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	sl_node_t *new_node[1];
+	sl_thread_data_t *tdata = thread_data;
+
+	nalloc_op_begin();
+	new_node[0] = _sl_node_new(key, NULL);
+
+	ret = _sl_compute(sl, key, fn, arg, new_node, thread_data);
+
+	if (ret)
+		_sl_node_free(new_node[0]);
+	nalloc_op_end();
+
+	if (!ret) map_size_add(((sl_t *)sl)->size, 1);
 	return ret;
 }
 
@@ -276,16 +533,43 @@ int map_delete(void *sl, void *thread_data, map_key_t key)
 	sl_node_t *node_to_delete[1] = { NULL };
 	sl_thread_data_t *tdata = thread_data;
 
+	nalloc_op_begin();
 	ret = _sl_delete(sl, key, node_to_delete);
 
+	if (ret)
+		_sl_node_free(node_to_delete[0]);
+	nalloc_op_end();
+
+	if (ret) map_size_add(((sl_t *)sl)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *sl, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	return map_delete_range_each(sl, thread_data, key1, key2);
+}
+
 int map_update(void *sl, void *thread_data, map_key_t key, void *value)
 {
 	return 0;
 }
 
+long long map_size(void *sl, void *thread_data, int exact)
+{
+	return map_size_sum(((sl_t *)sl)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *sl)
 {
 	int ret;
@@ -293,7 +577,7 @@ int map_validate(void *sl)
 	return ret;
 }
 
-void *map_name()
+char *map_name()
 {
 	return "skip_list_herlihy";
 }
@@ -13,13 +13,17 @@
 #endif
 
 #include "../key/key.h"
+#include "../size.h"
 
 #include "sl_random.h"
 #include "sl_types.h"
 #include "sl_validate.h"
 #include "sl_thread_data.h"
+#include "sl_batch.h"
+#include "sl_nav.h"
 
-static int _sl_lookup(sl_t *sl, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+static int _sl_lookup(sl_t *sl, map_key_t key, void **value)
 {
 	int i;
 	sl_node_t *curr = sl->head;
@@ -28,23 +32,27 @@ static int _sl_lookup(sl_t *sl, map_key_t key)
 		while (KEY_CMP(curr->next[i]->key, key) < 0)
 			curr = curr->next[i];
 
-	return (KEY_CMP(key, curr->next[0]->key) == 0);
+	curr = curr->next[0];
+	if (KEY_CMP(key, curr->key) != 0) return 0;
+	if (value) *value = curr->value;
+	return 1;
 }
 
-static __thread map_key_t rquery_result[10000];
-
-int _sl_rquery(sl_t *sl, map_key_t key1, map_key_t key2)
+//> Returns 0 if `visit` stopped the range query, 1 otherwise.
+int _sl_rquery(sl_t *sl, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
 {
-	int i, nkeys = 0;
+	int i;
 	sl_node_t *curr = sl->head;
 
 	for (i = MAX_LEVEL - 1; i >= 0; i--)
-		while (KEY_CMP(curr->next[i]->key, key1))
+		while (KEY_CMP(curr->next[i]->key, key1) < 0)
 			curr = curr->next[i];
 
+	//> The tail sentinel is the only node without a successor.
 	curr = curr->next[0];
-	while (KEY_CMP(curr->key, key2) <= 0) {
-		KEY_COPY(rquery_result[nkeys++], curr->key);
+	while (curr->next[0] != NULL && KEY_CMP(curr->key, key2) <= 0) {
+		if (visit(curr->key, curr->value, arg)) return 0;
 		curr = curr->next[0];
 	}
 
@@ -88,6 +96,22 @@ static int _sl_insert(sl_t *sl, map_key_t key, void *value, sl_node_t **new_node
 	return 1;
 }
 
+static int _sl_compute(sl_t *sl, map_key_t key, map_compute_t fn, void *arg,
+                       sl_node_t **new_node, sl_thread_data_t *tdata)
+{
+	sl_node_t *curr, *currs_saved[MAX_LEVEL];
+
+	curr = _sl_traverse(sl, key, currs_saved);
+	if (KEY_CMP(key, curr->next[0]->key) == 0) {
+		curr = curr->next[0];
+		curr->value = fn(key, curr->value, 1, arg);
+		return 1;
+	}
+	new_node[0]->value = fn(key, NULL, 0, arg);
+	_do_insert(new_node[0], currs_saved, tdata);
+	return 0;
+}
+
 static void _do_delete(map_key_t key, sl_node_t *currs_saved[MAX_LEVEL])
 {
 	int i;
@@ -103,10 +127,33 @@ static int _sl_delete(sl_t *sl, map_key_t key, sl_node_t **node_to_delete)
 
 	curr = _sl_traverse(sl, key, currs_saved);
 	if (KEY_CMP(key, curr->next[0]->key) != 0) return 0;
+	node_to_delete[0] = curr->next[0];
 	_do_delete(key, currs_saved);
 	return 1;
 }
 
+//> Unlinks the nodes of [key1, key2] from every level and returns their number.
+//> They stay linked to each other on level 0, starting from `*first`.
+static int _sl_delete_range(sl_t *sl, map_key_t key1, map_key_t key2,
+                            sl_node_t **first)
+{
+	int i, deleted = 0;
+	sl_node_t *curr, *currs_saved[MAX_LEVEL];
+
+	_sl_traverse(sl, key1, currs_saved);
+	*first = currs_saved[0]->next[0];
+	for (i=0; i < MAX_LEVEL; i++) {
+		//> The tail sentinel is the only node without a successor.
+		curr = currs_saved[i]->next[i];
+		while (curr->next[0] != NULL && KEY_CMP(curr->key, key2) <= 0) {
+			curr = curr->next[i];
+			if (i == 0) deleted++;
+		}
+		currs_saved[i]->next[i] = curr;
+	}
+	return deleted;
+}
+
 static int _sl_update(sl_t *sl, map_key_t key, void *value, sl_node_t **new_node,
                       sl_node_t **node_to_delete, sl_thread_data_t *tdata)
 {
@@ -118,6 +165,7 @@ static int _sl_update(sl_t *sl, map_key_t key, void *value, sl_node_t **new_node
 		_do_insert(new_node[0], currs_saved, tdata);
 		return 1;
 	} else {
+		node_to_delete[0] = curr->next[0];
 		_do_delete(key, currs_saved);
 		return 3;
 	}
@@ -128,11 +176,17 @@ static int _sl_update(sl_t *sl, map_key_t key, void *value, sl_node_t **new_node
 /******************************************************************************/
 void *map_new()
 {
-	return _sl_new();
+	sl_t *sl;
+
+	nalloc = nalloc_thread_init(-1, sizeof(sl_node_t));
+	sl = _sl_new();
+	sl->size = map_size_new();
+	return sl;
 }
 
 void *map_tdata_new(int tid)
 {
+	nalloc = nalloc_thread_init(tid, sizeof(sl_node_t));
 	return sl_thread_data_new(tid);
 }
 
@@ -146,58 +200,163 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	sl_thread_data_add(d1, d2, dst);
 }
 
+void map_tdata_free(void *thread_data)
+{
+	sl_thread_data_free(thread_data);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	map_size_free(((sl_t *)map)->size);
+	_sl_destroy(map, nthreads);
+}
+
+long long map_bulk_load(void *sl, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	_sl_bulk_load(sl, keys, values, n);
+	map_size_add(((sl_t *)sl)->size, n);
+	return n;
+}
+
 int map_lookup(void *sl, void *thread_data, map_key_t key)
+{
+	return map_get(sl, thread_data, key, NULL);
+}
+
+int map_get(void *sl, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
 	sl_thread_data_t *tdata = thread_data;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((sl_t *)sl)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_start(TX_NUM_RETRIES, tdata->tx_data, &((sl_t *)sl)->lock);
 #	endif
 
-	ret = _sl_lookup(sl, key);
+	ret = _sl_lookup(sl, key, value_out);
 
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_unlock(&((sl_t *)sl)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_end(tdata->tx_data, &((sl_t *)sl)->lock);
 #	endif
+	nalloc_op_end();
 
 	return ret;
 }
 
-int map_rquery(void *sl, void *thread_data, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *sl, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	int ret = 0;
+	int i, group, found = 0;
 	sl_thread_data_t *tdata = thread_data;
 
+	//> The lock is held (or the transaction runs) for one group at a time.
+	for (i=0; i < n; i += SL_BATCH_WIDTH) {
+		group = (n - i < SL_BATCH_WIDTH) ? n - i : SL_BATCH_WIDTH;
+		nalloc_op_begin();
+#		if defined(SYNC_CG_SPINLOCK)
+		pthread_spin_lock(&((sl_t *)sl)->lock);
+#		elif defined(SYNC_CG_HTM)
+		tx_start(TX_NUM_RETRIES, tdata->tx_data, &((sl_t *)sl)->lock);
+#		endif
+
+		found += _sl_lookup_batch(sl, &keys[i], group, &results[i]);
+
+#		if defined(SYNC_CG_SPINLOCK)
+		pthread_spin_unlock(&((sl_t *)sl)->lock);
+#		elif defined(SYNC_CG_HTM)
+		tx_end(tdata->tx_data, &((sl_t *)sl)->lock);
+#		endif
+		nalloc_op_end();
+	}
+
+	return found;
+}
+
+int map_rquery(void *sl, void *thread_data, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	sl_thread_data_t *tdata = thread_data;
+
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((sl_t *)sl)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_start(TX_NUM_RETRIES, tdata->tx_data, &((sl_t *)sl)->lock);
 #	endif
 
-	ret = _sl_rquery(sl, key1, key2);
+	_sl_rquery(sl, key1, key2, visit, arg);
 
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_unlock(&((sl_t *)sl)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_end(tdata->tx_data, &((sl_t *)sl)->lock);
 #	endif
+	nalloc_op_end();
+
+	return 1;
+}
+
+static int map_nav(void *sl, void *thread_data, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	sl_thread_data_t *tdata = thread_data;
+	int ret;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((sl_t *)sl)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, tdata->tx_data, &((sl_t *)sl)->lock);
+#	endif
+
+	ret = _sl_nav(sl, key, op, key_out, value_out);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((sl_t *)sl)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(tdata->tx_data, &((sl_t *)sl)->lock);
+#	endif
+	nalloc_op_end();
 
 	return ret;
+}
 
+int map_min(void *sl, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(sl, thread_data, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *sl, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(sl, thread_data, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *sl, void *thread_data, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(sl, thread_data, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *sl, void *thread_data, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(sl, thread_data, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *sl, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 	sl_node_t *new_node[1];
-	new_node[0] = _sl_node_new(key, value);
 	sl_thread_data_t *tdata = thread_data;
 
+	nalloc_op_begin();
+	new_node[0] = _sl_node_new(key, value);
+
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((sl_t *)sl)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -214,7 +373,41 @@ int map_insert(void *sl, void *thread_data, map_key_t key, void *value)
 
 	if (!ret)
 		_sl_node_free(new_node[0]);
+	nalloc_op_end();
+
+	if (ret) map_size_add(((sl_t *)sl)->size, 1);
+	return ret;
+}
+
+int map_compute(void *sl, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	sl_node_t *new_node[1];
+	sl_thread_data_t *tdata = thread_data;
+
+	nalloc_op_begin();
+	new_node[0] = _sl_node_new(key, NULL);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((sl_t *)sl)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, tdata->tx_data, &((sl_t *)sl)->lock);
+#	endif
+
+	ret = _sl_compute(sl, key, fn, arg, new_node, thread_data);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((sl_t *)sl)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(tdata->tx_data, &((sl_t *)sl)->lock);
+#	endif
+
+	if (ret)
+		_sl_node_free(new_node[0]);
+	nalloc_op_end();
 
+	if (!ret) map_size_add(((sl_t *)sl)->size, 1);
 	return ret;
 }
 
@@ -224,6 +417,7 @@ int map_delete(void *sl, void *thread_data, map_key_t key)
 	sl_node_t *node_to_delete[1] = { NULL };
 	sl_thread_data_t *tdata = thread_data;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((sl_t *)sl)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -238,9 +432,46 @@ int map_delete(void *sl, void *thread_data, map_key_t key)
 	tx_end(tdata->tx_data, &((sl_t *)sl)->lock);
 #	endif
 
-//	if (ret)
-//		_ll_node_free(node_to_delete[0]);
+	if (ret)
+		_sl_node_free(node_to_delete[0]);
+	nalloc_op_end();
 
+	if (ret) map_size_add(((sl_t *)sl)->size, -1);
+	return ret;
+}
+
+int map_delete_range(void *sl, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	int ret = 0, i;
+	sl_node_t *first = NULL, *next;
+	sl_thread_data_t *tdata = thread_data;
+
+	if (KEY_CMP(key1, key2) > 0) return 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((sl_t *)sl)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, tdata->tx_data, &((sl_t *)sl)->lock);
+#	endif
+
+	ret = _sl_delete_range(sl, key1, key2, &first);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((sl_t *)sl)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(tdata->tx_data, &((sl_t *)sl)->lock);
+#	endif
+
+	for (i=0; i < ret; i++) {
+		next = first->next[0];
+		_sl_node_free(first);
+		first = next;
+	}
+	nalloc_op_end();
+
+	map_size_add(((sl_t *)sl)->size, -ret);
 	return ret;
 }
 
@@ -251,6 +482,7 @@ int map_update(void *sl, void *thread_data, map_key_t key, void *value)
 	sl_node_t *node_to_delete[1] = { NULL };
 	sl_thread_data_t *tdata = thread_data;
 
+	nalloc_op_begin();
 	new_node[0] = _sl_node_new(key, value);
 
 #	if defined(SYNC_CG_SPINLOCK)
@@ -267,13 +499,32 @@ int map_update(void *sl, void *thread_data, map_key_t key, void *value)
 	tx_end(tdata->tx_data, &((sl_t *)sl)->lock);
 #	endif
 
-//	if (!ret)
-//		_sl_node_free(new_node[0]);
+	if (ret == 3) {
+		_sl_node_free(new_node[0]);
+		_sl_node_free(node_to_delete[0]);
+	}
+	nalloc_op_end();
 
+	map_size_updated(((sl_t *)sl)->size, ret);
 	return ret;
 
 }
 
+long long map_size(void *sl, void *thread_data, int exact)
+{
+	return map_size_sum(((sl_t *)sl)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *sl)
 {
 	int ret;
@@ -281,7 +532,7 @@ int map_validate(void *sl)
 	return ret;
 }
 
-void *map_name()
+char *map_name()
 {
 #	if defined(SYNC_CG_SPINLOCK)
 	return "skiplist-cg-lock";
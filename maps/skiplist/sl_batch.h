@@ -0,0 +1,75 @@
+#ifndef _SL_BATCH_H_
+#define _SL_BATCH_H_
+
+/**
+ * Batched lookups for the skiplists.
+ *
+ * The traversals of up to SL_BATCH_WIDTH keys are interleaved, one hop at a
+ * time, in the style of asynchronous memory access chaining (AMAC): each
+ * traversal keeps its own state (pred, curr, level) and, after every hop,
+ * prefetches the node it will examine next and moves on to the next
+ * traversal. Thus, the cache misses of the traversals overlap instead of
+ * being paid one after the other.
+ *
+ * A traversal stops at the first level that contains the key, like the
+ * lookups of Pugh's and Herlihy's skiplists. In Herlihy's skiplist the node
+ * must also be fully linked and not marked.
+ **/
+
+#include "arch.h"
+#include "sl_types.h"
+
+#define SL_BATCH_WIDTH 8
+
+#ifdef SL_HERLIHY
+#	define SL_BATCH_NODE_PRESENT(node) (!(node)->marked && (node)->fully_linked)
+#else
+#	define SL_BATCH_NODE_PRESENT(node) 1
+#endif
+
+static inline void _sl_batch_prefetch(sl_node_t *node, int level)
+{
+	__builtin_prefetch(node, 0, 3);                //> key
+	__builtin_prefetch(&node->next[level], 0, 3);  //> next hop
+}
+
+//> Looks up `nkeys` <= SL_BATCH_WIDTH keys.
+static int _sl_lookup_batch(sl_t *sl, map_key_t *keys, int nkeys, int *results)
+{
+	sl_node_t *pred[SL_BATCH_WIDTH], *curr[SL_BATCH_WIDTH];
+	int level[SL_BATCH_WIDTH];
+	int i, cmp, active, found = 0;
+
+	for (i=0; i < nkeys; i++) {
+		pred[i] = sl->head;
+		level[i] = MAX_LEVEL - 1;
+		curr[i] = pred[i]->next[level[i]];
+		_sl_batch_prefetch(curr[i], level[i]);
+	}
+
+	do {
+		active = 0;
+		for (i=0; i < nkeys; i++) {
+			//> Finished traversal.
+			if (level[i] < 0) continue;
+
+			cmp = KEY_CMP(curr[i]->key, keys[i]);
+			if (cmp == 0 || (cmp > 0 && level[i] == 0)) {
+				results[i] = (cmp == 0 && SL_BATCH_NODE_PRESENT(curr[i]));
+				found += results[i];
+				level[i] = -1;
+				continue;
+			}
+
+			if (cmp < 0) pred[i] = curr[i]; //> Move right.
+			else         level[i]--;        //> Move down.
+			curr[i] = pred[i]->next[level[i]];
+			_sl_batch_prefetch(curr[i], level[i]);
+			active = 1;
+		}
+	} while (active);
+
+	return found;
+}
+
+#endif /* _SL_BATCH_H_ */
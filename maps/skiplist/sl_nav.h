@@ -0,0 +1,78 @@
+#ifndef _SL_NAV_H_
+#define _SL_NAV_H_
+
+/**
+ * Ordered navigation for the skiplists.
+ *
+ * Forward queries find the last node of level 0 that is not larger than
+ * `key` (the head for map_min()) and walk level 0 to the first node that is
+ * in the map and has a larger key. Backward queries find the last node of
+ * level 0 that is smaller than `key` (the last node before the tail for
+ * map_max()); if that node is being inserted or deleted they start over,
+ * since an insertion completes and a deleted node is unlinked shortly.
+ *
+ * A node is in the map if it is fully linked and not marked in Herlihy's
+ * skiplist, and if it has not been unlinked in Pugh's one, where an unlinked
+ * node points back to a smaller key at level 0.
+ **/
+
+#include "../nav.h"
+#include "sl_types.h"
+
+#if defined(SL_HERLIHY)
+#	define SL_NAV_NODE_PRESENT(node) (!(node)->marked && (node)->fully_linked)
+#elif defined(LOCK_PER_NODE)
+#	define SL_NAV_NODE_PRESENT(node) \
+		(KEY_CMP((node)->key, (node)->next[0]->key) < 0)
+#else
+#	define SL_NAV_NODE_PRESENT(node) 1
+#endif
+
+//> The tail sentinel is the only node without a successor.
+#define SL_NAV_IS_TAIL(node) ((node)->next[0] == NULL)
+
+//> Returns the last node of level 0 that comes before the answer of `op`.
+static sl_node_t *_sl_nav_find_pred0(sl_t *sl, map_key_t key, map_nav_t op)
+{
+	int i, cmp;
+	sl_node_t *pred = sl->head, *curr;
+
+	if (op == MAP_NAV_MIN) return pred;
+
+	for (i=MAX_LEVEL-1; i >= 0; i--) {
+		curr = pred->next[i];
+		while (!SL_NAV_IS_TAIL(curr)) {
+			cmp = KEY_CMP(curr->key, key);
+			if (op == MAP_NAV_SUCC && cmp > 0) break;
+			if (op == MAP_NAV_PRED && cmp >= 0) break;
+			pred = curr;
+			curr = pred->next[i];
+		}
+	}
+	return pred;
+}
+
+static int _sl_nav(sl_t *sl, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	sl_node_t *curr;
+
+	if (MAP_NAV_IS_FORWARD(op)) {
+		curr = _sl_nav_find_pred0(sl, key, op)->next[0];
+		while (!SL_NAV_IS_TAIL(curr)) {
+			if (MAP_NAV_KEY_OK(op, curr->key, key) && SL_NAV_NODE_PRESENT(curr))
+				return map_nav_found(curr->key, curr->value, key_out, value_out);
+			curr = curr->next[0];
+		}
+		return 0;
+	}
+
+	while (1) {
+		curr = _sl_nav_find_pred0(sl, key, op);
+		if (curr == sl->head) return 0;
+		if (SL_NAV_NODE_PRESENT(curr))
+			return map_nav_found(curr->key, curr->value, key_out, value_out);
+	}
+}
+
+#endif /* _SL_NAV_H_ */
@@ -33,6 +33,15 @@ static inline sl_thread_data_t *sl_thread_data_new(int tid)
 	return ret;
 }
 
+static inline void sl_thread_data_free(sl_thread_data_t *tdata)
+{
+	if (!tdata) return;
+#	ifdef SYNC_CG_HTM
+	tx_thread_data_free(tdata->tx_data);
+#	endif
+	free(tdata);
+}
+
 static inline void sl_thread_data_print(sl_thread_data_t *tdata)
 {
 #	if defined(SYNC_CG_HTM)
@@ -9,6 +9,9 @@
 #include <limits.h> /* INT_MIN and INT_MAX */
 
 #include "../key/key.h"
+#include "../map.h"
+#include "../destroy.h"
+#include "../size.h"
 #include "alloc.h" /* XMALLOC() */
 
 #define MAX_LEVEL 13
@@ -41,6 +44,7 @@ typedef struct sl_node {
 
 typedef struct {
 	sl_node_t *head;
+	map_size_t *size; //> See size.h.
 
 #	if defined(SYNC_CG_SPINLOCK) || defined(SYNC_CG_HTM)
 	pthread_spinlock_t lock;
@@ -48,11 +52,13 @@ typedef struct {
 
 } sl_t;
 
+static __thread void *nalloc;
+
 static sl_node_t *_sl_node_new(map_key_t key, void *value)
 {
 	sl_node_t *ret;
 
-	XMALLOC(ret, 1);
+	ret = nalloc_alloc_node(nalloc);
 	KEY_COPY(ret->key, key);
 	ret->value = value;
 	memset(ret->next, 0, MAX_LEVEL * sizeof(*ret->next));
@@ -75,7 +81,7 @@ static sl_node_t *_sl_node_new(map_key_t key, void *value)
 
 static void _sl_node_free(sl_node_t *node)
 {
-	free(node);
+	nalloc_free_node(nalloc, node);
 }
 
 static sl_t *_sl_new()
@@ -115,4 +121,79 @@ static sl_t *_sl_new()
 	return ret;
 }
 
+/**
+ * Bulk loading: links the sorted keys[0..n-1] into the empty skiplist `sl`
+ * as a perfect skiplist. The i-th node (counting from 1) gets one level more
+ * than the trailing zeros of i, i.e., every second node reaches level 1,
+ * every fourth level 2 and so on, as get_rand_level() does on average.
+ **/
+static void _sl_bulk_load(sl_t *sl, map_key_t *keys, void **values,
+                          long long n)
+{
+	sl_node_t *last[MAX_LEVEL], *tail = sl->head->next[0], *node;
+	long long i;
+	int l, level;
+
+	for (l=0; l < MAX_LEVEL; l++)
+		last[l] = sl->head;
+
+	for (i=0; i < n; i++) {
+		level = __builtin_ctzll(i + 1) + 1;
+		if (level > MAX_LEVEL) level = MAX_LEVEL;
+
+		node = _sl_node_new(keys[i], values ? values[i] : NULL);
+#		ifdef SL_HERLIHY
+		node->fully_linked = 1;
+#		endif
+#		ifdef LEVEL_PER_NODE
+		node->toplevel = level;
+#		endif
+		for (l=0; l < level; l++) {
+			last[l]->next[l] = node;
+			last[l] = node;
+		}
+	}
+
+	for (l=0; l < MAX_LEVEL; l++)
+		last[l]->next[l] = tail;
+}
+
+/**
+ * map_destroy(). Every part is a node of level 0 and the nodes that follow it
+ * up to the next part; the last one ends with the tail. The parts are the head
+ * and the nodes of the highest level that has enough of them for the threads.
+ **/
+static void _sl_destroy_part(void *part, void *next_part, void *arg)
+{
+	sl_node_t *curr = part, *next;
+	while (curr != next_part) {
+		next = curr->next[0];
+		nalloc_free_node_now(nalloc, curr);
+		curr = next;
+	}
+}
+
+static void _sl_destroy(sl_t *sl, int nthreads)
+{
+	destroy_stack_t parts = { NULL, 0, 0 };
+	sl_node_t *curr;
+	int level = 0, nr, target = nthreads * DESTROY_PARTS_PER_THREAD;
+
+	destroy_push(&parts, sl->head);
+	if (nthreads > 1) {
+		for (level=MAX_LEVEL-1; level > 0; level--) {
+			nr = 0;
+			for (curr = sl->head->next[level]; curr->next[0] && nr < target;
+			     curr = curr->next[level])
+				nr++;
+			if (nr == target) break;
+		}
+		for (curr = sl->head->next[level]; curr->next[0]; curr = curr->next[level])
+			destroy_push(&parts, curr);
+	}
+	destroy_parts(parts.nodes, parts.nr_nodes, nthreads, _sl_destroy_part, NULL);
+	free(parts.nodes);
+	free(sl);
+}
+
 #endif /* _SL_TYPES_H_ */
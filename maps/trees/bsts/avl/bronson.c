@@ -9,6 +9,8 @@
 #include "utils.h"
 #include "../../../key/key.h"
 #include "../../../map.h"
+#include "../../../size.h"
+#include "../../../delete_range.h"
 
 #define INIT_LOCK(lock) pthread_spin_init((lock), PTHREAD_PROCESS_SHARED)
 #define LOCK(lock)      pthread_spin_lock((lock))
@@ -75,11 +77,14 @@ void wait_until_not_changing(avl_node_t *n)
 	}
 }
 
-int attempt_get(map_key_t key, avl_node_t *node, int dir, long long version)
+//> Logically deleted nodes (see attempt_rm_node()) are not in the map.
+int attempt_get(map_key_t key, avl_node_t *node, int dir, long long version,
+                void **value)
 {
 	avl_node_t *child;
 	int next_dir, ret;
 	long long child_version;
+	void *data;
 
 	while (1) {
 		child = GET_CHILD_DIR(node, dir);
@@ -90,7 +95,12 @@ int attempt_get(map_key_t key, avl_node_t *node, int dir, long long version)
 
 		//> Reached NULL or the node with the specified key.
 		if (child == NULL) return 0;
-		if (KEY_CMP(key, child->key) == 0) return 1;
+		if (KEY_CMP(key, child->key) == 0) {
+			data = child->data;
+			if (data == MARKED_NODE) return 0;
+			if (value) *value = data;
+			return 1;
+		}
 
 		//> Where to go next?
 		next_dir = (KEY_CMP(key, child->key) < 0) ? LEFT : RIGHT;
@@ -100,20 +110,180 @@ int attempt_get(map_key_t key, avl_node_t *node, int dir, long long version)
 			wait_until_not_changing(child);
 		} else if (child_version != UNLINKED && child == GET_CHILD_DIR(node, dir)) {
 			if (node->version != version) return RETRY;
-			ret = attempt_get(key, child, next_dir, child_version);
+			ret = attempt_get(key, child, next_dir, child_version, value);
 			if (ret != RETRY) return ret;
 		}
 	}
 }
 
-int _avl_lookup_helper(avl_t *avl, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+int _avl_lookup_helper(avl_t *avl, map_key_t key, void **value)
 {
 	int ret;
-	ret = attempt_get(key, avl->root, RIGHT, 0);
+	ret = attempt_get(key, avl->root, RIGHT, 0, value);
 	assert(ret != RETRY);
 	return ret;
 }
 
+typedef struct {
+	map_key_t key1, key2;
+	int after_key1; //> Set once a key is visited; key1 is then the last one.
+	map_visit_t visit;
+	void *arg;
+} rquery_t;
+
+/**
+ * Visits, in order, the keys of the subtree under the `dir` child of `node`
+ * that are in the range of `rq`.
+ * As in attempt_get(), a child is only followed while `node` still has
+ * `version`; otherwise RETRY is returned and the caller reads its own child
+ * again. Keys that have been visited are not visited again, because
+ * `rq->key1` moves forward with every visited key.
+ * Returns 0 once the range query is over, 1 otherwise.
+ **/
+int attempt_rquery(rquery_t *rq, avl_node_t *node, int dir, long long version)
+{
+	avl_node_t *child;
+	long long child_version;
+	int ret, cmp1;
+	void *data;
+
+	while (1) {
+		child = GET_CHILD_DIR(node, dir);
+		SW_BARRIER();
+
+		//> The node version has changed. Must retry.
+		if (node->version != version) return RETRY;
+
+		if (child == NULL) return 1;
+
+		child_version = child->version;
+		if (IS_SHRINKING(child_version)) {
+			wait_until_not_changing(child);
+			continue;
+		}
+		if (child_version == UNLINKED || child != GET_CHILD_DIR(node, dir))
+			continue;
+		if (node->version != version) return RETRY;
+
+		cmp1 = KEY_CMP(child->key, rq->key1);
+		if (cmp1 > 0) {
+			ret = attempt_rquery(rq, child, LEFT, child_version);
+			if (ret == RETRY) continue;
+			if (ret == 0) return 0;
+			cmp1 = KEY_CMP(child->key, rq->key1);
+		}
+
+		if (KEY_CMP(child->key, rq->key2) > 0) return 0;
+		if (cmp1 > 0 || (cmp1 == 0 && !rq->after_key1)) {
+			data = child->data;
+			SW_BARRIER();
+			if (child->version != child_version) continue;
+			KEY_COPY(rq->key1, child->key);
+			rq->after_key1 = 1;
+			if (data != MARKED_NODE && rq->visit(child->key, data, rq->arg))
+				return 0;
+		}
+		if (KEY_CMP(child->key, rq->key2) == 0) return 0;
+
+		ret = attempt_rquery(rq, child, RIGHT, child_version);
+		if (ret != RETRY) return ret;
+	}
+}
+
+void _avl_rquery_helper(avl_t *avl, map_key_t key1, map_key_t key2,
+                        map_visit_t visit, void *arg)
+{
+	rquery_t rq;
+	int ret;
+
+	KEY_COPY(rq.key1, key1);
+	KEY_COPY(rq.key2, key2);
+	rq.after_key1 = 0;
+	rq.visit = visit;
+	rq.arg = arg;
+	ret = attempt_rquery(&rq, avl->root, RIGHT, 0);
+	assert(ret != RETRY);
+}
+
+typedef struct {
+	map_key_t key;
+	map_nav_t op;
+	map_key_t *key_out;
+	void **value_out;
+} nav_t;
+
+/**
+ * Ordered navigation (see nav.h) in the subtree under the `dir` child of
+ * `node`, the same way attempt_rquery() visits a range. The keys are visited
+ * in the direction of `nv->op` until one of them is in the map. Keys that
+ * have been visited are not visited again, because `nv->key` moves with
+ * every visited key.
+ * Returns 0 once the answer is found, 1 otherwise.
+ **/
+int attempt_nav(nav_t *nv, avl_node_t *node, int dir, long long version)
+{
+	avl_node_t *child;
+	long long child_version;
+	int forward = MAP_NAV_IS_FORWARD(nv->op);
+	int first = forward ? LEFT : RIGHT, second = forward ? RIGHT : LEFT;
+	int ret;
+	void *data;
+
+	while (1) {
+		child = GET_CHILD_DIR(node, dir);
+		SW_BARRIER();
+
+		//> The node version has changed. Must retry.
+		if (node->version != version) return RETRY;
+
+		if (child == NULL) return 1;
+
+		child_version = child->version;
+		if (IS_SHRINKING(child_version)) {
+			wait_until_not_changing(child);
+			continue;
+		}
+		if (child_version == UNLINKED || child != GET_CHILD_DIR(node, dir))
+			continue;
+		if (node->version != version) return RETRY;
+
+		if (MAP_NAV_KEY_OK(nv->op, child->key, nv->key)) {
+			ret = attempt_nav(nv, child, first, child_version);
+			if (ret == RETRY) continue;
+			if (ret == 0) return 0;
+
+			data = child->data;
+			SW_BARRIER();
+			if (child->version != child_version) continue;
+			if (data != MARKED_NODE) {
+				map_nav_found(child->key, data, nv->key_out, nv->value_out);
+				return 0;
+			}
+			KEY_COPY(nv->key, child->key);
+			nv->op = forward ? MAP_NAV_SUCC : MAP_NAV_PRED;
+		}
+
+		ret = attempt_nav(nv, child, second, child_version);
+		if (ret != RETRY) return ret;
+	}
+}
+
+int _avl_nav_helper(avl_t *avl, map_key_t key, map_nav_t op,
+                    map_key_t *key_out, void **value_out)
+{
+	nav_t nv;
+	int ret;
+
+	KEY_COPY(nv.key, key);
+	nv.op = op;
+	nv.key_out = key_out;
+	nv.value_out = value_out;
+	ret = attempt_nav(&nv, avl->root, RIGHT, 0);
+	assert(ret != RETRY);
+	return (ret == 0);
+}
+
 /*****************************************************************************/
 /* Rebalancing functions                                                     */
 /*****************************************************************************/
@@ -415,6 +585,7 @@ static int attempt_node_unlink(avl_node_t *parent, avl_node_t *n)
 	if (splice) splice->parent = parent;
 
 	n->version = UNLINKED;
+	nalloc_free_node(nalloc, n);
 	return 1;
 }
 //> `node` and `parent` must be locked before calling.
@@ -495,14 +666,14 @@ int attempt_insert(map_key_t key, void *data, avl_node_t *node, int dir,
 	return 1;
 }
 
-int attempt_relink(avl_node_t *node)
+int attempt_relink(avl_node_t *node, void *data)
 {
 	int ret;
 	LOCK(&node->lock);
 	if (node->version == UNLINKED) {
 		ret = RETRY;
 	} else if (node->data == MARKED_NODE) {
-		node->data = NULL;
+		node->data = data;
 		ret = 1;
 	} else {
 		ret = 0;
@@ -530,7 +701,7 @@ int attempt_put(map_key_t key, void *data, avl_node_t *node, int dir,
 		} else {
 			next_dir = (KEY_CMP(key, child->key) < 0) ? LEFT : RIGHT;
 			if (KEY_CMP(key, child->key) == 0) {
-				ret = attempt_relink(child);
+				ret = attempt_relink(child, data);
 			} else {
 				child_version = child->version;
 				if (IS_SHRINKING(child_version)) {
@@ -602,6 +773,7 @@ int attempt_rm_node(avl_node_t *par, avl_node_t *n)
 		else                par->right = c;
 		if (c != NULL) c->parent = par;
 		n->version = UNLINKED;
+		nalloc_free_node(nalloc, n);
 	}
 	UNLOCK(&n->lock);
 	UNLOCK(&par->lock);
@@ -673,7 +845,7 @@ int attempt_update(map_key_t key, void *data, avl_node_t *node, int dir,
 		next_dir = (KEY_CMP(key, child->key) < 0) ? LEFT : RIGHT;
 		if (KEY_CMP(key, child->key) == 0) {
 			if (child->data == MARKED_NODE) {
-				ret = attempt_relink(child);
+				ret = attempt_relink(child, data);
 			} else {
 				ret = attempt_rm_node(node, child);
 				if (ret != RETRY) ret += 2;
@@ -700,6 +872,68 @@ int _avl_update_helper(avl_t *avl, map_key_t key, void *data)
 	return ret;
 }
 
+//> Returns 1 if the key was in the tree and 0 if it was inserted.
+int attempt_compute_node(avl_node_t *node, map_compute_t fn, void *arg)
+{
+	int ret;
+	LOCK(&node->lock);
+	if (node->version == UNLINKED) {
+		ret = RETRY;
+	} else if (node->data == MARKED_NODE) {
+		node->data = fn(node->key, NULL, 0, arg);
+		ret = 0;
+	} else {
+		node->data = fn(node->key, node->data, 1, arg);
+		ret = 1;
+	}
+	UNLOCK(&node->lock);
+	return ret;
+}
+
+int attempt_compute(map_key_t key, map_compute_t fn, void *arg,
+                    avl_node_t *node, int dir, long long version)
+{
+	avl_node_t *child;
+	int next_dir, ret = RETRY;
+	long long child_version;
+
+	do {
+		child = GET_CHILD_DIR(node, dir);
+		SW_BARRIER();
+
+		//> The node version has changed. Must retry.
+		if (node->version != version) return RETRY;
+
+		if (child == NULL) {
+			ret = attempt_insert(key, fn(key, NULL, 0, arg), node, dir, version);
+			if (ret != RETRY) ret = 0;
+		} else {
+			next_dir = (KEY_CMP(key, child->key) < 0) ? LEFT : RIGHT;
+			if (KEY_CMP(key, child->key) == 0) {
+				ret = attempt_compute_node(child, fn, arg);
+			} else {
+				child_version = child->version;
+				if (IS_SHRINKING(child_version)) {
+					wait_until_not_changing(child);
+				} else if (child_version != UNLINKED && child == GET_CHILD_DIR(node, dir)) {
+					if (node->version != version) return RETRY;
+					ret = attempt_compute(key, fn, arg, child, next_dir, child_version);
+				}
+			}
+		}
+	} while (ret == RETRY);
+
+	return ret;
+}
+
+int _avl_compute_helper(avl_t *avl, map_key_t key, map_compute_t fn, void *arg)
+{
+	int ret;
+	ret = attempt_compute(key, fn, arg, avl->root, RIGHT, 0);
+	assert(ret != RETRY);
+	return ret;
+}
+
 /******************************************************************************/
 /*            Map interface implementation                                    */
 /******************************************************************************/
@@ -707,8 +941,10 @@ void *map_new()
 {
 	avl_t *avl;
 	printf("Size of tree node is %lu\n", sizeof(avl_node_t));
+	nalloc = nalloc_thread_init(-1, sizeof(avl_node_t));
 	avl = avl_new();
 	avl->root = avl_node_new(MAX_KEY, 0);
+	avl->size = map_size_new();
 	return avl;
 }
 
@@ -726,39 +962,150 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 {
 }
 
+void map_tdata_free(void *thread_data)
+{
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((avl_t *)map)->root, nthreads, bst_destroy_children,
+	             bst_destroy_node);
+	map_size_free(((avl_t *)map)->size);
+	free(map);
+}
+
+//> Not supported; map_warmup() inserts the keys instead.
+long long map_bulk_load(void *avl, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	return 0;
+}
+
 int map_lookup(void *avl, void *thread_data, map_key_t key)
+{
+	return map_get(avl, thread_data, key, NULL);
+}
+
+int map_get(void *avl, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret;
-	ret = _avl_lookup_helper(avl, key);
+	nalloc_op_begin();
+	ret = _avl_lookup_helper(avl, key, value_out);
+	nalloc_op_end();
 	return ret;
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *avl, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	printf("Range query not yet implemented\n");
-	return 0;
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(avl, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	nalloc_op_begin();
+	_avl_rquery_helper(map, key1, key2, visit, arg);
+	nalloc_op_end();
+	return 1;
+}
+
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	int ret;
+	nalloc_op_begin();
+	ret = _avl_nav_helper(map, key, op, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *avl, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_insert_helper(avl, key, value);
+	nalloc_op_end();
+	if (ret) map_size_add(((avl_t *)avl)->size, 1);
+	return ret;
+}
+
+int map_compute(void *avl, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = _avl_compute_helper(avl, key, fn, arg);
+	nalloc_op_end();
+	if (!ret) map_size_add(((avl_t *)avl)->size, 1);
 	return ret;
 }
 
 int map_delete(void *avl, void *thread_data, map_key_t key)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_delete_helper(avl, key);
+	nalloc_op_end();
+	if (ret) map_size_add(((avl_t *)avl)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *avl, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	return map_delete_range_each(avl, thread_data, key1, key2);
+}
+
 int map_update(void *avl, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_update_helper(avl, key, value);
+	nalloc_op_end();
+	map_size_updated(((avl_t *)avl)->size, ret);
 	return ret;
 }
+
+long long map_size(void *avl, void *thread_data, int exact)
+{
+	return map_size_sum(((avl_t *)avl)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
 int map_validate(void *avl)
 {
 	int ret = 1;
@@ -6,6 +6,8 @@
 
 #include "utils.h"
 #include "../../../map.h"
+#include "../../../size.h"
+#include "../../../delete_range.h"
 #include "../../../key/key.h"
 #include "arch.h" /* CACHE_LINE_SIZE */
 #include "alloc.h"
@@ -20,6 +22,7 @@ typedef pthread_spinlock_t lock_t;
 #define NODE_HAS_SUCC_AND_PRED
 #define NODE_HAS_TREE_AND_SUCC_LOCKS
 #define NODE_HAS_LR_HEIGHTS
+#define NODE_HAS_MARK
 #include "avl.h"
 #include "validate.h"
 #include "print.h"
@@ -69,8 +72,8 @@ void tdata_add(tdata_t *d1, tdata_t *d2, tdata_t *dst)
 	}
 }
 
-#define MARK(n) ((n)->data = (void *)0xFFLLU)
-#define IS_MARKED(n) ((n)->data == (void *)0xFFLLU)
+#define MARK(n) ((n)->marked = 1)
+#define IS_MARKED(n) ((n)->marked)
 
 static avl_node_t *search(avl_t *avl, map_key_t k)
 {
@@ -87,12 +90,65 @@ static avl_node_t *search(avl_t *avl, map_key_t k)
 	}
 }
 
-static int _avl_lookup_helper(avl_t *avl, map_key_t k)
+//> `value` may be NULL if the caller does not need the value.
+//> The mark is read before the data, so a value is only returned for a node
+//> that was in the map at some point during the call.
+static int _avl_lookup_helper(avl_t *avl, map_key_t k, void **value)
 {
 	avl_node_t *n = search(avl, k);
 	while (KEY_CMP(n->key, k) > 0 && KEY_CMP(n->pred->key, k) >= 0) n = n->pred;
 	while (KEY_CMP(n->key, k) < 0 && KEY_CMP(n->succ->key, k) <= 0) n = n->succ;
-	return (KEY_CMP(n->key, k) == 0 && !IS_MARKED(n));
+	if (KEY_CMP(n->key, k) != 0) return 0;
+	if (IS_MARKED(n)) return 0;
+	if (value) *value = n->data;
+	return 1;
+}
+
+//> Walks the ordered (succ) list from the first key that is not smaller
+//> than key1. Marked nodes have been deleted and are skipped.
+static void _avl_rquery_helper(avl_t *avl, map_key_t key1, map_key_t key2,
+                               map_visit_t visit, void *arg)
+{
+	avl_node_t *n = search(avl, key1);
+
+	while (KEY_CMP(n->key, key1) > 0 && KEY_CMP(n->pred->key, key1) >= 0) n = n->pred;
+	while (KEY_CMP(n->key, key1) < 0) n = n->succ;
+	//> avl->root is the MAX_KEY sentinel, at the end of the list.
+	while (n != avl->root && KEY_CMP(n->key, key2) <= 0) {
+		if (!IS_MARKED(n) && visit(n->key, n->data, arg)) return;
+		n = n->succ;
+	}
+}
+
+//> Ordered navigation (see nav.h) over the ordered list, like range queries.
+//> The list starts at the MIN_KEY sentinel, the parent of avl->root, and ends
+//> at the MAX_KEY sentinel, avl->root.
+static int _avl_nav_helper(avl_t *avl, map_key_t k, map_nav_t op,
+                           map_key_t *key_out, void **value_out)
+{
+	avl_node_t *head = avl->root->parent, *tail = avl->root, *n;
+	int forward = MAP_NAV_IS_FORWARD(op);
+
+	if (op == MAP_NAV_MIN) {
+		n = head->succ;
+	} else if (op == MAP_NAV_MAX) {
+		n = tail->pred;
+	} else if (forward) {
+		n = search(avl, k);
+		while (KEY_CMP(n->key, k) > 0 && KEY_CMP(n->pred->key, k) > 0) n = n->pred;
+		while (n != tail && KEY_CMP(n->key, k) <= 0) n = n->succ;
+	} else {
+		n = search(avl, k);
+		while (KEY_CMP(n->key, k) < 0 && KEY_CMP(n->succ->key, k) < 0) n = n->succ;
+		while (n != head && KEY_CMP(n->key, k) >= 0) n = n->pred;
+	}
+
+	while (n != (forward ? tail : head)) {
+		if (!IS_MARKED(n))
+			return map_nav_found(n->key, n->data, key_out, value_out);
+		n = forward ? n->succ : n->pred;
+	}
+	return 0;
 }
 
 /*****************************************************************************/
@@ -276,6 +332,43 @@ static int _avl_insert_helper(avl_t *avl, map_key_t k, void *v, tdata_t *tdata)
 	}
 }
 
+//> The value is replaced while holding the `succ_lock` of the predecessor,
+//> which _avl_delete_helper() needs to remove the node.
+static int _avl_compute_helper(avl_t *avl, map_key_t k, map_compute_t fn,
+                               void *arg, tdata_t *tdata)
+{
+	avl_node_t *node, *p, *s, *new, *parent;
+
+	while(1) {
+		node = search(avl, k);
+		p = (KEY_CMP(node->key, k) >= 0) ? node->pred : node;
+		LOCK(&p->succ_lock);
+		s = p->succ;
+
+		if (KEY_CMP(k, p->key) > 0 && KEY_CMP(k, s->key) <= 0 && !IS_MARKED(p)) {
+			//> Key already in the tree
+			if (KEY_CMP(s->key, k) == 0) {
+				s->data = fn(k, s->data, 1, arg);
+				UNLOCK(&p->succ_lock);
+				return 1;
+			}
+			//> Ordering insertion
+			new = avl_node_new(k, fn(k, NULL, 0, arg));
+			parent = choose_parent(p, s, node, tdata);
+			new->succ = s;
+			new->pred = p;
+			new->parent = parent;
+			s->pred = new;
+			p->succ = new;
+			UNLOCK(&p->succ_lock);
+			//> Tree Layout insertion
+			insert_to_tree(avl, parent, new, tdata);
+			return 0;
+		}
+		UNLOCK(&p->succ_lock);
+	}
+}
+
 //> Acquires the required `tree_lock` locks.
 //> - If `n` has 0 or 1 child: `n->parent`, `n` and `n->NOT_NULL_CHILD`
 //>   are locked.
@@ -419,6 +512,7 @@ static int _avl_delete_helper(avl_t *avl, map_key_t k, tdata_t *tdata)
 			UNLOCK(&s->succ_lock);
 			UNLOCK(&p->succ_lock);
 			remove_from_tree(avl, s, has_two_children, tdata);
+			nalloc_free_node(nalloc, s);
 			return 1; 
 		}
 		UNLOCK(&p->succ_lock);
@@ -474,6 +568,7 @@ static int _avl_update_helper(avl_t *avl, map_key_t k, void *v, tdata_t *tdata)
 				UNLOCK(&s->succ_lock);
 				UNLOCK(&p->succ_lock);
 				remove_from_tree(avl, s, has_two_children, tdata);
+				nalloc_free_node(nalloc, s);
 				return 3; 
 			}
 		}
@@ -491,6 +586,7 @@ void *map_new()
 	avl_node_t *parent, *root;
 
 	printf("Size of tree node is %lu\n", sizeof(avl_node_t));
+	nalloc = nalloc_thread_init(-1, sizeof(avl_node_t));
 
 	parent = avl_node_new(MIN_KEY, 0);
 	root = avl_node_new(MAX_KEY, 0);
@@ -500,6 +596,7 @@ void *map_new()
 	parent->right = root;
 	parent->succ = root;
 	avl->root = root;
+	avl->size = map_size_new();
 	return avl;
 }
 
@@ -519,40 +616,153 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	tdata_add(d1, d2, dst);
 }
 
+void map_tdata_free(void *thread_data)
+{
+	free(thread_data);
+}
+
+//> The MIN_KEY sentinel, the parent of avl->root, is the root of the tree.
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((avl_t *)map)->root->parent, nthreads, bst_destroy_children,
+	             bst_destroy_node);
+	map_size_free(((avl_t *)map)->size);
+	free(map);
+}
+
+//> Not supported; map_warmup() inserts the keys instead.
+long long map_bulk_load(void *avl, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	return 0;
+}
+
 int map_lookup(void *avl, void *thread_data, map_key_t key)
+{
+	return map_get(avl, thread_data, key, NULL);
+}
+
+int map_get(void *avl, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret;
-	ret = _avl_lookup_helper(avl, key);
+	nalloc_op_begin();
+	ret = _avl_lookup_helper(avl, key, value_out);
+	nalloc_op_end();
 	return ret;
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *avl, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	printf("Range query not yet implemented\n");
-	return 0;
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(avl, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	nalloc_op_begin();
+	_avl_rquery_helper(map, key1, key2, visit, arg);
+	nalloc_op_end();
+	return 1;
+}
+
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	int ret;
+	nalloc_op_begin();
+	ret = _avl_nav_helper(map, key, op, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *avl, void *thread_data, map_key_t key, void *data)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_insert_helper(avl, key, data, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((avl_t *)avl)->size, 1);
+	return ret;
+}
+
+int map_compute(void *avl, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = _avl_compute_helper(avl, key, fn, arg, thread_data);
+	nalloc_op_end();
+	if (!ret) map_size_add(((avl_t *)avl)->size, 1);
 	return ret;
 }
 
 int map_delete(void *avl, void *thread_data, map_key_t key)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_delete_helper(avl, key, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((avl_t *)avl)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *avl, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	return map_delete_range_each(avl, thread_data, key1, key2);
+}
+
 int map_update(void *avl, void *thread_data, map_key_t key, void *data)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_update_helper(avl, key, data, thread_data);
+	nalloc_op_end();
+	map_size_updated(((avl_t *)avl)->size, ret);
 	return ret;
 }
 
+long long map_size(void *avl, void *thread_data, int exact)
+{
+	return map_size_sum(((avl_t *)avl)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *avl)
 {
 	int ret = 1;
@@ -13,11 +13,12 @@
 
 #define SYNC_RCU_HTM
 #include "../../../map.h"
+#include "../../../size.h"
+#include "../../../delete_range.h"
 #include "../../../rcu-htm/tdata.h"
 #include "validate.h"
 #include "print.h"
 
-#define MAX(a,b) ( (a) >= (b) ? (a) : (b) )
 #define MAX_HEIGHT 50
 
 static __thread void *nalloc;
@@ -34,7 +35,7 @@ static void avl_node_copy(avl_node_t *dest, avl_node_t *src)
 
 static avl_node_t *avl_node_new_copy(avl_node_t *src, tdata_t *tdata)
 {
-	avl_node_t *node = nalloc_alloc_node(nalloc);
+	avl_node_t *node = rcu_copy_alloc(nalloc, sizeof(*node));
 	avl_node_copy(node, src);
 	return node;
 }
@@ -130,12 +131,99 @@ static inline void _traverse_with_stack(avl_t *avl, map_key_t key,
 	}
 }
 
-static int _avl_lookup_helper(avl_t *avl, map_key_t key, int *hops)
+//> `value` may be NULL if the caller does not need the value.
+static int _avl_lookup_helper(avl_t *avl, map_key_t key, void **value,
+                              int *hops)
 {
 	avl_node_t *parent, *leaf;
 
 	_traverse(avl, key, &parent, &leaf, hops);
-	return (leaf != NULL);
+	if (!leaf) return 0;
+	if (value) *value = leaf->data;
+	return 1;
+}
+
+#define RQUERY_MAX_NODES 20
+static __thread avl_node_t *rquery_nodes[RQUERY_MAX_NODES];
+static __thread int rquery_nnodes;
+
+/**
+ * Collects the nodes of the subtree of `n` with keys in [key1, key2], in
+ * ascending key order, up to RQUERY_MAX_NODES of them. key1 itself is left
+ * out if `after_key1` is set.
+ * Called inside a transaction or with the global lock held, so the nodes
+ * form a consistent snapshot of the range.
+ **/
+static void _rquery_collect(avl_node_t *n, map_key_t key1, int after_key1,
+                            map_key_t key2)
+{
+	int cmp1;
+
+	if (!n || rquery_nnodes == RQUERY_MAX_NODES) return;
+
+	cmp1 = KEY_CMP(n->key, key1);
+	if (cmp1 > 0) _rquery_collect(n->left, key1, after_key1, key2);
+	if (rquery_nnodes == RQUERY_MAX_NODES) return;
+	if ((cmp1 > 0 || (cmp1 == 0 && !after_key1)) && KEY_CMP(n->key, key2) <= 0)
+		rquery_nodes[rquery_nnodes++] = n;
+	if (KEY_CMP(n->key, key2) < 0) _rquery_collect(n->right, key1, after_key1, key2);
+}
+
+/**
+ * Nodes are never modified in place once they are in the tree, apart from
+ * their child pointers, so the keys and values of the collected nodes are
+ * visited outside of the transaction.
+ * Ranges that span more than RQUERY_MAX_NODES nodes are scanned in several
+ * steps, each one continuing after the last collected key; every step is
+ * atomic but the range query as a whole is not.
+ **/
+static void _avl_rquery_helper(avl_t *avl, map_key_t key1, map_key_t key2,
+                               map_visit_t visit, void *arg, tdata_t *tdata)
+{
+	tm_begin_ret_t status;
+	int i, retries, done, after_from = 0;
+	avl_node_t *n;
+	map_key_t from;
+
+	KEY_COPY(from, key1);
+	while (1) {
+		//> First try with transactions
+		done = 0;
+		for (retries = 0; retries < TX_NUM_RETRIES; retries++) {
+			while (avl->lock != LOCK_FREE) ;
+			tdata->tx_starts++;
+			status = TX_BEGIN(0);
+			if (status == TM_BEGIN_SUCCESS) {
+				if (avl->lock != LOCK_FREE)
+					TX_ABORT(ABORT_GL_TAKEN);
+				rquery_nnodes = 0;
+				_rquery_collect(avl->root, from, after_from, key2);
+				TX_END(0);
+				done = 1;
+				break;
+			}
+			tdata->tx_aborts++;
+		}
+
+		//> Finally resort to the global lock
+		if (!done) {
+			tdata->lacqs++;
+			pthread_spin_lock(&avl->lock);
+			rquery_nnodes = 0;
+			_rquery_collect(avl->root, from, after_from, key2);
+			pthread_spin_unlock(&avl->lock);
+		}
+
+		for (i = 0; i < rquery_nnodes; i++) {
+			n = rquery_nodes[i];
+			if (visit(n->key, n->data, arg)) return;
+		}
+		if (rquery_nnodes < RQUERY_MAX_NODES) return;
+
+		KEY_COPY(from, rquery_nodes[rquery_nnodes-1]->key);
+		if (KEY_CMP(from, key2) >= 0) return;
+		after_from = 1;
+	}
 }
 
 static inline void _avl_insert_fixup(avl_t *avl, map_key_t key,
@@ -288,6 +376,14 @@ static avl_node_t *_insert_and_rebalance_with_copy(map_key_t key, void *value,
 	return connection_point;
 }
 
+//> Retires the nodes that were replaced by a committed copy.
+static void _retire_replaced(avl_node_t *nodes_to_free[MAX_HEIGHT], int ntf_top)
+{
+	int i;
+	for (i=0; i <= ntf_top; i++)
+		nalloc_free_node(nalloc, nodes_to_free[i]);
+}
+
 static int _avl_insert_helper(avl_t *avl, map_key_t key, void *value, tdata_t *tdata)
 {
 	avl_node_t *nodes_to_free[MAX_HEIGHT], *nodes_alloced[MAX_HEIGHT];
@@ -300,8 +396,10 @@ static int _avl_insert_helper(avl_t *avl, map_key_t key, void *value, tdata_t *t
 	avl_node_t *tree_copy_root, *connection_point;
 	int connection_point_stack_index;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 
 	if (++retries >= TX_NUM_RETRIES) {
@@ -328,6 +426,7 @@ try_from_scratch:
 				connection_point->right = tree_copy_root;
 		}
 		pthread_spin_unlock(&avl->lock);
+		_retire_replaced(nodes_to_free, ntf_top);
 		return 1;
 	}
 
@@ -433,6 +532,7 @@ validate_and_connect_copy:
 		}
 	}
 
+	_retire_replaced(nodes_to_free, ntf_top);
 	return 1;
 }
 
@@ -519,8 +619,10 @@ static avl_node_t *_delete_and_rebalance_with_copy(map_key_t key,
 			if (KEY_CMP(key, curr_cp->key) < 0) curr_cp->left = tree_copy_root;
 			else                    curr_cp->right = tree_copy_root;
 			tree_copy_root = curr_cp;
-			if (connection_point == original_to_be_deleted)
+			if (connection_point == original_to_be_deleted) {
 				KEY_COPY(tree_copy_root->key, to_be_deleted->key);
+				tree_copy_root->data = to_be_deleted->data;
+			}
 			curr_cp = avl_node_new_copy(tree_copy_root->left, tdata);
 			nodes_to_free[++(*ntf_top)] = tree_copy_root->left;
 			nodes_alloced[++(*nalloced_top)] = curr_cp;
@@ -561,8 +663,10 @@ static avl_node_t *_delete_and_rebalance_with_copy(map_key_t key,
 			if (KEY_CMP(key, curr_cp->key) < 0) curr_cp->left = tree_copy_root;
 			else                    curr_cp->right = tree_copy_root;
 			tree_copy_root = curr_cp;
-			if (connection_point == original_to_be_deleted)
+			if (connection_point == original_to_be_deleted) {
 				KEY_COPY(tree_copy_root->key, to_be_deleted->key);
+				tree_copy_root->data = to_be_deleted->data;
+			}
 			curr_cp = avl_node_new_copy(tree_copy_root->right, tdata);
 			nodes_to_free[++(*ntf_top)] = tree_copy_root->right;
 			nodes_alloced[++(*nalloced_top)] = curr_cp;
@@ -614,8 +718,10 @@ static avl_node_t *_delete_and_rebalance_with_copy(map_key_t key,
 		if (KEY_CMP(key, curr_cp->key) < 0) curr_cp->left = tree_copy_root;
 		else                                curr_cp->right = tree_copy_root;
 		tree_copy_root = curr_cp;
-		if (connection_point == original_to_be_deleted)
+		if (connection_point == original_to_be_deleted) {
 			KEY_COPY(tree_copy_root->key, to_be_deleted->key);
+			tree_copy_root->data = to_be_deleted->data;
+		}
 
 		// Move one level up
 		*connection_point_stack_index = stack_top;
@@ -639,6 +745,7 @@ static avl_node_t *_delete_and_rebalance_with_copy(map_key_t key,
 			tree_copy_root = curr_cp;
 		}
 		KEY_COPY(tree_copy_root->key, to_be_deleted->key);
+		tree_copy_root->data = to_be_deleted->data;
 		connection_point = to_be_deleted_stack_index > 0 ? 
 		                             node_stack[to_be_deleted_stack_index - 1] :
 		                             NULL;
@@ -661,8 +768,10 @@ static int _avl_delete_helper(avl_t *avl, map_key_t key, tdata_t *tdata)
 	avl_node_t *tree_copy_root, *connection_point;
 	int connection_point_stack_index;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 
 	/* Global lock fallback.*/
@@ -691,6 +800,7 @@ try_from_scratch:
 		}
 
 		pthread_spin_unlock(&avl->lock);
+		_retire_replaced(nodes_to_free, ntf_top);
 		return 1;
 	}
 
@@ -790,7 +900,115 @@ validate_and_connect_copy:
 		}
 	}
 
+	_retire_replaced(nodes_to_free, ntf_top);
+	return 1;
+}
+
+/**
+ * The node that contains `key` is replaced by a copy that carries the new
+ * value, instead of writing the value in place, so that the updates that
+ * have copied the node concurrently fail validation instead of installing
+ * the old value. A missing key is inserted by _avl_insert_helper() and we
+ * start over if it has been inserted in the meantime.
+ **/
+static int _avl_compute_helper(avl_t *avl, map_key_t key, map_compute_t fn,
+                               void *arg, tdata_t *tdata)
+{
+	avl_node_t *node_stack[MAX_HEIGHT];
+	avl_node_t *node, *node_cp, *parent;
+	int stack_top;
+	tm_begin_ret_t status;
+	int retries = -1;
+	int i;
+
+	rcu_copies_begin();
+try_from_scratch:
+
+	rcu_copies_discard();
+
+	if (++retries >= TX_NUM_RETRIES) {
+		tdata->lacqs++;
+		pthread_spin_lock(&avl->lock);
+		_traverse_with_stack(avl, key, node_stack, &stack_top);
+		if (stack_top < 0 || KEY_CMP(node_stack[stack_top]->key, key) != 0) {
+			pthread_spin_unlock(&avl->lock);
+			goto insert;
+		}
+		node = node_stack[stack_top];
+		node_cp = avl_node_new_copy(node, tdata);
+		node_cp->data = fn(key, node->data, 1, arg);
+		parent = (stack_top > 0) ? node_stack[stack_top-1] : NULL;
+		if (!parent)                               avl->root = node_cp;
+		else if (KEY_CMP(key, parent->key) <= 0) parent->left = node_cp;
+		else                                       parent->right = node_cp;
+		pthread_spin_unlock(&avl->lock);
+		nalloc_free_node(nalloc, node);
+		return 1;
+	}
+
+	/* Asynchronized traversal. */
+	_traverse_with_stack(avl, key, node_stack, &stack_top);
+	if (stack_top < 0 || KEY_CMP(node_stack[stack_top]->key, key) != 0)
+		goto insert;
+
+	node = node_stack[stack_top];
+	node_cp = avl_node_new_copy(node, tdata);
+	node_cp->data = fn(key, node->data, 1, arg);
+	parent = (stack_top > 0) ? node_stack[stack_top-1] : NULL;
+
+	int validation_retries = -1;
+validate_and_connect_copy:
+
+	if (++validation_retries >= TX_NUM_RETRIES)
+		goto try_from_scratch;
+
+	/* Transactional verification. */
+	while (avl->lock != LOCK_FREE)
+		;
+
+	tdata->tx_starts++;
+	status = TX_BEGIN(0);
+	if (status == TM_BEGIN_SUCCESS) {
+		if (avl->lock != LOCK_FREE)
+			TX_ABORT(ABORT_GL_TAKEN);
+
+		// Validate the access path and the children of the copied node.
+		if (avl->root != node_stack[0])
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+		for (i=0; i < stack_top; i++) {
+			if (KEY_CMP(key, node_stack[i]->key) <= 0) {
+				if (node_stack[i]->left != node_stack[i+1])
+					TX_ABORT(ABORT_VALIDATION_FAILURE);
+			} else {
+				if (node_stack[i]->right != node_stack[i+1])
+					TX_ABORT(ABORT_VALIDATION_FAILURE);
+			}
+		}
+		if (node->left != node_cp->left || node->right != node_cp->right)
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+		if (!parent)                               avl->root = node_cp;
+		else if (KEY_CMP(key, parent->key) <= 0) parent->left = node_cp;
+		else                                       parent->right = node_cp;
+
+		TX_END(0);
+	} else {
+		tdata->tx_aborts++;
+		if (ABORT_IS_EXPLICIT(status) && 
+		    ABORT_CODE(status) == ABORT_VALIDATION_FAILURE) {
+			tdata->tx_aborts_explicit_validation++;
+			goto try_from_scratch;
+		} else {
+			goto validate_and_connect_copy;
+		}
+	}
+
+	nalloc_free_node(nalloc, node);
 	return 1;
+
+insert:
+	if (_avl_insert_helper(avl, key, fn(key, NULL, 0, arg), tdata))
+		return 0;
+	goto try_from_scratch;
 }
 
 static int _avl_update_helper(avl_t *avl, map_key_t key, void *value, tdata_t *tdata)
@@ -806,8 +1024,10 @@ static int _avl_update_helper(avl_t *avl, map_key_t key, void *value, tdata_t *t
 	int connection_point_stack_index;
 	int op_is_insert = -1, ret;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 
 	if (++retries >= TX_NUM_RETRIES) {
@@ -854,6 +1074,7 @@ try_from_scratch:
 				connection_point->right = tree_copy_root;
 		}
 		pthread_spin_unlock(&avl->lock);
+		_retire_replaced(nodes_to_free, ntf_top);
 		return ret;
 	}
 
@@ -984,6 +1205,7 @@ validate_and_connect_copy:
 		}
 	}
 
+	_retire_replaced(nodes_to_free, ntf_top);
 	return ret;
 }
 
@@ -992,8 +1214,12 @@ validate_and_connect_copy:
 /******************************************************************************/
 void *map_new()
 {
+	avl_t *avl;
+
 	printf("Size of tree node is %lu\n", sizeof(avl_node_t));
-	return avl_new();
+	avl = avl_new();
+	avl->size = map_size_new();
+	return avl;
 }
 
 void *map_tdata_new(int tid)
@@ -1015,41 +1241,159 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	tdata_add(d1, d2, dst);
 }
 
+void map_tdata_free(void *thread_data)
+{
+	rcu_scratch_free(nalloc);
+	tdata_free(thread_data);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((avl_t *)map)->root, nthreads, bst_destroy_children,
+	             bst_destroy_node);
+	map_size_free(((avl_t *)map)->size);
+	free(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	((avl_t *)map)->root = bst_bulk_build_internal(keys, values, 0, n - 1);
+	map_size_add(((avl_t *)map)->size, n);
+	return n;
+}
+
 int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
 	int hops = 0;
-	ret = _avl_lookup_helper(map, key, &hops);
+	nalloc_op_begin();
+	ret = _avl_lookup_helper(map, key, value_out, &hops);
+	nalloc_op_end();
 	return ret; 
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	printf("Range query not yet implemented\n");
-	return 0;
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(map, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	nalloc_op_begin();
+	_avl_rquery_helper(map, key1, key2, visit, arg, tdata);
+	nalloc_op_end();
+	return 1;
+}
+
+//> Like lookups, navigation runs outside transactions: nodes are never
+//> modified in place.
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	avl_node_t *n;
+	int ret = 0;
+
+	nalloc_op_begin();
+	n = bst_nav_internal(((avl_t *)map)->root, key, op);
+	if (n) ret = map_nav_found(n->key, n->data, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *map, void *tdata, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_insert_helper(map, key, value, tdata);
+	nalloc_op_end();
+	if (ret) map_size_add(((avl_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *tdata, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = _avl_compute_helper(map, key, fn, arg, tdata);
+	nalloc_op_end();
+	if (!ret) map_size_add(((avl_t *)map)->size, 1);
 	return ret;
 }
 
 int map_delete(void *map, void *tdata, map_key_t key)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_delete_helper(map, key, tdata);
+	nalloc_op_end();
+	if (ret) map_size_add(((avl_t *)map)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *map, void *tdata, map_key_t key1, map_key_t key2)
+{
+	return map_delete_range_each(map, tdata, key1, key2);
+}
+
 int map_update(void *map, void *tdata, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _avl_update_helper(map, key, value, tdata);
+	nalloc_op_end();
+	map_size_updated(((avl_t *)map)->size, ret);
 	return ret;
 }
 
+long long map_size(void *map, void *tdata, int exact)
+{
+	return map_size_sum(((avl_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	int ret = 0;
@@ -2,6 +2,7 @@
 #define _AVL_VALIDATE_H_
 
 #include "avl.h"
+#include "utils.h" //> MAX()
 
 static int total_paths;
 static int min_path_len, max_path_len;
@@ -20,7 +21,11 @@ static int _avl_validate_rec(avl_node_t *root, int _depth,
 
 	if (!root) return -1;
 
+#	ifdef NODE_HAS_MARK
+	if (root->marked) marked_nodes++;
+#	else
 	if (root->data == MARKED_NODE) marked_nodes++;
+#	endif
 #	ifdef NODE_HAS_LOCK
 	if (root->lock != 1) locked_nodes++;
 #	endif
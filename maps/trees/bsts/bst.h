@@ -7,6 +7,9 @@
 #include <string.h>  //> memcpy()
 #include "../../key/key.h"
 #include "../../map.h"
+#include "../../nav.h"
+#include "../../destroy.h"
+#include "../../size.h"
 #include "alloc.h"
 
 typedef struct bst_node_s {
@@ -32,7 +35,13 @@ typedef struct bst_node_s {
 	int height;
 #	endif
 
-#	ifdef NODE_HAS_UPDATE
+#	if defined(NODE_HAS_UPDATE) && defined(NODE_HAS_RQ_TIMESTAMPS)
+	//> Only internal nodes are updated and only leaves are in limbo lists.
+	union {
+		info_t *update;
+		struct bst_node_s *rq_next;
+	};
+#	elif defined(NODE_HAS_UPDATE)
 	info_t *update;
 #	endif
 
@@ -51,10 +60,25 @@ typedef struct bst_node_s {
 #	ifdef NODE_HAS_LR_HEIGHTS
 	short int lheight, rheight;
 #	endif
+
+#	ifdef NODE_HAS_MARK
+	//> Logical deletion, apart from `data` so that every value can be stored.
+	volatile char marked;
+#	endif
+
+#	ifdef NODE_HAS_RQ_TIMESTAMPS
+	//> Only used in leaves, see rq.h.
+	volatile char rq_claimed, rq_unlinked;
+	volatile unsigned long itime, dtime;
+#		ifndef NODE_HAS_UPDATE
+	struct bst_node_s *rq_next;
+#		endif
+#	endif
 } bst_node_t;
 
 typedef struct {
 	bst_node_t *root;
+	map_size_t *size; //> See size.h.
 #	if defined(SYNC_CG_SPINLOCK) || defined(SYNC_CG_HTM) || defined(SYNC_RCU_HTM)
 	pthread_spinlock_t lock;
 #	endif
@@ -68,7 +92,12 @@ static bst_node_t *bst_node_new(map_key_t key, void *data, char isleaf)
 static bst_node_t *bst_node_new(map_key_t key, void *data)
 #endif
 {
+#	if defined(SYNC_RCU_HTM)
+	//> All new nodes of RCU-HTM are copies of an update attempt.
+	bst_node_t *node = rcu_copy_alloc(nalloc, sizeof(*node));
+#	else
 	bst_node_t *node = nalloc_alloc_node(nalloc);
+#	endif
 	memset(node, 0, sizeof(*node));
 	KEY_COPY(node->key, key);
 	node->data = data;
@@ -91,11 +120,108 @@ static bst_node_t *bst_node_new(map_key_t key, void *data)
 
 static bst_node_t *bst_node_new_copy(bst_node_t *src)
 {
+#	if defined(SYNC_RCU_HTM)
+	bst_node_t *node = rcu_copy_alloc(nalloc, sizeof(*node));
+#	else
 	bst_node_t *node = nalloc_alloc_node(nalloc);
+#	endif
 	memcpy(node, src, sizeof(*node));
 	return node;
 }
 
+#ifndef NODE_HAS_ISLEAF
+/**
+ * Bulk loading: build perfectly balanced trees out of the sorted
+ * keys[lo..hi] and return their root. The middle key goes to the root, so
+ * the right subtree is never smaller than the left one in internal trees
+ * and never larger in external ones. With NODE_HAS_HEIGHT the heights are
+ * set too (leaves have height 0).
+ **/
+static bst_node_t *bst_bulk_build_internal(map_key_t *keys, void **values,
+                                           long long lo, long long hi)
+{
+	bst_node_t *n;
+	long long mid;
+
+	if (lo > hi) return NULL;
+
+	mid = lo + (hi - lo) / 2;
+	n = bst_node_new(keys[mid], values ? values[mid] : NULL);
+	n->left = bst_bulk_build_internal(keys, values, lo, mid - 1);
+	n->right = bst_bulk_build_internal(keys, values, mid + 1, hi);
+#	ifdef NODE_HAS_HEIGHT
+	n->height = n->right ? n->right->height + 1 : 0;
+#	endif
+	return n;
+}
+
+//> The key of an internal node is the largest key of its left subtree.
+static bst_node_t *bst_bulk_build_external(map_key_t *keys, void **values,
+                                           long long lo, long long hi)
+{
+	bst_node_t *n;
+	long long mid;
+
+	if (lo > hi) return NULL;
+	if (lo == hi) return bst_node_new(keys[lo], values ? values[lo] : NULL);
+
+	mid = lo + (hi - lo) / 2;
+	n = bst_node_new(keys[mid], NULL);
+	n->left = bst_bulk_build_external(keys, values, lo, mid);
+	n->right = bst_bulk_build_external(keys, values, mid + 1, hi);
+#	ifdef NODE_HAS_HEIGHT
+	n->height = n->left->height + 1;
+#	endif
+	return n;
+}
+#endif /* NODE_HAS_ISLEAF */
+
+/**
+ * Ordered navigation (see nav.h). In internal trees the answer is the last
+ * node of the path of `key` where we go left (forward) or right (backward).
+ **/
+static bst_node_t *bst_nav_internal(bst_node_t *n, map_key_t key, map_nav_t op)
+{
+	bst_node_t *ret = NULL;
+
+	while (n) {
+		if (MAP_NAV_KEY_OK(op, n->key, key)) {
+			ret = n;
+			n = MAP_NAV_IS_FORWARD(op) ? n->left : n->right;
+		} else {
+			n = MAP_NAV_IS_FORWARD(op) ? n->right : n->left;
+		}
+	}
+	return ret;
+}
+
+//> In external trees the keys that are not larger than the key of an
+//> internal node are in its left subtree and only leaves hold keys. The key
+//> of an internal node may have been deleted, so if the leaf we reach is not
+//> the answer, the answer is the first leaf of the last subtree we skipped.
+static bst_node_t *bst_nav_external(bst_node_t *n, map_key_t key, map_nav_t op)
+{
+	bst_node_t *skipped = NULL;
+	int forward = MAP_NAV_IS_FORWARD(op);
+
+	if (n == NULL) return NULL;
+	while (n->left) {
+		if (op == MAP_NAV_SUCC && KEY_CMP(key, n->key) >= 0) {
+			n = n->right;
+		} else if (op == MAP_NAV_PRED && KEY_CMP(key, n->key) <= 0) {
+			n = n->left;
+		} else {
+			skipped = forward ? n->right : n->left;
+			n = forward ? n->left : n->right;
+		}
+	}
+	if (MAP_NAV_KEY_OK(op, n->key, key)) return n;
+	if (skipped == NULL) return NULL;
+	n = skipped;
+	while (n->left) n = forward ? n->left : n->right;
+	return n;
+}
+
 static bst_t *_bst_new_helper()
 {
 	bst_t *bst;
@@ -107,4 +233,16 @@ static bst_t *_bst_new_helper()
 	return bst;
 }
 
+//> map_destroy() callbacks of the BSTs with plain child pointers (see destroy.h).
+static void bst_destroy_children(void *node, destroy_stack_t *stack)
+{
+	destroy_push(stack, ((bst_node_t *)node)->left);
+	destroy_push(stack, ((bst_node_t *)node)->right);
+}
+
+static void bst_destroy_node(void *node)
+{
+	nalloc_free_node_now(nalloc, node);
+}
+
 #endif /* _BST_H_ */
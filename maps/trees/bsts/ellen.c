@@ -4,6 +4,8 @@
 #include <assert.h>
 
 #include "../../map.h"
+#include "../../size.h"
+#include "../../delete_range.h"
 #include "../../key/key.h"
 
 #include "arch.h" /* CACHE_LINE_SIZE */
@@ -41,7 +43,11 @@ union info_t {
 
 #define NODE_HAS_UPDATE
 #define NODE_HAS_ISLEAF
+#if !defined(NALLOC_HAZARD_POINTERS)
+#	define NODE_HAS_RQ_TIMESTAMPS
+#endif
 #include "bst.h"
+#include "rq.h"
 #define BST_EXTERNAL
 #define BST_ELLEN
 #include "validate.h"
@@ -64,6 +70,87 @@ static __thread void *nalloc_info;
 #define FLAG(ptr, flag) ((((uint64_t)(ptr)) & 0xfffffffffffffffc) | flag)
 #define UNFLAG(ptr)	    (((uint64_t)(ptr)) & 0xfffffffffffffffc)
 
+static void bst_help_marked(info_t *op);
+
+#if defined(NALLOC_HAZARD_POINTERS)
+//> Hazard slots [0, HP_SEARCH_SLOTS) hold the nodes and info records of the
+//> search result. The rest hold an operation's own info record or the nodes
+//> referenced by an info record that we help.
+#define HP_SEARCH_SLOTS 5
+#define HP_SLOT_OWN_OP  5
+#define HP_SLOT_HELP_0  5
+#define HP_SLOT_HELP_1  6
+#define HP_SLOT_HELP_2  7
+
+static int hp_free_slot(int s1, int s2, int s3, int s4)
+{
+	int i;
+	for (i=0; i < HP_SEARCH_SLOTS; i++)
+		if (i != s1 && i != s2 && i != s3 && i != s4) return i;
+	assert(0);
+	return -1;
+}
+
+/**
+ * bst_search() with hazard pointers.
+ * A node's children can only change while its update field is flagged and
+ * a node is unlinked only after its update field has been marked. Thus, a
+ * child `c` of `l` is still in the tree if, after protecting it, both
+ * l->update and the child pointer are unchanged and l is not marked.
+ * The info record of l->update is protected the same way, since it is
+ * retired only after it is replaced.
+ * When we reach a marked node we help unlink it, if its parent is still
+ * flagged for that delete, and restart.
+ **/
+static search_result_t *bst_search(map_key_t key, bst_node_t *root)
+{
+	search_result_t *res = &last_result;
+	bst_node_t *gp, *p, *l, *c, **child_addr;
+	info_t *gpupdate, *pupdate, *lupdate, *op;
+	int p_s, l_s, pu_s, lu_s, c_s;
+
+retry:
+	//> root is a sentinel and is never removed.
+	gp = p = NULL;
+	gpupdate = pupdate = NULL;
+	p_s = pu_s = l_s = -1;
+	l = root;
+	while (!l->isleaf) {
+		lupdate = l->update;
+		lu_s = hp_free_slot(p_s, l_s, pu_s, -1);
+		nalloc_hp_protect(lu_s, (void *)UNFLAG(lupdate));
+		if (l->update != lupdate) goto retry;
+		if (GETFLAG(lupdate) == STATE_MARK) {
+			op = (info_t *)UNFLAG(lupdate);
+			if (p && pupdate == (info_t *)FLAG(op, STATE_DFLAG) &&
+			    p->update == pupdate)
+				bst_help_marked(op);
+			goto retry;
+		}
+
+		child_addr = (KEY_CMP(key, l->key) <= 0) ? &l->left : &l->right;
+		c = *child_addr;
+		c_s = hp_free_slot(p_s, l_s, pu_s, lu_s);
+		nalloc_hp_protect(c_s, c);
+		if (l->update != lupdate || *child_addr != c) goto retry;
+
+		gp = p;
+		p = l;
+		l = c;
+		gpupdate = pupdate;
+		pupdate = lupdate;
+		p_s = l_s;
+		l_s = c_s;
+		pu_s = lu_s;
+	}
+	res->gp = gp;
+	res->p = p;
+	res->l = l;
+	res->gpupdate = gpupdate;
+	res->pupdate = pupdate;
+	return res;
+}
+#else
 static search_result_t *bst_search(map_key_t key, bst_node_t *root)
 {
 	//> JimSiak, DON'T remove "volatile" from the declaration of `res`
@@ -82,18 +169,44 @@ static search_result_t *bst_search(map_key_t key, bst_node_t *root)
 	}
 	return (search_result_t *)res;
 }
+#endif
+
+#if defined(NODE_HAS_RQ_TIMESTAMPS)
+//> Returns the delete that has been committed for leaf `l`, i.e., that has
+//> marked `p`, if any. `p` must be read after the parent->leaf edge, since a
+//> leaf is unlinked only after its parent has been marked.
+static info_t *bst_leaf_deleted(bst_node_t *p, bst_node_t *l)
+{
+	info_t *u = p->update;
+	if (GETFLAG(u) == STATE_MARK && ((info_t *)UNFLAG(u))->dinfo.l == l)
+		return (info_t *)UNFLAG(u);
+	return NULL;
+}
+#endif
 
 //> JimSiak: the original version of ASCYLIB used bst_search for the
 //>          lookup operation, but this leads to very slow performance due to
 //>          more memory accesses.
-static int bst_find(map_key_t key, bst_node_t *root)
+//> Leaves are never modified, so the value of a found leaf is consistent
+//> with its key.
+static int bst_find(map_key_t key, bst_node_t *root, void **value)
 {
-	bst_node_t *c = root;
+	bst_node_t *p = NULL, *c = root;
 	while (!c->isleaf) {
+		p = c;
 		if (KEY_CMP(key, c->key) <= 0) c = c->left;
 		else                           c = c->right;
 	}
-	return (KEY_CMP(c->key, key) == 0);
+	if (KEY_CMP(c->key, key) != 0) return 0;
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	if (bst_leaf_deleted(p, c)) {
+		bst_rq_dtime(c);
+		return 0;
+	}
+	bst_rq_itime(c);
+#	endif
+	if (value) *value = c->data;
+	return 1;
 }
 
 static info_t *create_iinfo_t(bst_node_t *p, bst_node_t *ni, bst_node_t *l)
@@ -118,7 +231,16 @@ static info_t *create_dinfo_t(bst_node_t *gp, bst_node_t *p, bst_node_t *l,
 	return new_info;
 }
 
-static void bst_cas_child(bst_node_t *parent, bst_node_t *old, bst_node_t *new)
+//> Retires the info record that was referenced by an `update` field which
+//> has just been successfully replaced.
+static inline void bst_retire_info(info_t *old_update)
+{
+	info_t *info = (info_t *)UNFLAG(old_update);
+	if (info) nalloc_free_node(nalloc_info, info);
+}
+
+//> Returns 1 if the child pointer was changed by this call.
+static int bst_cas_child(bst_node_t *parent, bst_node_t *old, bst_node_t *new)
 {
 	bst_node_t **ptr;
 	//> If the parent contains MIN_KEY, i.e., it is the root of the tree, we
@@ -127,24 +249,34 @@ static void bst_cas_child(bst_node_t *parent, bst_node_t *old, bst_node_t *new)
 	ptr = &parent->right;
 	if (KEY_CMP(parent->key, MIN_KEY) != 0 && KEY_CMP(new->key, parent->key) <= 0)
 		ptr = &parent->left;
-	bst_node_t *unused = CAS_PTR(ptr, old, new);
+	return (CAS_PTR(ptr, old, new) == old);
 }
 
+//> The replaced nodes are retired only after the flag is cleared, so that
+//> they stay alive as long as the info record is installed in the tree.
 static void bst_help_insert(info_t *op)
 {
-	bst_cas_child(op->iinfo.p, op->iinfo.l, op->iinfo.new_internal);
+	int replaced;
+	replaced = bst_cas_child(op->iinfo.p, op->iinfo.l, op->iinfo.new_internal);
 	(void)CAS_PTR(&(op->iinfo.p->update), FLAG(op, STATE_IFLAG),
 	                                      FLAG(op, STATE_CLEAN));
+	if (replaced) nalloc_free_node(nalloc, op->iinfo.l);
 }
 
 static void bst_help_marked(info_t *op)
 {
 	bst_node_t *other;
+	int unlinked;
 	other = (op->dinfo.p->right == op->dinfo.l) ? op->dinfo.p->left :
 	                                              op->dinfo.p->right;
-	bst_cas_child(op->dinfo.gp, op->dinfo.p,other);
+	bst_rq_limbo_claim(op->dinfo.l);
+	unlinked = bst_cas_child(op->dinfo.gp, op->dinfo.p, other);
 	(void)CAS_PTR(&(op->dinfo.gp->update), FLAG(op,STATE_DFLAG),
 	                                       FLAG(op,STATE_CLEAN));
+	if (unlinked) {
+		nalloc_free_node(nalloc, op->dinfo.p);
+		bst_rq_leaf_unlinked(op->dinfo.l);
+	}
 }
 
 static void bst_help(info_t *u);
@@ -152,13 +284,23 @@ static void bst_help(info_t *u);
 static char bst_help_delete(info_t *op)
 {
 	info_t *result; 
+#	if defined(NALLOC_HAZARD_POINTERS)
+	//> pupdate may have been replaced and reused before we protected it.
+	//> If it is still installed it cannot be reused any more.
+	result = op->dinfo.p->update;
+	if (result == op->dinfo.pupdate)
+#	endif
 	result = CAS_PTR(&(op->dinfo.p->update), op->dinfo.pupdate,
 	                                         FLAG(op,STATE_MARK));
 	if (result == op->dinfo.pupdate || result == (info_t *)FLAG(op, STATE_MARK)) {
+		if (result == op->dinfo.pupdate) bst_retire_info(result);
 		bst_help_marked(op);
 		return 1;
 	} else {
+#		if !defined(NALLOC_HAZARD_POINTERS)
+		//> With hazard pointers `result` is not protected; the retry helps it.
 		bst_help(result);
+#		endif
 		(void)CAS_PTR(&(op->dinfo.gp->update), FLAG(op,STATE_DFLAG), FLAG(op,STATE_CLEAN));
 		return 0;
 	}
@@ -166,6 +308,25 @@ static char bst_help_delete(info_t *op)
 
 static void bst_help(info_t *u)
 {
+#	if defined(NALLOC_HAZARD_POINTERS)
+	//> The info record and the node whose update field holds `u` are
+	//> protected by the caller. Protect the nodes the record refers to and
+	//> make sure it is still installed, so that none of them is retired.
+	info_t *op = (info_t *)UNFLAG(u);
+	if (GETFLAG(u) == STATE_IFLAG) {
+		nalloc_hp_protect(HP_SLOT_HELP_0, op->iinfo.l);
+		nalloc_hp_protect(HP_SLOT_HELP_1, op->iinfo.new_internal);
+		if (op->iinfo.p->update != u) return;
+	} else if (GETFLAG(u) == STATE_DFLAG) {
+		nalloc_hp_protect(HP_SLOT_HELP_0, op->dinfo.p);
+		nalloc_hp_protect(HP_SLOT_HELP_1, op->dinfo.l);
+		nalloc_hp_protect(HP_SLOT_HELP_2, (void *)UNFLAG(op->dinfo.pupdate));
+		if (op->dinfo.gp->update != u) return;
+	} else {
+		//> Marked nodes are helped by bst_search().
+		return;
+	}
+#	endif
 	if      (GETFLAG(u) == STATE_IFLAG) bst_help_insert((info_t*)UNFLAG(u));
 	else if (GETFLAG(u) == STATE_MARK)  bst_help_marked((info_t*)UNFLAG(u));
 	else if (GETFLAG(u) == STATE_DFLAG) bst_help_delete((info_t*)UNFLAG(u)); 
@@ -191,6 +352,11 @@ static int do_bst_insert(map_key_t key, void *data, bst_node_t **new_node,
 	KEY_COPY((*new_sibling)->key, search_result->l->key);
 	(*new_sibling)->data = search_result->l->data;
 	(*new_sibling)->isleaf = 1;
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	//> The copy replaces the leaf, so the key stays in the tree since the
+	//> leaf was inserted.
+	(*new_sibling)->itime = bst_rq_itime(search_result->l);
+#	endif
 	(*new_internal)->data = 0;
 	(*new_internal)->isleaf = 0;
 
@@ -203,15 +369,48 @@ static int do_bst_insert(map_key_t key, void *data, bst_node_t **new_node,
 	}
 	KEY_COPY((*new_internal)->key, (*new_internal)->left->key);
 	op = create_iinfo_t(search_result->p, *new_internal, search_result->l);
+#	if defined(NALLOC_HAZARD_POINTERS)
+	nalloc_hp_protect(HP_SLOT_OWN_OP, op);
+#	endif
 	result = CAS_PTR(&(search_result->p->update), search_result->pupdate,
 	                                              FLAG(op,STATE_IFLAG));
 	if (result == search_result->pupdate) {
+		bst_retire_info(result);
 		bst_help_insert(op);
+		bst_rq_itime(*new_node);
 		return 1;
 	} else {
+		nalloc_free_node(nalloc_info, op);
+#		if !defined(NALLOC_HAZARD_POINTERS)
 		bst_help(result);
+#		endif
+		return 0;
+	}
+}
+
+//> Frees the nodes of an insertion that were never linked in the tree.
+static void bst_free_unused(bst_node_t *new_node, bst_node_t *new_sibling,
+                            bst_node_t *new_internal)
+{
+	if (!new_node) return;
+	nalloc_free_node(nalloc, new_node);
+	nalloc_free_node(nalloc, new_sibling);
+	nalloc_free_node(nalloc, new_internal);
+}
+
+//> Returns 1 if the leaf of `res` is still in the tree. Otherwise it helps
+//> the delete that removes it, so that the caller can search again.
+static int bst_leaf_present(search_result_t *res)
+{
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	info_t *op = bst_leaf_deleted(res->p, res->l);
+	if (op) {
+		bst_help_marked(op);
 		return 0;
 	}
+	bst_rq_itime(res->l);
+#	endif
+	return 1;
 }
 
 static int bst_insert(map_key_t key, void *data,  bst_node_t *root)
@@ -221,14 +420,84 @@ static int bst_insert(map_key_t key, void *data,  bst_node_t *root)
 
 	while(1) {
 		search_result = bst_search(key,root);
-		if (KEY_CMP(search_result->l->key, key) == 0)
+		if (KEY_CMP(search_result->l->key, key) == 0) {
+			if (!bst_leaf_present(search_result)) continue;
+			bst_free_unused(new_node, new_sibling, new_internal);
 			return 0;
+		}
 		if (do_bst_insert(key, data, &new_node, &new_sibling, &new_internal,
 		                  search_result))
 			return 1;
 	}
 }
 
+/**
+ * Replaces leaf `l` with a copy that carries the new value. It follows the
+ * protocol of do_bst_insert(), with the copy as the new internal node, so
+ * the flag on the parent keeps concurrent deletes from removing `l`.
+ **/
+static int do_bst_compute(map_key_t key, map_compute_t fn, void *arg,
+                          search_result_t *search_result)
+{
+	info_t *op, *result;
+	bst_node_t *new_leaf;
+
+	//> Another operation is currently on parent node. Help it.
+	if (GETFLAG(search_result->pupdate) != STATE_CLEAN) {
+		bst_help(search_result->pupdate);
+		return 0;
+	}
+
+	new_leaf = bst_node_new(key, fn(key, search_result->l->data, 1, arg), 1);
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	//> The key stays in the tree since `l` was inserted.
+	new_leaf->itime = bst_rq_itime(search_result->l);
+#	endif
+	op = create_iinfo_t(search_result->p, new_leaf, search_result->l);
+#	if defined(NALLOC_HAZARD_POINTERS)
+	nalloc_hp_protect(HP_SLOT_OWN_OP, op);
+#	endif
+	result = CAS_PTR(&(search_result->p->update), search_result->pupdate,
+	                                              FLAG(op,STATE_IFLAG));
+	if (result == search_result->pupdate) {
+		bst_retire_info(result);
+		bst_help_insert(op);
+		return 1;
+	} else {
+		nalloc_free_node(nalloc_info, op);
+		nalloc_free_node(nalloc, new_leaf);
+#		if !defined(NALLOC_HAZARD_POINTERS)
+		bst_help(result);
+#		endif
+		return 0;
+	}
+}
+
+static int bst_compute(map_key_t key, map_compute_t fn, void *arg,
+                       bst_node_t *root)
+{
+	bst_node_t *new_internal = NULL, *new_sibling = NULL, *new_node = NULL;
+	search_result_t *search_result;
+	void *new_value = NULL;
+
+	while (1) {
+		search_result = bst_search(key,root);
+		if (KEY_CMP(search_result->l->key, key) == 0) {
+			if (!bst_leaf_present(search_result)) continue;
+			if (do_bst_compute(key, fn, arg, search_result)) {
+				bst_free_unused(new_node, new_sibling, new_internal);
+				return 1;
+			}
+			continue;
+		}
+		//> The new leaf is allocated once, so is its value computed.
+		if (!new_node) new_value = fn(key, NULL, 0, arg);
+		if (do_bst_insert(key, new_value, &new_node, &new_sibling,
+		                  &new_internal, search_result))
+			return 0;
+	}
+}
+
 static int do_bst_delete(search_result_t *search_result)
 {
 	info_t *op, *result;
@@ -245,15 +514,23 @@ static int do_bst_delete(search_result_t *search_result)
 		return 0;
 	}
 
+	bst_rq_itime(search_result->l);
 	op = create_dinfo_t(search_result->gp, search_result->p, 
 	                    search_result->l, search_result->pupdate);
+#	if defined(NALLOC_HAZARD_POINTERS)
+	nalloc_hp_protect(HP_SLOT_OWN_OP, op);
+#	endif
 	result = CAS_PTR(&(search_result->gp->update), search_result->gpupdate,
 	                  FLAG(op,STATE_DFLAG));
 	if (result == search_result->gpupdate) {
+		bst_retire_info(result);
 		if (bst_help_delete(op) == 1)
 			return 1;
 	} else {
+		nalloc_free_node(nalloc_info, op);
+#		if !defined(NALLOC_HAZARD_POINTERS)
 		bst_help(result);
+#		endif
 	}
 	return 0;
 }
@@ -277,13 +554,17 @@ static int bst_update(map_key_t key, void *data, bst_node_t *root)
 	while (1) {
 		search_result = bst_search(key,root); 
 		if (op_is_insert == -1) {
-			if (KEY_CMP(search_result->l->key, key) == 0) op_is_insert = 0;
-			else                                          op_is_insert = 1;
+			if (KEY_CMP(search_result->l->key, key) != 0) op_is_insert = 1;
+			else if (bst_leaf_present(search_result))     op_is_insert = 0;
+			else                                          continue;
 		}
 
 		if (op_is_insert) {
-			if (KEY_CMP(search_result->l->key, key) == 0)
+			if (KEY_CMP(search_result->l->key, key) == 0) {
+				if (!bst_leaf_present(search_result)) continue;
+				bst_free_unused(new_node, new_sibling, new_internal);
 				return 0;
+			}
 			if (do_bst_insert(key, data, &new_node, &new_sibling, &new_internal, search_result))
 				return 1;
 		} else {
@@ -296,18 +577,62 @@ static int bst_update(map_key_t key, void *data, bst_node_t *root)
 	return 0;
 }
 
-static unsigned long long bst_size_rec(bst_node_t* node)
+#if defined(NODE_HAS_RQ_TIMESTAMPS)
+//> Collects the leaves in [key1, key2] of the subtree rooted at `n`, whose
+//> parent is `p`, in ascending key order. The sentinel leaves hold MIN_KEY.
+static void bst_rquery_collect(bst_node_t *p, bst_node_t *n, map_key_t key1,
+                               map_key_t key2, unsigned long ts)
 {
-		if (node->isleaf == 0) {
-			return (bst_size_rec((bst_node_t*) node->right) + bst_size_rec((bst_node_t*) node->left));
-		} else {
-			return 1;
+	if (n->isleaf) {
+		if (KEY_CMP(n->key, MIN_KEY) != 0 &&
+		    KEY_CMP(n->key, key1) >= 0 && KEY_CMP(n->key, key2) <= 0)
+			bst_rq_collect(n, bst_leaf_deleted(p, n) != NULL, ts);
+		return;
+	}
+	if (KEY_CMP(key1, n->key) <= 0) bst_rquery_collect(n, n->left, key1, key2, ts);
+	if (KEY_CMP(key2, n->key) > 0) bst_rquery_collect(n, n->right, key1, key2, ts);
+}
+
+//> Ordered navigation in the subtree rooted at `n`, whose parent is `p` (see
+//> nav.h). Like bst_find(), it skips the leaves that are being deleted.
+static bst_node_t *bst_nav_rec(bst_node_t *p, bst_node_t *n, map_key_t key,
+                               map_nav_t op)
+{
+	bst_node_t *left, *right, *ret = NULL;
+
+	if (n->isleaf) {
+		if (KEY_CMP(n->key, MIN_KEY) == 0 || !MAP_NAV_KEY_OK(op, n->key, key))
+			return NULL;
+		if (bst_leaf_deleted(p, n)) {
+			bst_rq_dtime(n);
+			return NULL;
 		}
+		bst_rq_itime(n);
+		return n;
+	}
+
+	left = n->left;
+	right = n->right;
+	if (MAP_NAV_IS_FORWARD(op)) {
+		if (op == MAP_NAV_MIN || KEY_CMP(key, n->key) < 0)
+			ret = bst_nav_rec(n, left, key, op);
+		return ret ? ret : bst_nav_rec(n, right, key, op);
+	}
+	if (op == MAP_NAV_MAX || KEY_CMP(key, n->key) > 0)
+		ret = bst_nav_rec(n, right, key, op);
+	return ret ? ret : bst_nav_rec(n, left, key, op);
 }
+#endif
 
-static unsigned long long bst_size(bst_node_t* node)
+//> map_destroy() callback (see destroy.h). The info record of an internal
+//> node is freed along with it. A marked node shares its record with its
+//> grandparent, which owns it, and in leaves `update` is the limbo link.
+static void bst_destroy_node_and_info(void *node)
 {
-	return bst_size_rec(node)-2;
+	bst_node_t *n = node;
+	if (!n->isleaf && UNFLAG(n->update) && GETFLAG(n->update) != STATE_MARK)
+		nalloc_free_node_now(nalloc_info, (info_t *)UNFLAG(n->update));
+	nalloc_free_node_now(nalloc, n);
 }
 
 /******************************************************************************/
@@ -316,10 +641,12 @@ static unsigned long long bst_size(bst_node_t* node)
 void *map_new()
 {
 	printf("Size of tree node is %lu\n", sizeof(bst_node_t));
+	nalloc = nalloc_thread_init(-1, sizeof(bst_node_t));
 	bst_t *bst = _bst_new_helper();
 	bst->root = bst_node_new(MIN_KEY, 0, 0);
 	bst->root->left = bst_node_new(MIN_KEY, 0, 1);
 	bst->root->right = bst_node_new(MIN_KEY, 0, 1);
+	bst->size = map_size_new();
 	return bst;
 }
 
@@ -339,40 +666,184 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 {
 }
 
+void map_tdata_free(void *thread_data)
+{
+	bst_rq_thread_exit();
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	bst_rq_limbo_drain();
+	destroy_tree(((bst_t *)map)->root, nthreads, bst_destroy_children,
+	             bst_destroy_node_and_info);
+	map_size_free(((bst_t *)map)->size);
+	free(map);
+}
+
+//> Not supported; map_warmup() inserts the keys instead.
+long long map_bulk_load(void *bst, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	return 0;
+}
+
 int map_lookup(void *bst, void *thread_data, map_key_t key)
+{
+	return map_get(bst, thread_data, key, NULL);
+}
+
+int map_get(void *bst, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret;
-	ret = bst_find(key, ((bst_t *)bst)->root);
+	nalloc_op_begin();
+#	if defined(NALLOC_HAZARD_POINTERS)
+	bst_node_t *l = bst_search(key, ((bst_t *)bst)->root)->l;
+	ret = (KEY_CMP(l->key, key) == 0);
+	if (ret && value_out) *value_out = l->data;
+#	else
+	ret = bst_find(key, ((bst_t *)bst)->root, value_out);
+#	endif
+	nalloc_op_end();
 	return ret;
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *bst, void *thread_data, map_key_t *keys, int n,
+                     int *results)
+{
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(bst, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
 {
-	printf("Range query not yet implemented\n");
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	unsigned long ts;
+	int nr_sorted;
+
+	nalloc_op_begin();
+	ts = bst_rq_begin();
+	bst_rquery_collect(NULL, ((bst_t *)map)->root, key1, key2, ts);
+	nr_sorted = bst_rq_nr_leaves;
+	bst_rq_scan_limbo(key1, key2, ts);
+	bst_rq_end(nr_sorted, visit, arg);
+	nalloc_op_end();
+	return 1;
+#	else
+	//> Range queries need epoch-based reclamation (see rq.h).
 	return 0;
+#	endif
+}
+
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	bst_node_t *n;
+	int ret = 0;
+
+	nalloc_op_begin();
+	n = bst_nav_rec(NULL, ((bst_t *)map)->root, key, op);
+	if (n) ret = map_nav_found(n->key, n->data, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+#	else
+	//> Like range queries, it needs epoch-based reclamation.
+	return 0;
+#	endif
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *bst, void *thread_data, map_key_t key, void *data)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = bst_insert(key, data, ((bst_t *)bst)->root);
+	nalloc_op_end();
+	if (ret) map_size_add(((bst_t *)bst)->size, 1);
+	return ret;
+}
+
+int map_compute(void *bst, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = bst_compute(key, fn, arg, ((bst_t *)bst)->root);
+	nalloc_op_end();
+	if (!ret) map_size_add(((bst_t *)bst)->size, 1);
 	return ret;
 }
 
 int map_delete(void *bst, void *thread_data, map_key_t key)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = bst_delete(key, ((bst_t *)bst)->root);
+	nalloc_op_end();
+	if (ret) map_size_add(((bst_t *)bst)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *bst, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	return map_delete_range_each(bst, thread_data, key1, key2);
+#	else
+	//> Without navigation only `key1` could be deleted.
+	return -1;
+#	endif
+}
+
 int map_update(void *bst, void *thread_data, map_key_t key, void *data)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = bst_update(key, data, ((bst_t *)bst)->root);
+	nalloc_op_end();
+	map_size_updated(((bst_t *)bst)->size, ret);
 	return ret;
 }
 
+long long map_size(void *bst, void *thread_data, int exact)
+{
+	return map_size_sum(((bst_t *)bst)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *bst)
 {
 	int ret = 1;
@@ -3,7 +3,11 @@
 #include <assert.h>
 
 #include "../../map.h"
+#include "../../size.h"
+#include "../../delete_range.h"
 #include "../../key/key.h"
+#include "../../nav.h"
+#include "../../destroy.h"
 #include "alloc.h"
 #include "arch.h"
 
@@ -36,6 +40,7 @@
 #define SETNULL(node)  ((node_t *)((((uint64_t)node) & 0xfffffffffffffffe) | 1))
 
 static __thread void *nalloc;
+static __thread void *nalloc_op;
 
 typedef __attribute__((aligned(64))) union operation_t operation_t;
 typedef __attribute__((aligned(64))) struct node_t node_t;
@@ -44,14 +49,18 @@ typedef struct child_cas_op_t {
 	char is_left;
 	node_t *expected,
 	       *update;
+	//> Set by bst_compute(), which changes the value instead of a child.
+	char is_value;
+	void *old_value,
+	     *new_value;
 } child_cas_op_t;
 
 typedef struct relocate_op_t {
 	int state; // initialize to ONGOING every time a relocate operation is created
 	node_t *dest;
 	operation_t *dest_op;
-	int remove_key;
-	int replace_key;
+	map_key_t remove_key;
+	map_key_t replace_key;
 	void *remove_value;
 	void *replace_value;
 } relocate_op_t;
@@ -63,13 +72,18 @@ union operation_t {
 };
 
 struct node_t {
-	int key; 
+	map_key_t key;
     void *value;
 	operation_t *op;
 	node_t *left,
 	       *right;
 };
 
+typedef struct {
+	node_t *root; //> The MIN_KEY node, the keys are in its right subtree.
+	map_size_t *size; //> See size.h.
+} bst_t;
+
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
 //> Per-thread data statistics
 typedef struct {
@@ -99,10 +113,10 @@ void tdata_print(tdata_t *td)
 }
 //>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>
 
-node_t *create_node(int key, void *value)
+node_t *create_node(map_key_t key, void *value)
 {
 	node_t *new_node = nalloc_alloc_node(nalloc);
-    new_node->key = key;
+    KEY_COPY(new_node->key, key);
     new_node->value = value;
     new_node->op = NULL;
 	new_node->right = SETNULL(new_node->right);
@@ -113,11 +127,21 @@ node_t *create_node(int key, void *value)
 operation_t* alloc_op()
 {
     operation_t *new_op;
-	XMALLOC(new_op, 1);
+	new_op = nalloc_alloc_node(nalloc_op);
 	memset(new_op, 0, sizeof(*new_op));
     return new_op;
 }
 
+/**
+ * An operation stays referenced by the `op` field of a node after it has
+ * completed. It is retired when that field is replaced by a different
+ * operation (or when the node gets marked for removal).
+ **/
+static inline void retire_op(operation_t *old_op)
+{
+	if (UNFLAG(old_op)) nalloc_free_node(nalloc_op, UNFLAG(old_op));
+}
+
 node_t *bst_initialize()
 {
 	//> Assign minimum key to the root, actual tree will be 
@@ -128,13 +152,20 @@ node_t *bst_initialize()
 
 /**
  * Changes the appropriate child (i.e., left or right) of node `dest` from
- * `op->expected` to `op->update`
+ * `op->expected` to `op->update`, or its value from `op->old_value` to
+ * `op->new_value`.
 **/
 static void help_child_cas(operation_t *op, node_t *dest)
 {
 	node_t **address = (op->child_cas_op.is_left) ? &(dest->left) :
 	                                                &(dest->right);
-	(void)CAS_PTR(address, op->child_cas_op.expected, op->child_cas_op.update);
+	node_t *expected = op->child_cas_op.expected;
+	if (op->child_cas_op.is_value)
+		(void)CAS_PTR(&(dest->value), op->child_cas_op.old_value,
+		                              op->child_cas_op.new_value);
+	else if (CAS_PTR(address, expected, op->child_cas_op.update) == expected &&
+	         !ISNULL(expected))
+		nalloc_free_node(nalloc, expected);
 	(void)CAS_PTR(&(dest->op), FLAG(op, STATE_OP_CHILDCAS), FLAG(op, STATE_OP_NONE));
 }
 
@@ -153,8 +184,12 @@ static void help_marked(operation_t *pred_op, node_t *pred, node_t *curr)
 	cas_op->child_cas_op.expected = curr;
 	cas_op->child_cas_op.update = new_ref;
 
-	if (CAS_BOOL(&(pred->op), pred_op, FLAG(cas_op, STATE_OP_CHILDCAS)))
+	if (CAS_BOOL(&(pred->op), pred_op, FLAG(cas_op, STATE_OP_CHILDCAS))) {
+		retire_op(pred_op);
 		help_child_cas(cas_op, pred);
+	} else {
+		nalloc_free_node(nalloc_op, cas_op);
+	}
 }
 
 static char help_relocate(operation_t *op, node_t *pred, operation_t *pred_op,
@@ -164,6 +199,7 @@ static char help_relocate(operation_t *op, node_t *pred, operation_t *pred_op,
 	if (seen_state == STATE_OP_ONGOING) {
 		operation_t *seen_op = CAS_PTR(&(op->relocate_op.dest->op), op->relocate_op.dest_op, FLAG(op, STATE_OP_RELOCATE));
 		if (seen_op == op->relocate_op.dest_op || seen_op == FLAG(op, STATE_OP_RELOCATE)) {
+			if (seen_op == op->relocate_op.dest_op) retire_op(seen_op);
 			CAS_PTR(&(op->relocate_op.state), STATE_OP_ONGOING, STATE_OP_SUCCESSFUL);
 			seen_state = STATE_OP_SUCCESSFUL;
 		} else {
@@ -172,7 +208,14 @@ static char help_relocate(operation_t *op, node_t *pred, operation_t *pred_op,
 	}
 
 	if (seen_state == STATE_OP_SUCCESSFUL) {
+#		if defined(MAP_KEY_TYPE_INT) || defined(MAP_KEY_TYPE_INT64)
 		CAS_BOOL(&(op->relocate_op.dest->key), op->relocate_op.remove_key, op->relocate_op.replace_key);
+#		else
+		//> Keys wider than a word cannot be CASed; all the helpers copy the
+		//> same key, and only while `dest` still holds the removed one.
+		if (KEY_CMP(op->relocate_op.dest->key, op->relocate_op.remove_key) == 0)
+			KEY_COPY(op->relocate_op.dest->key, op->relocate_op.replace_key);
+#		endif
 		CAS_BOOL(&(op->relocate_op.dest->value), op->relocate_op.remove_value, op->relocate_op.replace_value);
 		CAS_BOOL(&(op->relocate_op.dest->op), FLAG(op, STATE_OP_RELOCATE), FLAG(op, STATE_OP_NONE));
 	}
@@ -189,16 +232,53 @@ static char help_relocate(operation_t *op, node_t *pred, operation_t *pred_op,
 	return result;
 }
 
+#if defined(NALLOC_HAZARD_POINTERS)
+/**
+ * With hazard pointers, child CAS and relocate operations are completed only
+ * by the threads that published them. Their helpers would have to access
+ * nodes and operations (`expected`, `dest`, `dest_op`) that may already have
+ * been reclaimed and cannot be protected after the fact. The owners complete
+ * them without waiting for other threads, so the rest of the threads just
+ * retry. Marked nodes are still unlinked by any thread that finds them.
+ *
+ * Slots [0, HP_FIND_SLOTS) hold the nodes and operations found by bst_find().
+ * A node is still in the tree while its `op` field has not been marked, and
+ * its children change only through a child CAS operation installed in `op`.
+ * Thus, a child read from a node is safe to access if, after protecting it,
+ * the `op` field of its parent and the child pointer are both unchanged.
+ **/
+#define HP_FIND_SLOTS     7
+#define HP_SLOT_DEST      7 //> Node to remove when relocating.
+#define HP_SLOT_DEST_OP   8
+#define HP_SLOT_RELOC_OP  9
+
+static int hp_free_slot(int s1, int s2, int s3, int s4, int s5, int s6)
+{
+	int i;
+	for (i=0; i < HP_FIND_SLOTS; i++)
+		if (i != s1 && i != s2 && i != s3 && i != s4 && i != s5 && i != s6)
+			return i;
+	assert(0);
+	return -1;
+}
+#endif
+
 static void help(node_t *pred, operation_t *pred_op,
                  node_t *curr, operation_t *curr_op)
 {
 	switch (GETFLAG(curr_op)) {
+#	if defined(NALLOC_HAZARD_POINTERS)
+	case STATE_OP_CHILDCAS:
+	case STATE_OP_RELOCATE:
+		break;
+#	else
 	case STATE_OP_CHILDCAS:
 		help_child_cas(UNFLAG(curr_op), curr);
 		break;
 	case STATE_OP_RELOCATE:
 		help_relocate(UNFLAG(curr_op), pred, pred_op, curr);
 		break;
+#	endif
 	case STATE_OP_MARK:
 		help_marked(pred_op, pred, curr);
 		break;
@@ -207,12 +287,120 @@ static void help(node_t *pred, operation_t *pred_op,
 	}
 }
 
-static int bst_find(int k, node_t **pred, operation_t **pred_op,
+#if defined(NALLOC_HAZARD_POINTERS)
+//> `aux_root` is either the root or protected by the caller.
+static int bst_find(map_key_t k, node_t **pred, operation_t **pred_op,
                            node_t **curr, operation_t **curr_op,
                            node_t *aux_root, node_t *root,
                            tdata_t *tdata)
 {
-	int result, curr_key;
+	int result;
+	map_key_t curr_key = MIN_KEY;
+	node_t *next, **next_addr, *last_right;
+	operation_t *last_right_op;
+	int pred_s, pred_op_s, curr_s, curr_op_s, last_right_s, last_right_op_s;
+	int next_s;
+
+RETRY:
+	*pred = NULL; *pred_op = NULL;
+	pred_s = pred_op_s = -1;
+
+	result = NOT_FOUND_R;
+	*curr = aux_root;
+	curr_s = -1;
+	*curr_op = (*curr)->op;
+	curr_op_s = 0;
+	nalloc_hp_protect(curr_op_s, UNFLAG(*curr_op));
+	if ((*curr)->op != *curr_op) {
+		tdata->retries[0]++;
+		goto RETRY;
+	}
+
+	//> Ongoing operation on the root of the tree
+	if (GETFLAG(*curr_op) != STATE_OP_NONE) {
+		if (aux_root == root) {
+			tdata->retries[0]++;
+			goto RETRY;
+		} else {
+			return ABORT;
+		}
+	}
+
+	next_addr = &(*curr)->right;
+	next = *next_addr;
+	last_right = *curr;
+	last_right_op = *curr_op;
+	last_right_s = curr_s;
+	last_right_op_s = curr_op_s;
+
+	while (!ISNULL(next)) {
+		next_s = hp_free_slot(pred_s, pred_op_s, curr_s, curr_op_s,
+		                      last_right_s, last_right_op_s);
+		nalloc_hp_protect(next_s, next);
+		if ((*curr)->op != *curr_op || *next_addr != next) {
+			tdata->retries[0]++;
+			goto RETRY;
+		}
+
+		*pred = *curr;
+		*pred_op = *curr_op;
+		pred_s = curr_s;
+		pred_op_s = curr_op_s;
+		*curr = next;
+		curr_s = next_s;
+		*curr_op = (*curr)->op;
+		curr_op_s = hp_free_slot(pred_s, pred_op_s, curr_s, -1,
+		                         last_right_s, last_right_op_s);
+		nalloc_hp_protect(curr_op_s, UNFLAG(*curr_op));
+		if ((*curr)->op != *curr_op) {
+			tdata->retries[0]++;
+			goto RETRY;
+		}
+
+		if (GETFLAG(*curr_op) != STATE_OP_NONE) {
+			help(*pred, *pred_op, *curr, *curr_op);
+			tdata->retries[0]++;
+			goto RETRY;
+		}
+
+		KEY_COPY(curr_key, (*curr)->key);
+		if (KEY_CMP(k, curr_key) < 0) {
+			result = NOT_FOUND_L;
+			next_addr = &(*curr)->left;
+		} else if (KEY_CMP(k, curr_key) > 0) {
+			result = NOT_FOUND_R;
+			next_addr = &(*curr)->right;
+			last_right = *curr;
+			last_right_op = *curr_op;
+			last_right_s = curr_s;
+			last_right_op_s = curr_op_s;
+		} else {
+			result = FOUND;
+			break;
+		}
+		next = *next_addr;
+	}
+	
+	if (result != FOUND && last_right_op != last_right->op) {
+		tdata->retries[0]++;
+		goto RETRY;
+	}
+
+	if ((*curr)->op != *curr_op) {
+		tdata->retries[0]++;
+		goto RETRY;
+	}
+
+	return result;
+} 
+#else
+static int bst_find(map_key_t k, node_t **pred, operation_t **pred_op,
+                           node_t **curr, operation_t **curr_op,
+                           node_t *aux_root, node_t *root,
+                           tdata_t *tdata)
+{
+	int result;
+	map_key_t curr_key = MIN_KEY;
 	node_t *next, *last_right;
 	operation_t *last_right_op;
 
@@ -250,11 +438,11 @@ RETRY:
 			goto RETRY;
 		}
 
-		curr_key = (*curr)->key;
-		if (k < curr_key) {
+		KEY_COPY(curr_key, (*curr)->key);
+		if (KEY_CMP(k, curr_key) < 0) {
 			result = NOT_FOUND_L;
 			next = (*curr)->left;
-		} else if (k > curr_key) {
+		} else if (KEY_CMP(k, curr_key) > 0) {
 			result = NOT_FOUND_R;
 			next = (*curr)->right;
 			last_right = *curr;
@@ -277,17 +465,109 @@ RETRY:
 
 	return result;
 } 
-
-static int bst_contains(int k, node_t *root, tdata_t *tdata)
+#endif
+
+//> `value` may be NULL if the caller does not need the value.
+//> A relocation changes the key and the value of a node with two separate
+//> CASes, but only after it has changed the node's op. Thus, if the op of
+//> the found node is unchanged after we read the value, the value belongs
+//> to `k`.
+static int bst_contains(map_key_t k, node_t *root, void **value, tdata_t *tdata)
 {
 	node_t *pred, *curr;
 	operation_t *pred_op, *curr_op;
+	void *v;
+	int ret;
 
-    int ret = bst_find(k, &pred, &pred_op, &curr, &curr_op, root, root, tdata);
-	return (ret == FOUND);
+	while (1) {
+		ret = bst_find(k, &pred, &pred_op, &curr, &curr_op, root, root, tdata);
+		if (ret != FOUND) return 0;
+		if (!value) return 1;
+		v = curr->value;
+		__sync_synchronize();
+		if (curr->op == curr_op) break;
+		tdata->retries[0]++;
+	}
+	*value = v;
+	return 1;
 }
 
-static int do_bst_add(int k, void *v, int result, node_t *root, node_t **new_node,
+#if !defined(NALLOC_HAZARD_POINTERS)
+/**
+ * Ordered navigation (see nav.h). The answer is the last node of the path of
+ * `k` where we go left (forward) or right (backward). Like bst_find(), we
+ * help the operations we meet and validate the last node where we went
+ * right, since its successor may have been relocated into it. The node of
+ * the answer is validated too, since a relocation changes its key and value.
+ **/
+static int bst_nav(map_key_t k, map_nav_t op, node_t *root, map_key_t *key_out,
+                   void **value_out, tdata_t *tdata)
+{
+	node_t *pred, *curr, *next, *last_right, *found;
+	operation_t *pred_op, *curr_op, *last_right_op, *found_op;
+	int forward = MAP_NAV_IS_FORWARD(op);
+	map_key_t curr_key = MIN_KEY, found_key = MIN_KEY;
+	int ok;
+	void *found_value = NULL;
+
+RETRY:
+	found = NULL;
+	found_op = NULL;
+	curr = root;
+	curr_op = curr->op;
+
+	//> Ongoing operation on the root of the tree
+	if (GETFLAG(curr_op) != STATE_OP_NONE) {
+		help_child_cas(UNFLAG(curr_op), curr);
+		tdata->retries[0]++;
+		goto RETRY;
+	}
+
+	next = curr->right;
+	last_right = curr;
+	last_right_op = curr_op;
+
+	while (!ISNULL(next)) {
+		pred = curr;
+		pred_op = curr_op;
+		curr = next;
+		curr_op = curr->op;
+
+		if (GETFLAG(curr_op) != STATE_OP_NONE) {
+			help(pred, pred_op, curr, curr_op);
+			tdata->retries[0]++;
+			goto RETRY;
+		}
+
+		KEY_COPY(curr_key, curr->key);
+		ok = MAP_NAV_KEY_OK(op, curr_key, k);
+		if (ok) {
+			found = curr;
+			found_op = curr_op;
+			KEY_COPY(found_key, curr_key);
+			found_value = curr->value;
+		}
+		if ((ok && forward) || (!ok && !forward)) {
+			next = curr->left;
+		} else {
+			next = curr->right;
+			last_right = curr;
+			last_right_op = curr_op;
+		}
+	}
+
+	__sync_synchronize();
+	if (last_right_op != last_right->op || (found && found_op != found->op)) {
+		tdata->retries[0]++;
+		goto RETRY;
+	}
+
+	if (!found) return 0;
+	return map_nav_found(found_key, found_value, key_out, value_out);
+}
+#endif
+
+static int do_bst_add(map_key_t k, void *v, int result, node_t *root, node_t **new_node,
                       node_t *old, node_t *curr, operation_t *curr_op)
 {
 	operation_t *cas_op;
@@ -305,13 +585,15 @@ static int do_bst_add(int k, void *v, int result, node_t *root, node_t **new_nod
 	cas_op->child_cas_op.update = *new_node;
 
 	if (CAS_PTR(&curr->op, curr_op, FLAG(cas_op, STATE_OP_CHILDCAS)) == curr_op) {
+		retire_op(curr_op);
 		help_child_cas(cas_op, curr);
 		return 1;
 	}
+	nalloc_free_node(nalloc_op, cas_op);
 	return 0;
 }
 
-static int bst_add(int k, void *v, node_t *root, tdata_t *tdata)
+static int bst_add(map_key_t k, void *v, node_t *root, tdata_t *tdata)
 {
 	node_t *pred, *curr, *new_node = NULL, *old = NULL;
 	operation_t *pred_op, *curr_op;
@@ -321,7 +603,10 @@ static int bst_add(int k, void *v, node_t *root, tdata_t *tdata)
 		old = NULL;
 
 		result = bst_find(k, &pred, &pred_op, &curr, &curr_op, root, root, tdata);
-		if (result == FOUND) return 0;
+		if (result == FOUND) {
+			if (new_node) nalloc_free_node(nalloc, new_node);
+			return 0;
+		}
 
 		if (do_bst_add(k, v, result, root, &new_node, old, curr, curr_op))
 			return 1;
@@ -329,7 +614,63 @@ static int bst_add(int k, void *v, node_t *root, tdata_t *tdata)
 	}
 }
 
-static int do_bst_remove(int k, node_t *root, node_t *curr, node_t *pred,
+/**
+ * The value of a node is replaced with a child CAS operation on the node
+ * itself, so it is ordered with the other operations on the node, like a
+ * relocation that copies it, through the `op` field.
+ **/
+static int do_bst_compute(map_key_t k, map_compute_t fn, void *arg, node_t *curr,
+                          operation_t *curr_op)
+{
+	operation_t *cas_op;
+	void *v;
+
+	v = curr->value;
+	__sync_synchronize();
+	if (curr->op != curr_op) return 0;
+
+	cas_op = alloc_op();
+	cas_op->child_cas_op.is_value = 1;
+	cas_op->child_cas_op.old_value = v;
+	cas_op->child_cas_op.new_value = fn(k, v, 1, arg);
+
+	if (CAS_PTR(&curr->op, curr_op, FLAG(cas_op, STATE_OP_CHILDCAS)) == curr_op) {
+		retire_op(curr_op);
+		help_child_cas(cas_op, curr);
+		return 1;
+	}
+	nalloc_free_node(nalloc_op, cas_op);
+	return 0;
+}
+
+static int bst_compute(map_key_t k, map_compute_t fn, void *arg, node_t *root,
+                       tdata_t *tdata)
+{
+	node_t *pred, *curr, *new_node = NULL, *old = NULL;
+	operation_t *pred_op, *curr_op;
+	void *v = NULL;
+	int result = 0;
+
+	while (1) {
+		old = NULL;
+
+		result = bst_find(k, &pred, &pred_op, &curr, &curr_op, root, root, tdata);
+		if (result == FOUND) {
+			if (do_bst_compute(k, fn, arg, curr, curr_op)) {
+				if (new_node) nalloc_free_node(nalloc, new_node);
+				return 1;
+			}
+		} else {
+			//> The new node is allocated once, so is its value computed.
+			if (!new_node) v = fn(k, NULL, 0, arg);
+			if (do_bst_add(k, v, result, root, &new_node, old, curr, curr_op))
+				return 0;
+		}
+		tdata->retries[1]++;
+	}
+}
+
+static int do_bst_remove(map_key_t k, node_t *root, node_t *curr, node_t *pred,
                          operation_t *curr_op, operation_t *pred_op,
                          operation_t **reloc_op, tdata_t *tdata)
 {
@@ -340,32 +681,48 @@ static int do_bst_remove(int k, node_t *root, node_t *curr, node_t *pred,
 	if (ISNULL(curr->right) || ISNULL(curr->left)) {
 		//> Node has less than two children
 		if (CAS_BOOL(&(curr->op), curr_op, FLAG(curr_op, STATE_OP_MARK))) {
+			retire_op(curr_op);
 			help_marked(pred_op, pred, curr);
 			return 1;
 		}
 	} else {
 		//> Node has two children
+#		if defined(NALLOC_HAZARD_POINTERS)
+		//> The second bst_find() reuses the slots of the first one.
+		nalloc_hp_protect(HP_SLOT_DEST, curr);
+		nalloc_hp_protect(HP_SLOT_DEST_OP, UNFLAG(curr_op));
+#		endif
 		res = bst_find(k, &pred, &pred_op, &replace, &replace_op, curr, root, tdata);
 		if (res == ABORT || curr->op != curr_op)
 			return 0;
             
 		if (*reloc_op == NULL) *reloc_op = alloc_op(); 
+#		if defined(NALLOC_HAZARD_POINTERS)
+		//> Once `dest` is unflagged, the operation may be retired by others.
+		nalloc_hp_protect(HP_SLOT_RELOC_OP, *reloc_op);
+#		endif
 		(*reloc_op)->relocate_op.state = STATE_OP_ONGOING;
 		(*reloc_op)->relocate_op.dest = curr;
 		(*reloc_op)->relocate_op.dest_op = curr_op;
-		(*reloc_op)->relocate_op.remove_key = k;
-		(*reloc_op)->relocate_op.remove_value = res;
-		(*reloc_op)->relocate_op.replace_key = replace->key;
+		KEY_COPY((*reloc_op)->relocate_op.remove_key, k);
+		(*reloc_op)->relocate_op.remove_value = curr->value;
+		KEY_COPY((*reloc_op)->relocate_op.replace_key, replace->key);
 		(*reloc_op)->relocate_op.replace_value = replace->value;
 
-		if (CAS_BOOL(&(replace->op), replace_op, FLAG(*reloc_op, STATE_OP_RELOCATE)))
-			if (help_relocate(*reloc_op, pred, pred_op, replace))
+		if (CAS_BOOL(&(replace->op), replace_op, FLAG(*reloc_op, STATE_OP_RELOCATE))) {
+			//> The relocation is now published, so it cannot be reused
+			//> in case we need to retry.
+			operation_t *op = *reloc_op;
+			*reloc_op = NULL;
+			retire_op(replace_op);
+			if (help_relocate(op, pred, pred_op, replace))
 				return 1;
+		}
 	}
 	return 0;
 }
 
-static int bst_remove(int k, node_t *root, tdata_t *tdata)
+static int bst_remove(map_key_t k, node_t *root, tdata_t *tdata)
 {
 	node_t *pred, *curr;
 	operation_t *pred_op, *curr_op, *reloc_op = NULL;
@@ -373,15 +730,20 @@ static int bst_remove(int k, node_t *root, tdata_t *tdata)
 
 	while (1) {
         res = bst_find(k, &pred, &pred_op, &curr, &curr_op, root, root, tdata);
-		if (res != FOUND) return 0;
+		if (res != FOUND) {
+			if (reloc_op) nalloc_free_node(nalloc_op, reloc_op);
+			return 0;
+		}
 
-		if (do_bst_remove(k, root, curr, pred, curr_op, pred_op, &reloc_op, tdata))
+		if (do_bst_remove(k, root, curr, pred, curr_op, pred_op, &reloc_op, tdata)) {
+			if (reloc_op) nalloc_free_node(nalloc_op, reloc_op);
 			return 1;
+		}
 		tdata->retries[2]++;
 	}
 }
 
-static int bst_update(int k, void *v, node_t *root, tdata_t *tdata)
+static int bst_update(map_key_t k, void *v, node_t *root, tdata_t *tdata)
 {
 	node_t *pred, *curr, *new_node = NULL, *old;
 	operation_t *pred_op, *curr_op, *reloc_op = NULL;
@@ -398,16 +760,22 @@ static int bst_update(int k, void *v, node_t *root, tdata_t *tdata)
 		}
 
 		if (op_is_insert) {
-			if (res == FOUND)
+			if (res == FOUND) {
+				if (new_node) nalloc_free_node(nalloc, new_node);
 				return 0;
+			}
 			if (do_bst_add(k, v, res, root, &new_node, old, curr, curr_op))
 				return 1;
 			tdata->retries[1]++;
 		} else {
-			if (res != FOUND)
+			if (res != FOUND) {
+				if (reloc_op) nalloc_free_node(nalloc_op, reloc_op);
 				return 2;
-			if (do_bst_remove(k, root, curr, pred, curr_op, pred_op, &reloc_op, tdata))
+			}
+			if (do_bst_remove(k, root, curr, pred, curr_op, pred_op, &reloc_op, tdata)) {
+				if (reloc_op) nalloc_free_node(nalloc_op, reloc_op);
 				return 3;
+			}
 			tdata->retries[2]++;
 		}
 	}
@@ -428,9 +796,9 @@ static void _bst_validate_rec(volatile node_t *root, int _th)
 	_th++;
 
 	/* BST violation? */
-	if (!ISNULL(left) && left->key >= root->key)
+	if (!ISNULL(left) && KEY_CMP(left->key, root->key) >= 0)
 		bst_violations++;
-	if (!ISNULL(right) && right->key < root->key)
+	if (!ISNULL(right) && KEY_CMP(right->key, root->key) < 0)
 		bst_violations++;
 
 	/* We found a path (a node with at least one sentinel child). */
@@ -489,7 +857,7 @@ static void bst_print_rec(volatile node_t *root, int level)
 		return;
 	}
 
-	printf("%d\n", root->key);
+	KEY_PRINT(root->key, "", "\n");
 
 	bst_print_rec(root->left, level + 1);
 }
@@ -507,18 +875,45 @@ int bst_print(volatile node_t *n) {
 }
 /******************************************************************************/
 
+/**
+ * map_destroy() callbacks (see destroy.h). The operation of a node is freed
+ * along with it, unless the node is marked; the operation of a marked node
+ * has been retired or is owned by the destination of its relocation.
+ **/
+static void bst_destroy_children(void *node, destroy_stack_t *stack)
+{
+	node_t *n = node;
+	if (!ISNULL(n->left))  destroy_push(stack, n->left);
+	if (!ISNULL(n->right)) destroy_push(stack, n->right);
+}
+
+static void bst_destroy_node(void *node)
+{
+	node_t *n = node;
+	if (UNFLAG(n->op) && GETFLAG(n->op) != STATE_OP_MARK)
+		nalloc_free_node_now(nalloc_op, UNFLAG(n->op));
+	nalloc_free_node_now(nalloc, n);
+}
+
 /******************************************************************************/
 /*            Map interface implementation                                    */
 /******************************************************************************/
 void *map_new()
 {
+	bst_t *bst;
+
 	printf("Size of tree node is %lu\n", sizeof(node_t));
-	return (void *)bst_initialize();
+	nalloc = nalloc_thread_init(-1, sizeof(node_t));
+	XMALLOC(bst, 1);
+	bst->root = bst_initialize();
+	bst->size = map_size_new();
+	return bst;
 }
 
 void *map_tdata_new(int tid)
 {
 	nalloc = nalloc_thread_init(tid, sizeof(node_t));
+	nalloc_op = nalloc_thread_init(tid, sizeof(operation_t));
 	tdata_t *td = tdata_new(tid);
 	return td;
 }
@@ -534,44 +929,165 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	tdata_add(d1, d2, dst);
 }
 
-int map_lookup(void *bst, void *thread_data, int key)
+void map_tdata_free(void *thread_data)
+{
+	free(thread_data);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((bst_t *)map)->root, nthreads, bst_destroy_children,
+	             bst_destroy_node);
+	map_size_free(((bst_t *)map)->size);
+	free(map);
+}
+
+//> Not supported; map_warmup() inserts the keys instead.
+long long map_bulk_load(void *bst, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	return 0;
+}
+
+int map_lookup(void *bst, void *thread_data, map_key_t key)
+{
+	return map_get(bst, thread_data, key, NULL);
+}
+
+int map_get(void *bst, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret;
-	ret = bst_contains(key, bst, thread_data);
+	nalloc_op_begin();
+	ret = bst_contains(key, ((bst_t *)bst)->root, value_out, thread_data);
+	nalloc_op_end();
 	return ret;
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *bst, void *thread_data, map_key_t *keys, int n,
+                     int *results)
+{
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(bst, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
 {
 	printf("Range query not yet implemented\n");
 	return 0;
 }
 
-int map_insert(void *bst, void *thread_data, int key, void *value)
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+#	if !defined(NALLOC_HAZARD_POINTERS)
+	int ret;
+	nalloc_op_begin();
+	ret = bst_nav(key, op, ((bst_t *)map)->root, key_out, value_out, tdata);
+	nalloc_op_end();
+	return ret;
+#	else
+	//> Not supported with hazard pointers, bst_nav() does not protect the
+	//> nodes it reads.
+	return 0;
+#	endif
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
+}
+
+int map_insert(void *bst, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
-	ret = bst_add(key, value, bst, thread_data);
+	nalloc_op_begin();
+	ret = bst_add(key, value, ((bst_t *)bst)->root, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((bst_t *)bst)->size, 1);
 	return ret;
 }
 
-int map_delete(void *bst, void *thread_data, int key)
+int map_compute(void *bst, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
 {
 	int ret = 0;
-	ret = bst_remove(key, bst, thread_data);
+	nalloc_op_begin();
+	ret = bst_compute(key, fn, arg, ((bst_t *)bst)->root, thread_data);
+	nalloc_op_end();
+	if (!ret) map_size_add(((bst_t *)bst)->size, 1);
 	return ret;
 }
 
-int map_update(void *bst, void *thread_data, int key, void *value)
+int map_delete(void *bst, void *thread_data, map_key_t key)
 {
 	int ret = 0;
-	ret = bst_update(key, value, bst, thread_data);
+	nalloc_op_begin();
+	ret = bst_remove(key, ((bst_t *)bst)->root, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((bst_t *)bst)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *bst, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+#	if !defined(NALLOC_HAZARD_POINTERS)
+	return map_delete_range_each(bst, thread_data, key1, key2);
+#	else
+	//> Without navigation only `key1` could be deleted.
+	return -1;
+#	endif
+}
+
+int map_update(void *bst, void *thread_data, map_key_t key, void *value)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = bst_update(key, value, ((bst_t *)bst)->root, thread_data);
+	nalloc_op_end();
+	map_size_updated(((bst_t *)bst)->size, ret);
+	return ret;
+}
+
+long long map_size(void *bst, void *thread_data, int exact)
+{
+	return map_size_sum(((bst_t *)bst)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *bst)
 {
 	int ret = 1;
-	ret = _bst_validate_helper(bst);
+	ret = _bst_validate_helper(((bst_t *)bst)->root);
 	return ret;
 }
 
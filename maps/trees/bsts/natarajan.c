@@ -1,11 +1,18 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <assert.h>
 
 #include "utils.h"
 #include "../../key/key.h"
 #include "../../map.h"
+#include "../../size.h"
+#include "../../delete_range.h"
+#if !defined(NALLOC_HAZARD_POINTERS)
+#	define NODE_HAS_RQ_TIMESTAMPS
+#endif
 #include "bst.h"
+#include "rq.h"
 #define BST_NATARAJAN
 #define BST_EXTERNAL
 #include "validate.h"
@@ -29,13 +36,101 @@ typedef struct seek_record_t {
 	bst_node_t *ancestor,
 	           *successor,
 	           *parent,
-	           *leaf;
-	char padding[CACHE_LINE_SIZE - 4 * sizeof(bst_node_t *)];
+	           *leaf,
+	           *leaf_field; //> The parent->leaf edge, as read by the seek.
+	char padding[CACHE_LINE_SIZE - 5 * sizeof(bst_node_t *)];
 } __attribute__((aligned(CACHE_LINE_SIZE))) seek_record_t;
 
 static __thread seek_record_t *seek_record;
 static __thread void *nalloc;
 
+#if defined(NALLOC_HAZARD_POINTERS)
+//> Keeps the leaf flagged by a delete protected across its retries.
+#define HP_SLOT_LEAF_TO_DELETE (NALLOC_HP_SLOTS - 1)
+
+static int hp_free_slot(int s1, int s2, int s3, int s4)
+{
+	int i;
+	for (i=0; i < HP_SLOT_LEAF_TO_DELETE; i++)
+		if (i != s1 && i != s2 && i != s3 && i != s4) return i;
+	assert(0);
+	return -1;
+}
+
+/**
+ * seek() with hazard pointers.
+ * Every node is published in a free hazard slot before it is dereferenced
+ * and keeps its slot while it is part of the seek record.
+ * A newly reached node is still in the tree if both the edge we followed to
+ * it and the ancestor->successor edge are unchanged. The edges from
+ * successor down to leaf are tagged, so that path can only be unlinked by
+ * changing the ancestor's edge. If validation fails we restart from root.
+ **/
+static seek_record_t *seek(map_key_t key, bst_node_t *root,
+                           int *nr_nodes_traversed)
+{
+	bst_node_t *ancestor, *successor, *parent, *leaf, *current;
+	bst_node_t *parent_field, *current_field, *anchor_field;
+	bst_node_t **parent_field_addr, **current_field_addr, **anchor_addr;
+	int anc_s, suc_s, par_s, leaf_s, cur_s;
+
+retry:
+	*nr_nodes_traversed = 0;
+
+	//> root and its right child are sentinels and are never removed.
+	ancestor = root;
+	successor = parent = ADDRESS(root->right);
+	anc_s = suc_s = par_s = -1;
+	anchor_addr = &root->right;
+	anchor_field = *anchor_addr;
+
+	parent_field_addr = &parent->right;
+	parent_field = *parent_field_addr;
+	leaf = ADDRESS(parent_field);
+	leaf_s = 0;
+	nalloc_hp_protect(leaf_s, leaf);
+	if (*parent_field_addr != parent_field) goto retry;
+
+	current_field_addr = &leaf->right;
+	current_field = *current_field_addr;
+	current = ADDRESS(current_field);
+
+	while (current != NULL) {
+		cur_s = hp_free_slot(anc_s, suc_s, par_s, leaf_s);
+		nalloc_hp_protect(cur_s, current);
+		if (*current_field_addr != current_field || *anchor_addr != anchor_field)
+			goto retry;
+
+		(*nr_nodes_traversed)++;
+
+		if (!GETTAG(parent_field)) {
+			ancestor = parent;
+			anc_s = par_s;
+			successor = leaf;
+			suc_s = leaf_s;
+			anchor_addr = parent_field_addr;
+			anchor_field = parent_field;
+		}
+		parent = leaf;
+		par_s = leaf_s;
+		leaf = current;
+		leaf_s = cur_s;
+
+		parent_field = current_field;
+		parent_field_addr = current_field_addr;
+		current_field_addr = (KEY_CMP(key, current->key) <= 0) ? &current->left :
+		                                                         &current->right;
+		current_field = *current_field_addr;
+		current = ADDRESS(current_field);
+	}
+	seek_record->ancestor = ancestor;
+	seek_record->successor = successor;
+	seek_record->parent = parent;
+	seek_record->leaf = leaf;
+	seek_record->leaf_field = parent_field;
+	return seek_record;
+}
+#else
 static seek_record_t *seek(map_key_t key, bst_node_t *root,
                            int *nr_nodes_traversed)
 {
@@ -74,15 +169,77 @@ static seek_record_t *seek(map_key_t key, bst_node_t *root,
 	seek_record->successor = seek_record_l.successor;
 	seek_record->parent = seek_record_l.parent;
 	seek_record->leaf = seek_record_l.leaf;
+	seek_record->leaf_field = parent_field;
 	return seek_record;
 }
+#endif
 
-static int bst_search(map_key_t key, bst_node_t *root)
+//> `value` may be NULL if the caller does not need the value.
+//> A leaf reached through a flagged edge has been deleted.
+static int bst_search(map_key_t key, bst_node_t *root, void **value)
 {
 	int nr_nodes;
+	bst_node_t *leaf;
+
 	seek(key, root, &nr_nodes);
-	return (KEY_CMP(seek_record->leaf->key, key) == 0);
+	leaf = seek_record->leaf;
+	if (KEY_CMP(leaf->key, key) != 0) return 0;
+	if (GETFLAG(seek_record->leaf_field)) {
+		bst_rq_dtime(leaf);
+		return 0;
+	}
+	bst_rq_itime(leaf);
+	if (value) *value = leaf->data;
+	return 1;
+}
+
+/**
+ * Retires the nodes removed from the tree by a successful cleanup, i.e., all
+ * the internal nodes from `successor` down to `parent` along with the flagged
+ * leaf hanging from each one of them. The edges along this path are tagged
+ * and thus cannot change any more.
+ **/
+static void bst_retire_removed(map_key_t key, bst_node_t *successor,
+                               bst_node_t *parent, bst_node_t *leaf)
+{
+	bst_node_t *curr = successor, *next, *flagged;
+
+	while (curr != parent) {
+		if (KEY_CMP(key, curr->key) <= 0) {
+			next = curr->left;
+			flagged = curr->right;
+		} else {
+			next = curr->right;
+			flagged = curr->left;
+		}
+		bst_rq_leaf_unlinked(ADDRESS(flagged));
+		nalloc_free_node(nalloc, curr);
+		curr = ADDRESS(next);
+	}
+	nalloc_free_node(nalloc, parent);
+	bst_rq_leaf_unlinked(leaf);
+}
+
+#if defined(NODE_HAS_RQ_TIMESTAMPS)
+//> Claims the flagged leaves that a cleanup is about to remove, i.e., the
+//> ones that bst_retire_removed() will retire if the cleanup succeeds.
+static void bst_claim_removed(map_key_t key, bst_node_t *successor,
+                              bst_node_t *parent, bst_node_t *leaf)
+{
+	bst_node_t *curr = successor;
+
+	while (curr != parent) {
+		if (KEY_CMP(key, curr->key) <= 0) {
+			bst_rq_limbo_claim(ADDRESS(curr->right));
+			curr = ADDRESS(curr->left);
+		} else {
+			bst_rq_limbo_claim(ADDRESS(curr->left));
+			curr = ADDRESS(curr->right);
+		}
+	}
+	bst_rq_limbo_claim(leaf);
 }
+#endif
 
 static int bst_cleanup(map_key_t key)
 {
@@ -118,8 +275,13 @@ static int bst_cleanup(map_key_t key)
 	} while (res != untagged);
 
 	sibl = *sibling_addr;
-	if (CAS_PTR(succ_addr, ADDRESS(successor), UNTAG(sibl)) == ADDRESS(successor))
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	bst_claim_removed(key, successor, parent, ADDRESS(chld));
+#	endif
+	if (CAS_PTR(succ_addr, ADDRESS(successor), UNTAG(sibl)) == ADDRESS(successor)) {
+		bst_retire_removed(key, successor, parent, ADDRESS(chld));
 		return 1;
+	}
 
 	return 0;
 }
@@ -152,7 +314,10 @@ static int do_bst_insert(map_key_t key, void *val, uint *created,
 	(*new_internal)->key = (*new_internal)->left->key;
 
 	result = CAS_PTR(child_addr, ADDRESS(leaf), ADDRESS(*new_internal));
-	if (result == ADDRESS(leaf)) return 1;
+	if (result == ADDRESS(leaf)) {
+		bst_rq_itime(*new_node);
+		return 1;
+	}
 
 	chld = *child_addr; 
 	if ((ADDRESS(chld) == leaf) && (GETFLAG(chld) || GETTAG(chld)))
@@ -169,12 +334,85 @@ static int bst_insert(map_key_t key, void *val, bst_node_t *root)
 
 	while (1) {
 		seek(key, root, &nr_nodes);
-		if (KEY_CMP(seek_record->leaf->key, key) == 0) return 0;
+		if (KEY_CMP(seek_record->leaf->key, key) == 0) {
+			//> The key is being deleted, help remove it and retry.
+			if (GETFLAG(seek_record->leaf_field)) {
+				bst_cleanup(key);
+				continue;
+			}
+			bst_rq_itime(seek_record->leaf);
+			if (created) {
+				nalloc_free_node(nalloc, new_internal);
+				nalloc_free_node(nalloc, new_node);
+			}
+			return 0;
+		}
 		if (do_bst_insert(key, val, &created, &new_internal, &new_node))
 			return 1;
 	}
 }
 
+//> Replaces the leaf with a copy that carries the new value. Like in
+//> do_bst_insert(), the CAS fails if a delete has flagged or tagged the edge.
+static int do_bst_compute(map_key_t key, map_compute_t fn, void *arg)
+{
+	bst_node_t *parent = seek_record->parent;
+	bst_node_t *leaf = seek_record->leaf;
+	bst_node_t **child_addr;
+	bst_node_t *new_leaf, *chld;
+
+	if (KEY_CMP(key, parent->key) <= 0) child_addr = &(parent->left); 
+	else                                child_addr = &(parent->right);
+
+	new_leaf = bst_node_new(key, fn(key, leaf->data, 1, arg));
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	//> The key stays in the tree since `leaf` was inserted.
+	new_leaf->itime = bst_rq_itime(leaf);
+#	endif
+
+	if (CAS_PTR(child_addr, ADDRESS(leaf), new_leaf) == ADDRESS(leaf)) {
+		nalloc_free_node(nalloc, leaf);
+		return 1;
+	}
+	nalloc_free_node(nalloc, new_leaf);
+
+	chld = *child_addr; 
+	if ((ADDRESS(chld) == leaf) && (GETFLAG(chld) || GETTAG(chld)))
+		bst_cleanup(key);
+
+	return 0;
+}
+
+static int bst_compute(map_key_t key, map_compute_t fn, void *arg,
+                       bst_node_t *root)
+{
+	int nr_nodes;
+	bst_node_t *new_internal = NULL, *new_node = NULL;
+	uint created = 0;
+	void *new_value = NULL;
+
+	while (1) {
+		seek(key, root, &nr_nodes);
+		if (KEY_CMP(seek_record->leaf->key, key) == 0) {
+			//> The key is being deleted, help remove it and retry.
+			if (GETFLAG(seek_record->leaf_field)) {
+				bst_cleanup(key);
+				continue;
+			}
+			if (!do_bst_compute(key, fn, arg)) continue;
+			if (created) {
+				nalloc_free_node(nalloc, new_internal);
+				nalloc_free_node(nalloc, new_node);
+			}
+			return 1;
+		}
+		//> The new leaf is allocated once, so is its value computed.
+		if (!created) new_value = fn(key, NULL, 0, arg);
+		if (do_bst_insert(key, new_value, &created, &new_internal, &new_node))
+			return 0;
+	}
+}
+
 static int do_bst_remove(map_key_t key, int *injecting, bst_node_t **leaf)
 {
 	void *val = seek_record->leaf->data;
@@ -190,9 +428,16 @@ static int do_bst_remove(map_key_t key, int *injecting, bst_node_t **leaf)
 		if (KEY_CMP((*leaf)->key, key) != 0) return 0;
 
 		lf = ADDRESS(*leaf);
+		bst_rq_itime(lf);
 		result = CAS_PTR(child_addr, lf, FLAG(lf));
 		if (result == ADDRESS(*leaf)) {
 			*injecting = 0;
+			bst_rq_dtime(lf);
+#			if defined(NALLOC_HAZARD_POINTERS)
+			//> *leaf is compared with the leaf of later seeks, so it
+			//> must not be reused until we return.
+			nalloc_hp_protect(HP_SLOT_LEAF_TO_DELETE, lf);
+#			endif
 			if (bst_cleanup(key)) return 1;
 		} else {
 			if ((ADDRESS(*child_addr) == *leaf) &&
@@ -231,13 +476,24 @@ static int bst_update(map_key_t key, void *val, bst_node_t *root)
 	while (1) {
 		seek(key, root, &nr_nodes);
 		if (op_is_insert == -1) {
-			if (KEY_CMP(seek_record->leaf->key, key) == 0) op_is_insert = 0;
-			else                                           op_is_insert = 1;
+			if (KEY_CMP(seek_record->leaf->key, key) == 0 &&
+			    !GETFLAG(seek_record->leaf_field)) op_is_insert = 0;
+			else                                  op_is_insert = 1;
 		}
 
 		if (op_is_insert) {
-			if (KEY_CMP(seek_record->leaf->key, key) == 0)
+			if (KEY_CMP(seek_record->leaf->key, key) == 0) {
+				if (GETFLAG(seek_record->leaf_field)) {
+					bst_cleanup(key);
+					continue;
+				}
+				bst_rq_itime(seek_record->leaf);
+				if (created) {
+					nalloc_free_node(nalloc, new_internal);
+					nalloc_free_node(nalloc, new_node);
+				}
 				return 0;
+			}
 			if (do_bst_insert(key, val, &created, &new_internal, &new_node))
 				return 1;
 		} else {
@@ -247,25 +503,82 @@ static int bst_update(map_key_t key, void *val, bst_node_t *root)
     }
 }
 
+#if defined(NODE_HAS_RQ_TIMESTAMPS)
+//> Collects the leaves in [key1, key2] of the subtree that hangs from the
+//> edge `field`, in ascending key order. The sentinel leaves hold MIN_KEY.
+static void bst_rquery_collect(bst_node_t *field, map_key_t key1,
+                               map_key_t key2, unsigned long ts)
+{
+	bst_node_t *n = ADDRESS(field), *left = n->left;
+
+	if (!ADDRESS(left)) {
+		if (KEY_CMP(n->key, MIN_KEY) != 0 &&
+		    KEY_CMP(n->key, key1) >= 0 && KEY_CMP(n->key, key2) <= 0)
+			bst_rq_collect(n, GETFLAG(field), ts);
+		return;
+	}
+	if (KEY_CMP(key1, n->key) <= 0) bst_rquery_collect(left, key1, key2, ts);
+	if (KEY_CMP(key2, n->key) > 0) bst_rquery_collect(n->right, key1, key2, ts);
+}
+
+//> Ordered navigation in the subtree that hangs from the edge `field` (see
+//> nav.h). Like bst_search(), it skips the leaves reached through a flagged
+//> edge.
+static bst_node_t *bst_nav_rec(bst_node_t *field, map_key_t key, map_nav_t op)
+{
+	bst_node_t *n = ADDRESS(field), *left = n->left, *right = n->right;
+	bst_node_t *ret = NULL;
+
+	if (!ADDRESS(left)) {
+		if (KEY_CMP(n->key, MIN_KEY) == 0 || !MAP_NAV_KEY_OK(op, n->key, key))
+			return NULL;
+		if (GETFLAG(field)) {
+			bst_rq_dtime(n);
+			return NULL;
+		}
+		bst_rq_itime(n);
+		return n;
+	}
+
+	if (MAP_NAV_IS_FORWARD(op)) {
+		if (op == MAP_NAV_MIN || KEY_CMP(key, n->key) < 0)
+			ret = bst_nav_rec(left, key, op);
+		return ret ? ret : bst_nav_rec(right, key, op);
+	}
+	if (op == MAP_NAV_MAX || KEY_CMP(key, n->key) > 0)
+		ret = bst_nav_rec(right, key, op);
+	return ret ? ret : bst_nav_rec(left, key, op);
+}
+#endif
+
+//> map_destroy() callback (see destroy.h); the edges may be flagged or tagged.
+static void bst_destroy_children_address(void *node, destroy_stack_t *stack)
+{
+	destroy_push(stack, ADDRESS(((bst_node_t *)node)->left));
+	destroy_push(stack, ADDRESS(((bst_node_t *)node)->right));
+}
+
 /******************************************************************************/
 /*            Map interface implementation                                    */
 /******************************************************************************/
 void *map_new()
 {
 	printf("Size of tree node is %lu\n", sizeof(bst_node_t));
+	nalloc = nalloc_thread_init(-1, sizeof(bst_node_t));
 	bst_t *bst = _bst_new_helper();
 	bst->root = bst_node_new(MIN_KEY, NULL);
 	bst->root->left = bst_node_new(MIN_KEY, NULL);
 	bst->root->right = bst_node_new(MIN_KEY, NULL);
 	bst->root->right->left = bst_node_new(MIN_KEY, NULL);
 	bst->root->right->right = bst_node_new(MIN_KEY, NULL);
+	bst->size = map_size_new();
 	return bst;
 }
 
 void *map_tdata_new(int tid)
 {
 	nalloc = nalloc_thread_init(tid, sizeof(bst_node_t));
-	XMALLOC(seek_record, 1);
+	if (!seek_record) XMALLOC(seek_record, 1);
 	return NULL;
 }
 
@@ -278,40 +591,181 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 {
 }
 
+void map_tdata_free(void *thread_data)
+{
+	free(seek_record);
+	seek_record = NULL;
+	bst_rq_thread_exit();
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	bst_rq_limbo_drain();
+	destroy_tree(((bst_t *)map)->root, nthreads, bst_destroy_children_address,
+	             bst_destroy_node);
+	map_size_free(((bst_t *)map)->size);
+	free(map);
+}
+
+//> Not supported; map_warmup() inserts the keys instead.
+long long map_bulk_load(void *bst, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	return 0;
+}
+
 int map_lookup(void *bst, void *thread_data, map_key_t key)
+{
+	return map_get(bst, thread_data, key, NULL);
+}
+
+int map_get(void *bst, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret;
-	ret = bst_search(key, ((bst_t *)bst)->root);
+	nalloc_op_begin();
+	ret = bst_search(key, ((bst_t *)bst)->root, value_out);
+	nalloc_op_end();
 	return ret;
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *bst, void *thread_data, map_key_t *keys, int n,
+                     int *results)
+{
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(bst, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	bst_node_t *root = ((bst_t *)map)->root;
+	unsigned long ts;
+	int nr_sorted;
+
+	nalloc_op_begin();
+	ts = bst_rq_begin();
+	bst_rquery_collect(ADDRESS(root->right)->right, key1, key2, ts);
+	nr_sorted = bst_rq_nr_leaves;
+	bst_rq_scan_limbo(key1, key2, ts);
+	bst_rq_end(nr_sorted, visit, arg);
+	nalloc_op_end();
+	return 1;
+#	else
+	//> Range queries need epoch-based reclamation (see rq.h).
+	return 0;
+#	endif
+}
+
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
 {
-	printf("Range query not yet implemented\n");
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	bst_node_t *n;
+	int ret = 0;
+
+	nalloc_op_begin();
+	n = bst_nav_rec(((bst_t *)map)->root, key, op);
+	if (n) ret = map_nav_found(n->key, n->data, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+#	else
+	//> Like range queries, it needs epoch-based reclamation.
 	return 0;
+#	endif
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *bst, void *thread_data, map_key_t key, void *data)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = bst_insert(key, data, ((bst_t *)bst)->root);
+	nalloc_op_end();
+	if (ret) map_size_add(((bst_t *)bst)->size, 1);
+	return ret;
+}
+
+int map_compute(void *bst, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = bst_compute(key, fn, arg, ((bst_t *)bst)->root);
+	nalloc_op_end();
+	if (!ret) map_size_add(((bst_t *)bst)->size, 1);
 	return ret;
 }
 
 int map_delete(void *bst, void *thread_data, map_key_t key)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = bst_remove(key, ((bst_t *)bst)->root);
+	nalloc_op_end();
+	if (ret) map_size_add(((bst_t *)bst)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *bst, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+#	if defined(NODE_HAS_RQ_TIMESTAMPS)
+	return map_delete_range_each(bst, thread_data, key1, key2);
+#	else
+	//> Without navigation only `key1` could be deleted.
+	return -1;
+#	endif
+}
+
 int map_update(void *bst, void *thread_data, map_key_t key, void *data)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = bst_update(key, data, ((bst_t *)bst)->root);
+	nalloc_op_end();
+	map_size_updated(((bst_t *)bst)->size, ret);
 	return ret;
 }
 
+long long map_size(void *bst, void *thread_data, int exact)
+{
+	return map_size_sum(((bst_t *)bst)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *bst)
 {
 	int ret = 1;
@@ -7,6 +7,8 @@
 #include "alloc.h"
 #include "ht.h"
 #include "../../map.h"
+#include "../../size.h"
+#include "../../delete_range.h"
 #include "../../key/key.h"
 #include "../../rcu-htm/tdata.h"
 #include "htm/htm.h"
@@ -22,14 +24,14 @@
  * contains `key`. `parent` is either leaf's parent (if `leaf` != NULL) or
  * the node that will be the parent of the inserted node.
  **/
-static inline void _traverse(bst_t *bst, int key, bst_node_t **parent,
+static inline void _traverse(bst_t *bst, map_key_t key, bst_node_t **parent,
                                                   bst_node_t **leaf)
 {
 	*parent = NULL;
 	*leaf = bst->root;
 
 	while (*leaf) {
-		int leaf_key = (*leaf)->key;
+		map_key_t leaf_key = (*leaf)->key;
 		if (leaf_key == key)
 			return;
 
@@ -41,7 +43,7 @@ static inline void _traverse(bst_t *bst, int key, bst_node_t **parent,
 //> Be careful when changing this
 #define MAX_HEIGHT 100
 
-static inline void _traverse_with_stack(bst_t *avl, int key,
+static inline void _traverse_with_stack(bst_t *avl, map_key_t key,
                                         bst_node_t *node_stack[MAX_HEIGHT],
                                         int *stack_top)
 {
@@ -49,22 +51,25 @@ static inline void _traverse_with_stack(bst_t *avl, int key,
 	*stack_top = -1;
 	while (leaf) {
 		node_stack[++(*stack_top)] = leaf;
-		int leaf_key = leaf->key;
+		map_key_t leaf_key = leaf->key;
 		if (leaf_key == key) return;
 		parent = leaf;
 		leaf = (key < leaf_key) ? leaf->left : leaf->right;
 	}
 }
 
-static int _bst_lookup_helper(bst_t *bst, int key)
+//> `value` may be NULL if the caller does not need the value.
+static int _bst_lookup_helper(bst_t *bst, map_key_t key, void **value)
 {
 	bst_node_t *parent, *leaf;
 
 	_traverse(bst, key, &parent, &leaf);
-	return (leaf != NULL);
+	if (!leaf) return 0;
+	if (value) *value = leaf->data;
+	return 1;
 }
 
-static bst_node_t *_insert_with_copy(int key, void *value,
+static bst_node_t *_insert_with_copy(map_key_t key, void *value,
         bst_node_t *node_stack[MAX_HEIGHT], int stack_top, tdata_t *tdata,
         bst_node_t **tree_copy_root_ret, int *connection_point_stack_index)
 {
@@ -81,7 +86,7 @@ static bst_node_t *_insert_with_copy(int key, void *value,
 	return connection_point;
 }
 
-static int _bst_insert_helper(bst_t *bst, int key, void *value, tdata_t *tdata)
+static int _bst_insert_helper(bst_t *bst, map_key_t key, void *value, tdata_t *tdata)
 {
 	bst_node_t *node_stack[MAX_HEIGHT];
 	int stack_top;
@@ -91,8 +96,10 @@ static int _bst_insert_helper(bst_t *bst, int key, void *value, tdata_t *tdata)
 	bst_node_t *tree_copy_root, *connection_point;
 	int connection_point_stack_index;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 
 	if (++retries >= TX_NUM_RETRIES) {
@@ -243,7 +250,7 @@ static inline void _find_successor_with_stack(bst_node_t *node,
 	ht_insert(tdata->ht, &leaf->left, NULL);
 }
 
-static int _delete_with_copy(int key,
+static int _delete_with_copy(map_key_t key,
         bst_node_t *node_stack[MAX_HEIGHT], int stack_top, tdata_t *tdata,
         bst_node_t **tree_copy_root_ret, int *connection_point_stack_index,
         int *new_stack_top, bst_node_t **connection_point)
@@ -280,6 +287,7 @@ static int _delete_with_copy(int key,
 			tree_copy_root = curr_cp;
 		}
 		tree_copy_root->key = to_be_deleted->key;
+		tree_copy_root->data = to_be_deleted->data;
 		*connection_point = to_be_deleted_stack_index > 0 ? 
 		                             node_stack[to_be_deleted_stack_index - 1] :
 		                             NULL;
@@ -290,7 +298,19 @@ static int _delete_with_copy(int key,
 	return 1;
 }
 
-static int _bst_delete_helper(bst_t *bst, int key, tdata_t *tdata)
+/**
+ * Retires the nodes that were replaced by a committed copy, i.e., the ones
+ * below the connection point in `node_stack`. For insertions there are none.
+ **/
+static void _retire_replaced(bst_node_t *node_stack[MAX_HEIGHT],
+                             int connection_point_stack_index, int stack_top)
+{
+	int i;
+	for (i=connection_point_stack_index+1; i <= stack_top; i++)
+		nalloc_free_node(nalloc, node_stack[i]);
+}
+
+static int _bst_delete_helper(bst_t *bst, map_key_t key, tdata_t *tdata)
 {
 	bst_node_t *node_stack[MAX_HEIGHT];
 	int stack_top;
@@ -300,8 +320,10 @@ static int _bst_delete_helper(bst_t *bst, int key, tdata_t *tdata)
 	bst_node_t *tree_copy_root, *connection_point;
 	int connection_point_stack_index;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 
 	if (++retries >= TX_NUM_RETRIES) {
@@ -330,6 +352,7 @@ try_from_scratch:
 				connection_point->right = tree_copy_root;
 		}
 		pthread_spin_unlock(&bst->lock);
+		_retire_replaced(node_stack, connection_point_stack_index, stack_top);
 		return 1;
 	}
 
@@ -428,10 +451,119 @@ validate_and_connect_copy:
 		}
 	}
 
+	_retire_replaced(node_stack, connection_point_stack_index, stack_top);
 	return 1;
 }
 
-static int _bst_update_helper(bst_t *bst, int key, void *value, tdata_t *tdata)
+/**
+ * The node that contains `key` is replaced by a copy that carries the new
+ * value, instead of writing the value in place, so that the updates that
+ * have copied the node concurrently fail validation instead of installing
+ * the old value. A missing key is inserted by _bst_insert_helper() and we
+ * start over if it has been inserted in the meantime.
+ **/
+static int _bst_compute_helper(bst_t *bst, map_key_t key, map_compute_t fn,
+                               void *arg, tdata_t *tdata)
+{
+	bst_node_t *node_stack[MAX_HEIGHT];
+	bst_node_t *node, *node_cp, *parent;
+	int stack_top;
+	tm_begin_ret_t status;
+	int retries = -1;
+	int i;
+
+	rcu_copies_begin();
+try_from_scratch:
+
+	rcu_copies_discard();
+
+	if (++retries >= TX_NUM_RETRIES) {
+		tdata->lacqs++;
+		pthread_spin_lock(&bst->lock);
+		_traverse_with_stack(bst, key, node_stack, &stack_top);
+		if (stack_top < 0 || node_stack[stack_top]->key != key) {
+			pthread_spin_unlock(&bst->lock);
+			goto insert;
+		}
+		node = node_stack[stack_top];
+		node_cp = bst_node_new_copy(node);
+		node_cp->data = fn(key, node->data, 1, arg);
+		parent = (stack_top > 0) ? node_stack[stack_top-1] : NULL;
+		if (!parent)                 bst->root = node_cp;
+		else if (key < parent->key) parent->left = node_cp;
+		else                         parent->right = node_cp;
+		pthread_spin_unlock(&bst->lock);
+		_retire_replaced(node_stack, stack_top - 1, stack_top);
+		return 1;
+	}
+
+	/* Asynchronized traversal. */
+	_traverse_with_stack(bst, key, node_stack, &stack_top);
+	if (stack_top < 0 || node_stack[stack_top]->key != key)
+		goto insert;
+
+	node = node_stack[stack_top];
+	node_cp = bst_node_new_copy(node);
+	node_cp->data = fn(key, node->data, 1, arg);
+	parent = (stack_top > 0) ? node_stack[stack_top-1] : NULL;
+
+	int validation_retries = -1;
+validate_and_connect_copy:
+
+	if (++validation_retries >= TX_NUM_RETRIES)
+		goto try_from_scratch;
+
+	/* Transactional verification. */
+	while (bst->lock != LOCK_FREE)
+		;
+
+	tdata->tx_starts++;
+	status = TX_BEGIN(0);
+	if (status == TM_BEGIN_SUCCESS) {
+		if (bst->lock != LOCK_FREE)
+			TX_ABORT(ABORT_GL_TAKEN);
+
+		// Validate the access path and the children of the copied node.
+		if (bst->root != node_stack[0])
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+		for (i=0; i < stack_top; i++) {
+			if (key < node_stack[i]->key) {
+				if (node_stack[i]->left != node_stack[i+1])
+					TX_ABORT(ABORT_VALIDATION_FAILURE);
+			} else {
+				if (node_stack[i]->right != node_stack[i+1])
+					TX_ABORT(ABORT_VALIDATION_FAILURE);
+			}
+		}
+		if (node->left != node_cp->left || node->right != node_cp->right)
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+
+		if (!parent)                 bst->root = node_cp;
+		else if (key < parent->key) parent->left = node_cp;
+		else                         parent->right = node_cp;
+
+		TX_END(0);
+	} else {
+		tdata->tx_aborts++;
+		if (ABORT_IS_EXPLICIT(status) && 
+		    ABORT_CODE(status) == ABORT_VALIDATION_FAILURE) {
+			tdata->tx_aborts_explicit_validation++;
+			goto try_from_scratch;
+		} else {
+			goto validate_and_connect_copy;
+		}
+	}
+
+	_retire_replaced(node_stack, stack_top - 1, stack_top);
+	return 1;
+
+insert:
+	if (_bst_insert_helper(bst, key, fn(key, NULL, 0, arg), tdata))
+		return 0;
+	goto try_from_scratch;
+}
+
+static int _bst_update_helper(bst_t *bst, map_key_t key, void *value, tdata_t *tdata)
 {
 	bst_node_t *node_stack[MAX_HEIGHT];
 	int stack_top;
@@ -442,8 +574,10 @@ static int _bst_update_helper(bst_t *bst, int key, void *value, tdata_t *tdata)
 	int connection_point_stack_index;
 	int op_is_insert = -1;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 
 	if (++retries >= TX_NUM_RETRIES) {
@@ -491,6 +625,7 @@ try_from_scratch:
 				connection_point->right = tree_copy_root;
 		}
 		pthread_spin_unlock(&bst->lock);
+		_retire_replaced(node_stack, connection_point_stack_index, stack_top);
 		return ret;
 	}
 
@@ -613,6 +748,7 @@ validate_and_connect_copy:
 		}
 	}
 
+	_retire_replaced(node_stack, connection_point_stack_index, stack_top);
 	return ret;
 }
 
@@ -621,8 +757,12 @@ validate_and_connect_copy:
 /******************************************************************************/
 void *map_new()
 {
+	bst_t *bst;
+
 	printf("Size of tree node is %lu\n", sizeof(bst_node_t));
-	return _bst_new_helper();
+	bst = _bst_new_helper();
+	bst->size = map_size_new();
+	return bst;
 }
 
 void *map_tdata_new(int tid)
@@ -644,40 +784,157 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	tdata_add(d1, d2, dst);
 }
 
-int map_lookup(void *map, void *thread_data, int key)
+void map_tdata_free(void *thread_data)
+{
+	rcu_scratch_free(nalloc);
+	tdata_free(thread_data);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((bst_t *)map)->root, nthreads, bst_destroy_children,
+	             bst_destroy_node);
+	map_size_free(((bst_t *)map)->size);
+	free(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	((bst_t *)map)->root = bst_bulk_build_internal(keys, values, 0, n - 1);
+	map_size_add(((bst_t *)map)->size, n);
+	return n;
+}
+
+int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
-	ret = _bst_lookup_helper(map, key);
+	nalloc_op_begin();
+	ret = _bst_lookup_helper(map, key, value_out);
+	nalloc_op_end();
 	return ret; 
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
+{
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(map, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
 {
 	printf("Range query not yet implemented\n");
 	return 0;
 }
 
-int map_insert(void *map, void *thread_data, int key, void *value)
+//> Like lookups, navigation runs outside transactions: nodes are never
+//> modified in place.
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
 {
+	bst_node_t *n;
 	int ret = 0;
+
+	nalloc_op_begin();
+	n = bst_nav_internal(((bst_t *)map)->root, key, op);
+	if (n) ret = map_nav_found(n->key, n->data, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
+}
+
+int map_insert(void *map, void *thread_data, map_key_t key, void *value)
+{
+	int ret = 0;
+	nalloc_op_begin();
 	ret = _bst_insert_helper(map, key, value, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((bst_t *)map)->size, 1);
 	return ret;
 }
 
-int map_delete(void *map, void *thread_data, int key)
+int map_compute(void *map, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
 {
 	int ret = 0;
+	nalloc_op_begin();
+	ret = _bst_compute_helper(map, key, fn, arg, thread_data);
+	nalloc_op_end();
+	if (!ret) map_size_add(((bst_t *)map)->size, 1);
+	return ret;
+}
+
+int map_delete(void *map, void *thread_data, map_key_t key)
+{
+	int ret = 0;
+	nalloc_op_begin();
 	ret = _bst_delete_helper(map, key, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((bst_t *)map)->size, -1);
 	return ret;
 }
 
-int map_update(void *map, void *thread_data, int key, void *value)
+int map_delete_range(void *map, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	return map_delete_range_each(map, thread_data, key1, key2);
+}
+
+int map_update(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = _bst_update_helper(map, key, value, thread_data);
+	nalloc_op_end();
+	map_size_updated(((bst_t *)map)->size, ret);
 	return ret;
 }
 
+long long map_size(void *map, void *thread_data, int exact)
+{
+	return map_size_sum(((bst_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	int ret = 0;
@@ -0,0 +1,273 @@
+#ifndef _BST_RQ_H_
+#define _BST_RQ_H_
+
+/**
+ * Linearizable range queries for the lock-free external BSTs, in the style of
+ * Arbel-Raviv and Brown, "Harnessing Epoch-based Reclamation for Efficient
+ * Range Queries" (PPoPP '18).
+ *
+ * A range query takes a timestamp `ts` by incrementing the global clock and
+ * returns the leaves that were in the tree at that time, i.e., those with
+ * itime <= ts < dtime.
+ *
+ * The itime and dtime of a leaf are set lazily: the first thread that
+ * observes the insertion of the leaf (reaches it) or its committed deletion
+ * (e.g., reaches it through a flagged edge) copies the clock into the field
+ * with a CAS before it acts on what it observed. Thus, the update takes
+ * effect at that point, which is always inside the update, because the
+ * updater sets the field itself before it returns.
+ *
+ * A leaf that is unlinked while a range query runs cannot be reached by the
+ * traversal of the range query any more. Before it is unlinked, the leaf is
+ * pushed to the limbo list of the first thread that claims it, and range
+ * queries scan all the limbo lists after their traversal. A leaf leaves the
+ * limbo list, and is freed, once it has been unlinked and no running range
+ * query may return it (dtime <= ts of all running range queries).
+ *
+ * The leaves reached by a range query are only kept alive by epoch-based
+ * reclamation, so maps compile this in (NODE_HAS_RQ_TIMESTAMPS) only when
+ * they do not use hazard pointers.
+ **/
+
+#if defined(NODE_HAS_RQ_TIMESTAMPS)
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "alloc.h"
+#include "arch.h"
+#include "bst.h"
+
+#define BST_RQ_LIMBO_TRIM 64      //> Leaves pushed between two trims of a limbo list.
+#define BST_RQ_TS_NONE    0UL     //> No range query running.
+#define BST_RQ_TS_PENDING (~0UL)  //> A range query is taking its timestamp.
+
+typedef struct bst_rq_thread_s {
+	//> Timestamp of the running range query, read by the other threads.
+	volatile unsigned long announce;
+	char pad[CACHE_LINE_SIZE - sizeof(unsigned long)];
+
+	bst_node_t * volatile limbo;
+	int nr_pushed;
+	//> Set when its thread has exited; the limbo list is then trimmed by the
+	//> thread that takes the record over.
+	volatile int unused;
+
+	struct bst_rq_thread_s *next;
+} bst_rq_thread_t;
+
+//> 0 means "not set yet" for itime and dtime.
+static volatile unsigned long bst_rq_clock = 1;
+static bst_rq_thread_t * volatile bst_rq_threads;
+static __thread bst_rq_thread_t *bst_rq_me;
+
+//> Grows on demand, a range query may return any number of leaves.
+static __thread bst_node_t **bst_rq_leaves;
+static __thread int bst_rq_leaves_sz, bst_rq_nr_leaves;
+
+static bst_rq_thread_t *bst_rq_thread_self()
+{
+	bst_rq_thread_t *t;
+
+	if (bst_rq_me) return bst_rq_me;
+
+	for (t = bst_rq_threads; t; t = t->next)
+		if (t->unused && __sync_bool_compare_and_swap(&t->unused, 1, 0)) {
+			bst_rq_me = t;
+			return t;
+		}
+
+	XMALLOC(t, 1);
+	memset(t, 0, sizeof(*t));
+	do {
+		t->next = bst_rq_threads;
+	} while (!__sync_bool_compare_and_swap(&bst_rq_threads, t->next, t));
+	bst_rq_me = t;
+	return t;
+}
+
+static void bst_rq_thread_exit()
+{
+	bst_rq_thread_t *me = bst_rq_me;
+
+	free(bst_rq_leaves);
+	bst_rq_leaves = NULL;
+	bst_rq_leaves_sz = bst_rq_nr_leaves = 0;
+	if (!me) return;
+	bst_rq_me = NULL;
+	__sync_synchronize();
+	me->unused = 1;
+}
+
+static inline unsigned long bst_rq_ts_set(volatile unsigned long *ts)
+{
+	if (!*ts) __sync_bool_compare_and_swap(ts, 0, bst_rq_clock);
+	return *ts;
+}
+#define bst_rq_itime(l) bst_rq_ts_set(&(l)->itime)
+#define bst_rq_dtime(l) bst_rq_ts_set(&(l)->dtime)
+
+//> Frees the leaves of our limbo list that have been unlinked and cannot be
+//> returned by any running range query.
+static void bst_rq_limbo_trim(bst_rq_thread_t *me)
+{
+	bst_rq_thread_t *t;
+	bst_node_t *l, *next, * volatile *prev;
+	unsigned long min_ts, a;
+
+	//> Range queries that start after we read the clock get a larger
+	//> timestamp than any dtime in our list.
+	min_ts = bst_rq_clock;
+	for (t = bst_rq_threads; t; t = t->next) {
+		a = t->announce;
+		if (a == BST_RQ_TS_PENDING) return;
+		if (a != BST_RQ_TS_NONE && a < min_ts) min_ts = a;
+	}
+
+	//> Range queries that scan the list concurrently may still be on the
+	//> removed leaves; nalloc_free_node() does not reuse them before they finish.
+	prev = &me->limbo;
+	for (l = me->limbo; l; l = next) {
+		next = l->rq_next;
+		if (l->rq_unlinked && l->dtime <= min_ts) {
+			__atomic_store_n(prev, next, __ATOMIC_RELEASE);
+			nalloc_free_node(nalloc, l);
+		} else {
+			prev = &l->rq_next;
+		}
+	}
+	me->nr_pushed = 0;
+}
+
+//> Must be called for every leaf whose deletion has been committed before
+//> the leaf is unlinked. Only the first caller pushes it to its limbo list.
+static void bst_rq_limbo_claim(bst_node_t *l)
+{
+	bst_rq_thread_t *me;
+
+	bst_rq_dtime(l);
+	if (l->rq_claimed || !__sync_bool_compare_and_swap(&l->rq_claimed, 0, 1))
+		return;
+	me = bst_rq_thread_self();
+	l->rq_next = me->limbo;
+	__atomic_store_n(&me->limbo, l, __ATOMIC_RELEASE);
+	if (++me->nr_pushed >= BST_RQ_LIMBO_TRIM) bst_rq_limbo_trim(me);
+}
+
+//> Called instead of nalloc_free_node() for a deleted leaf once it has been
+//> unlinked. It is freed when it leaves the limbo list.
+static inline void bst_rq_leaf_unlinked(bst_node_t *l)
+{
+	l->rq_unlinked = 1;
+}
+
+/**
+ * Empties all the limbo lists, for map_destroy(). The unlinked leaves are
+ * freed; the ones that are still in the tree are left to destroy_tree(), so
+ * this runs before it. The limbo lists are shared by all the maps of the
+ * implementation, so no thread may be using any of them.
+ **/
+static void bst_rq_limbo_drain()
+{
+	bst_rq_thread_t *t;
+	bst_node_t *l, *next;
+
+	for (t = bst_rq_threads; t; t = t->next) {
+		for (l = t->limbo; l; l = next) {
+			next = l->rq_next;
+			if (l->rq_unlinked) nalloc_free_node_now(nalloc, l);
+		}
+		t->limbo = NULL;
+		t->nr_pushed = 0;
+	}
+}
+
+static void bst_rq_leaves_grow()
+{
+	bst_rq_leaves_sz = bst_rq_leaves_sz ? 2 * bst_rq_leaves_sz : 128;
+	bst_rq_leaves = realloc(bst_rq_leaves,
+	                        bst_rq_leaves_sz * sizeof(*bst_rq_leaves));
+	if (!bst_rq_leaves) {
+		fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+		exit(1);
+	}
+}
+
+//> Returns the timestamp of the range query. The announcement is visible
+//> before the clock is incremented, since the increment is a full barrier.
+static unsigned long bst_rq_begin()
+{
+	bst_rq_thread_t *me = bst_rq_thread_self();
+	unsigned long ts;
+
+	me->announce = BST_RQ_TS_PENDING;
+	ts = __sync_fetch_and_add(&bst_rq_clock, 1);
+	me->announce = ts;
+	bst_rq_nr_leaves = 0;
+	return ts;
+}
+
+//> Adds leaf `l` to the result if it was in the tree at `ts`. `deleted`
+//> tells whether the deletion of `l` has been observed as committed.
+static inline void bst_rq_collect(bst_node_t *l, int deleted, unsigned long ts)
+{
+	if (bst_rq_itime(l) > ts) return;
+	if (deleted) {
+		if (bst_rq_dtime(l) <= ts) return;
+	} else if (l->dtime && l->dtime <= ts) {
+		return;
+	}
+	if (bst_rq_nr_leaves == bst_rq_leaves_sz) bst_rq_leaves_grow();
+	bst_rq_leaves[bst_rq_nr_leaves++] = l;
+}
+
+static void bst_rq_scan_limbo(map_key_t key1, map_key_t key2, unsigned long ts)
+{
+	bst_rq_thread_t *t;
+	bst_node_t *l;
+
+	for (t = bst_rq_threads; t; t = t->next)
+		for (l = __atomic_load_n(&t->limbo, __ATOMIC_ACQUIRE); l; l = l->rq_next)
+			if (KEY_CMP(l->key, key1) >= 0 && KEY_CMP(l->key, key2) <= 0)
+				bst_rq_collect(l, 1, ts);
+}
+
+static int bst_rq_leaf_cmp(const void *a, const void *b)
+{
+	return KEY_CMP((*(bst_node_t **)a)->key, (*(bst_node_t **)b)->key);
+}
+
+/**
+ * Visits the collected leaves in ascending key order. The first `nr_sorted`
+ * leaves come from the traversal and are already sorted; the ones found in
+ * the limbo lists are not. A key may have been collected twice, either from
+ * the traversal and a limbo list, or from two copies of the leaf.
+ **/
+static void bst_rq_end(int nr_sorted, map_visit_t visit, void *arg)
+{
+	bst_node_t *l;
+	int i;
+
+	bst_rq_me->announce = BST_RQ_TS_NONE;
+
+	if (bst_rq_nr_leaves != nr_sorted)
+		qsort(bst_rq_leaves, bst_rq_nr_leaves, sizeof(*bst_rq_leaves),
+		      bst_rq_leaf_cmp);
+	for (i=0; i < bst_rq_nr_leaves; i++) {
+		l = bst_rq_leaves[i];
+		if (i > 0 && KEY_CMP(l->key, bst_rq_leaves[i-1]->key) == 0) continue;
+		if (visit(l->key, l->data, arg)) break;
+	}
+}
+
+#else
+
+#define bst_rq_itime(l)           do { } while (0)
+#define bst_rq_dtime(l)           do { } while (0)
+#define bst_rq_limbo_claim(l)     do { } while (0)
+#define bst_rq_leaf_unlinked(l)   nalloc_free_node(nalloc, (l))
+#define bst_rq_thread_exit()      do { } while (0)
+#define bst_rq_limbo_drain()      do { } while (0)
+
+#endif /* NODE_HAS_RQ_TIMESTAMPS */
+
+#endif /* _BST_RQ_H_ */
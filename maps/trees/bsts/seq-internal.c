@@ -5,6 +5,8 @@
 #include <stdlib.h>
 
 #include "../../key/key.h"
+#include "../../size.h"
+#include "../../delete_range.h"
 
 #include "bst.h"
 #include "print.h"
@@ -35,11 +37,14 @@ static inline void _traverse(bst_t *bst, map_key_t key,
 	}
 }
 
-static int _bst_lookup_helper(bst_t *bst, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+static int _bst_lookup_helper(bst_t *bst, map_key_t key, void **value)
 {
 	bst_node_t *parent, *leaf;
 	_traverse(bst, key, &parent, &leaf);
-	return (leaf != NULL);
+	if (!leaf) return 0;
+	if (value) *value = leaf->data;
+	return 1;
 }
 
 static int _bst_insert_helper(bst_t *bst, map_key_t key, void *value)
@@ -63,6 +68,25 @@ static int _bst_insert_helper(bst_t *bst, map_key_t key, void *value)
 	return 1;
 }
 
+static int _bst_compute_helper(bst_t *bst, map_key_t key, map_compute_t fn,
+                               void *arg)
+{
+	bst_node_t *parent, *leaf, *new_node;
+
+	_traverse(bst, key, &parent, &leaf);
+
+	if (leaf) {
+		leaf->data = fn(key, leaf->data, 1, arg);
+		return 1;
+	}
+
+	new_node = bst_node_new(key, fn(key, NULL, 0, arg));
+	if (!parent)                            bst->root = new_node;
+	else if (KEY_CMP(key, parent->key) < 0) parent->left = new_node;
+	else                                    parent->right = new_node;
+	return 0;
+}
+
 static inline void _find_successor(bst_node_t *node, bst_node_t **parent,
                                                      bst_node_t **leaf)
 {
@@ -88,16 +112,20 @@ static int _bst_delete_helper(bst_t *bst, map_key_t key)
 		if (!parent) bst->root = leaf->right;
 		else if (parent->left == leaf) parent->left = leaf->right;
 		else if (parent->right == leaf) parent->right = leaf->right;
+		nalloc_free_node(nalloc, leaf);
 	} else if (!leaf->right) {
 		if (!parent) bst->root = leaf->left;
 		else if (parent->left == leaf) parent->left = leaf->left;
 		else if (parent->right == leaf) parent->right = leaf->left;
+		nalloc_free_node(nalloc, leaf);
 	} else { // Leaf has two children.
 		_find_successor(leaf, &succ_parent, &succ);
 
 		KEY_COPY(leaf->key, succ->key);
+		leaf->data = succ->data;
 		if (succ_parent->left == succ) succ_parent->left = succ->right;
 		else succ_parent->right = succ->right;
+		nalloc_free_node(nalloc, succ);
 	}
 
 	return 1;
@@ -127,15 +155,19 @@ static int _bst_update_helper(bst_t *bst, map_key_t key, void *value)
 		if (!parent) bst->root = leaf->right;
 		else if (parent->left == leaf) parent->left = leaf->right;
 		else if (parent->right == leaf) parent->right = leaf->right;
+		nalloc_free_node(nalloc, leaf);
 	} else if (!leaf->right) {
 		if (!parent) bst->root = leaf->left;
 		else if (parent->left == leaf) parent->left = leaf->left;
 		else if (parent->right == leaf) parent->right = leaf->left;
+		nalloc_free_node(nalloc, leaf);
 	} else { // Leaf has two children.
 		_find_successor(leaf, &succ_parent, &succ);
 		KEY_COPY(leaf->key, succ->key);
+		leaf->data = succ->data;
 		if (succ_parent->left == succ) succ_parent->left = succ->right;
 		else succ_parent->right = succ->right;
+		nalloc_free_node(nalloc, succ);
 	}
 
 	return 3;
@@ -147,8 +179,12 @@ static int _bst_update_helper(bst_t *bst, map_key_t key, void *value)
 /******************************************************************************/
 void *map_new()
 {
+	bst_t *bst;
+
 	printf("Size of tree node is %lu\n", sizeof(bst_node_t));
-	return _bst_new_helper();
+	bst = _bst_new_helper();
+	bst->size = map_size_new();
+	return bst;
 }
 
 void *map_tdata_new(int tid)
@@ -175,37 +211,126 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 #	endif
 }
 
+void map_tdata_free(void *thread_data)
+{
+#	if defined(SYNC_CG_HTM)
+	tx_thread_data_free(thread_data);
+#	endif
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((bst_t *)map)->root, nthreads, bst_destroy_children,
+	             bst_destroy_node);
+	map_size_free(((bst_t *)map)->size);
+	free(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	((bst_t *)map)->root = bst_bulk_build_internal(keys, values, 0, n - 1);
+	map_size_add(((bst_t *)map)->size, n);
+	return n;
+}
+
 int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((bst_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_start(TX_NUM_RETRIES, thread_data, &((bst_t *)map)->lock);
 #	endif
 
-	ret = _bst_lookup_helper(map, key);
+	ret = _bst_lookup_helper(map, key, value_out);
 
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_unlock(&((bst_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((bst_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
 	return ret; 
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
+{
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(map, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
 {
 	printf("Range query not yet implemented\n");
 	return 0;
 }
 
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	bst_node_t *n;
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((bst_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, tdata, &((bst_t *)map)->lock);
+#	endif
+
+	n = bst_nav_internal(((bst_t *)map)->root, key, op);
+	if (n) ret = map_nav_found(n->key, n->data, key_out, value_out);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((bst_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(tdata, &((bst_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+
+	return ret;
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
+}
+
 int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((bst_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -219,7 +344,34 @@ int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((bst_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
+	if (ret) map_size_add(((bst_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((bst_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, thread_data, &((bst_t *)map)->lock);
+#	endif
+
+	ret = _bst_compute_helper(map, key, fn, arg);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((bst_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(thread_data, &((bst_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+
+	if (!ret) map_size_add(((bst_t *)map)->size, 1);
 	return ret;
 }
 
@@ -227,6 +379,7 @@ int map_delete(void *map, void *thread_data, map_key_t key)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((bst_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -240,14 +393,23 @@ int map_delete(void *map, void *thread_data, map_key_t key)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((bst_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
+	if (ret) map_size_add(((bst_t *)map)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *map, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	return map_delete_range_each(map, thread_data, key1, key2);
+}
+
 int map_update(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((bst_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -261,11 +423,28 @@ int map_update(void *map, void *thread_data, map_key_t key, void *value)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((bst_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
+	map_size_updated(((bst_t *)map)->size, ret);
 	return ret;
 
 }
 
+long long map_size(void *map, void *thread_data, int exact)
+{
+	return map_size_sum(((bst_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	return bst_validate(map);
@@ -5,9 +5,14 @@
 #include <pthread.h> //> pthread_spinlock_t
 
 #include "alloc.h"
+#include "arch.h"
 #include "htm/htm.h"
 #include "ht.h"
 #include "../../../map.h"
+#include "../../../nav.h"
+#include "../../../destroy.h"
+#include "../../../size.h"
+#include "../../../delete_range.h"
 #include "../../../rcu-htm/tdata.h"
 #include "../../../key/key.h"
 
@@ -27,6 +32,7 @@ typedef struct abtree_node_s {
 
 typedef struct {
 	abtree_node_t *root;
+	map_size_t *size; //> See size.h.
 	pthread_spinlock_t lock;
 } abtree_t;
 
@@ -37,7 +43,7 @@ static __thread void *nalloc;
  **/
 static abtree_node_t *abtree_node_new(char leaf)
 {
-	abtree_node_t *ret = nalloc_alloc_node(nalloc);
+	abtree_node_t *ret = rcu_copy_alloc(nalloc, sizeof(*ret));
 	ret->no_keys = 0;
 	ret->leaf = leaf;
 	return ret;
@@ -50,9 +56,24 @@ static abtree_node_t *abtree_node_new_copy(abtree_node_t *n)
 	return ret;
 }
 
+/**
+ * Retires the nodes that were replaced by a rebalancing copy.
+ * 's' is NULL when no sibling took part in the rebalancing.
+ **/
+static void abtree_retire_rebalanced(abtree_node_t *p, abtree_node_t *l,
+                                     abtree_node_t *s)
+{
+	nalloc_free_node(nalloc, p);
+	nalloc_free_node(nalloc, l);
+	if (s) nalloc_free_node(nalloc, s);
+}
+
 static int abtree_node_search(abtree_node_t *n, map_key_t key)
 {
 	int i = 0;
+#	if defined(MAP_KEY_TYPE_VAR_STR)
+	return var_str_key_search(n->keys, n->no_keys, key);
+#	endif
 	while (i < n->no_keys && KEY_CMP(key, n->keys[i]) > 0) i++;
 	return i;
 }
@@ -136,7 +157,8 @@ static map_key_t abtree_node_get_max_key(abtree_node_t *n)
 	return max;
 }
 
-static int abtree_lookup(abtree_t *abtree, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+static int abtree_lookup(abtree_t *abtree, map_key_t key, void **value)
 {
 	int index;
 	abtree_node_t *n = abtree->root;
@@ -150,7 +172,267 @@ static int abtree_lookup(abtree_t *abtree, map_key_t key)
 		n = n->children[index];
 	}
 	index = abtree_node_search(n, key);
-	return (KEY_CMP(n->keys[index], key) == 0);
+	if (index >= n->no_keys || KEY_CMP(n->keys[index], key) != 0)
+		return 0;
+	//> The value of keys[i] in a leaf is children[i+1].
+	if (value) *value = n->children[index+1];
+	return 1;
+}
+
+/**
+ * Ordered navigation in the subtree of `n` (see nav.h). The children that may
+ * hold the answer are tried in order until one of them has it, starting from
+ * the one `key` is routed to.
+ **/
+static int abtree_nav_subtree(abtree_node_t *n, map_key_t key, map_nav_t op,
+                              map_key_t *key_out, void **value_out)
+{
+	int i;
+
+	if (n->leaf) {
+		//> The value of keys[i] in a leaf is children[i+1].
+		if (MAP_NAV_IS_FORWARD(op)) {
+			for (i=0; i < n->no_keys; i++)
+				if (MAP_NAV_KEY_OK(op, n->keys[i], key))
+					return map_nav_found(n->keys[i], n->children[i+1],
+					                     key_out, value_out);
+		} else {
+			for (i=n->no_keys-1; i >= 0; i--)
+				if (MAP_NAV_KEY_OK(op, n->keys[i], key))
+					return map_nav_found(n->keys[i], n->children[i+1],
+					                     key_out, value_out);
+		}
+		return 0;
+	}
+
+	//> Child i holds the keys in [keys[i-1], keys[i]).
+	if (op == MAP_NAV_MIN) {
+		i = 0;
+	} else if (op == MAP_NAV_MAX) {
+		i = n->no_keys;
+	} else {
+		i = abtree_node_search(n, key);
+		if (op == MAP_NAV_SUCC && i < n->no_keys && KEY_CMP(n->keys[i], key) == 0)
+			i++;
+	}
+
+	if (MAP_NAV_IS_FORWARD(op)) {
+		for (; i <= n->no_keys; i++)
+			if (abtree_nav_subtree(n->children[i], key, op, key_out, value_out))
+				return 1;
+	} else {
+		for (; i >= 0; i--)
+			if (abtree_nav_subtree(n->children[i], key, op, key_out, value_out))
+				return 1;
+	}
+	return 0;
+}
+
+/**
+ * Bulk loading: builds an (a,b)-tree bottom-up out of the sorted
+ * keys[0..n-1] and returns its root. Every level has the fewest nodes that
+ * fit the level below and the keys (children) are spread evenly over them,
+ * so all nodes but the root have at least ABTREE_DEGREE_MIN keys.
+ **/
+static abtree_node_t *abtree_bulk_build(map_key_t *keys, void **values,
+                                        long long n)
+{
+	abtree_node_t **level, *node;
+	map_key_t *mins;
+	long long nnodes, nparents, i, from;
+	int j, cnt;
+
+	if (n <= 0) return NULL;
+
+	nnodes = (n + ABTREE_DEGREE_MAX - 1) / ABTREE_DEGREE_MAX;
+	XMALLOC(level, nnodes);
+	XMALLOC(mins, nnodes);
+
+	//> The leaves. The value of keys[i] in a leaf is children[i+1].
+	for (i=0, from=0; i < nnodes; i++, from += cnt) {
+		cnt = n / nnodes + (i < n % nnodes);
+		node = abtree_node_new(1);
+		node->marked = node->tag = 0;
+		for (j=0; j < cnt; j++) {
+			KEY_COPY(node->keys[j], keys[from+j]);
+			node->children[j+1] = values ? values[from+j] : NULL;
+		}
+		node->no_keys = cnt;
+		KEY_COPY(mins[i], keys[from]);
+		level[i] = node;
+	}
+
+	//> The internal levels overwrite the arrays of the level below in place;
+	//> parent i never overwrites a child it has not consumed yet.
+	//> The separator of two children is the smallest key of the right one.
+	while (nnodes > 1) {
+		nparents = (nnodes + ABTREE_DEGREE_MAX) / (ABTREE_DEGREE_MAX + 1);
+		for (i=0, from=0; i < nparents; i++, from += cnt) {
+			cnt = nnodes / nparents + (i < nnodes % nparents);
+			node = abtree_node_new(0);
+			node->marked = node->tag = 0;
+			node->children[0] = level[from];
+			for (j=1; j < cnt; j++) {
+				KEY_COPY(node->keys[j-1], mins[from+j]);
+				node->children[j] = level[from+j];
+			}
+			node->no_keys = cnt - 1;
+			if (i != from) KEY_COPY(mins[i], mins[from]);
+			level[i] = node;
+		}
+		nnodes = nparents;
+	}
+
+	node = level[0];
+	free(level);
+	free(mins);
+	return node;
+}
+
+#define ABTREE_BATCH_WIDTH 8
+
+/**
+ * Looks up `nkeys` <= ABTREE_BATCH_WIDTH keys with their traversals
+ * interleaved (group prefetching): every round moves each traversal one level
+ * down and prefetches the node it moves to, so that the cache misses of the
+ * traversals overlap instead of being paid one after the other.
+ **/
+static int abtree_lookup_batch(abtree_t *abtree, map_key_t *keys, int nkeys,
+                               int *results)
+{
+	abtree_node_t *n[ABTREE_BATCH_WIDTH], *root = abtree->root;
+	int i, index, active, found = 0;
+
+	for (i=0; i < nkeys; i++) {
+		n[i] = root;
+		results[i] = 0;
+	}
+	//> Empty tree.
+	if (!root) return 0;
+
+	do {
+		active = 0;
+		for (i=0; i < nkeys; i++) {
+			if (n[i]->leaf) continue;
+			index = abtree_node_search(n[i], keys[i]);
+			if (index < n[i]->no_keys && KEY_CMP(n[i]->keys[index], keys[i]) == 0)
+				index++;
+			n[i] = n[i]->children[index];
+			prefetch_range(n[i], sizeof(abtree_node_t));
+			active = 1;
+		}
+	} while (active);
+
+	for (i=0; i < nkeys; i++) {
+		index = abtree_node_search(n[i], keys[i]);
+		results[i] = index < n[i]->no_keys && KEY_CMP(n[i]->keys[index], keys[i]) == 0;
+		found += results[i];
+	}
+	return found;
+}
+
+#define RQUERY_MAX_NODES 20
+static __thread abtree_node_t *rquery_nodes[RQUERY_MAX_NODES];
+static __thread int rquery_nnodes, rquery_more;
+//> Where the next step of the range query starts, if `rquery_more` is set.
+static __thread map_key_t rquery_next;
+
+/**
+ * Collects the leaves of the subtree of `n` that may hold keys of
+ * [key1, key2], left to right, up to RQUERY_MAX_NODES of them. `lo` is the
+ * smallest key the subtree may hold; if a leaf does not fit, the smallest key
+ * it may hold is kept in `rquery_next`.
+ * Returns 0 once no more leaves should be collected, 1 otherwise.
+ **/
+static int abtree_rquery_collect(abtree_node_t *n, map_key_t lo,
+                                 map_key_t key1, map_key_t key2)
+{
+	int i;
+
+	if (n->leaf) {
+		if (rquery_nnodes == RQUERY_MAX_NODES) {
+			KEY_COPY(rquery_next, lo);
+			rquery_more = 1;
+			return 0;
+		}
+		rquery_nodes[rquery_nnodes++] = n;
+		return 1;
+	}
+
+	//> Child i holds the keys in [keys[i-1], keys[i]).
+	for (i=abtree_node_get_index(n, key1); i <= n->no_keys; i++) {
+		if (i > 0 && KEY_CMP(n->keys[i-1], key2) > 0) return 0;
+		if (!abtree_rquery_collect(n->children[i], i > 0 ? n->keys[i-1] : lo,
+		                           key1, key2))
+			return 0;
+	}
+	return 1;
+}
+
+//> Called inside a transaction or with the global lock held, so the leaves
+//> form a consistent snapshot of the range.
+static void abtree_get_rquery_nodes(abtree_t *abtree, map_key_t key1,
+                                    map_key_t key2)
+{
+	rquery_nnodes = rquery_more = 0;
+	if (abtree->root)
+		abtree_rquery_collect(abtree->root, key1, key1, key2);
+}
+
+/**
+ * Nodes are never modified in place once they are in the tree, only replaced
+ * by copies, so the keys of the collected leaves are visited outside of the
+ * transaction.
+ * Ranges that span more than RQUERY_MAX_NODES leaves are scanned in several
+ * steps, each one continuing from the smallest key the first leaf left out
+ * may hold; every step is atomic but the range query as a whole is not.
+ **/
+static void abtree_rquery(abtree_t *abtree, map_key_t key1, map_key_t key2,
+                          map_visit_t visit, void *arg, tdata_t *tdata)
+{
+	tm_begin_ret_t status;
+	int i, j, retries, done;
+	abtree_node_t *n;
+	map_key_t from;
+
+	KEY_COPY(from, key1);
+	while (1) {
+		//> First try with transactions
+		done = 0;
+		for (retries = 0; retries < TX_NUM_RETRIES; retries++) {
+			while (abtree->lock != LOCK_FREE) ;
+			tdata->tx_starts++;
+			status = TX_BEGIN(0);
+			if (status == TM_BEGIN_SUCCESS) {
+				if (abtree->lock != LOCK_FREE)
+					TX_ABORT(ABORT_GL_TAKEN);
+				abtree_get_rquery_nodes(abtree, from, key2);
+				TX_END(0);
+				done = 1;
+				break;
+			}
+			tdata->tx_aborts++;
+		}
+
+		//> Finally resort to the global lock
+		if (!done) {
+			tdata->lacqs++;
+			pthread_spin_lock(&abtree->lock);
+			abtree_get_rquery_nodes(abtree, from, key2);
+			pthread_spin_unlock(&abtree->lock);
+		}
+
+		for (i = 0; i < rquery_nnodes; i++) {
+			n = rquery_nodes[i];
+			for (j = 0; j < n->no_keys; j++) {
+				if (KEY_CMP(n->keys[j], from) < 0) continue;
+				if (KEY_CMP(n->keys[j], key2) > 0) return;
+				if (visit(n->keys[j], n->children[j+1], arg)) return;
+			}
+		}
+		if (!rquery_more) return;
+		KEY_COPY(from, rquery_next);
+	}
 }
 
 static void abtree_traverse_stack(abtree_t *abtree, map_key_t key,
@@ -420,7 +702,7 @@ static abtree_node_t *abtree_redistribute_sibling_keys(abtree_node_t *p, abtree_
 
 static void abtree_rebalance(abtree_t *abtree, map_key_t key, int *should_rebalance)
 {
-	abtree_node_t *gp, *p, *l, *s;
+	abtree_node_t *gp, *p, *l, *s = NULL;
 	int i = 0, gpindex, pindex, sindex;
 	abtree_node_t *copy = NULL;
 
@@ -477,6 +759,7 @@ static void abtree_rebalance(abtree_t *abtree, map_key_t key, int *should_rebala
 	if (copy) {
 		if (gp == NULL) abtree->root = copy;
 		else            gp->children[gpindex] = copy;
+		abtree_retire_rebalanced(p, l, s);
 	}
 }
 
@@ -521,13 +804,14 @@ static abtree_node_t *abtree_rebalance_with_copy(abtree_t *abtree, map_key_t key
                                    int *node_stack_indexes, int stack_top,
                                    int *should_rebalance, abtree_node_t **copy,
                                    int *connection_point_stack_index,
-                                   tdata_t *tdata)
+                                   abtree_node_t **sibling, tdata_t *tdata)
 {
 	abtree_node_t *gp, *p, *l, *s;
 	int gpindex, pindex, sindex;
 
 	*should_rebalance = 0;
 	*copy = NULL;
+	*sibling = NULL;
 	*connection_point_stack_index = -1;
 	gp = (stack_top >= 2) ? node_stack[stack_top-2] : NULL;
 	gpindex = (stack_top >= 2) ? node_stack_indexes[stack_top-2] : -1;
@@ -548,6 +832,7 @@ static abtree_node_t *abtree_rebalance_with_copy(abtree_t *abtree, map_key_t key
 	} else if (l->no_keys < ABTREE_DEGREE_MIN) {
 		sindex = pindex ? pindex - 1 : pindex + 1;
 		s = p->children[sindex];
+		*sibling = s;
 		ht_insert(tdata->ht, &p->children[sindex], s);
 		if (s->tag) {
 			//> FIXME
@@ -596,82 +881,6 @@ abtree_node_t *abtree_leaf_split(abtree_node_t *n, int index, map_key_t key, voi
 	return rnode;
 }
 
-static int abtree_do_insert(abtree_t *abtree, map_key_t key, void *val,
-                           abtree_node_t **node_stack, int *node_stack_indexes,
-                           int *node_stack_top, int *should_rebalance)
-{
-	abtree_node_t *n;
-	int index, pindex;
-
-	*should_rebalance = 0;
-
-	//> Empty tree case.
-	if (*node_stack_top == -1) {
-		n = abtree_node_new(1);
-		abtree_node_insert_index(n, 0, key, val);
-		abtree->root = n;
-		return 1;
-	}
-
-	n = node_stack[*node_stack_top];
-	index = node_stack_indexes[*node_stack_top];
-
-	//> Case of a not full leaf.
-	if (n->no_keys < ABTREE_DEGREE_MAX) {
-		abtree_node_insert_index(n, index, key, val);
-		return 1;
-	}
-
-	//> Case of a full leaf.
-	abtree_node_t *rnode = abtree_leaf_split(n, index, key, val);
-	abtree_node_t *parent_new = abtree_node_new(0);
-	abtree_node_insert_index(parent_new, 0, rnode->keys[0], rnode);
-	parent_new->children[0] = n;
-	parent_new->tag = 1;
-
-	//> We surpassed the root. New root needs to be created.
-	if (*node_stack_top == 0) {
-		abtree->root = parent_new;
-		parent_new->tag = 0;
-	} else {
-		abtree_node_t *p = node_stack[*node_stack_top - 1];
-		pindex = node_stack_indexes[*node_stack_top - 1];
-		p->children[pindex] = parent_new;
-	}
-
-	//> Fix the node_stack for the rebalancing
-	pindex = (KEY_CMP(key, parent_new->keys[0]) < 0) ? 0 : 1;
-	node_stack[*node_stack_top] = parent_new;
-	node_stack_indexes[*node_stack_top] = pindex;
-	node_stack[++(*node_stack_top)] = parent_new->children[pindex];
-	*should_rebalance = 1;
-	return 1;
-}
-
-static int abtree_insert(abtree_t *abtree, map_key_t key, void *val, void *tdata)
-{
-	abtree_node_t *node_stack[MAX_HEIGHT];
-	int node_stack_indexes[MAX_HEIGHT], node_stack_top = -1;
-	int should_rebalance, ret;
-
-	//> Route to the appropriate leaf.
-	abtree_traverse_stack(abtree, key, node_stack, node_stack_indexes,
-	                     &node_stack_top);
-	int index = node_stack_indexes[node_stack_top];
-	abtree_node_t *n = node_stack[node_stack_top];
-	//> Key already in the tree.
-	if (node_stack_top >= 0 && index < ABTREE_DEGREE_MAX &&
-	                           KEY_CMP(key, n->keys[index]) == 0)
-		return 0;
-	//> Key not in the tree.
-	ret = abtree_do_insert(abtree, key, val, node_stack, node_stack_indexes,
-	                       &node_stack_top, &should_rebalance);
-
-	while (should_rebalance)
-		abtree_rebalance(abtree, key, &should_rebalance);
-	return ret;
-}
-
 static abtree_node_t *abtree_do_delete_with_copy(abtree_t *abtree, map_key_t key, 
                            abtree_node_t **node_stack,
                            int *node_stack_indexes, int node_stack_top,
@@ -688,44 +897,6 @@ static abtree_node_t *abtree_do_delete_with_copy(abtree_t *abtree, map_key_t key
 	return node_stack_top > 0 ? node_stack[node_stack_top-1] : NULL;
 }
 
-static int abtree_delete(abtree_t *abtree, map_key_t key, void *tdata)
-{
-	int index;
-	abtree_node_t *n, *tree_cp_root, *connection_point;
-	abtree_node_t *node_stack[MAX_HEIGHT];
-	int node_stack_indexes[MAX_HEIGHT];
-	int node_stack_top = -1, should_rebalance, connection_point_stack_index;
-
-	//> Route to the appropriate leaf.
-	abtree_traverse_stack(abtree, key, node_stack, node_stack_indexes,
-	                     &node_stack_top);
-
-	//> Empty tree case.
-	if (node_stack_top == -1)
-		return 0;
-	n = node_stack[node_stack_top];
-	index = node_stack_indexes[node_stack_top];
-	//> Key not in the tree.
-	if (index >= n->no_keys || KEY_CMP(key, n->keys[index]) != 0)
-		return 0;
-	//> Key in the tree.
-	connection_point = abtree_do_delete_with_copy(abtree, key, node_stack,
-	                                         node_stack_indexes, node_stack_top,
-	                                         &should_rebalance, &tree_cp_root,
-	                                         &connection_point_stack_index);
-	//> Install copy
-	if (connection_point == NULL) {
-		abtree->root = tree_cp_root;
-	} else {
-		int index = node_stack_indexes[connection_point_stack_index];
-		connection_point->children[index] = tree_cp_root;
-	}
-
-	while (should_rebalance)
-		abtree_rebalance(abtree, key, &should_rebalance);
-	return 1;
-}
-
 static abtree_node_t *abtree_do_insert_with_copy(abtree_t *abtree,
                            map_key_t key, void *val,
                            abtree_node_t **node_stack, int *node_stack_indexes,
@@ -768,43 +939,143 @@ static abtree_node_t *abtree_do_insert_with_copy(abtree_t *abtree,
 	return node_stack_top > 0 ? node_stack[node_stack_top-1] : NULL;
 }
 
-static int abtree_update(abtree_t *abtree, map_key_t key, void *val, tdata_t *tdata)
+//> Copies the leaf that contains `key` and replaces the value in the copy.
+static abtree_node_t *abtree_do_compute_with_copy(map_key_t key,
+                           map_compute_t fn, void *arg,
+                           abtree_node_t **node_stack,
+                           int *node_stack_indexes, int node_stack_top,
+                           abtree_node_t **copy,
+                           int *connection_point_stack_index)
+{
+	abtree_node_t *n_cp = abtree_node_new_copy(node_stack[node_stack_top]);
+	int index = node_stack_indexes[node_stack_top];
+
+	n_cp->children[index+1] = fn(key, n_cp->children[index+1], 1, arg);
+	*copy = n_cp;
+	*connection_point_stack_index = node_stack_top - 1;
+	return node_stack_top > 0 ? node_stack[node_stack_top-1] : NULL;
+}
+
+//> Rebalances the path to `key` after an update, with one transaction per step.
+static void abtree_rebalance_rcu_htm(abtree_t *abtree, map_key_t key,
+                                     tdata_t *tdata)
+{
+	tm_begin_ret_t status;
+	abtree_node_t *node_stack[MAX_HEIGHT];
+	int node_stack_indexes[MAX_HEIGHT], stack_top = -1;
+	int should_rebalance = 1, connection_point_stack_index, index;
+	abtree_node_t *tree_cp_root, *connection_point, *sibling;
+
+	while (should_rebalance) {
+
+		//> Copies of a rebalancing that failed validation.
+		rcu_copies_discard();
+		ht_reset(tdata->ht);
+
+		abtree_traverse_for_rebalance(abtree, key, &should_rebalance, node_stack,
+                              node_stack_indexes, &stack_top);
+		if (!should_rebalance) break;
+		connection_point = abtree_rebalance_with_copy(abtree, key,
+		                           node_stack, node_stack_indexes,
+		                           stack_top, &should_rebalance, &tree_cp_root,
+		                           &connection_point_stack_index, &sibling, tdata);
+	
+		while (1) {
+			status = TX_BEGIN(0);
+			if (status == TM_BEGIN_SUCCESS) {
+				if (abtree->lock != LOCK_FREE)
+					TX_ABORT(ABORT_GL_TAKEN);
+
+				//> Validate copy
+				if (stack_top < 0 && abtree->root != NULL)
+					TX_ABORT(ABORT_VALIDATION_FAILURE);
+				if (stack_top >= 0 && abtree->root != node_stack[0])
+					TX_ABORT(ABORT_VALIDATION_FAILURE);
+				int i;
+				abtree_node_t *n1, *n2;
+				for (i=0; i < stack_top; i++) {
+					n1 = node_stack[i];
+					index = node_stack_indexes[i];
+					n2 = n1->children[index];
+					if (n2 != node_stack[i+1])
+						TX_ABORT(ABORT_VALIDATION_FAILURE);
+				}
+				int j;
+				for (i=0; i < HT_LEN; i++) {
+					for (j=0; j < tdata->ht->bucket_next_index[i]; j+=2) {
+						abtree_node_t **np = tdata->ht->entries[i][j];
+						abtree_node_t  *n  = tdata->ht->entries[i][j+1];
+						if (*np != n) TX_ABORT(ABORT_VALIDATION_FAILURE);
+					}
+				}
+
+				if (tree_cp_root != NULL) {
+					if (connection_point == NULL) {
+						abtree->root = tree_cp_root;
+					} else {
+						index = node_stack_indexes[connection_point_stack_index];
+						connection_point->children[index] = tree_cp_root;
+					}
+				}
+
+				TX_END(0);
+				rcu_copies_begin();
+				if (tree_cp_root != NULL)
+					abtree_retire_rebalanced(node_stack[stack_top-1],
+					                         node_stack[stack_top], sibling);
+				break;
+			} else {
+				tdata->tx_aborts++;
+				if (ABORT_IS_EXPLICIT(status) && 
+				    ABORT_CODE(status) == ABORT_VALIDATION_FAILURE) {
+					tdata->tx_aborts_explicit_validation++;
+					should_rebalance = 1;
+					break;
+				}
+			}
+		}
+	}
+
+}
+
+#define ABTREE_STACK_HAS_KEY(node_stack, node_stack_indexes, stack_top, key) \
+	((stack_top) >= 0 && \
+	 (node_stack_indexes)[stack_top] < (node_stack)[stack_top]->no_keys && \
+	 KEY_CMP((node_stack)[stack_top]->keys[(node_stack_indexes)[stack_top]], key) == 0)
+
+/**
+ * Inserts `key` if `op` is 1, deletes it if `op` is 0 and, if `op` is -1,
+ * inserts it when it is not in the tree and deletes it otherwise.
+ * Returns 0 (1) if the key was not (was) inserted and 2 (3) if it was not
+ * (was) deleted, like map_update().
+ **/
+static int abtree_do_update(abtree_t *abtree, map_key_t key, void *val, int op,
+                            tdata_t *tdata)
 {
 	tm_begin_ret_t status;
 	abtree_node_t *node_stack[MAX_HEIGHT];
 	int node_stack_indexes[MAX_HEIGHT], stack_top = -1;
-	int op_is_insert = -1, should_rebalance, ret;
+	int op_is_insert, found, should_rebalance, ret;
 	int connection_point_stack_index, index;
 	int retries = -1;
-	abtree_node_t *tree_cp_root, *connection_point;
+	abtree_node_t *tree_cp_root, *connection_point, *sibling;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 
 	if (++retries >= TX_NUM_RETRIES) {
 		tdata->lacqs++;
 		pthread_spin_lock(&abtree->lock);
 		abtree_traverse_stack(abtree, key, node_stack, node_stack_indexes, &stack_top);
-		if (stack_top == -1) {
-			op_is_insert = 1;
-		} else {
-			index = node_stack_indexes[stack_top];
-			abtree_node_t *n = node_stack[stack_top];
-			if (index >= n->no_keys || KEY_CMP(key, n->keys[index]) != 0)
-				op_is_insert = 1;
-			else if (index < ABTREE_DEGREE_MAX && KEY_CMP(key, n->keys[index]) == 0)
-				op_is_insert = 0;
-		}
-
-		if (op_is_insert && stack_top >= 0 &&
-		    node_stack_indexes[stack_top] < ABTREE_DEGREE_MAX &&
-		    KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0) {
+		found = ABTREE_STACK_HAS_KEY(node_stack, node_stack_indexes, stack_top, key);
+		op_is_insert = (op == -1) ? !found : op;
+		if (op_is_insert && found) {
 			pthread_spin_unlock(&abtree->lock);
 			return 0;
-		} else if (!op_is_insert && (stack_top < 0 ||
-		            node_stack_indexes[stack_top] >= node_stack[stack_top]->no_keys ||
-					KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) != 0)) {
+		} else if (!op_is_insert && !found) {
 			pthread_spin_unlock(&abtree->lock);
 			return 2;
 		}
@@ -828,6 +1099,9 @@ try_from_scratch:
 			index = node_stack_indexes[connection_point_stack_index];
 			connection_point->children[index] = tree_cp_root;
 		}
+		//> The copies are in the tree now, so they are not reused.
+		rcu_copies_begin();
+		if (stack_top >= 0) nalloc_free_node(nalloc, node_stack[stack_top]);
 
 		//> FIXME is this "correct" (performance-wise) to be here??
 		while (should_rebalance)
@@ -838,26 +1112,12 @@ try_from_scratch:
 
 	//> Asynchronized traversal. 
 	abtree_traverse_stack(abtree, key, node_stack, node_stack_indexes, &stack_top);
-	if (stack_top == -1) {
-		op_is_insert = 1;
-	} else {
-		index = node_stack_indexes[stack_top];
-		abtree_node_t *n = node_stack[stack_top];
-		if (index >= n->no_keys || KEY_CMP(key, n->keys[index]) != 0)
-			op_is_insert = 1;
-		else if (index < ABTREE_DEGREE_MAX && KEY_CMP(key, n->keys[index]) == 0)
-			op_is_insert = 0;
-	}
-	if (op_is_insert && stack_top >= 0 &&
-	    node_stack_indexes[stack_top] < ABTREE_DEGREE_MAX &&
-	    KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0) {
+	found = ABTREE_STACK_HAS_KEY(node_stack, node_stack_indexes, stack_top, key);
+	op_is_insert = (op == -1) ? !found : op;
+	if (op_is_insert && found)
 		return 0;
-	} else if (!op_is_insert && (stack_top < 0 ||
-	            node_stack_indexes[stack_top] >= node_stack[stack_top]->no_keys ||
-				KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) != 0)) {
-		pthread_spin_unlock(&abtree->lock);
+	else if (!op_is_insert && !found)
 		return 2;
-	}
 
 	if (op_is_insert) {
 		connection_point = abtree_do_insert_with_copy(abtree, key, val, node_stack,
@@ -916,6 +1176,8 @@ validate_and_connect_copy:
 			connection_point->children[index] = tree_cp_root;
 		}
 		TX_END(0);
+		rcu_copies_begin();
+		if (stack_top >= 0) nalloc_free_node(nalloc, node_stack[stack_top]);
 	} else {
 		tdata->tx_aborts++;
 		if (ABORT_IS_EXPLICIT(status) && 
@@ -927,72 +1189,137 @@ validate_and_connect_copy:
 		}
 	}
 
-	//> FIXME
-	while (should_rebalance) {
+	if (should_rebalance) abtree_rebalance_rcu_htm(abtree, key, tdata);
+	return ret;
+}
 
-		ht_reset(tdata->ht);
+static int abtree_insert(abtree_t *abtree, map_key_t key, void *val, tdata_t *tdata)
+{
+	return abtree_do_update(abtree, key, val, 1, tdata);
+}
 
-		abtree_traverse_for_rebalance(abtree, key, &should_rebalance, node_stack,
-                              node_stack_indexes, &stack_top);
-		if (!should_rebalance) break;
-		connection_point = abtree_rebalance_with_copy(abtree, key,
-		                           node_stack, node_stack_indexes,
-		                           stack_top, &should_rebalance, &tree_cp_root,
-		                           &connection_point_stack_index, tdata);
-	
-		while (1) {
-			status = TX_BEGIN(0);
-			if (status == TM_BEGIN_SUCCESS) {
-				if (abtree->lock != LOCK_FREE)
-					TX_ABORT(ABORT_GL_TAKEN);
+static int abtree_delete(abtree_t *abtree, map_key_t key, tdata_t *tdata)
+{
+	return abtree_do_update(abtree, key, NULL, 0, tdata) == 3;
+}
 
-				//> Validate copy
-				if (stack_top < 0 && abtree->root != NULL)
-					TX_ABORT(ABORT_VALIDATION_FAILURE);
-				if (stack_top >= 0 && abtree->root != node_stack[0])
-					TX_ABORT(ABORT_VALIDATION_FAILURE);
-				int i;
-				abtree_node_t *n1, *n2;
-				for (i=0; i < stack_top; i++) {
-					n1 = node_stack[i];
-					index = node_stack_indexes[i];
-					n2 = n1->children[index];
-					if (n2 != node_stack[i+1])
-						TX_ABORT(ABORT_VALIDATION_FAILURE);
-				}
-				int j;
-				for (i=0; i < HT_LEN; i++) {
-					for (j=0; j < tdata->ht->bucket_next_index[i]; j+=2) {
-						abtree_node_t **np = tdata->ht->entries[i][j];
-						abtree_node_t  *n  = tdata->ht->entries[i][j+1];
-						if (*np != n) TX_ABORT(ABORT_VALIDATION_FAILURE);
-					}
-				}
+static int abtree_update(abtree_t *abtree, map_key_t key, void *val, tdata_t *tdata)
+{
+	return abtree_do_update(abtree, key, val, -1, tdata);
+}
 
-				if (tree_cp_root != NULL) {
-					if (connection_point == NULL) {
-						abtree->root = tree_cp_root;
-					} else {
-						index = node_stack_indexes[connection_point_stack_index];
-						connection_point->children[index] = tree_cp_root;
-					}
-				}
+/**
+ * Like abtree_update(), the leaf is replaced by a copy, which carries the new
+ * value if the key is in the tree and the new key otherwise.
+ **/
+static int abtree_compute(abtree_t *abtree, map_key_t key, map_compute_t fn,
+                          void *arg, tdata_t *tdata)
+{
+	tm_begin_ret_t status;
+	abtree_node_t *node_stack[MAX_HEIGHT];
+	int node_stack_indexes[MAX_HEIGHT], stack_top = -1;
+	int found, should_rebalance;
+	int connection_point_stack_index, index;
+	int retries = -1;
+	abtree_node_t *tree_cp_root, *connection_point;
 
-				TX_END(0);
-				break;
-			} else {
-				tdata->tx_aborts++;
-				if (ABORT_IS_EXPLICIT(status) && 
-				    ABORT_CODE(status) == ABORT_VALIDATION_FAILURE) {
-					tdata->tx_aborts_explicit_validation++;
-					should_rebalance = 1;
-					break;
-				}
-			}
+	rcu_copies_begin();
+try_from_scratch:
+
+	rcu_copies_discard();
+	ht_reset(tdata->ht);
+	should_rebalance = 0;
+
+	if (++retries >= TX_NUM_RETRIES) {
+		tdata->lacqs++;
+		pthread_spin_lock(&abtree->lock);
+		abtree_traverse_stack(abtree, key, node_stack, node_stack_indexes, &stack_top);
+		found = ABTREE_STACK_HAS_KEY(node_stack, node_stack_indexes, stack_top, key);
+		if (found)
+			connection_point = abtree_do_compute_with_copy(key, fn, arg,
+			                       node_stack, node_stack_indexes, stack_top,
+			                       &tree_cp_root, &connection_point_stack_index);
+		else
+			connection_point = abtree_do_insert_with_copy(abtree, key,
+			                       fn(key, NULL, 0, arg), node_stack,
+			                       node_stack_indexes, stack_top,
+			                       &should_rebalance, &tree_cp_root,
+			                       &connection_point_stack_index);
+		if (connection_point == NULL) {
+			abtree->root = tree_cp_root;
+		} else {
+			index = node_stack_indexes[connection_point_stack_index];
+			connection_point->children[index] = tree_cp_root;
 		}
+		//> The copies are in the tree now, so they are not reused.
+		rcu_copies_begin();
+		if (stack_top >= 0) nalloc_free_node(nalloc, node_stack[stack_top]);
+
+		while (should_rebalance)
+			abtree_rebalance(abtree, key, &should_rebalance);
+		pthread_spin_unlock(&abtree->lock);
+		return found;
 	}
 
-	return ret;
+	//> Asynchronized traversal.
+	abtree_traverse_stack(abtree, key, node_stack, node_stack_indexes, &stack_top);
+	found = ABTREE_STACK_HAS_KEY(node_stack, node_stack_indexes, stack_top, key);
+	if (found)
+		connection_point = abtree_do_compute_with_copy(key, fn, arg,
+		                       node_stack, node_stack_indexes, stack_top,
+		                       &tree_cp_root, &connection_point_stack_index);
+	else
+		connection_point = abtree_do_insert_with_copy(abtree, key,
+		                       fn(key, NULL, 0, arg), node_stack,
+		                       node_stack_indexes, stack_top,
+		                       &should_rebalance, &tree_cp_root,
+		                       &connection_point_stack_index);
+
+	int validation_retries = -1;
+validate_and_connect_copy:
+
+	if (++validation_retries >= TX_NUM_RETRIES) goto try_from_scratch;
+	while (abtree->lock != LOCK_FREE) ;
+
+	tdata->tx_starts++;
+	status = TX_BEGIN(0);
+	if (status == TM_BEGIN_SUCCESS) {
+		if (abtree->lock != LOCK_FREE)
+			TX_ABORT(ABORT_GL_TAKEN);
+
+		//> Validate copy
+		if (stack_top < 0 && abtree->root != NULL)
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+		if (stack_top >= 0 && abtree->root != node_stack[0])
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+		int i;
+		for (i=0; i < stack_top; i++)
+			if (node_stack[i]->children[node_stack_indexes[i]] != node_stack[i+1])
+				TX_ABORT(ABORT_VALIDATION_FAILURE);
+
+		// Now let's 'commit' the tree copy onto the original tree.
+		if (connection_point == NULL) {
+			abtree->root = tree_cp_root;
+		} else {
+			index = node_stack_indexes[connection_point_stack_index];
+			connection_point->children[index] = tree_cp_root;
+		}
+		TX_END(0);
+		rcu_copies_begin();
+		if (stack_top >= 0) nalloc_free_node(nalloc, node_stack[stack_top]);
+	} else {
+		tdata->tx_aborts++;
+		if (ABORT_IS_EXPLICIT(status) && 
+		    ABORT_CODE(status) == ABORT_VALIDATION_FAILURE) {
+			tdata->tx_aborts_explicit_validation++;
+			goto try_from_scratch;
+		} else {
+			goto validate_and_connect_copy;
+		}
+	}
+
+	if (should_rebalance) abtree_rebalance_rcu_htm(abtree, key, tdata);
+	return found;
 }
 
 static void abtree_print_rec(abtree_node_t *root, int level)
@@ -1111,13 +1438,32 @@ static int abtree_validate_helper(abtree_t *abtree)
 	return check_bst && check_abtree_properties;
 }
 
+//> map_destroy() callbacks (see destroy.h). The children of a leaf are values.
+static void abtree_destroy_children(void *node, destroy_stack_t *stack)
+{
+	abtree_node_t *n = node;
+	int i;
+	if (n->leaf) return;
+	for (i=0; i <= n->no_keys; i++)
+		destroy_push(stack, n->children[i]);
+}
+
+static void abtree_destroy_node(void *node)
+{
+	nalloc_free_node_now(nalloc, node);
+}
+
 /******************************************************************************/
 /*            Map interface implementation                                    */
 /******************************************************************************/
 void *map_new()
 {
+	abtree_t *abtree;
+
 	printf("Size of tree node is %lu\n", sizeof(abtree_node_t));
-	return abtree_new();
+	abtree = abtree_new();
+	abtree->size = map_size_new();
+	return abtree;
 }
 
 void *map_tdata_new(int tid)
@@ -1139,39 +1485,164 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	tdata_add(d1, d2, dst);
 }
 
+void map_tdata_free(void *thread_data)
+{
+	rcu_scratch_free(nalloc);
+	tdata_free(thread_data);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((abtree_t *)map)->root, nthreads, abtree_destroy_children,
+	             abtree_destroy_node);
+	map_size_free(((abtree_t *)map)->size);
+	free(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	((abtree_t *)map)->root = abtree_bulk_build(keys, values, n);
+	map_size_add(((abtree_t *)map)->size, n);
+	return n;
+}
+
 int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
-	ret = abtree_lookup(map, key);
+	nalloc_op_begin();
+	ret = abtree_lookup(map, key, value_out);
+	nalloc_op_end();
 	return ret; 
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	return 0;
+	int i, group, found = 0;
+
+	for (i=0; i < n; i += ABTREE_BATCH_WIDTH) {
+		group = (n - i < ABTREE_BATCH_WIDTH) ? n - i : ABTREE_BATCH_WIDTH;
+		nalloc_op_begin();
+		found += abtree_lookup_batch(map, &keys[i], group, &results[i]);
+		nalloc_op_end();
+	}
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	nalloc_op_begin();
+	abtree_rquery(map, key1, key2, visit, arg, tdata);
+	nalloc_op_end();
+	return 1;
+}
+
+//> Nodes are never modified in place, so like the lookups it runs outside
+//> of transactions.
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	abtree_node_t *root;
+	int ret = 0;
+
+	nalloc_op_begin();
+	root = ((abtree_t *)map)->root;
+	if (root) ret = abtree_nav_subtree(root, key, op, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = abtree_insert(map, key, value, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((abtree_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = abtree_compute(map, key, fn, arg, thread_data);
+	nalloc_op_end();
+	if (!ret) map_size_add(((abtree_t *)map)->size, 1);
 	return ret;
 }
 
 int map_delete(void *map, void *thread_data, map_key_t key)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = abtree_delete(map, key, thread_data);
+	nalloc_op_end();
+	if (ret) map_size_add(((abtree_t *)map)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *map, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	return map_delete_range_each(map, thread_data, key1, key2);
+}
+
 int map_update(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = abtree_update(map, key, value, thread_data);
+	nalloc_op_end();
+	map_size_updated(((abtree_t *)map)->size, ret);
 	return ret;
 }
 
+long long map_size(void *map, void *thread_data, int exact)
+{
+	return map_size_sum(((abtree_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	int ret = 0;
@@ -6,9 +6,14 @@
 #endif
 
 #include "alloc.h"
+#include "arch.h"
 #include "htm/htm.h"
 #include "ht.h"
 #include "../../../map.h"
+#include "../../../nav.h"
+#include "../../../destroy.h"
+#include "../../../size.h"
+#include "../../../delete_range.h"
 #include "../../../rcu-htm/tdata.h"
 #include "../../../key/key.h"
 
@@ -28,6 +33,7 @@ typedef struct abtree_node_s {
 
 typedef struct {
 	abtree_node_t *root;
+	map_size_t *size; //> See size.h.
 
 #	if defined(SYNC_CG_SPINLOCK) || defined(SYNC_CG_HTM)
 	pthread_spinlock_t lock;
@@ -50,6 +56,9 @@ static abtree_node_t *abtree_node_new(char leaf)
 static int abtree_node_search(abtree_node_t *n, map_key_t key)
 {
 	int i = 0;
+#	if defined(MAP_KEY_TYPE_VAR_STR)
+	return var_str_key_search(n->keys, n->no_keys, key);
+#	endif
 	while (i < n->no_keys && KEY_CMP(key, n->keys[i]) > 0) i++;
 	return i;
 }
@@ -129,7 +138,8 @@ static map_key_t abtree_node_get_max_key(abtree_node_t *n)
 	return max;
 }
 
-static int abtree_lookup(abtree_t *abtree, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+static int abtree_lookup(abtree_t *abtree, map_key_t key, void **value)
 {
 	int index;
 	abtree_node_t *n = abtree->root;
@@ -139,11 +149,202 @@ static int abtree_lookup(abtree_t *abtree, map_key_t key)
 
 	while (!n->leaf) {
 		index = abtree_node_search(n, key);
-		if (index < n->no_keys && KEY_CMP(n->keys[index], key)) index++;
+		if (index < n->no_keys && KEY_CMP(n->keys[index], key) == 0) index++;
 		n = n->children[index];
 	}
 	index = abtree_node_search(n, key);
-	return (KEY_CMP(n->keys[index], key) == 0);
+	if (index >= n->no_keys || KEY_CMP(n->keys[index], key) != 0)
+		return 0;
+	//> The value of keys[i] in a leaf is children[i+1].
+	if (value) *value = n->children[index+1];
+	return 1;
+}
+
+/**
+ * Bulk loading: builds an (a,b)-tree bottom-up out of the sorted
+ * keys[0..n-1] and returns its root. Every level has the fewest nodes that
+ * fit the level below and the keys (children) are spread evenly over them,
+ * so all nodes but the root have at least ABTREE_DEGREE_MIN keys.
+ **/
+static abtree_node_t *abtree_bulk_build(map_key_t *keys, void **values,
+                                        long long n)
+{
+	abtree_node_t **level, *node;
+	map_key_t *mins;
+	long long nnodes, nparents, i, from;
+	int j, cnt;
+
+	if (n <= 0) return NULL;
+
+	nnodes = (n + ABTREE_DEGREE_MAX - 1) / ABTREE_DEGREE_MAX;
+	XMALLOC(level, nnodes);
+	XMALLOC(mins, nnodes);
+
+	//> The leaves. The value of keys[i] in a leaf is children[i+1].
+	for (i=0, from=0; i < nnodes; i++, from += cnt) {
+		cnt = n / nnodes + (i < n % nnodes);
+		node = abtree_node_new(1);
+		node->marked = node->tag = 0;
+		for (j=0; j < cnt; j++) {
+			KEY_COPY(node->keys[j], keys[from+j]);
+			node->children[j+1] = values ? values[from+j] : NULL;
+		}
+		node->no_keys = cnt;
+		KEY_COPY(mins[i], keys[from]);
+		level[i] = node;
+	}
+
+	//> The internal levels overwrite the arrays of the level below in place;
+	//> parent i never overwrites a child it has not consumed yet.
+	//> The separator of two children is the smallest key of the right one.
+	while (nnodes > 1) {
+		nparents = (nnodes + ABTREE_DEGREE_MAX) / (ABTREE_DEGREE_MAX + 1);
+		for (i=0, from=0; i < nparents; i++, from += cnt) {
+			cnt = nnodes / nparents + (i < nnodes % nparents);
+			node = abtree_node_new(0);
+			node->marked = node->tag = 0;
+			node->children[0] = level[from];
+			for (j=1; j < cnt; j++) {
+				KEY_COPY(node->keys[j-1], mins[from+j]);
+				node->children[j] = level[from+j];
+			}
+			node->no_keys = cnt - 1;
+			if (i != from) KEY_COPY(mins[i], mins[from]);
+			level[i] = node;
+		}
+		nnodes = nparents;
+	}
+
+	node = level[0];
+	free(level);
+	free(mins);
+	return node;
+}
+
+#define ABTREE_BATCH_WIDTH 8
+
+/**
+ * Looks up `nkeys` <= ABTREE_BATCH_WIDTH keys with their traversals
+ * interleaved (group prefetching): every round moves each traversal one level
+ * down and prefetches the node it moves to, so that the cache misses of the
+ * traversals overlap instead of being paid one after the other.
+ **/
+static int abtree_lookup_batch(abtree_t *abtree, map_key_t *keys, int nkeys,
+                               int *results)
+{
+	abtree_node_t *n[ABTREE_BATCH_WIDTH], *root = abtree->root;
+	int i, index, active, found = 0;
+
+	for (i=0; i < nkeys; i++) {
+		n[i] = root;
+		results[i] = 0;
+	}
+	//> Empty tree.
+	if (!root) return 0;
+
+	do {
+		active = 0;
+		for (i=0; i < nkeys; i++) {
+			if (n[i]->leaf) continue;
+			index = abtree_node_search(n[i], keys[i]);
+			if (index < n[i]->no_keys && KEY_CMP(n[i]->keys[index], keys[i]) == 0)
+				index++;
+			n[i] = n[i]->children[index];
+			prefetch_range(n[i], sizeof(abtree_node_t));
+			active = 1;
+		}
+	} while (active);
+
+	for (i=0; i < nkeys; i++) {
+		index = abtree_node_search(n[i], keys[i]);
+		results[i] = index < n[i]->no_keys && KEY_CMP(n[i]->keys[index], keys[i]) == 0;
+		found += results[i];
+	}
+	return found;
+}
+
+/**
+ * Visits the keys of [key1, key2] in the subtree of `n`, in ascending order.
+ * Returns 0 once the range query is over (a key larger than key2 was found
+ * or `visit` stopped it), 1 otherwise.
+ **/
+static int abtree_rquery_rec(abtree_node_t *n, map_key_t key1, map_key_t key2,
+                             map_visit_t visit, void *arg)
+{
+	int i;
+
+	if (n->leaf) {
+		for (i=abtree_node_search(n, key1); i < n->no_keys; i++) {
+			if (KEY_CMP(n->keys[i], key2) > 0) return 0;
+			if (visit(n->keys[i], n->children[i+1], arg)) return 0;
+		}
+		return 1;
+	}
+
+	//> Child i holds the keys in [keys[i-1], keys[i]).
+	i = abtree_node_search(n, key1);
+	if (i < n->no_keys && KEY_CMP(n->keys[i], key1) == 0) i++;
+	for (; i <= n->no_keys; i++) {
+		if (i > 0 && KEY_CMP(n->keys[i-1], key2) > 0) return 0;
+		if (!abtree_rquery_rec(n->children[i], key1, key2, visit, arg)) return 0;
+	}
+	return 1;
+}
+
+static void abtree_rquery(abtree_t *abtree, map_key_t key1, map_key_t key2,
+                          map_visit_t visit, void *arg)
+{
+	if (abtree->root)
+		abtree_rquery_rec(abtree->root, key1, key2, visit, arg);
+}
+
+/**
+ * Ordered navigation in the subtree of `n` (see nav.h). The children that may
+ * hold the answer are tried in order until one of them has it, starting from
+ * the one `key` is routed to.
+ **/
+static int abtree_nav_subtree(abtree_node_t *n, map_key_t key, map_nav_t op,
+                              map_key_t *key_out, void **value_out)
+{
+	int i;
+
+	if (n->leaf) {
+		//> The value of keys[i] in a leaf is children[i+1].
+		if (MAP_NAV_IS_FORWARD(op)) {
+			for (i=0; i < n->no_keys; i++)
+				if (MAP_NAV_KEY_OK(op, n->keys[i], key))
+					return map_nav_found(n->keys[i], n->children[i+1],
+					                     key_out, value_out);
+		} else {
+			for (i=n->no_keys-1; i >= 0; i--)
+				if (MAP_NAV_KEY_OK(op, n->keys[i], key))
+					return map_nav_found(n->keys[i], n->children[i+1],
+					                     key_out, value_out);
+		}
+		return 0;
+	}
+
+	//> Child i holds the keys in [keys[i-1], keys[i]).
+	if (op == MAP_NAV_MIN) {
+		i = 0;
+	} else if (op == MAP_NAV_MAX) {
+		i = n->no_keys;
+	} else {
+		i = abtree_node_search(n, key);
+		if (op == MAP_NAV_SUCC && i < n->no_keys && KEY_CMP(n->keys[i], key) == 0)
+			i++;
+	}
+
+	if (MAP_NAV_IS_FORWARD(op)) {
+		for (; i <= n->no_keys; i++)
+			if (abtree_nav_subtree(n->children[i], key, op, key_out, value_out))
+				return 1;
+	} else {
+		for (; i >= 0; i--)
+			if (abtree_nav_subtree(n->children[i], key, op, key_out, value_out))
+				return 1;
+	}
+	return 0;
 }
 
 static void abtree_traverse_stack(abtree_t *abtree, map_key_t key,
@@ -194,6 +395,7 @@ static void abtree_join_parent_with_child(abtree_node_t *p, int pindex,
 		p->children[i + first_ptr_to_shift] = l->children[i];
 
 	p->no_keys = new_no_keys;
+	nalloc_free_node(nalloc, l);
 }
 
 static void abtree_split_parent_and_child(abtree_node_t *p, int pindex,
@@ -275,6 +477,7 @@ static void abtree_join_siblings(abtree_node_t *p, abtree_node_t *l,
 	}
 	p->tag = 0;
 	p->no_keys--;
+	nalloc_free_node(nalloc, right);
 }
 
 static void abtree_redistribute_sibling_keys(abtree_node_t *p, abtree_node_t *l,
@@ -480,7 +683,7 @@ static int abtree_insert(abtree_t *abtree, map_key_t key, void *val)
 	int index = node_stack_indexes[node_stack_top];
 	abtree_node_t *n = node_stack[node_stack_top];
 	//> Key already in the tree.
-	if (node_stack_top >= 0 && index < ABTREE_DEGREE_MAX &&
+	if (node_stack_top >= 0 && index < n->no_keys &&
 	                           KEY_CMP(key, n->keys[index]) == 0)
 		return 0;
 	//> Key not in the tree.
@@ -492,6 +695,28 @@ static int abtree_insert(abtree_t *abtree, map_key_t key, void *val)
 	return ret;
 }
 
+static int abtree_compute(abtree_t *abtree, map_key_t key, map_compute_t fn,
+                          void *arg)
+{
+	int index;
+	abtree_node_t *n = abtree->root;
+
+	if (n) {
+		while (!n->leaf) {
+			index = abtree_node_search(n, key);
+			if (index < n->no_keys && KEY_CMP(n->keys[index], key) == 0) index++;
+			n = n->children[index];
+		}
+		index = abtree_node_search(n, key);
+		if (index < n->no_keys && KEY_CMP(n->keys[index], key) == 0) {
+			n->children[index+1] = fn(key, n->children[index+1], 1, arg);
+			return 1;
+		}
+	}
+	//> abtree_insert() returns 0 only if the key is already there.
+	return !abtree_insert(abtree, key, fn(key, NULL, 0, arg));
+}
+
 static int abtree_do_delete(abtree_t *abtree, map_key_t key, abtree_node_t **node_stack,
                            int *node_stack_indexes, int node_stack_top,
                            int *should_rebalance)
@@ -555,7 +780,7 @@ static int abtree_update(abtree_t *abtree, map_key_t key, void *val)
 		abtree_node_t *n = node_stack[node_stack_top];
 		if (index >= n->no_keys || KEY_CMP(key, n->keys[index]) != 0)
 			op_is_insert = 1;
-		else if (index < ABTREE_DEGREE_MAX && KEY_CMP(key, n->keys[index]) == 0)
+		else if (index < n->no_keys && KEY_CMP(key, n->keys[index]) == 0)
 			op_is_insert = 0;
 	}
 	
@@ -691,13 +916,32 @@ static int abtree_validate_helper(abtree_t *abtree)
 	return check_bst && check_abtree_properties;
 }
 
+//> map_destroy() callbacks (see destroy.h). The children of a leaf are values.
+static void abtree_destroy_children(void *node, destroy_stack_t *stack)
+{
+	abtree_node_t *n = node;
+	int i;
+	if (n->leaf) return;
+	for (i=0; i <= n->no_keys; i++)
+		destroy_push(stack, n->children[i]);
+}
+
+static void abtree_destroy_node(void *node)
+{
+	nalloc_free_node_now(nalloc, node);
+}
+
 /******************************************************************************/
 /* Red-Black tree interface implementation                                    */
 /******************************************************************************/
 void *map_new()
 {
+	abtree_t *abtree;
+
 	printf("Size of tree node is %lu\n", sizeof(abtree_node_t));
-	return abtree_new();
+	abtree = abtree_new();
+	abtree->size = map_size_new();
+	return abtree;
 }
 
 void *map_tdata_new(int tid)
@@ -725,36 +969,160 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 #	endif
 }
 
+void map_tdata_free(void *thread_data)
+{
+#	if defined(SYNC_CG_HTM)
+	tx_thread_data_free(thread_data);
+#	endif
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((abtree_t *)map)->root, nthreads, abtree_destroy_children,
+	             abtree_destroy_node);
+	map_size_free(((abtree_t *)map)->size);
+	free(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	((abtree_t *)map)->root = abtree_bulk_build(keys, values, n);
+	map_size_add(((abtree_t *)map)->size, n);
+	return n;
+}
+
 int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((abtree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_start(TX_NUM_RETRIES, thread_data, &((abtree_t *)map)->lock);
 #	endif
 
-	ret = abtree_lookup(map, key);
+	ret = abtree_lookup(map, key, value_out);
 
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_unlock(&((abtree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((abtree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
 	return ret; 
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	return 0;
+	int i, group, found = 0;
+
+	//> The lock is held (or the transaction runs) for one group at a time.
+	for (i=0; i < n; i += ABTREE_BATCH_WIDTH) {
+		group = (n - i < ABTREE_BATCH_WIDTH) ? n - i : ABTREE_BATCH_WIDTH;
+		nalloc_op_begin();
+#		if defined(SYNC_CG_SPINLOCK)
+		pthread_spin_lock(&((abtree_t *)map)->lock);
+#		elif defined(SYNC_CG_HTM)
+		tx_start(TX_NUM_RETRIES, thread_data, &((abtree_t *)map)->lock);
+#		endif
+
+		found += abtree_lookup_batch(map, &keys[i], group, &results[i]);
+
+#		if defined(SYNC_CG_SPINLOCK)
+		pthread_spin_unlock(&((abtree_t *)map)->lock);
+#		elif defined(SYNC_CG_HTM)
+		tx_end(thread_data, &((abtree_t *)map)->lock);
+#		endif
+		nalloc_op_end();
+	}
+
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((abtree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, tdata, &((abtree_t *)map)->lock);
+#	endif
+
+	abtree_rquery(map, key1, key2, visit, arg);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((abtree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(tdata, &((abtree_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+
+	return 1;
+}
+
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	abtree_node_t *root;
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((abtree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, tdata, &((abtree_t *)map)->lock);
+#	endif
+
+	root = ((abtree_t *)map)->root;
+	if (root) ret = abtree_nav_subtree(root, key, op, key_out, value_out);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((abtree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(tdata, &((abtree_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+
+	return ret;
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((abtree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -768,6 +1136,32 @@ int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((abtree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
+	if (ret) map_size_add(((abtree_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((abtree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, thread_data, &((abtree_t *)map)->lock);
+#	endif
+
+	ret = abtree_compute(map, key, fn, arg);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((abtree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(thread_data, &((abtree_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+	if (!ret) map_size_add(((abtree_t *)map)->size, 1);
 	return ret;
 }
 
@@ -775,6 +1169,7 @@ int map_delete(void *map, void *thread_data, map_key_t key)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((abtree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -788,14 +1183,23 @@ int map_delete(void *map, void *thread_data, map_key_t key)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((abtree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
+	if (ret) map_size_add(((abtree_t *)map)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *map, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	return map_delete_range_each(map, thread_data, key1, key2);
+}
+
 int map_update(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((abtree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -809,9 +1213,26 @@ int map_update(void *map, void *thread_data, map_key_t key, void *value)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((abtree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
+	map_size_updated(((abtree_t *)map)->size, ret);
 	return ret;
 }
 
+long long map_size(void *map, void *thread_data, int exact)
+{
+	return map_size_sum(((abtree_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	int ret = 0;
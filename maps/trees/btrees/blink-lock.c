@@ -33,6 +33,8 @@
 #include <pthread.h> //> pthread_spinlock_t
 
 #include "../../key/key.h"
+#include "../../size.h"
+#include "../../delete_range.h"
 #define RWLOCK_PER_NODE
 #define HIGHKEY_PER_NODE
 #define SYNC_CG_SPINLOCK
@@ -57,16 +59,17 @@ static void *btree_node_scan(btree_node_t *n, map_key_t key, int *link_ptr_ret,
 	int i = 0;
 	*link_ptr_ret = 0;
 	*index = -1;
-	if (n->highkey != MAX_KEY && key > n->highkey) {
+	if (KEY_CMP(key, n->highkey) > 0) {
 		*link_ptr_ret = 1;
 		return n->sibling;
 	}
-	while (i < n->no_keys && key > n->keys[i]) i++;
+	while (i < n->no_keys && KEY_CMP(key, n->keys[i]) > 0) i++;
 	*index = i;
 	return n->children[i];
 }
 
-static int btree_lookup(btree_t *btree, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+static int btree_lookup(btree_t *btree, map_key_t key, void **value)
 {
 	int link_ptr_ret = 0, index = 0, not_locked, ret;
 	btree_node_t *n, *t;
@@ -96,14 +99,16 @@ TOP:
 	do {
 		t = n;
 		n = btree_node_scan(n, key, &link_ptr_ret, &index);
-		if (n != NULL) {
+		//> In a leaf, a non-link child is a value, not a node to lock.
+		if (link_ptr_ret) {
 			not_locked = TRYRDLOCK_NODE(n);
 			UNLOCK_NODE(t);
 			if (not_locked) goto TOP;
 		}
 	} while (link_ptr_ret);
 
-	ret = (t->keys[index] == key);
+	ret = (index < t->no_keys && KEY_CMP(t->keys[index], key) == 0);
+	if (ret && value) *value = t->children[index+1];
 	UNLOCK_NODE(t);
 	return ret;
 }
@@ -166,7 +171,8 @@ static int _do_insert(btree_t *btree, map_key_t key, void *val,
                       int stack_top)
 {
 	btree_node_t *n, *internal;
-	int index, internal_index, key_to_add;
+	int index, internal_index;
+	map_key_t key_to_add;
 	void *ptr_to_add;
   
 	n = node_stack[stack_top];
@@ -174,7 +180,8 @@ static int _do_insert(btree_t *btree, map_key_t key, void *val,
 	n = move_right(n, key, &index);
 
 	//> Key already in the leaf.
-	if (index < 2 * BTREE_ORDER && index < n->no_keys && key == n->keys[index]) {
+	if (index < 2 * BTREE_ORDER && index < n->no_keys &&
+	    KEY_CMP(key, n->keys[index]) == 0) {
 		UNLOCK_NODE(n);
 		return 0;
 	}
@@ -189,10 +196,10 @@ static int _do_insert(btree_t *btree, map_key_t key, void *val,
 	//> Case of full leaf.
 	btree_node_t *rnode = btree_leaf_split(n, index, key, val);
 
-	key_to_add = n->keys[n->no_keys-1];
+	KEY_COPY(key_to_add, n->keys[n->no_keys-1]);
 	ptr_to_add = rnode;
-	rnode->highkey = n->highkey;
-	n->highkey = key_to_add;
+	KEY_COPY(rnode->highkey, n->highkey);
+	KEY_COPY(n->highkey, key_to_add);
 
 	while (1) {
 		stack_top--;
@@ -223,10 +230,10 @@ static int _do_insert(btree_t *btree, map_key_t key, void *val,
 		//> Internal node full.
 		rnode = btree_internal_split(internal, internal_index, key_to_add, ptr_to_add,
 		                             &key_to_add);
-		rnode->highkey = internal->highkey;
+		KEY_COPY(rnode->highkey, internal->highkey);
 		if (KEY_CMP(rnode->keys[rnode->no_keys-1], rnode->highkey) > 0)
-			rnode->highkey = rnode->keys[rnode->no_keys-1];
-		internal->highkey = key_to_add;
+			KEY_COPY(rnode->highkey, rnode->keys[rnode->no_keys-1]);
+		KEY_COPY(internal->highkey, key_to_add);
 		ptr_to_add = rnode;
 		UNLOCK_NODE(n);
 		n = internal;
@@ -268,7 +275,7 @@ static int _do_delete(map_key_t key, btree_node_t **node_stack,
 	btree_node_t *n = node_stack[stack_top];
 
 //	LOCK_NODE(n);
-	if (index >= n->no_keys || key != n->keys[index]) ret = 0;
+	if (index >= n->no_keys || KEY_CMP(key, n->keys[index]) != 0) ret = 0;
 	else btree_node_delete_index(n, index);
 	UNLOCK_NODE(n);
 	return ret;
@@ -315,20 +322,157 @@ static int btree_update(btree_t *btree, map_key_t key, void *val)
 	index = node_stack_indexes[stack_top];
 	n = node_stack[stack_top];
 
-	if (index >= n->no_keys || key != n->keys[index])
+	if (index >= n->no_keys || KEY_CMP(key, n->keys[index]) != 0)
 		return _do_insert(btree, key, val, node_stack, node_stack_indexes,
 		                  stack_top);
 	else
 		return _do_delete(key, node_stack, node_stack_indexes, stack_top) + 2;
 }
 
+//> The value is replaced while holding the write lock of the leaf.
+static int btree_compute(btree_t *btree, map_key_t key, map_compute_t fn,
+                         void *arg)
+{
+	btree_node_t *n;
+	btree_node_t *node_stack[20];
+	int node_stack_indexes[20];
+	int stack_top = -1, index;
+
+	//> Route to the appropriate leaf.
+	btree_traverse_stack(btree, key, node_stack, node_stack_indexes, &stack_top);
+
+	//> Empty tree case.
+	if (stack_top == -1) {
+		assert(btree->root == NULL);
+		n = btree_node_new(1);
+		btree_node_insert_index(n, 0, key, fn(key, NULL, 0, arg));
+		btree->root = n;
+		n->sibling = NULL;
+		pthread_spin_unlock(&btree->lock);
+		return 0;
+	}
+
+	n = move_right(node_stack[stack_top], key, &index);
+	if (index < n->no_keys && KEY_CMP(key, n->keys[index]) == 0) {
+		n->children[index+1] = fn(key, n->children[index+1], 1, arg);
+		UNLOCK_NODE(n);
+		return 1;
+	}
+
+	node_stack[stack_top] = n;
+	_do_insert(btree, key, fn(key, NULL, 0, arg), node_stack,
+	           node_stack_indexes, stack_top);
+	return 0;
+}
+
+/**
+ * Returns the leaf that covers `key` read-locked, like btree_lookup(), or
+ * NULL if the tree is empty. `*low` is set to a key that is smaller than all
+ * the keys of the leaf, or to MIN_KEY for the leftmost leaf.
+ **/
+static btree_node_t *btree_nav_leaf(btree_t *btree, map_key_t key,
+                                    map_key_t *low)
+{
+	int link_ptr_ret = 0, index = 0, not_locked;
+	btree_node_t *n, *t;
+
+TOP:
+	KEY_COPY(*low, MIN_KEY);
+	pthread_spin_lock(&btree->lock);
+	n = btree->root;
+	if (!n) {
+		pthread_spin_unlock(&btree->lock);
+		return NULL;
+	}
+
+	if (TRYRDLOCK_NODE(n)) {
+		pthread_spin_unlock(&btree->lock);
+		goto TOP;
+	}
+	pthread_spin_unlock(&btree->lock);
+	while (1) {
+		t = n;
+		n = btree_node_scan(t, key, &link_ptr_ret, &index);
+		if (t->leaf && !link_ptr_ret) return t;
+		//> Child `index` holds the keys in (keys[index-1], keys[index]].
+		if (link_ptr_ret)   KEY_COPY(*low, t->highkey);
+		else if (index > 0) KEY_COPY(*low, t->keys[index-1]);
+		not_locked = TRYRDLOCK_NODE(n);
+		UNLOCK_NODE(t);
+		if (not_locked) goto TOP;
+	}
+}
+
+/**
+ * There are no links to the left, so when the leaf that covers `key` has no
+ * key smaller than `key`, a backward operation starts over for the keys that
+ * are not larger than the lower bound of the leaf. Forward operations follow the
+ * sibling links of the leaves, read-locking them hand over hand.
+ **/
+static int btree_nav(btree_t *btree, map_key_t key, map_nav_t op,
+                     map_key_t *key_out, void **value_out)
+{
+	btree_node_t *n, *t;
+	map_key_t route, low;
+	int i, not_locked, inclusive = 0;
+
+	route = (op == MAP_NAV_MAX) ? MAX_KEY : key;
+
+TOP:
+	n = btree_nav_leaf(btree, route, &low);
+	if (!n) return 0;
+
+	if (!MAP_NAV_IS_FORWARD(op)) {
+		for (i=n->no_keys-1; i >= 0; i--) {
+			if (MAP_NAV_KEY_OK(op, n->keys[i], key) ||
+			    (inclusive && KEY_CMP(n->keys[i], key) == 0)) {
+				map_nav_found(n->keys[i], n->children[i+1], key_out, value_out);
+				UNLOCK_NODE(n);
+				return 1;
+			}
+		}
+		UNLOCK_NODE(n);
+		if (KEY_CMP(low, MIN_KEY) == 0) return 0;
+		//> Keys equal to `low` are routed to the left of it, so the search
+		//> goes on with the keys that are not larger than `low`.
+		KEY_COPY(route, low);
+		KEY_COPY(key, low);
+		op = MAP_NAV_PRED;
+		inclusive = 1;
+		goto TOP;
+	}
+
+	while (1) {
+		for (i=0; i < n->no_keys; i++) {
+			if (MAP_NAV_KEY_OK(op, n->keys[i], key)) {
+				map_nav_found(n->keys[i], n->children[i+1], key_out, value_out);
+				UNLOCK_NODE(n);
+				return 1;
+			}
+		}
+		t = n;
+		n = t->sibling;
+		if (!n) {
+			UNLOCK_NODE(t);
+			return 0;
+		}
+		not_locked = TRYRDLOCK_NODE(n);
+		UNLOCK_NODE(t);
+		if (not_locked) goto TOP;
+	}
+}
+
 /******************************************************************************/
 /*      Map interface implementation                                          */
 /******************************************************************************/
 void *map_new()
 {
+	btree_t *btree;
+
 	printf("Size of tree node is %lu\n", sizeof(btree_node_t));
-	return btree_new();
+	btree = btree_new();
+	btree->size = map_size_new();
+	return btree;
 }
 
 void *map_tdata_new(int tid)
@@ -346,40 +490,152 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 {
 }
 
+void map_tdata_free(void *thread_data)
+{
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((btree_t *)map)->root, nthreads, btree_destroy_children,
+	             btree_destroy_node);
+	map_size_free(((btree_t *)map)->size);
+	free(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	((btree_t *)map)->root = btree_bulk_build(keys, values, n, 0);
+	map_size_add(((btree_t *)map)->size, n);
+	return n;
+}
+
 int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
-	ret = btree_lookup(map, key);
+	nalloc_op_begin();
+	ret = btree_lookup(map, key, value_out);
+	nalloc_op_end();
 	return ret; 
 }
 
-int map_rquery(void *map, void *thread_data, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
+{
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(map, thread_data, keys[i]));
+	return found;
+}
+
+int map_rquery(void *map, void *thread_data, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
 {
+	nalloc_op_begin();
 	printf("Range Query operation is not implemented\n");
+	nalloc_op_end();
 	return 0;
 }
 
+static int map_nav(void *map, void *thread_data, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	int ret;
+	nalloc_op_begin();
+	ret = btree_nav(map, key, op, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *map, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *thread_data, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *thread_data, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, key, MAP_NAV_PRED, key_out, value_out);
+}
+
 int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = btree_insert(map, key, value);
+	nalloc_op_end();
+	if (ret) map_size_add(((btree_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+	nalloc_op_begin();
+	ret = btree_compute(map, key, fn, arg);
+	nalloc_op_end();
+	if (!ret) map_size_add(((btree_t *)map)->size, 1);
 	return ret;
 }
 
 int map_delete(void *map, void *thread_data, map_key_t key)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = btree_delete(map, key);
+	nalloc_op_end();
+	if (ret) map_size_add(((btree_t *)map)->size, -1);
 	return ret;
 }
 
+int map_delete_range(void *map, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	return map_delete_range_each(map, thread_data, key1, key2);
+}
+
 int map_update(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
+	nalloc_op_begin();
 	ret = btree_update(map, key, value);
+	nalloc_op_end();
+	map_size_updated(((btree_t *)map)->size, ret);
 	return ret;
 }
 
+long long map_size(void *map, void *thread_data, int exact)
+{
+	return map_size_sum(((btree_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	int ret = 0;
@@ -8,6 +8,9 @@
 #endif
 #include "../../key/key.h"
 #include "../../map.h"
+#include "../../nav.h"
+#include "../../destroy.h"
+#include "../../size.h"
 #include "alloc.h"
 
 #ifndef BTREE_ORDER
@@ -30,10 +33,17 @@ typedef struct btree_node_s {
 
 typedef struct {
 	btree_node_t *root;
+	map_size_t *size; //> See size.h.
 
 #	if defined(SYNC_CG_SPINLOCK) || defined(SYNC_CG_HTM) || defined(SYNC_RCU_HTM)
 	pthread_spinlock_t lock;
 #	endif
+#	if defined(SYNC_RCU_HTM)
+	//> See map_snapshot(). In a snapshot, `snapshot_of` is the map it was
+	//> taken from; it is NULL in the map itself.
+	volatile int nr_snapshots;
+	void *snapshot_of, *snapshot_pin;
+#	endif
 } btree_t;
 
 static __thread void *nalloc;
@@ -43,7 +53,12 @@ static __thread void *nalloc;
  **/
 static btree_node_t *btree_node_new(char leaf)
 {
+#	if defined(SYNC_RCU_HTM)
+	//> All new nodes of RCU-HTM are copies of an update attempt.
+	btree_node_t *ret = rcu_copy_alloc(nalloc, sizeof(*ret));
+#	else
 	btree_node_t *ret = nalloc_alloc_node(nalloc);
+#	endif
 	memset(ret, 0, sizeof(*ret));
 	ret->leaf = leaf;
 #	ifdef RWLOCK_PER_NODE
@@ -65,6 +80,9 @@ static btree_node_t *btree_node_new_copy(btree_node_t *n)
 static int btree_node_search(btree_node_t *n, map_key_t key)
 {
 	int i = 0;
+#	if defined(MAP_KEY_TYPE_VAR_STR)
+	return var_str_key_search(n->keys, n->no_keys, key);
+#	endif
 	while (i < n->no_keys && KEY_CMP(key, n->keys[i]) > 0) i++;
 	return i;
 }
@@ -176,15 +194,210 @@ static btree_node_t *btree_internal_split(btree_node_t *n, int index, map_key_t
 	return rnode;
 }
 
+//> Links the nodes of a bulk loaded level; `maxs[i]` is the largest key
+//> under `level[i]`.
+static void btree_bulk_link_level(btree_node_t **level, map_key_t *maxs,
+                                  long long nnodes)
+{
+	long long i;
+	for (i=0; i < nnodes - 1; i++) {
+		level[i]->sibling = level[i+1];
+#		ifdef HIGHKEY_PER_NODE
+		KEY_COPY(level[i]->highkey, maxs[i]);
+#		endif
+	}
+}
+
+/**
+ * Bulk loading: builds a B+tree bottom-up out of the sorted keys[0..n-1] and
+ * returns its root. Every level has the fewest nodes that fit the level
+ * below and the keys (children) are spread evenly over them, so all nodes
+ * but the root are at least half-full. The nodes of every level are linked
+ * through their sibling pointers. The separator of two children is the
+ * smallest key of the right one if `sep_is_right_min` (equal keys are routed
+ * to the right), the largest key of the left one otherwise.
+ **/
+static btree_node_t *btree_bulk_build(map_key_t *keys, void **values,
+                                      long long n, int sep_is_right_min)
+{
+	btree_node_t **level, *node;
+	map_key_t *mins, *maxs;
+	long long nnodes, nparents, i, from;
+	int j, cnt;
+
+	if (n <= 0) return NULL;
+
+	nnodes = (n + 2 * BTREE_ORDER - 1) / (2 * BTREE_ORDER);
+	XMALLOC(level, nnodes);
+	XMALLOC(mins, nnodes);
+	XMALLOC(maxs, nnodes);
+
+	//> The leaves. The value of keys[i] in a leaf is children[i+1].
+	for (i=0, from=0; i < nnodes; i++, from += cnt) {
+		cnt = n / nnodes + (i < n % nnodes);
+		node = btree_node_new(1);
+		for (j=0; j < cnt; j++) {
+			KEY_COPY(node->keys[j], keys[from+j]);
+			node->children[j+1] = values ? values[from+j] : NULL;
+		}
+		node->no_keys = cnt;
+		KEY_COPY(mins[i], keys[from]);
+		KEY_COPY(maxs[i], keys[from+cnt-1]);
+		level[i] = node;
+	}
+	btree_bulk_link_level(level, maxs, nnodes);
+
+	//> The internal levels overwrite the arrays of the level below in place;
+	//> parent i never overwrites a child it has not consumed yet.
+	while (nnodes > 1) {
+		nparents = (nnodes + 2 * BTREE_ORDER) / (2 * BTREE_ORDER + 1);
+		for (i=0, from=0; i < nparents; i++, from += cnt) {
+			cnt = nnodes / nparents + (i < nnodes % nparents);
+			node = btree_node_new(0);
+			node->children[0] = level[from];
+			for (j=1; j < cnt; j++) {
+				if (sep_is_right_min) KEY_COPY(node->keys[j-1], mins[from+j]);
+				else                  KEY_COPY(node->keys[j-1], maxs[from+j-1]);
+				node->children[j] = level[from+j];
+			}
+			node->no_keys = cnt - 1;
+			if (i != from) KEY_COPY(mins[i], mins[from]);
+			KEY_COPY(maxs[i], maxs[from+cnt-1]);
+			level[i] = node;
+		}
+		nnodes = nparents;
+		btree_bulk_link_level(level, maxs, nnodes);
+	}
+
+	node = level[0];
+	free(level);
+	free(mins);
+	free(maxs);
+	return node;
+}
+
+/**
+ * Ordered navigation in the subtree of `n` (see nav.h). The children that may
+ * hold the answer are tried in order until one of them has it, since leaves
+ * may be empty. The first one is the child on the left of the first separator
+ * that is not smaller than `key`, which works with either routing of the
+ * keys that are equal to a separator.
+ **/
+static int btree_nav_subtree(btree_node_t *n, map_key_t key, map_nav_t op,
+                             map_key_t *key_out, void **value_out)
+{
+	int i;
+
+	if (n->leaf) {
+		//> The value of keys[i] in a leaf is children[i+1].
+		if (MAP_NAV_IS_FORWARD(op)) {
+			for (i=0; i < n->no_keys; i++)
+				if (MAP_NAV_KEY_OK(op, n->keys[i], key))
+					return map_nav_found(n->keys[i], n->children[i+1],
+					                     key_out, value_out);
+		} else {
+			for (i=n->no_keys-1; i >= 0; i--)
+				if (MAP_NAV_KEY_OK(op, n->keys[i], key))
+					return map_nav_found(n->keys[i], n->children[i+1],
+					                     key_out, value_out);
+		}
+		return 0;
+	}
+
+	if (op == MAP_NAV_MIN)      i = 0;
+	else if (op == MAP_NAV_MAX) i = n->no_keys;
+	else                        i = btree_node_search(n, key);
+
+	if (MAP_NAV_IS_FORWARD(op)) {
+		for (; i <= n->no_keys; i++)
+			if (btree_nav_subtree(n->children[i], key, op, key_out, value_out))
+				return 1;
+	} else {
+		for (; i >= 0; i--)
+			if (btree_nav_subtree(n->children[i], key, op, key_out, value_out))
+				return 1;
+	}
+	return 0;
+}
+
+/**
+ * Spreads the keys of p->children[i] and p->children[i+1] evenly over the two
+ * nodes or, if they fit in one, merges the right one into the left one.
+ * Unlike the rebalancing of single deletions, the nodes may have any number
+ * of keys; this is for the range deletions. Returns 1 if the nodes were
+ * merged, in which case the caller frees the right one. The separator of two
+ * leaves is chosen as in btree_bulk_build().
+ **/
+static int btree_range_rebalance(btree_node_t *p, int i, int sep_is_right_min)
+{
+	btree_node_t *l = p->children[i], *r = p->children[i+1];
+	map_key_t keys[4 * BTREE_ORDER + 1];
+	void *children[4 * BTREE_ORDER + 2];
+	int j, nkeys = 0, nchildren = 0, nleft, nright;
+
+	//> The value of keys[j] in a leaf is children[j+1], so the two leaves
+	//> are concatenated like internal nodes without the separator.
+	for (j=0; j < l->no_keys; j++) KEY_COPY(keys[nkeys++], l->keys[j]);
+	for (j=0; j <= l->no_keys; j++) children[nchildren++] = l->children[j];
+	if (!l->leaf) KEY_COPY(keys[nkeys++], p->keys[i]);
+	for (j=0; j < r->no_keys; j++) KEY_COPY(keys[nkeys++], r->keys[j]);
+	for (j=l->leaf; j <= r->no_keys; j++) children[nchildren++] = r->children[j];
+
+	if (nkeys <= 2 * BTREE_ORDER) {
+		for (j=0; j < nkeys; j++) KEY_COPY(l->keys[j], keys[j]);
+		for (j=0; j <= nkeys; j++) l->children[j] = children[j];
+		l->no_keys = nkeys;
+		l->sibling = r->sibling;
+		btree_node_delete_index(p, i);
+		return 1;
+	}
+
+	//> The separator of internal nodes is the middle key, which moves up to
+	//> the parent.
+	nleft = nkeys / 2;
+	nright = nkeys - nleft - !l->leaf;
+	for (j=0; j < nleft; j++) KEY_COPY(l->keys[j], keys[j]);
+	for (j=0; j <= nleft; j++) l->children[j] = children[j];
+	l->no_keys = nleft;
+	if (l->leaf && !sep_is_right_min) KEY_COPY(p->keys[i], keys[nleft-1]);
+	else                              KEY_COPY(p->keys[i], keys[nleft]);
+	for (j=0; j < nright; j++) KEY_COPY(r->keys[j], keys[nkeys - nright + j]);
+	for (j=0; j <= nright; j++) r->children[j] = children[nkeys - nright + j];
+	if (r->leaf) r->children[0] = NULL;
+	r->no_keys = nright;
+	return 0;
+}
+
+
+//> map_destroy() callbacks (see destroy.h). The children of a leaf are values.
+static void btree_destroy_children(void *node, destroy_stack_t *stack)
+{
+	btree_node_t *n = node;
+	int i;
+	if (n->leaf) return;
+	for (i=0; i <= n->no_keys; i++)
+		destroy_push(stack, n->children[i]);
+}
+
+static void btree_destroy_node(void *node)
+{
+	nalloc_free_node_now(nalloc, node);
+}
+
 static btree_t *btree_new()
 {
 	btree_t *ret;
 	XMALLOC(ret, 1);
 	ret->root = NULL;
+	ret->size = NULL;
 
 #	if defined(SYNC_CG_SPINLOCK) || defined(SYNC_CG_HTM) || defined(SYNC_RCU_HTM)
 	pthread_spin_init(&ret->lock, PTHREAD_PROCESS_SHARED);
 #	endif
+#	if defined(SYNC_RCU_HTM)
+	ret->nr_snapshots = 0;
+	ret->snapshot_of = ret->snapshot_pin = NULL;
+#	endif
 
 	return ret;
 }
@@ -4,8 +4,10 @@
 #include <pthread.h>
 
 #include "alloc.h"
+#include "arch.h"
 #include "ht.h"
 #include "../../map.h"
+#include "../../size.h"
 #include "../../key/key.h"
 #include "../../rcu-htm/tdata.h"
 #include "htm/htm.h"
@@ -33,80 +35,185 @@ static int btree_traverse(btree_t *btree, map_key_t key,
 	return 1;
 }
 
-int btree_lookup(btree_t *btree, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+int btree_lookup(btree_t *btree, map_key_t key, void **value)
 {
 	int index;
 	btree_node_t *leaf;
 
 	if (btree_traverse(btree, key, &leaf, &index) == 0)
 		return 0;
-	else
-		return (KEY_CMP(leaf->keys[index], key) == 0);
+	if (index >= leaf->no_keys || KEY_CMP(leaf->keys[index], key) != 0)
+		return 0;
+	//> The value of keys[i] in a leaf is children[i+1].
+	if (value) *value = leaf->children[index+1];
+	return 1;
 }
 
-static __thread map_key_t rquery_result[1000];
-static __thread btree_node_t *rquery_nodes[20];
+#define BTREE_BATCH_WIDTH 8
 
-static int get_keys_from_rquery_nodes(map_key_t key1, map_key_t key2, int nnodes)
+/**
+ * Looks up `nkeys` <= BTREE_BATCH_WIDTH keys with their traversals
+ * interleaved (group prefetching): every round moves each traversal one level
+ * down and prefetches the node it moves to, so that the cache misses of the
+ * traversals overlap. Like btree_lookup(), it runs outside of transactions;
+ * each traversal starts from the same root.
+ **/
+static int btree_lookup_batch(btree_t *btree, map_key_t *keys, int nkeys,
+                              int *results)
 {
-	int i, j, index = 0;
-	btree_node_t *n;
-	for (i = 0, n = rquery_nodes[i]; i < nnodes; i++) {
-		for (j = 0; j < n->no_keys; j++) {
-			if (KEY_CMP(n->keys[j], key1) >= 0 && KEY_CMP(n->keys[j], key2) <= 0) {
-				KEY_COPY(rquery_result[index], n->keys[j]);
-				index++;
-			}
+	btree_node_t *n[BTREE_BATCH_WIDTH], *root = btree->root;
+	int i, index, active, found = 0;
+
+	for (i=0; i < nkeys; i++) {
+		n[i] = root;
+		results[i] = 0;
+	}
+	if (!root) return 0;
+
+	do {
+		active = 0;
+		for (i=0; i < nkeys; i++) {
+			if (n[i]->leaf) continue;
+			index = btree_node_search(n[i], keys[i]);
+			n[i] = n[i]->children[index];
+			prefetch_range(n[i], sizeof(btree_node_t));
+			active = 1;
 		}
+	} while (active);
+
+	for (i=0; i < nkeys; i++) {
+		index = btree_node_search(n[i], keys[i]);
+		results[i] = index < n[i]->no_keys && KEY_CMP(n[i]->keys[index], keys[i]) == 0;
+		found += results[i];
 	}
-	return index;
+	return found;
 }
 
-static int get_rquery_nodes(btree_node_t *leaf, map_key_t key2)
+#define RQUERY_MAX_NODES 20
+static __thread btree_node_t *rquery_nodes[RQUERY_MAX_NODES];
+
+//> Original siblings that are replaced by copies during delete rebalancing.
+//> They are retired together with the copied path after a successful commit.
+static __thread btree_node_t *replaced_siblings[20];
+static __thread int replaced_siblings_top;
+
+static void btree_retire_replaced(btree_node_t **node_stack, int from, int to)
 {
-	btree_node_t *n = leaf;
-	int nnodes = 0;
-	while (n != NULL && KEY_CMP(n->keys[n->no_keys-1], key2) < 0) {
+	int i;
+	for (i=(from < 0 ? 0 : from); i <= to; i++)
+		nalloc_free_node(nalloc, node_stack[i]);
+	for (i=0; i < replaced_siblings_top; i++)
+		nalloc_free_node(nalloc, replaced_siblings[i]);
+	replaced_siblings_top = 0;
+}
+
+/**
+ * Collects the leaves that hold the keys of [key1, key2], up to
+ * RQUERY_MAX_NODES of them. Called inside a transaction or with the global
+ * lock held, so the leaves form a consistent snapshot of the range.
+ **/
+static int get_rquery_nodes(btree_t *btree, map_key_t key1, map_key_t key2)
+{
+	btree_node_t *n;
+	int index, nnodes = 0;
+
+	if (btree_traverse(btree, key1, &n, &index) == 0) return 0;
+	while (n != NULL && nnodes < RQUERY_MAX_NODES) {
 		rquery_nodes[nnodes++] = n;
+		if (n->no_keys > 0 && KEY_CMP(n->keys[n->no_keys-1], key2) >= 0) break;
 		n = n->sibling;
 	}
-	if (n != NULL) rquery_nodes[nnodes++] = n;
 	return nnodes;
 }
 
-int btree_rquery(btree_t *btree, map_key_t key1, map_key_t key2)
+/**
+ * Leaves are never modified in place, only replaced by copies, so the keys
+ * of the collected leaves are visited outside of the transaction.
+ * Ranges that span more than RQUERY_MAX_NODES leaves are scanned in several
+ * steps, each one continuing after the last key of the previous one; every
+ * step is atomic but the range query as a whole is not.
+ * Returns 0 if `visit` stopped the range query, 1 otherwise.
+ **/
+int btree_rquery(btree_t *btree, map_key_t key1, map_key_t key2,
+                 map_visit_t visit, void *arg, tdata_t *tdata)
 {
 	tm_begin_ret_t status;
-	int index, i, nkeys = 0, nnodes = 0, retries = TX_NUM_RETRIES;
-	btree_node_t *leaf;
+	int i, j, nnodes, retries, after_from = 0;
+	btree_node_t *n;
+	map_key_t from;
 
-	if (btree_traverse(btree, key1, &leaf, &index) == 0) return 0;
-	if (KEY_CMP(leaf->keys[index], key2) > 0) return 0;
-	
-	//> First try with transactions
-	while (retries-- > 0) {
-		status = TX_BEGIN(0);
-		if (status == TM_BEGIN_SUCCESS) {
-			nnodes = get_rquery_nodes(leaf, key2);
-			TX_END(0);
-			break;
-		} else {
+	KEY_COPY(from, key1);
+	while (1) {
+		//> First try with transactions
+		nnodes = -1;
+		for (retries = 0; retries < TX_NUM_RETRIES; retries++) {
+			while (btree->lock != LOCK_FREE) ;
+			tdata->tx_starts++;
+			status = TX_BEGIN(0);
+			if (status == TM_BEGIN_SUCCESS) {
+				if (btree->lock != LOCK_FREE)
+					TX_ABORT(ABORT_GL_TAKEN);
+				nnodes = get_rquery_nodes(btree, from, key2);
+				TX_END(0);
+				break;
+			}
+			tdata->tx_aborts++;
 		}
-	}
 
-	//> Finally resort to the global lock
-	if (retries == 0) {
-		pthread_spin_lock(&btree->lock);
-		nnodes = get_rquery_nodes(leaf, key2);
-		pthread_spin_unlock(&btree->lock);
+		//> Finally resort to the global lock
+		if (nnodes == -1) {
+			tdata->lacqs++;
+			pthread_spin_lock(&btree->lock);
+			nnodes = get_rquery_nodes(btree, from, key2);
+			pthread_spin_unlock(&btree->lock);
+		}
+
+		for (i = 0; i < nnodes; i++) {
+			n = rquery_nodes[i];
+			for (j = 0; j < n->no_keys; j++) {
+				if (KEY_CMP(n->keys[j], from) < 0) continue;
+				if (after_from && KEY_CMP(n->keys[j], from) == 0) continue;
+				if (KEY_CMP(n->keys[j], key2) > 0) return 1;
+				if (visit(n->keys[j], n->children[j+1], arg)) return 0;
+			}
+		}
+		if (nnodes < RQUERY_MAX_NODES) return 1;
+
+		//> Continue after the last key of the last collected leaf.
+		n = rquery_nodes[nnodes-1];
+		if (n->no_keys == 0) return 1;
+		KEY_COPY(from, n->keys[n->no_keys-1]);
+		if (KEY_CMP(from, key2) >= 0) return 1;
+		after_from = 1;
 	}
+}
+
+/**
+ * Range query on a snapshot, whose nodes never change, in the subtree of `n`.
+ * It descends the tree instead of following the sibling pointers of the
+ * leaves, which are still modified in place.
+ * Returns 0 if `visit` stopped the range query, 1 otherwise.
+ **/
+static int btree_snapshot_rquery(btree_node_t *n, map_key_t key1, map_key_t key2,
+                                 map_visit_t visit, void *arg)
+{
+	int i;
 
-//	nkeys = get_keys_from_rquery_nodes(key1, key2, nnodes);
-//	printf("NKEYS: %d", nkeys);
-//	for (i = 0; i < nkeys; i++)
-//		printf("-> %d", rquery_result[i]);
-//	printf("\n");
+	if (n->leaf) {
+		for (i=0; i < n->no_keys; i++) {
+			if (KEY_CMP(n->keys[i], key1) < 0) continue;
+			if (KEY_CMP(n->keys[i], key2) > 0) break;
+			if (visit(n->keys[i], n->children[i+1], arg)) return 0;
+		}
+		return 1;
+	}
 
+	for (i=btree_node_search(n, key1); i <= n->no_keys; i++) {
+		if (!btree_snapshot_rquery(n->children[i], key1, key2, visit, arg))
+			return 0;
+		if (i < n->no_keys && KEY_CMP(n->keys[i], key2) > 0) break;
+	}
 	return 1;
 }
 
@@ -278,6 +385,36 @@ btree_node_t *btree_insert_with_copy(map_key_t key, void *val,
 	return conn_point;
 }
 
+/**
+ * While there are snapshots (see map_snapshot()), the nodes they reach must
+ * not be modified in place. Updates then also copy the rest of their path,
+ * from the connection point up to the root, and connect the copy by
+ * replacing the root. Returns the new connection point, i.e., NULL.
+ **/
+static btree_node_t *btree_copy_to_root(btree_node_t **node_stack,
+                                        int *node_stack_indexes,
+                                        btree_node_t *connection_point,
+                                        int *connection_point_stack_index,
+                                        btree_node_t **tree_cp_root,
+                                        tdata_t *tdata)
+{
+	btree_node_t *cur, *cur_cp;
+	int i, j;
+
+	if (connection_point == NULL) return NULL;
+
+	for (i=*connection_point_stack_index; i >= 0; i--) {
+		cur = node_stack[i];
+		cur_cp = btree_node_new_copy(cur);
+		for (j=0; j <= cur_cp->no_keys; j++)
+			ht_insert(tdata->ht, &cur->children[j], cur_cp->children[j]);
+		cur_cp->children[node_stack_indexes[i]] = *tree_cp_root;
+		*tree_cp_root = cur_cp;
+	}
+	*connection_point_stack_index = -1;
+	return NULL;
+}
+
 int btree_insert(btree_t *btree, map_key_t key, void *val, tdata_t *tdata)
 {
 	tm_begin_ret_t status;
@@ -288,16 +425,20 @@ int btree_insert(btree_t *btree, map_key_t key, void *val, tdata_t *tdata)
 	int retries = -1;
 	int connection_point_stack_index;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 	to_modify_sibling = new_sibling = NULL;
+	replaced_siblings_top = 0;
 
 	if (++retries >= TX_NUM_RETRIES) {
 		tdata->lacqs++;
 		pthread_spin_lock(&btree->lock);
 		btree_traverse_stack(btree, key, node_stack, node_stack_indexes, &stack_top);
-		if (stack_top >= 0 && node_stack_indexes[stack_top] < 2 * BTREE_ORDER &&
+		if (stack_top >= 0 &&
+		        node_stack_indexes[stack_top] < node_stack[stack_top]->no_keys &&
 		        KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0) {
 			pthread_spin_unlock(&btree->lock);
 			return 0;
@@ -307,6 +448,11 @@ try_from_scratch:
 		                                  &tree_cp_root,
 		                                  &connection_point_stack_index,
 		                                  &to_modify_sibling, &new_sibling, tdata);
+		if (btree->nr_snapshots)
+			connection_point = btree_copy_to_root(node_stack, node_stack_indexes,
+			                                      connection_point,
+			                                      &connection_point_stack_index,
+			                                      &tree_cp_root, tdata);
 		if (connection_point == NULL) {
 			btree->root = tree_cp_root;
 		} else {
@@ -315,12 +461,14 @@ try_from_scratch:
 		}
 		if (to_modify_sibling != NULL) to_modify_sibling->sibling = new_sibling;
 		pthread_spin_unlock(&btree->lock);
+		btree_retire_replaced(node_stack, connection_point_stack_index + 1, stack_top);
 		return 1;
 	}
 
 	//> Asynchronized traversal. If key is there we can safely return.
 	btree_traverse_stack(btree, key, node_stack, node_stack_indexes, &stack_top);
-	if (stack_top >= 0 && node_stack_indexes[stack_top] < 2 * BTREE_ORDER &&
+	if (stack_top >= 0 &&
+	        node_stack_indexes[stack_top] < node_stack[stack_top]->no_keys &&
 	        KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0)
 		return 0;
 
@@ -330,6 +478,12 @@ try_from_scratch:
 	                                  &connection_point_stack_index,
 	                                  &to_modify_sibling, &new_sibling, tdata);
 
+	if (btree->nr_snapshots)
+		connection_point = btree_copy_to_root(node_stack, node_stack_indexes,
+		                                      connection_point,
+		                                      &connection_point_stack_index,
+		                                      &tree_cp_root, tdata);
+
 	int validation_retries = -1;
 validate_and_connect_copy:
 
@@ -342,7 +496,9 @@ validate_and_connect_copy:
 		if (btree->lock != LOCK_FREE)
 			TX_ABORT(ABORT_GL_TAKEN);
 
-		//> Validate copy
+		//> Validate copy; snapshots may have been taken since it was made.
+		if (connection_point != NULL && btree->nr_snapshots)
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
 		if (stack_top < 0 && btree->root != NULL)
 			TX_ABORT(ABORT_VALIDATION_FAILURE);
 		if (stack_top >= 0 && btree->root != node_stack[0])
@@ -385,9 +541,135 @@ validate_and_connect_copy:
 		}
 	}
 
+	btree_retire_replaced(node_stack, connection_point_stack_index + 1, stack_top);
 	return 1;
 }
 
+/**
+ * Replaces the value of the key the stack leads to with `new_val` by copying
+ * the whole path, for btree_compute() while there are snapshots. Called with
+ * the global lock held; the caller retires the nodes of the path.
+ **/
+static void btree_compute_with_copy(btree_t *btree, btree_node_t **node_stack,
+                                    int *node_stack_indexes, int stack_top,
+                                    void *new_val, tdata_t *tdata)
+{
+	btree_node_t *leaf_cp, *to_modify_sibling, *tree_cp_root;
+	int connection_point_stack_index = stack_top - 1;
+
+	rcu_copies_begin();
+	ht_reset(tdata->ht);
+	replaced_siblings_top = 0;
+
+	leaf_cp = btree_node_new_copy(node_stack[stack_top]);
+	leaf_cp->children[node_stack_indexes[stack_top]+1] = new_val;
+	to_modify_sibling = find_left_sibling(node_stack, node_stack_indexes,
+	                                      stack_top, tdata);
+	tree_cp_root = leaf_cp;
+	if (stack_top > 0)
+		btree_copy_to_root(node_stack, node_stack_indexes, node_stack[stack_top-1],
+		                   &connection_point_stack_index, &tree_cp_root, tdata);
+	btree->root = tree_cp_root;
+	if (to_modify_sibling != NULL) to_modify_sibling->sibling = leaf_cp;
+}
+
+/**
+ * The value of a key that is in the tree is replaced in place. Updates that
+ * copy the leaf validate the values of the original (see tdata->ht), so they
+ * do not miss the new value. The new value is computed outside of the
+ * transaction, which only validates the path to the leaf and that the old
+ * value is still there. A missing key is inserted by btree_insert() and we
+ * start over if that fails because the key has been inserted in the meantime.
+ * While there are snapshots the value is not written in place; the global
+ * lock is taken and the path is copied instead (btree_compute_with_copy()).
+ **/
+int btree_compute(btree_t *btree, map_key_t key, map_compute_t fn, void *arg,
+                  tdata_t *tdata)
+{
+	tm_begin_ret_t status;
+	btree_node_t *node_stack[20], *leaf;
+	int node_stack_indexes[20], stack_top, index, i, copied;
+	int retries = -1;
+	void *old_val, *new_val;
+
+try_from_scratch:
+
+	if (++retries >= TX_NUM_RETRIES || btree->nr_snapshots) {
+		tdata->lacqs++;
+		pthread_spin_lock(&btree->lock);
+		btree_traverse_stack(btree, key, node_stack, node_stack_indexes, &stack_top);
+		if (stack_top >= 0) {
+			leaf = node_stack[stack_top];
+			index = node_stack_indexes[stack_top];
+			if (index < leaf->no_keys && KEY_CMP(leaf->keys[index], key) == 0) {
+				new_val = fn(key, leaf->children[index+1], 1, arg);
+				copied = btree->nr_snapshots;
+				if (copied)
+					btree_compute_with_copy(btree, node_stack, node_stack_indexes,
+					                        stack_top, new_val, tdata);
+				else
+					leaf->children[index+1] = new_val;
+				pthread_spin_unlock(&btree->lock);
+				if (copied) btree_retire_replaced(node_stack, 0, stack_top);
+				return 1;
+			}
+		}
+		pthread_spin_unlock(&btree->lock);
+		goto insert;
+	}
+
+	btree_traverse_stack(btree, key, node_stack, node_stack_indexes, &stack_top);
+	if (stack_top < 0) goto insert;
+	leaf = node_stack[stack_top];
+	index = node_stack_indexes[stack_top];
+	if (index >= leaf->no_keys || KEY_CMP(leaf->keys[index], key) != 0)
+		goto insert;
+
+	old_val = leaf->children[index+1];
+	new_val = fn(key, old_val, 1, arg);
+
+	int validation_retries = -1;
+validate_and_write:
+
+	if (++validation_retries >= TX_NUM_RETRIES) goto try_from_scratch;
+	while (btree->lock != LOCK_FREE) ;
+
+	tdata->tx_starts++;
+	status = TX_BEGIN(0);
+	if (status == TM_BEGIN_SUCCESS) {
+		if (btree->lock != LOCK_FREE)
+			TX_ABORT(ABORT_GL_TAKEN);
+
+		//> Validate the path and the old value.
+		if (btree->nr_snapshots)
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+		if (btree->root != node_stack[0])
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+		for (i=0; i < stack_top; i++)
+			if (node_stack[i]->children[node_stack_indexes[i]] != node_stack[i+1])
+				TX_ABORT(ABORT_VALIDATION_FAILURE);
+		if (leaf->children[index+1] != old_val)
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
+
+		leaf->children[index+1] = new_val;
+		TX_END(0);
+	} else {
+		tdata->tx_aborts++;
+		if (ABORT_IS_EXPLICIT(status) && 
+		    ABORT_CODE(status) == ABORT_VALIDATION_FAILURE) {
+			tdata->tx_aborts_explicit_validation++;
+			goto try_from_scratch;
+		} else {
+			goto validate_and_write;
+		}
+	}
+	return 1;
+
+insert:
+	if (btree_insert(btree, key, fn(key, NULL, 0, arg), tdata)) return 0;
+	goto try_from_scratch;
+}
+
 /**
  * c = current
  * p = parent
@@ -406,6 +688,7 @@ btree_node_t *btree_merge_with_copy(btree_node_t *c, btree_node_t *p, int pindex
 	if (pindex > 0) {
 		sibling = sibling_left;
 		sibling_cp = btree_node_new_copy(sibling);
+		replaced_siblings[replaced_siblings_top++] = sibling;
 		for (i=0; i <= sibling_cp->no_keys; i++)
 			ht_insert(tdata->ht, &sibling->children[i], sibling_cp->children[i]);
 		ht_insert(tdata->ht, &sibling->sibling, sibling_cp->sibling);
@@ -454,6 +737,8 @@ btree_node_t *btree_merge_with_copy(btree_node_t *c, btree_node_t *p, int pindex
 		c->no_keys = sibling_index;
 		*merged_with_left_sibling = 0;
 		c->sibling = sibling_cp->sibling;
+		replaced_siblings[replaced_siblings_top++] = sibling;
+		rcu_copy_discard(sibling_cp);
 		return c;
 	}
 
@@ -487,6 +772,7 @@ btree_node_t *btree_borrow_keys_with_copies(btree_node_t *c, btree_node_t *p, in
 		if (sibling->no_keys > BTREE_ORDER) {
 			sibling_cp = btree_node_new_copy(sibling);
 			parent_cp = btree_node_new_copy(p);
+			replaced_siblings[replaced_siblings_top++] = sibling;
 			for (i=0; i <= sibling_cp->no_keys; i++)
 				ht_insert(tdata->ht, &sibling->children[i], sibling_cp->children[i]);
 			for (i=0; i <= parent_cp->no_keys; i++)
@@ -524,6 +810,7 @@ btree_node_t *btree_borrow_keys_with_copies(btree_node_t *c, btree_node_t *p, in
 		if (sibling->no_keys > BTREE_ORDER) {
 			sibling_cp = btree_node_new_copy(sibling);
 			parent_cp = btree_node_new_copy(p);
+			replaced_siblings[replaced_siblings_top++] = sibling;
 			for (i=0; i <= sibling_cp->no_keys; i++)
 				ht_insert(tdata->ht, &sibling->children[i], sibling_cp->children[i]);
 			for (i=0; i <= parent_cp->no_keys; i++)
@@ -662,10 +949,13 @@ int btree_delete(btree_t *btree, map_key_t key, tdata_t *tdata)
 	int node_stack_indexes[20], stack_top, index, retries = -1;
 	int connection_point_stack_index;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 	to_modify_sibling = new_sibling = NULL;
+	replaced_siblings_top = 0;
 
 	if (++retries >= TX_NUM_RETRIES) {
 		tdata->lacqs++;
@@ -686,13 +976,20 @@ try_from_scratch:
 		                                  &tree_cp_root,
 		                                  &connection_point_stack_index,
 		                                  &to_modify_sibling, &new_sibling, tdata);
+		if (btree->nr_snapshots)
+			connection_point = btree_copy_to_root(node_stack, node_stack_indexes,
+			                                      connection_point,
+			                                      &connection_point_stack_index,
+			                                      &tree_cp_root, tdata);
 		if (connection_point == NULL) {
 			btree->root = tree_cp_root;
 		} else {
 			index = node_stack_indexes[connection_point_stack_index];
 			connection_point->children[index] = tree_cp_root;
 		}
+		if (to_modify_sibling != NULL) to_modify_sibling->sibling = new_sibling;
 		pthread_spin_unlock(&btree->lock);
+		btree_retire_replaced(node_stack, connection_point_stack_index + 1, stack_top);
 		return 1;
 	}
 
@@ -709,6 +1006,12 @@ try_from_scratch:
 	                                  &connection_point_stack_index,
 	                                  &to_modify_sibling, &new_sibling, tdata);
 
+	if (btree->nr_snapshots)
+		connection_point = btree_copy_to_root(node_stack, node_stack_indexes,
+		                                      connection_point,
+		                                      &connection_point_stack_index,
+		                                      &tree_cp_root, tdata);
+
 	int validation_retries = -1;
 validate_and_connect_copy:
 
@@ -721,7 +1024,9 @@ validate_and_connect_copy:
 		if (btree->lock != LOCK_FREE)
 			TX_ABORT(ABORT_GL_TAKEN);
 
-		//> Validate copy
+		//> Validate copy; snapshots may have been taken since it was made.
+		if (connection_point != NULL && btree->nr_snapshots)
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
 		if (stack_top < 0 && btree->root != NULL)
 			TX_ABORT(ABORT_VALIDATION_FAILURE);
 		if (stack_top >= 0 && btree->root != node_stack[0])
@@ -751,7 +1056,7 @@ validate_and_connect_copy:
 			index = node_stack_indexes[connection_point_stack_index];
 			connection_point->children[index] = tree_cp_root;
 		}
-
+		if (to_modify_sibling != NULL) to_modify_sibling->sibling = new_sibling;
 		TX_END(0);
 	} else {
 		tdata->tx_aborts++;
@@ -764,6 +1069,7 @@ validate_and_connect_copy:
 		}
 	}
 
+	btree_retire_replaced(node_stack, connection_point_stack_index + 1, stack_top);
 	return 1;
 }
 
@@ -778,10 +1084,13 @@ int btree_update(btree_t *btree, map_key_t key, void *val, tdata_t *tdata)
 	int connection_point_stack_index;
 	int op_is_insert = -1, ret;
 
+	rcu_copies_begin();
 try_from_scratch:
 
+	rcu_copies_discard();
 	ht_reset(tdata->ht);
 	to_modify_sibling = new_sibling = NULL;
+	replaced_siblings_top = 0;
 
 	if (++retries >= TX_NUM_RETRIES) {
 		tdata->lacqs++;
@@ -790,14 +1099,15 @@ try_from_scratch:
 		if (op_is_insert == -1) {
 			if (stack_top < 0)
 				op_is_insert = 1;
-			else if (node_stack_indexes[stack_top] < 2 * BTREE_ORDER &&
+			else if (node_stack_indexes[stack_top] < node_stack[stack_top]->no_keys &&
 			         KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0)
 				op_is_insert = 0;
 			else
 				op_is_insert = 1;
 		}
-		if (op_is_insert && stack_top >= 0 && node_stack_indexes[stack_top] < 2 * BTREE_ORDER &&
-		        KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0) {
+		if (op_is_insert && stack_top >= 0 &&
+		    node_stack_indexes[stack_top] < node_stack[stack_top]->no_keys &&
+		    KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0) {
 			pthread_spin_unlock(&btree->lock);
 			return 0;
 		} else if (!op_is_insert && (stack_top < 0 || 
@@ -821,6 +1131,11 @@ try_from_scratch:
 			                                  &to_modify_sibling, &new_sibling, tdata);
 			ret = 3;
 		}
+		if (btree->nr_snapshots)
+			connection_point = btree_copy_to_root(node_stack, node_stack_indexes,
+			                                      connection_point,
+			                                      &connection_point_stack_index,
+			                                      &tree_cp_root, tdata);
 		if (connection_point == NULL) {
 			btree->root = tree_cp_root;
 		} else {
@@ -829,6 +1144,7 @@ try_from_scratch:
 		}
 		if (to_modify_sibling != NULL) to_modify_sibling->sibling = new_sibling;
 		pthread_spin_unlock(&btree->lock);
+		btree_retire_replaced(node_stack, connection_point_stack_index + 1, stack_top);
 		return ret;
 	}
 
@@ -837,14 +1153,15 @@ try_from_scratch:
 	if (op_is_insert == -1) {
 		if (stack_top < 0)
 			op_is_insert = 1;
-		else if (node_stack_indexes[stack_top] < 2 * BTREE_ORDER &&
+		else if (node_stack_indexes[stack_top] < node_stack[stack_top]->no_keys &&
 		         KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0)
 			op_is_insert = 0;
 		else
 			op_is_insert = 1;
 	}
-	if (op_is_insert && stack_top >= 0 && node_stack_indexes[stack_top] < 2 * BTREE_ORDER &&
-	        KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0)
+	if (op_is_insert && stack_top >= 0 &&
+	    node_stack_indexes[stack_top] < node_stack[stack_top]->no_keys &&
+	    KEY_CMP(node_stack[stack_top]->keys[node_stack_indexes[stack_top]], key) == 0)
 		return 0;
 	else if (!op_is_insert && (stack_top < 0 || 
 	            node_stack_indexes[stack_top] >= node_stack[stack_top]->no_keys ||
@@ -867,6 +1184,12 @@ try_from_scratch:
 		ret = 3;
 	}
 
+	if (btree->nr_snapshots)
+		connection_point = btree_copy_to_root(node_stack, node_stack_indexes,
+		                                      connection_point,
+		                                      &connection_point_stack_index,
+		                                      &tree_cp_root, tdata);
+
 	int validation_retries = -1;
 validate_and_connect_copy:
 
@@ -879,7 +1202,9 @@ validate_and_connect_copy:
 		if (btree->lock != LOCK_FREE)
 			TX_ABORT(ABORT_GL_TAKEN);
 
-		//> Validate copy
+		//> Validate copy; snapshots may have been taken since it was made.
+		if (connection_point != NULL && btree->nr_snapshots)
+			TX_ABORT(ABORT_VALIDATION_FAILURE);
 		if (stack_top < 0 && btree->root != NULL)
 			TX_ABORT(ABORT_VALIDATION_FAILURE);
 		if (stack_top >= 0 && btree->root != node_stack[0])
@@ -922,16 +1247,220 @@ validate_and_connect_copy:
 		}
 	}
 
+	btree_retire_replaced(node_stack, connection_point_stack_index + 1, stack_top);
 	return ret;
 }
 
+/**
+ * Range deletion. With the global lock held, it deletes the keys like the
+ * sequential B+tree (btrees/seq.c): only the paths to key1 and key2 are
+ * visited, the subtrees between them are unlinked as a whole and the two
+ * paths are rebalanced. Lookups run outside of transactions, though, so every
+ * node it modifies is a copy, like those of the other updates, and the copies
+ * are published at once by replacing the root. The copies and the nodes they
+ * replace are kept in `range_copies` and `range_replaced`.
+ **/
+static __thread btree_node_t **range_copies, **range_replaced;
+static __thread int range_nr_copies, range_max_copies;
+
+static int btree_range_is_copy(btree_node_t *n)
+{
+	int i;
+	for (i=0; i < range_nr_copies; i++)
+		if (range_copies[i] == n) return 1;
+	return 0;
+}
+
+//> Replaces `*np` with a copy, unless it is one already, and returns it.
+static btree_node_t *btree_range_own(btree_node_t **np)
+{
+	if (btree_range_is_copy(*np)) return *np;
+	if (range_nr_copies == range_max_copies) {
+		range_max_copies = 2 * range_max_copies + 16;
+		range_copies = realloc(range_copies,
+		                       range_max_copies * sizeof(*range_copies));
+		range_replaced = realloc(range_replaced,
+		                         range_max_copies * sizeof(*range_replaced));
+		if (!range_copies || !range_replaced) {
+			fprintf(stderr, "Out of memory: %s:%d\n", __FILE__, __LINE__);
+			exit(1);
+		}
+	}
+	range_replaced[range_nr_copies] = *np;
+	*np = btree_node_new_copy(*np);
+	range_copies[range_nr_copies++] = *np;
+	return *np;
+}
+
+//> Drops a copy that does not make it to the tree; the node it replaced is
+//> still retired.
+static void btree_range_drop(btree_node_t *copy)
+{
+	int i;
+	for (i=0; i < range_nr_copies; i++)
+		if (range_copies[i] == copy) range_copies[i] = NULL;
+	rcu_copy_discard(copy);
+}
+
+//> Retires the unlinked subtree of `n` and returns the number of its keys.
+static int btree_range_retire_subtree(btree_node_t *n)
+{
+	int i, nr_keys = 0;
+
+	if (n->leaf) nr_keys = n->no_keys;
+	else for (i=0; i <= n->no_keys; i++)
+		nr_keys += btree_range_retire_subtree(n->children[i]);
+	nalloc_free_node(nalloc, n);
+	return nr_keys;
+}
+
+//> btree_range_fix() of btrees/seq.c on the copy `n`.
+static void btree_range_fix(btree_node_t *n)
+{
+	btree_node_t *c, *r;
+	int i, j;
+
+	if (n->leaf) return;
+	for (i=0; i <= n->no_keys && n->no_keys > 0; i++) {
+		c = n->children[i];
+		if (c->no_keys >= BTREE_ORDER) continue;
+		j = (i > 0) ? i - 1 : i;
+		btree_range_own((btree_node_t **)&n->children[j]);
+		r = btree_range_own((btree_node_t **)&n->children[j+1]);
+		if (btree_range_rebalance(n, j, 0))
+			btree_range_drop(r);
+		else
+			btree_range_fix(r);
+		btree_range_fix(n->children[j]);
+		i = -1;
+	}
+}
+
+//> btree_delete_range_rec() of btrees/seq.c on the copy `n`. Keys that are
+//> equal to a separator are in the left subtree here.
+static int btree_delete_range_rec(btree_node_t *n, map_key_t key1,
+                                  map_key_t key2)
+{
+	btree_node_t *l, *r;
+	int lo, hi, i, gap, deleted = 0;
+
+	if (n->leaf) {
+		lo = btree_node_search(n, key1);
+		for (hi=lo; hi < n->no_keys && KEY_CMP(n->keys[hi], key2) <= 0; hi++)
+			;
+		gap = hi - lo;
+		for (i=hi; i < n->no_keys; i++) {
+			KEY_COPY(n->keys[i-gap], n->keys[i]);
+			n->children[i-gap+1] = n->children[i+1];
+		}
+		n->no_keys -= gap;
+		return gap;
+	}
+
+	lo = btree_node_search(n, key1);
+	hi = btree_node_search(n, key2);
+
+	l = btree_range_own((btree_node_t **)&n->children[lo]);
+	deleted += btree_delete_range_rec(l, key1, key2);
+	if (hi != lo) {
+		r = btree_range_own((btree_node_t **)&n->children[hi]);
+		deleted += btree_delete_range_rec(r, key1, key2);
+		for (i=lo+1; i < hi; i++)
+			deleted += btree_range_retire_subtree(n->children[i]);
+
+		//> keys[hi-1] separates children[lo] and children[hi].
+		gap = hi - lo - 1;
+		for (i=lo; i + gap < n->no_keys; i++)
+			KEY_COPY(n->keys[i], n->keys[i+gap]);
+		for (i=lo+1; i + gap <= n->no_keys; i++)
+			n->children[i] = n->children[i+gap];
+		n->no_keys -= gap;
+	}
+
+	btree_range_fix(n);
+	return deleted;
+}
+
+/**
+ * Links the leaves of the subtree of `n` to the ones around them; `*prev` is
+ * the last leaf before the subtree. The subtrees that were not copied are
+ * linked inside already, only their first and last leaf are looked at.
+ * Range queries follow the sibling pointers only inside transactions or with
+ * the global lock held, so the leaves that were not copied are fixed in place.
+ **/
+static void btree_range_link(btree_node_t *n, btree_node_t **prev)
+{
+	btree_node_t *first = n, *last = n;
+	int i;
+
+	if (!n->leaf && btree_range_is_copy(n)) {
+		for (i=0; i <= n->no_keys; i++)
+			btree_range_link(n->children[i], prev);
+		return;
+	}
+	while (!first->leaf) first = first->children[0];
+	while (!last->leaf) last = last->children[last->no_keys];
+	if (*prev && (*prev)->sibling != first) (*prev)->sibling = first;
+	*prev = last;
+}
+
+static int btree_delete_range(btree_t *btree, map_key_t key1, map_key_t key2,
+                              tdata_t *tdata)
+{
+	btree_node_t *root, *prev = NULL;
+	int deleted, i;
+
+	if (KEY_CMP(key1, key2) > 0) return 0;
+
+	rcu_copies_begin();
+	range_nr_copies = 0;
+	tdata->lacqs++;
+	pthread_spin_lock(&btree->lock);
+
+	root = btree->root;
+	if (!root) {
+		pthread_spin_unlock(&btree->lock);
+		return 0;
+	}
+	btree_range_own(&root);
+	deleted = btree_delete_range_rec(root, key1, key2);
+	if (deleted == 0) {
+		pthread_spin_unlock(&btree->lock);
+		for (i=0; i < range_nr_copies; i++)
+			if (range_copies[i]) rcu_copy_discard(range_copies[i]);
+		return 0;
+	}
+
+	//> The root may be left without keys.
+	while (root && root->no_keys == 0) {
+		btree_node_t *child = root->leaf ? NULL : root->children[0];
+		if (btree_range_is_copy(root)) btree_range_drop(root);
+		else nalloc_free_node(nalloc, root);
+		root = child;
+	}
+	if (root) {
+		btree_range_link(root, &prev);
+		if (btree_range_is_copy(prev)) prev->sibling = NULL;
+	}
+	btree->root = root;
+	pthread_spin_unlock(&btree->lock);
+
+	for (i=0; i < range_nr_copies; i++)
+		nalloc_free_node(nalloc, range_replaced[i]);
+	return deleted;
+}
+
 /******************************************************************************/
 /* MAP interface implementation                                               */
 /******************************************************************************/
 void *map_new()
 {
+	btree_t *btree;
+
 	printf("Size of tree node is %lu\n", sizeof(btree_node_t));
-	return btree_new();
+	btree = btree_new();
+	btree->size = map_size_new();
+	return btree;
 }
 
 void *map_tdata_new(int tid)
@@ -951,29 +1480,195 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 	tdata_add(d1, d2, dst);
 }
 
+void map_tdata_free(void *thread_data)
+{
+	rcu_scratch_free(nalloc);
+	tdata_free(thread_data);
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((btree_t *)map)->root, nthreads, btree_destroy_children,
+	             btree_destroy_node);
+	map_size_free(((btree_t *)map)->size);
+	free(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	((btree_t *)map)->root = btree_bulk_build(keys, values, n, 0);
+	map_size_add(((btree_t *)map)->size, n);
+	return n;
+}
+
 int map_lookup(void *map, void *tdata, map_key_t key)
 {
-	return btree_lookup(map, key);
+	return map_get(map, tdata, key, NULL);
 }
 
-int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2)
+int map_get(void *map, void *tdata, map_key_t key, void **value_out)
 {
-	return btree_rquery(map, key1, key2);
+	int ret;
+	nalloc_op_begin();
+	ret = btree_lookup(map, key, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_lookup_batch(void *map, void *tdata, map_key_t *keys, int n,
+                     int *results)
+{
+	int i, group, found = 0;
+
+	for (i=0; i < n; i += BTREE_BATCH_WIDTH) {
+		group = (n - i < BTREE_BATCH_WIDTH) ? n - i : BTREE_BATCH_WIDTH;
+		nalloc_op_begin();
+		found += btree_lookup_batch(map, &keys[i], group, &results[i]);
+		nalloc_op_end();
+	}
+	return found;
+}
+
+int map_rquery(void *map, void *tdata, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	btree_t *btree = map;
+
+	nalloc_op_begin();
+	if (btree->snapshot_of == NULL)
+		btree_rquery(btree, key1, key2, visit, arg, tdata);
+	else if (btree->root != NULL)
+		btree_snapshot_rquery(btree->root, key1, key2, visit, arg);
+	nalloc_op_end();
+	return 1;
+}
+
+//> Like the lookups, runs outside of transactions on the nodes it reaches.
+static int map_nav(void *map, void *tdata, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	btree_node_t *root;
+	int ret = 0;
+
+	nalloc_op_begin();
+	root = ((btree_t *)map)->root;
+	if (root) ret = btree_nav_subtree(root, key, op, key_out, value_out);
+	nalloc_op_end();
+	return ret;
+}
+
+int map_min(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *tdata, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *tdata, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *tdata, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, tdata, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *map, void *tdata, map_key_t key, void *value)
 {
-	return btree_insert(map, key, value, tdata);
+	int ret;
+	nalloc_op_begin();
+	ret = btree_insert(map, key, value, tdata);
+	nalloc_op_end();
+	if (ret) map_size_add(((btree_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *tdata, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret;
+	nalloc_op_begin();
+	ret = btree_compute(map, key, fn, arg, tdata);
+	nalloc_op_end();
+	if (!ret) map_size_add(((btree_t *)map)->size, 1);
+	return ret;
 }
 
 int map_delete(void *map, void *tdata, map_key_t key)
 {
-	return btree_delete(map, key, tdata);
+	int ret;
+	nalloc_op_begin();
+	ret = btree_delete(map, key, tdata);
+	nalloc_op_end();
+	if (ret) map_size_add(((btree_t *)map)->size, -1);
+	return ret;
+}
+
+int map_delete_range(void *map, void *tdata, map_key_t key1, map_key_t key2)
+{
+	int ret;
+	nalloc_op_begin();
+	ret = btree_delete_range(map, key1, key2, tdata);
+	nalloc_op_end();
+	map_size_add(((btree_t *)map)->size, -ret);
+	return ret;
 }
 
 int map_update(void *map, void *tdata, map_key_t key, void *value)
 {
-	return btree_update(map, key, value, tdata);
+	int ret;
+	nalloc_op_begin();
+	ret = btree_update(map, key, value, tdata);
+	nalloc_op_end();
+	map_size_updated(((btree_t *)map)->size, ret);
+	return ret;
+}
+
+long long map_size(void *map, void *tdata, int exact)
+{
+	return map_size_sum(((btree_t *)map)->size, exact);
+}
+
+/**
+ * A snapshot is a btree_t with the root of the map at the moment it is taken.
+ * Taking the global lock aborts the running transactions, so every update
+ * that commits afterwards sees nr_snapshots and copies its path up to the
+ * root instead of modifying nodes of the snapshot. The nodes those updates
+ * replace are retired as usual and the pin keeps them until the release.
+ **/
+void *map_snapshot(void *map, void *tdata)
+{
+	btree_t *btree = map, *snapshot;
+	void *pin;
+
+	pin = nalloc_pin();
+	if (pin == NULL) return NULL;
+
+	snapshot = btree_new();
+	snapshot->snapshot_of = btree;
+	snapshot->snapshot_pin = pin;
+	pthread_spin_lock(&btree->lock);
+	btree->nr_snapshots++;
+	snapshot->root = btree->root;
+	pthread_spin_unlock(&btree->lock);
+	return snapshot;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+	btree_t *s = snapshot;
+
+	__sync_fetch_and_sub(&((btree_t *)s->snapshot_of)->nr_snapshots, 1);
+	nalloc_unpin(s->snapshot_pin);
+	pthread_spin_destroy(&s->lock);
+	free(s);
 }
 
 void map_print(void *map)
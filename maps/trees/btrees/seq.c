@@ -3,7 +3,9 @@
 #include <assert.h>
 
 #include "alloc.h"
+#include "arch.h"
 #include "../../key/key.h"
+#include "../../size.h"
 #include "btree.h"
 #include "validate.h"
 #include "print.h"
@@ -37,46 +39,83 @@ static int btree_traverse(btree_t *btree, map_key_t key,
 	return 1;
 }
 
-static int btree_lookup(btree_t *btree, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+static int btree_lookup(btree_t *btree, map_key_t key, void **value)
 {
 	int index;
 	btree_node_t *leaf;
 
 	if (btree_traverse(btree, key, &leaf, &index) == 0)
 		return 0;
-	else
-		return (KEY_CMP(leaf->keys[index], key) == 0);
+	if (index >= leaf->no_keys || KEY_CMP(leaf->keys[index], key) != 0)
+		return 0;
+	//> The value of keys[i] in a leaf is children[i+1].
+	if (value) *value = leaf->children[index+1];
+	return 1;
 }
 
-static __thread map_key_t rquery_result[1000];
+#define BTREE_BATCH_WIDTH 8
 
-static int btree_rquery(btree_t *btree, map_key_t key1, map_key_t key2, int *len)
+/**
+ * Looks up `nkeys` <= BTREE_BATCH_WIDTH keys with their traversals
+ * interleaved (group prefetching): every round moves each traversal one level
+ * down and prefetches the node it moves to, so that the cache misses of the
+ * traversals overlap instead of being paid one after the other.
+ **/
+static int btree_lookup_batch(btree_t *btree, map_key_t *keys, int nkeys,
+                              int *results)
 {
-	int index, i, nkeys;
-	btree_node_t *leaf, *n;
+	btree_node_t *n[BTREE_BATCH_WIDTH];
+	int i, index, active, found = 0;
+
+	for (i=0; i < nkeys; i++) {
+		n[i] = btree->root;
+		results[i] = 0;
+	}
+	//> Empty tree.
+	if (!btree->root) return 0;
+
+	do {
+		active = 0;
+		for (i=0; i < nkeys; i++) {
+			if (n[i]->leaf) continue;
+			index = btree_node_search(n[i], keys[i]);
+			if (index < n[i]->no_keys && KEY_CMP(n[i]->keys[index], keys[i]) == 0)
+				index++;
+			n[i] = n[i]->children[index];
+			prefetch_range(n[i], sizeof(btree_node_t));
+			active = 1;
+		}
+	} while (active);
 
-	*len = 0;
+	for (i=0; i < nkeys; i++) {
+		index = btree_node_search(n[i], keys[i]);
+		results[i] = index < n[i]->no_keys && KEY_CMP(n[i]->keys[index], keys[i]) == 0;
+		found += results[i];
+	}
+	return found;
+}
+
+//> Walks the leaves through their sibling pointers.
+//> Returns 0 if `visit` stopped the range query, 1 otherwise.
+static int btree_rquery(btree_t *btree, map_key_t key1, map_key_t key2,
+                        map_visit_t visit, void *arg)
+{
+	int index, i;
+	btree_node_t *leaf, *n;
 
 	if (btree_traverse(btree, key1, &leaf, &index) == 0)
-		return 0;
+		return 1;
 
-	if (KEY_CMP(leaf->keys[index], key2) > 0)
-		return 0;
-	
-	nkeys = 0;
 	n = leaf;
 	while (n != NULL) {
-		for (i = index; i < n->no_keys && KEY_CMP(n->keys[i], key2) <= 0; i++) {
-			KEY_COPY(rquery_result[nkeys], n->keys[i]);
-			nkeys++;
+		for (i = index; i < n->no_keys; i++) {
+			if (KEY_CMP(n->keys[i], key2) > 0) return 1;
+			if (visit(n->keys[i], n->children[i+1], arg)) return 0;
 		}
-		if (i < n->no_keys && KEY_CMP(n->keys[i], key2) >= 0)
-			break;
 		n = n->sibling;
 		index = 0;
 	}
-
-	*len = nkeys;
 	return 1;
 }
 
@@ -179,12 +218,27 @@ static int btree_insert(btree_t *btree, map_key_t key, void *val)
 	//> Key already in the tree.
 	int index = node_stack_indexes[node_stack_top];
 	btree_node_t *n = node_stack[node_stack_top];
-	if (node_stack_top >= 0 && index < 2 * BTREE_ORDER && KEY_CMP(key, n->keys[index]) == 0)
+	if (node_stack_top >= 0 && index < n->no_keys && KEY_CMP(key, n->keys[index]) == 0)
 		return 0;
 	//> Key not in the tree.
 	return btree_do_insert(btree, key, val, node_stack, node_stack_indexes, node_stack_top);
 }
 
+static int btree_compute(btree_t *btree, map_key_t key, map_compute_t fn,
+                         void *arg)
+{
+	int index;
+	btree_node_t *leaf;
+
+	if (btree_traverse(btree, key, &leaf, &index) &&
+	    index < leaf->no_keys && KEY_CMP(leaf->keys[index], key) == 0) {
+		leaf->children[index+1] = fn(key, leaf->children[index+1], 1, arg);
+		return 1;
+	}
+	btree_insert(btree, key, fn(key, NULL, 0, arg));
+	return 0;
+}
+
 /**
  * c = current
  * p = parent
@@ -214,6 +268,7 @@ static int btree_merge(btree_node_t *c, btree_node_t *p, int pindex)
 
 		sibling->sibling = c->sibling;
 		sibling->no_keys = sibling_index;
+		nalloc_free_node(nalloc, c);
 		return (pindex - 1);
 	}
 
@@ -235,6 +290,7 @@ static int btree_merge(btree_node_t *c, btree_node_t *p, int pindex)
 
 		c->sibling = sibling->sibling;
 		c->no_keys = sibling_index;
+		nalloc_free_node(nalloc, sibling);
 		return pindex;
 	}
 
@@ -319,6 +375,7 @@ static int btree_do_delete(btree_t *btree, map_key_t key, btree_node_t **node_st
 		//> We reached root which contains only one key.
 		if (node_stack_top == 0 && cur->no_keys == 1) {
 			btree->root = cur->children[0];
+			nalloc_free_node(nalloc, cur);
 			break;
 		}
 
@@ -370,6 +427,121 @@ static int btree_delete(btree_t *btree, map_key_t key)
 	                       node_stack_top);
 }
 
+//> Frees the subtree of `n` and returns the number of its keys.
+static int btree_free_subtree(btree_node_t *n)
+{
+	int i, nr_keys = 0;
+
+	if (n->leaf) nr_keys = n->no_keys;
+	else for (i=0; i <= n->no_keys; i++)
+		nr_keys += btree_free_subtree(n->children[i]);
+	nalloc_free_node(nalloc, n);
+	return nr_keys;
+}
+
+/**
+ * Makes all the children of `n` at least half-full, unless `n` is left with
+ * a single child, which is fixed along with `n` by its parent. The children
+ * that a rebalance moves around may have children that are not half-full,
+ * so they are fixed in turn.
+ **/
+static void btree_range_fix(btree_node_t *n)
+{
+	btree_node_t *c, *r;
+	int i, j;
+
+	if (n->leaf) return;
+	for (i=0; i <= n->no_keys && n->no_keys > 0; i++) {
+		c = n->children[i];
+		if (c->no_keys >= BTREE_ORDER) continue;
+		j = (i > 0) ? i - 1 : i;
+		r = n->children[j+1];
+		if (btree_range_rebalance(n, j, 1))
+			nalloc_free_node(nalloc, r);
+		else
+			btree_range_fix(r);
+		btree_range_fix(n->children[j]);
+		i = -1;
+	}
+}
+
+/**
+ * Deletes the keys of [key1, key2] from the subtree of `n`. Only the paths
+ * to key1 and key2 are visited; the subtrees between them are freed as a
+ * whole and the nodes of the two paths are made half-full again on the way
+ * back up. Returns the number of keys deleted.
+ **/
+static int btree_delete_range_rec(btree_node_t *n, map_key_t key1,
+                                  map_key_t key2)
+{
+	btree_node_t *l, *r;
+	int lo, hi, i, gap, deleted = 0;
+
+	if (n->leaf) {
+		lo = btree_node_search(n, key1);
+		for (hi=lo; hi < n->no_keys && KEY_CMP(n->keys[hi], key2) <= 0; hi++)
+			;
+		gap = hi - lo;
+		for (i=hi; i < n->no_keys; i++) {
+			KEY_COPY(n->keys[i-gap], n->keys[i]);
+			n->children[i-gap+1] = n->children[i+1];
+		}
+		n->no_keys -= gap;
+		return gap;
+	}
+
+	lo = btree_node_search(n, key1);
+	if (lo < n->no_keys && KEY_CMP(n->keys[lo], key1) == 0) lo++;
+	hi = btree_node_search(n, key2);
+	if (hi < n->no_keys && KEY_CMP(n->keys[hi], key2) == 0) hi++;
+
+	deleted += btree_delete_range_rec(n->children[lo], key1, key2);
+	if (hi != lo) {
+		deleted += btree_delete_range_rec(n->children[hi], key1, key2);
+		for (i=lo+1; i < hi; i++)
+			deleted += btree_free_subtree(n->children[i]);
+
+		//> Link every level of the two subtrees over the freed ones.
+		l = n->children[lo];
+		r = n->children[hi];
+		while (1) {
+			l->sibling = r;
+			if (l->leaf) break;
+			l = l->children[l->no_keys];
+			r = r->children[0];
+		}
+
+		//> keys[hi-1] separates children[lo] and children[hi].
+		gap = hi - lo - 1;
+		for (i=lo; i + gap < n->no_keys; i++)
+			KEY_COPY(n->keys[i], n->keys[i+gap]);
+		for (i=lo+1; i + gap <= n->no_keys; i++)
+			n->children[i] = n->children[i+gap];
+		n->no_keys -= gap;
+	}
+
+	btree_range_fix(n);
+	return deleted;
+}
+
+static int btree_delete_range(btree_t *btree, map_key_t key1, map_key_t key2)
+{
+	btree_node_t *root = btree->root;
+	int deleted;
+
+	if (!root || KEY_CMP(key1, key2) > 0) return 0;
+
+	deleted = btree_delete_range_rec(root, key1, key2);
+
+	//> The root may be left without keys.
+	while (root && root->no_keys == 0) {
+		btree->root = root->leaf ? NULL : root->children[0];
+		nalloc_free_node(nalloc, root);
+		root = btree->root;
+	}
+	return deleted;
+}
+
 static int btree_update(btree_t *btree, map_key_t key, void *val)
 {
 	btree_node_t *node_stack[20];
@@ -404,8 +576,12 @@ static int btree_update(btree_t *btree, map_key_t key, void *val)
 /******************************************************************************/
 void *map_new()
 {
+	btree_t *btree;
+
 	printf("Size of tree node is %lu\n", sizeof(btree_node_t));
-	return btree_new();
+	btree = btree_new();
+	btree->size = map_size_new();
+	return btree;
 }
 
 void *map_tdata_new(int tid)
@@ -433,52 +609,160 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 #	endif
 }
 
+void map_tdata_free(void *thread_data)
+{
+#	if defined(SYNC_CG_HTM)
+	tx_thread_data_free(thread_data);
+#	endif
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((btree_t *)map)->root, nthreads, btree_destroy_children,
+	             btree_destroy_node);
+	map_size_free(((btree_t *)map)->size);
+	free(map);
+}
+
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	((btree_t *)map)->root = btree_bulk_build(keys, values, n, 1);
+	map_size_add(((btree_t *)map)->size, n);
+	return n;
+}
+
 int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((btree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_start(TX_NUM_RETRIES, thread_data, &((btree_t *)map)->lock);
 #	endif
 
-	ret = btree_lookup(map, key);
+	ret = btree_lookup(map, key, value_out);
 
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_unlock(&((btree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((btree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
 	return ret; 
 }
 
-int map_rquery(void *map, void *thread_data, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	int ret = 0, nkeys;
+	int i, group, found = 0;
+
+	//> The lock is held (or the transaction runs) for one group at a time.
+	for (i=0; i < n; i += BTREE_BATCH_WIDTH) {
+		group = (n - i < BTREE_BATCH_WIDTH) ? n - i : BTREE_BATCH_WIDTH;
+		nalloc_op_begin();
+#		if defined(SYNC_CG_SPINLOCK)
+		pthread_spin_lock(&((btree_t *)map)->lock);
+#		elif defined(SYNC_CG_HTM)
+		tx_start(TX_NUM_RETRIES, thread_data, &((btree_t *)map)->lock);
+#		endif
+
+		found += btree_lookup_batch(map, &keys[i], group, &results[i]);
+
+#		if defined(SYNC_CG_SPINLOCK)
+		pthread_spin_unlock(&((btree_t *)map)->lock);
+#		elif defined(SYNC_CG_HTM)
+		tx_end(thread_data, &((btree_t *)map)->lock);
+#		endif
+		nalloc_op_end();
+	}
 
+	return found;
+}
+
+int map_rquery(void *map, void *thread_data, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((btree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_start(TX_NUM_RETRIES, thread_data, &((btree_t *)map)->lock);
 #	endif
 
-	ret = btree_rquery(map, key1, key2, &nkeys);
+	btree_rquery(map, key1, key2, visit, arg);
 
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_unlock(&((btree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((btree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
-	return ret; 
+	return 1;
+}
+
+static int map_nav(void *map, void *thread_data, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	btree_node_t *root;
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((btree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, thread_data, &((btree_t *)map)->lock);
+#	endif
+
+	root = ((btree_t *)map)->root;
+	if (root) ret = btree_nav_subtree(root, key, op, key_out, value_out);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((btree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(thread_data, &((btree_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+
+	return ret;
+}
+
+int map_min(void *map, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *thread_data, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *thread_data, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((btree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -492,6 +776,32 @@ int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((btree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
+	if (ret) map_size_add(((btree_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((btree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, thread_data, &((btree_t *)map)->lock);
+#	endif
+
+	ret = btree_compute(map, key, fn, arg);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((btree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(thread_data, &((btree_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+	if (!ret) map_size_add(((btree_t *)map)->size, 1);
 	return ret;
 }
 
@@ -499,6 +809,7 @@ int map_delete(void *map, void *thread_data, map_key_t key)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((btree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -512,7 +823,34 @@ int map_delete(void *map, void *thread_data, map_key_t key)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((btree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
+	if (ret) map_size_add(((btree_t *)map)->size, -1);
+	return ret;
+}
+
+int map_delete_range(void *map, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((btree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, thread_data, &((btree_t *)map)->lock);
+#	endif
+
+	ret = btree_delete_range(map, key1, key2);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((btree_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(thread_data, &((btree_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+
+	map_size_add(((btree_t *)map)->size, -ret);
 	return ret;
 }
 
@@ -520,6 +858,7 @@ int map_update(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((btree_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -533,9 +872,26 @@ int map_update(void *map, void *thread_data, map_key_t key, void *value)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((btree_t *)map)->lock);
 #	endif
+	nalloc_op_end();
+	map_size_updated(((btree_t *)map)->size, ret);
 	return ret;
 }
 
+long long map_size(void *map, void *thread_data, int exact)
+{
+	return map_size_sum(((btree_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	int ret = 0;
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "seq.h"
+#include "../../size.h"
 #include "treap.h"
 #include "validate.h"
 
@@ -17,9 +18,13 @@
 /******************************************************************************/
 void *map_new()
 {
+	treap_t *treap;
+
 	printf("Size of treap node is %lu (internal) and %lu (external)\n",
 	        sizeof(treap_node_internal_t), sizeof(treap_node_external_t));
-	return treap_new();
+	treap = treap_new();
+	treap->size = map_size_new();
+	return treap;
 }
 
 void *map_tdata_new(int tid)
@@ -48,52 +53,138 @@ void map_tdata_add(void *d1, void *d2, void *dst)
 #	endif
 }
 
+void map_tdata_free(void *thread_data)
+{
+#	if defined(SYNC_CG_HTM)
+	tx_thread_data_free(thread_data);
+#	endif
+}
+
+void map_destroy(void *map, int nthreads)
+{
+	destroy_tree(((treap_t *)map)->root, nthreads, treap_destroy_children,
+	             treap_destroy_node);
+	map_size_free(((treap_t *)map)->size);
+	free(map);
+}
+
+//> Not supported; map_warmup() inserts the keys instead.
+long long map_bulk_load(void *map, void *tdata, map_key_t *keys, void **values,
+                        long long n)
+{
+	return 0;
+}
+
 int map_lookup(void *map, void *thread_data, map_key_t key)
+{
+	return map_get(map, thread_data, key, NULL);
+}
+
+int map_get(void *map, void *thread_data, map_key_t key, void **value_out)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((treap_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_start(TX_NUM_RETRIES, thread_data, &((treap_t *)map)->lock);
 #	endif
 
-	ret = treap_seq_lookup(map, key);
+	ret = treap_seq_lookup(map, key, value_out);
 
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_unlock(&((treap_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((treap_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
 	return ret; 
 }
 
-int map_rquery(void *map, void *thread_data, map_key_t key1, map_key_t key2)
+int map_lookup_batch(void *map, void *thread_data, map_key_t *keys, int n,
+                     int *results)
 {
-	int ret = 0, nkeys;
+	int i, found = 0;
+	for (i=0; i < n; i++)
+		found += (results[i] = map_lookup(map, thread_data, keys[i]));
+	return found;
+}
 
+int map_rquery(void *map, void *thread_data, map_key_t key1, map_key_t key2,
+               map_visit_t visit, void *arg)
+{
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((treap_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_start(TX_NUM_RETRIES, thread_data, &((treap_t *)map)->lock);
 #	endif
 
-	ret = treap_seq_rquery(map, key1, key2, &nkeys);
+	treap_seq_rquery(map, key1, key2, visit, arg);
 
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_unlock(&((treap_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((treap_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
-	return ret; 
+	return 1;
+}
+
+static int map_nav(void *map, void *thread_data, map_key_t key, map_nav_t op,
+                   map_key_t *key_out, void **value_out)
+{
+	int ret;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((treap_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, thread_data, &((treap_t *)map)->lock);
+#	endif
+
+	ret = treap_seq_nav(map, key, op, key_out, value_out);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((treap_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(thread_data, &((treap_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+
+	return ret;
+}
+
+int map_min(void *map, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, MIN_KEY, MAP_NAV_MIN, key_out, value_out);
+}
+
+int map_max(void *map, void *thread_data, map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, MAX_KEY, MAP_NAV_MAX, key_out, value_out);
+}
+
+int map_successor(void *map, void *thread_data, map_key_t key,
+                  map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, key, MAP_NAV_SUCC, key_out, value_out);
+}
+
+int map_predecessor(void *map, void *thread_data, map_key_t key,
+                    map_key_t *key_out, void **value_out)
+{
+	return map_nav(map, thread_data, key, MAP_NAV_PRED, key_out, value_out);
 }
 
 int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((treap_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -107,6 +198,32 @@ int map_insert(void *map, void *thread_data, map_key_t key, void *value)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((treap_t *)map)->lock);
 #	endif
+	nalloc_op_end();
+	if (ret) map_size_add(((treap_t *)map)->size, 1);
+	return ret;
+}
+
+int map_compute(void *map, void *thread_data, map_key_t key, map_compute_t fn,
+                void *arg)
+{
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((treap_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, thread_data, &((treap_t *)map)->lock);
+#	endif
+
+	ret = treap_seq_compute(map, key, fn, arg);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((treap_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(thread_data, &((treap_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+	if (!ret) map_size_add(((treap_t *)map)->size, 1);
 	return ret;
 }
 
@@ -114,6 +231,7 @@ int map_delete(void *map, void *thread_data, map_key_t key)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((treap_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -127,7 +245,34 @@ int map_delete(void *map, void *thread_data, map_key_t key)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((treap_t *)map)->lock);
 #	endif
+	nalloc_op_end();
 
+	if (ret) map_size_add(((treap_t *)map)->size, -1);
+	return ret;
+}
+
+int map_delete_range(void *map, void *thread_data, map_key_t key1,
+                     map_key_t key2)
+{
+	int ret = 0;
+
+	nalloc_op_begin();
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_lock(&((treap_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_start(TX_NUM_RETRIES, thread_data, &((treap_t *)map)->lock);
+#	endif
+
+	ret = treap_seq_delete_range(map, key1, key2);
+
+#	if defined(SYNC_CG_SPINLOCK)
+	pthread_spin_unlock(&((treap_t *)map)->lock);
+#	elif defined(SYNC_CG_HTM)
+	tx_end(thread_data, &((treap_t *)map)->lock);
+#	endif
+	nalloc_op_end();
+
+	map_size_add(((treap_t *)map)->size, -ret);
 	return ret;
 }
 
@@ -135,6 +280,7 @@ int map_update(void *map, void *thread_data, map_key_t key, void *value)
 {
 	int ret = 0;
 
+	nalloc_op_begin();
 #	if defined(SYNC_CG_SPINLOCK)
 	pthread_spin_lock(&((treap_t *)map)->lock);
 #	elif defined(SYNC_CG_HTM)
@@ -148,9 +294,26 @@ int map_update(void *map, void *thread_data, map_key_t key, void *value)
 #	elif defined(SYNC_CG_HTM)
 	tx_end(thread_data, &((treap_t *)map)->lock);
 #	endif
+	nalloc_op_end();
+	map_size_updated(((treap_t *)map)->size, ret);
 	return ret;
 }
 
+long long map_size(void *map, void *thread_data, int exact)
+{
+	return map_size_sum(((treap_t *)map)->size, exact);
+}
+
+//> Not supported.
+void *map_snapshot(void *map, void *tdata)
+{
+	return NULL;
+}
+
+void map_snapshot_release(void *snapshot, void *tdata)
+{
+}
+
 int map_validate(void *map)
 {
 	int ret = 0;
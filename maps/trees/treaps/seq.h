@@ -31,10 +31,17 @@ static void *treap_traverse(treap_t *treap, map_key_t key)
 	return root;
 }
 
-static int treap_seq_lookup(treap_t *treap, map_key_t key)
+//> `value` may be NULL if the caller does not need the value.
+static int treap_seq_lookup(treap_t *treap, map_key_t key, void **value)
 {
 	treap_node_external_t *external = treap_traverse(treap, key);
-	return ( (external != NULL) && (treap_node_external_indexof(external, key) != -1) );
+	int index;
+
+	if (external == NULL) return 0;
+	index = treap_node_external_indexof(external, key);
+	if (index == -1) return 0;
+	if (value) *value = external->values[index];
+	return 1;
 }
 
 static void treap_rebalance(treap_t *treap, stack_t *stack)
@@ -128,6 +135,35 @@ static int treap_seq_insert(treap_t *treap, map_key_t key, void *value)
 	return 1;
 }
 
+static int treap_seq_compute(treap_t *treap, map_key_t key, map_compute_t fn,
+                             void *arg)
+{
+	treap_node_external_t *external;
+	int key_index;
+	stack_t stack;
+
+	treap_traverse_with_stack(treap, key, &stack);
+
+	//> 1. Empty treap
+	if (stack_size(&stack) == 0) {
+		treap->root = treap_node_new(key, fn(key, NULL, 0, arg), 0);
+		return 0;
+	}
+
+	external = stack_pop(&stack);
+	key_index = treap_node_external_indexof(external, key);
+
+	//> 2. Key already in the tree
+	if (key_index != -1) {
+		external->values[key_index] = fn(key, external->values[key_index], 1, arg);
+		return 1;
+	}
+
+	//> 3. Key not in the tree, insert it
+	_do_insert(treap, external, &stack, key, fn(key, NULL, 0, arg));
+	return 0;
+}
+
 static void _do_delete(treap_t *treap, treap_node_external_t *external,
                        stack_t *stack, int key_index)
 {
@@ -150,7 +186,9 @@ static void _do_delete(treap_t *treap, treap_node_external_t *external,
 				if (internal == internal_parent->left) internal_parent->left = sibling;
 				else                                   internal_parent->right = sibling;
 			}
+			nalloc_free_node(nalloc_internal, internal);
 		}
+		nalloc_free_node(nalloc_external, external);
 	}
 
 }
@@ -177,6 +215,88 @@ static int treap_seq_delete(treap_t *treap, map_key_t key)
 	return 1;
 }
 
+//> Frees the subtree of `node` and returns the number of its keys.
+static int treap_free_subtree(void *node)
+{
+	treap_node_internal_t *internal;
+	int nr_keys;
+
+	if (!treap_node_is_internal(node)) {
+		nr_keys = ((treap_node_external_t *)node)->nr_keys;
+		nalloc_free_node(nalloc_external, node);
+		return nr_keys;
+	}
+	internal = node;
+	nr_keys = treap_free_subtree(internal->left) +
+	          treap_free_subtree(internal->right);
+	nalloc_free_node(nalloc_internal, internal);
+	return nr_keys;
+}
+
+/**
+ * Deletes the keys of [key1, key2] from the subtree of `node` and returns its
+ * new root, or NULL if it is left empty. `from_key1` (`to_key2`) is set if
+ * all the keys of the subtree are known to be larger (smaller) than key1
+ * (key2), so the subtrees that are in the range are freed as a whole without
+ * looking at their keys. An internal node that loses one of its subtrees is
+ * replaced by the other one, which keeps the heap order of the weights.
+ **/
+static void *treap_delete_range_rec(void *node, map_key_t key1, map_key_t key2,
+                                    int from_key1, int to_key2, int *deleted)
+{
+	treap_node_internal_t *internal;
+	treap_node_external_t *external;
+	int i, j;
+
+	if (from_key1 && to_key2) {
+		*deleted += treap_free_subtree(node);
+		return NULL;
+	}
+
+	if (!treap_node_is_internal(node)) {
+		external = node;
+		for (i=0, j=0; i < external->nr_keys; i++) {
+			if (KEY_CMP(external->keys[i], key1) >= 0 &&
+			    KEY_CMP(external->keys[i], key2) <= 0)
+				continue;
+			KEY_COPY(external->keys[j], external->keys[i]);
+			external->values[j] = external->values[i];
+			j++;
+		}
+		*deleted += external->nr_keys - j;
+		external->nr_keys = j;
+		if (j > 0) return external;
+		nalloc_free_node(nalloc_external, external);
+		return NULL;
+	}
+
+	//> The keys that are not larger than internal->key are on the left.
+	internal = node;
+	if (KEY_CMP(key1, internal->key) <= 0)
+		internal->left = treap_delete_range_rec(internal->left, key1, key2,
+		                      from_key1, to_key2 || KEY_CMP(internal->key, key2) <= 0,
+		                      deleted);
+	if (KEY_CMP(key2, internal->key) > 0)
+		internal->right = treap_delete_range_rec(internal->right, key1, key2,
+		                      from_key1 || KEY_CMP(internal->key, key1) >= 0, to_key2,
+		                      deleted);
+	if (internal->left && internal->right) return internal;
+
+	node = internal->left ? internal->left : internal->right;
+	nalloc_free_node(nalloc_internal, internal);
+	return node;
+}
+
+//> Returns the number of keys deleted.
+static int treap_seq_delete_range(treap_t *treap, map_key_t key1, map_key_t key2)
+{
+	int deleted = 0;
+
+	if (treap->root == NULL || KEY_CMP(key1, key2) > 0) return 0;
+	treap->root = treap_delete_range_rec(treap->root, key1, key2, 0, 0, &deleted);
+	return deleted;
+}
+
 static int treap_seq_update(treap_t *treap, map_key_t key, void *value)
 {
 	treap_node_external_t *external, *sibling;
@@ -205,9 +325,9 @@ static int treap_seq_update(treap_t *treap, map_key_t key, void *value)
 	}
 }
 
-static __thread map_key_t rquery_result[1000];
-
-static int treap_seq_rquery(treap_t *treap, map_key_t key1, map_key_t key2, int *nkeys)
+//> Returns 0 if `visit` stopped the range query, 1 otherwise.
+static int treap_seq_rquery(treap_t *treap, map_key_t key1, map_key_t key2,
+                            map_visit_t visit, void *arg)
 {
 	void *curr, *prev = NULL;
 	treap_node_external_t *external;
@@ -217,9 +337,8 @@ static int treap_seq_rquery(treap_t *treap, map_key_t key1, map_key_t key2, int
 
 	treap_traverse_with_stack(treap, key1, &stack);
 	stack_sz = stack_size(&stack);
-	if (stack_sz == 0) return 0;
+	if (stack_sz == 0) return 1;
 
-	*nkeys = 0;
 	while (1) {
 		curr = stack_pop(&stack);
 		if (curr == NULL) {
@@ -241,11 +360,17 @@ static int treap_seq_rquery(treap_t *treap, map_key_t key1, map_key_t key2, int
 			}
 		} else {
 			external = curr;
-			key_index = treap_node_external_indexof(external, key1);
-			if (key_index == -1) key_index = 0;
+			key_index = 0;
 			while (key_index < external->nr_keys &&
-			       KEY_CMP(external->keys[key_index], key2) <= 0)
-				rquery_result[(*nkeys)++] = external->keys[key_index++];
+			       KEY_CMP(external->keys[key_index], key1) < 0)
+				key_index++;
+			while (key_index < external->nr_keys &&
+			       KEY_CMP(external->keys[key_index], key2) <= 0) {
+				if (visit(external->keys[key_index],
+				          external->values[key_index], arg))
+					return 0;
+				key_index++;
+			}
 			if (key_index < external->nr_keys)
 				break;
 			prev = external;
@@ -255,6 +380,54 @@ static int treap_seq_rquery(treap_t *treap, map_key_t key1, map_key_t key2, int
 	return 1;
 }
 
+/**
+ * Ordered navigation in the subtree of `node` (see nav.h). The keys that are
+ * not larger than the key of an internal node are in its left subtree.
+ **/
+static int treap_seq_nav_rec(void *node, map_key_t key, map_nav_t op,
+                             map_key_t *key_out, void **value_out)
+{
+	treap_node_internal_t *internal;
+	treap_node_external_t *external;
+	int i;
+
+	if (node == NULL) return 0;
+
+	if (!treap_node_is_internal(node)) {
+		external = node;
+		if (MAP_NAV_IS_FORWARD(op)) {
+			for (i=0; i < external->nr_keys; i++)
+				if (MAP_NAV_KEY_OK(op, external->keys[i], key))
+					return map_nav_found(external->keys[i], external->values[i],
+					                     key_out, value_out);
+		} else {
+			for (i=external->nr_keys-1; i >= 0; i--)
+				if (MAP_NAV_KEY_OK(op, external->keys[i], key))
+					return map_nav_found(external->keys[i], external->values[i],
+					                     key_out, value_out);
+		}
+		return 0;
+	}
+
+	internal = node;
+	if (MAP_NAV_IS_FORWARD(op)) {
+		if ((op == MAP_NAV_MIN || KEY_CMP(key, internal->key) < 0) &&
+		    treap_seq_nav_rec(internal->left, key, op, key_out, value_out))
+			return 1;
+		return treap_seq_nav_rec(internal->right, key, op, key_out, value_out);
+	}
+	if ((op == MAP_NAV_MAX || KEY_CMP(key, internal->key) > 0) &&
+	    treap_seq_nav_rec(internal->right, key, op, key_out, value_out))
+		return 1;
+	return treap_seq_nav_rec(internal->left, key, op, key_out, value_out);
+}
+
+static int treap_seq_nav(treap_t *treap, map_key_t key, map_nav_t op,
+                         map_key_t *key_out, void **value_out)
+{
+	return treap_seq_nav_rec(treap->root, key, op, key_out, value_out);
+}
+
 //> Splits the treap in two treaps.
 //> The left part is returned and the right part is put in *right_part
 static treap_t *treap_split(treap_t *treap, treap_t **right_part)
@@ -271,6 +444,7 @@ static treap_t *treap_split(treap_t *treap, treap_t **right_part)
 		internal = treap->root;
 		right_treap->root = internal->right;
 		treap->root = internal->left;
+		nalloc_free_node(nalloc_internal, internal);
 	} else {
 		right_treap->root = treap_node_external_split(treap->root);
 	}
@@ -9,6 +9,9 @@
 #endif
 #include "../../key/key.h"
 #include "../../map.h"
+#include "../../nav.h"
+#include "../../destroy.h"
+#include "../../size.h"
 #include "alloc.h"
 
 #ifndef TREAP_EXTERNAL_NODE_ORDER
@@ -41,6 +44,7 @@ struct treap_node_external {
 typedef struct {
 	//> root points to either an internal or an external node
 	void *root;
+	map_size_t *size; //> See size.h; NULL in the treaps of ca-locks.c.
 
 #	if defined(SYNC_CG_SPINLOCK) || defined(SYNC_CG_HTM) || defined(SYNC_RCU_HTM)
 	pthread_spinlock_t lock;
@@ -247,11 +251,27 @@ static unsigned int treap_size(treap_t *treap)
 	else return treap_size_rec(treap->root);
 }
 
+//> map_destroy() callbacks (see destroy.h).
+static void treap_destroy_children(void *node, destroy_stack_t *stack)
+{
+	treap_node_internal_t *internal = node;
+	if (!treap_node_is_internal(node)) return;
+	destroy_push(stack, internal->left);
+	destroy_push(stack, internal->right);
+}
+
+static void treap_destroy_node(void *node)
+{
+	if (treap_node_is_internal(node)) nalloc_free_node_now(nalloc_internal, node);
+	else                              nalloc_free_node_now(nalloc_external, node);
+}
+
 static treap_t *treap_new()
 {
 	treap_t *ret;
 	XMALLOC(ret, 1);
 	ret->root = NULL;
+	ret->size = NULL;
 
 //	//> FIXME
 //	nalloc_internal = nalloc_thread_init(0, sizeof(treap_node_internal_t));